@@ -6,6 +6,12 @@
 
 #include "ml/Network.h"
 #include "ml/Dataset.h"
+#include "ml/NeuronPruner.h"
+#include "ml/LowRankCompressor.h"
+#include "ml/ModelCompiler.h"
+#include "ml/ModelFile.h"
+#include "ml/Checkpoint.h"
+#include "ml/PredictionCache.h"
 #include "Utils.h"
 
 #include "graphics/VertexBuffer.h"
@@ -116,6 +122,16 @@ int main(void)
         bool showSampleViewer = false;
         int selectedDatasetType = 0;          // 0=MNIST for now only this
         float learningRate = 0.01f;
+        int selectedPrecision = 0;            // 0=FP32, 1=BF16 mixed precision
+        float pruneSparsity = 0.9f;           // Fraction of weights zeroed per layer
+        bool sparseInference = false;
+        int regrowInterval = 100;             // Batches between prune-and-regrow steps (sparse training)
+        int neuronRanking = 0;                // 0=weight norm, 1=activation variance
+        float neuronPruneFraction = 0.25f;    // Fraction of every hidden layer removed
+        std::vector<NeuronPruningReport> pruningReports;
+        float maxAccuracyLoss = 0.01f;        // Budget for low rank compression
+        char compiledHeaderPath[256] = "model_compiled.h";
+        char modelPath[256] = "model.nnm";
 
         int numberOfLayers = 4;               // Total layers including input and output
         std::vector<int> layerSizes(4);       // Vector to store nodes for each layer
@@ -132,6 +148,13 @@ int main(void)
         static float currentLoss = 0.0f;
         static float currentAccuracy = 0.0f;
 
+        // Checkpoints (written on a background thread)
+        int checkpointInterval = 0;           // Epochs between checkpoints, 0 = off
+        char checkpointPath[256] = "checkpoint.nnck";
+        CheckpointWriter checkpointWriter;
+        bool incrementalCheckpoints = false;  // Deltas against the last full checkpoint
+        int fullCheckpointInterval = 10;      // Checkpoints per full one in incremental mode
+
         // Metrics
         std::vector<float> lossHistory;
         std::vector<float> accuracyHistory;
@@ -161,6 +184,9 @@ int main(void)
         int canvasPredictedClass = 0;
         bool displayCanvasMetrics = false;
 
+        // Sample viewer and canvas predictions, keyed by the network version so training or loading drops them
+        PredictionCache predictionCache(256);
+
         //Eigen::setNbThreads(4); // (?)
 
         #pragma endregion 
@@ -374,6 +400,8 @@ int main(void)
 
                     // Create network with current layer configuration
                     network = Network(layerSizes);
+                    network.setPrecision(selectedPrecision == 1 ? Precision::BF16 : Precision::FP32);
+                    network.setSparseInference(sparseInference);
                     networkCreated = true;
 
                     std::cout << "Network created with architecture: ";
@@ -401,6 +429,14 @@ int main(void)
                 ImGui::Button("Select activation function (TBD)");
                 ImGui::SliderFloat("Learning Rate", &learningRate, 0.001f, 5.0f);
 
+                const char* precisionTypes[] = { "FP32", "BF16 (mixed)" };
+                if (ImGui::Combo("Precision", &selectedPrecision, precisionTypes, 2))
+                    network.setPrecision(selectedPrecision == 1 ? Precision::BF16 : Precision::FP32);
+                if (ImGui::IsItemHovered())
+                {
+                    ImGui::SetTooltip("BF16 stores activations and deltas in bf16 with stochastic rounding, weights stay fp32");
+                }
+
                 ImGui::InputInt("Batch Size", &batchSize);
                 if (batchSize < 1) batchSize = 1;
                 if (batchSize > maxSamples) batchSize = maxSamples;
@@ -419,6 +455,59 @@ int main(void)
                     }
                 }
 
+                ImGui::InputInt("Checkpoint Every (epochs)", &checkpointInterval);
+                if (checkpointInterval < 0) checkpointInterval = 0;
+                ImGui::InputText("Checkpoint Path", checkpointPath, sizeof(checkpointPath));
+                bool incrementalChanged = ImGui::Checkbox("Incremental Checkpoints", &incrementalCheckpoints);
+                if (ImGui::IsItemHovered())
+                {
+                    ImGui::SetTooltip("Every checkpoint gets its own file (<path>.<n>), most of them only store the XOR against the last full one");
+                }
+                if (incrementalCheckpoints)
+                {
+                    ImGui::SameLine();
+                    ImGui::SetNextItemWidth(100);
+                    incrementalChanged |= ImGui::InputInt("Full Every", &fullCheckpointInterval);
+                    if (fullCheckpointInterval < 1) fullCheckpointInterval = 1;
+                }
+                if (incrementalChanged)
+                    checkpointWriter.setIncremental(incrementalCheckpoints, fullCheckpointInterval);
+
+                if (checkpointWriter.getWrittenCount() > 0)
+                {
+                    ImGui::Text("Checkpoints: %d written, last capture %.1f us, last write %.1f ms",
+                        checkpointWriter.getWrittenCount(), checkpointWriter.getLastCaptureUs(), checkpointWriter.getLastWriteMs());
+
+                    auto records = checkpointWriter.getRecords();
+                    if (ImGui::TreeNode("Checkpoint Files"))
+                    {
+                        if (ImGui::BeginTable("CheckpointTable", 4, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+                        {
+                            ImGui::TableSetupColumn("File");
+                            ImGui::TableSetupColumn("Epoch");
+                            ImGui::TableSetupColumn("Type");
+                            ImGui::TableSetupColumn("Bytes Written");
+                            ImGui::TableHeadersRow();
+                            for (const auto& record : records)
+                            {
+                                ImGui::TableNextRow();
+                                ImGui::TableSetColumnIndex(0);
+                                ImGui::Text("%s", record.filepath.c_str());
+                                ImGui::TableSetColumnIndex(1);
+                                ImGui::Text("%d", record.epoch);
+                                ImGui::TableSetColumnIndex(2);
+                                ImGui::Text("%s", record.delta ? "delta" : "full");
+                                ImGui::TableSetColumnIndex(3);
+                                ImGui::Text("%zu (%.0f%%)", record.bytesWritten, 100.0f * record.bytesWritten / record.rawBytes);
+                            }
+                            ImGui::EndTable();
+                        }
+                        ImGui::TreePop();
+                    }
+                }
+                if (checkpointWriter.lastWriteFailed())
+                    ImGui::TextColored(ImVec4(1, 0.5f, 0, 1), "Last checkpoint could not be written");
+
                 if (datasetLoaded && networkCreated && !isTraining)
                 {
                     if (ImGui::Button("Start Training"))
@@ -453,6 +542,9 @@ int main(void)
                         currentAccuracy = epochAccuracy / numBatches;
                         currentEpoch++;
 
+                        if (checkpointInterval > 0 && currentEpoch % checkpointInterval == 0)
+                            checkpointWriter.Save(network, dataset, currentEpoch, learningRate, batchSize, checkpointPath);
+
                         UpdateTrainingMetrics(currentEpoch, currentLoss, currentAccuracy,
                             lossHistory, accuracyHistory, epochNumbers, maxHistorySize);
 
@@ -474,6 +566,48 @@ int main(void)
                     }
                 }
 
+                // Resume needs the same dataset, the network comes from the checkpoint
+                if (datasetLoaded && !isTraining)
+                {
+                    if (networkCreated)
+                        ImGui::SameLine();
+                    if (ImGui::Button("Resume From Checkpoint"))
+                    {
+                        // Incremental mode writes <path>.<n> : the newest record of this run, else the newest on disk
+                        checkpointWriter.Flush();
+                        std::vector<CheckpointRecord> records = checkpointWriter.getRecords();
+                        std::string resumePath = checkpointPath;
+                        if (!records.empty())
+                            resumePath = records.back().filepath;
+                        else if (incrementalCheckpoints)
+                            resumePath = FindLatestCheckpoint(checkpointPath);
+
+                        TrainingCheckpoint checkpoint;
+                        if (LoadCheckpoint(resumePath, checkpoint) && dataset.setCursor(checkpoint.dataset))
+                        {
+                            network.RestoreState(checkpoint.network);
+                            networkCreated = true;
+                            currentEpoch = checkpoint.epoch;
+                            learningRate = checkpoint.learningRate;
+                            batchSize = checkpoint.batchSize;
+                            selectedPrecision = network.getPrecision() == Precision::BF16 ? 1 : 0;
+                            sparseInference = network.getSparseInference();
+
+                            numberOfLayers = network.getLayerCount();
+                            layerSizes.resize(numberOfLayers);
+                            for (int i = 0; i < numberOfLayers; i++)
+                                layerSizes[i] = network.getLayerSize(i);
+
+                            isTraining = currentEpoch < epochs;
+                            std::cout << "Resuming from epoch " << currentEpoch << " (" << resumePath << ")" << std::endl;
+                        }
+                        else
+                        {
+                            std::cout << "Could not resume from " << resumePath << std::endl;
+                        }
+                    }
+                }
+
                 if (datasetLoaded && networkCreated)
                 {
                     
@@ -506,6 +640,164 @@ int main(void)
                 }
             }
 
+            // Pruning section
+            if (ImGui::CollapsingHeader("Pruning") && networkCreated)
+            {
+                ImGui::SliderFloat("Target Sparsity", &pruneSparsity, 0.0f, 0.99f);
+
+                if (!isTraining && ImGui::Button("Prune Weights"))
+                {
+                    network.PruneByMagnitude(pruneSparsity);
+                    std::cout << "Network pruned to " << (pruneSparsity * 100.0f) << "% sparsity per layer" << std::endl;
+                }
+                if (network.isPruned())
+                {
+                    ImGui::SameLine();
+                    if (ImGui::Button("Clear Mask"))
+                        network.ClearPruning();
+                    ImGui::SameLine();
+                    ImGui::TextColored(ImVec4(0, 1, 0, 1), "Training fine-tunes the surviving weights");
+                }
+
+                if (ImGui::Checkbox("Sparse Inference", &sparseInference))
+                    network.setSparseInference(sparseInference);
+                if (ImGui::IsItemHovered())
+                {
+                    ImGui::SetTooltip("Run predictions with sparse matrix-vector products, faster at high sparsity");
+                }
+
+                ImGui::Separator();
+                ImGui::InputInt("Regrow Interval", &regrowInterval);
+                if (regrowInterval < 1) regrowInterval = 1;
+
+                if (!network.isSparseTraining())
+                {
+                    if (!isTraining && ImGui::Button("Start Sparse Training"))
+                    {
+                        network.EnableSparseTraining(pruneSparsity, regrowInterval);
+                        std::cout << "Sparse training enabled at " << (pruneSparsity * 100.0f) << "% sparsity" << std::endl;
+                    }
+                    if (ImGui::IsItemHovered())
+                    {
+                        ImGui::SetTooltip("Random sparse connectivity at the target sparsity, rewired by gradient magnitude during training");
+                    }
+                }
+                else
+                {
+                    ImGui::TextColored(ImVec4(0, 1, 0, 1), "Dynamic sparse training active");
+                    ImGui::SameLine();
+                    if (ImGui::Button("Back to Dense"))
+                        network.DisableSparseTraining();
+                }
+
+                for (int i = 0; i < network.getLayerCount() - 1; i++)
+                    ImGui::Text("Layer %d -> %d: %.1f%% zeros", i, i + 1, network.getSparsity(i) * 100.0f);
+
+                // Structured pruning shrinks the dense layers instead of zeroing weights
+                ImGui::Separator();
+                ImGui::Text("Neuron Pruning:");
+                const char* rankings[] = { "Weight Norm", "Activation Variance" };
+                ImGui::Combo("Ranking", &neuronRanking, rankings, 2);
+                ImGui::SliderFloat("Neurons Removed", &neuronPruneFraction, 0.0f, 0.95f);
+                NeuronRanking ranking = neuronRanking == 1 ? NeuronRanking::ActivationVariance : NeuronRanking::WeightNorm;
+
+                if (datasetLoaded && !isTraining)
+                {
+                    if (ImGui::Button("Prune Neurons"))
+                    {
+                        PruneNeurons(network, dataset, neuronPruneFraction, ranking);
+
+                        // Keep the architecture panel in sync with the smaller network
+                        if (network.getLayerCount() == numberOfLayers)
+                        {
+                            for (int i = 0; i < numberOfLayers; i++)
+                                layerSizes[i] = network.getLayerSize(i);
+                        }
+                        std::cout << "Removed " << (neuronPruneFraction * 100.0f) << "% of the hidden neurons" << std::endl;
+                    }
+                    ImGui::SameLine();
+                    if (ImGui::Button("Accuracy vs Latency Sweep"))
+                        pruningReports = NeuronPruningSweep(network, dataset, { 0.0f, 0.25f, 0.5f, 0.75f, 0.9f }, ranking);
+                }
+
+                if (!pruningReports.empty() && ImGui::BeginTable("PruningSweep", 4, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+                {
+                    ImGui::TableSetupColumn("Removed");
+                    ImGui::TableSetupColumn("Parameters");
+                    ImGui::TableSetupColumn("Accuracy");
+                    ImGui::TableSetupColumn("Latency");
+                    ImGui::TableHeadersRow();
+
+                    for (const auto& report : pruningReports)
+                    {
+                        ImGui::TableNextRow();
+                        ImGui::TableSetColumnIndex(0);
+                        ImGui::Text("%.0f%%", report.fraction * 100.0f);
+                        ImGui::TableSetColumnIndex(1);
+                        ImGui::Text("%d", report.parameters);
+                        ImGui::TableSetColumnIndex(2);
+                        ImGui::Text("%.2f%%", report.accuracy * 100.0f);
+                        ImGui::TableSetColumnIndex(3);
+                        ImGui::Text("%.1f us", report.latencyUs);
+                    }
+                    ImGui::EndTable();
+                }
+
+                // Low rank compression
+                ImGui::Separator();
+                ImGui::Text("Low Rank Compression:");
+                ImGui::SliderFloat("Max Accuracy Loss", &maxAccuracyLoss, 0.0f, 0.1f, "%.3f");
+                if (datasetLoaded && !isTraining && ImGui::Button("Compress Layers (SVD)"))
+                {
+                    auto reports = CompressLowRank(network, dataset, maxAccuracyLoss);
+                    for (const auto& report : reports)
+                        std::cout << "Layer " << report.layer << ": rank " << report.rank << ", " << report.denseFlops
+                            << " -> " << report.factorizedFlops << " multiply-adds, accuracy " << (report.accuracy * 100.0f) << "%" << std::endl;
+                }
+                for (int i = 0; i < network.getLayerCount() - 1; i++)
+                {
+                    if (network.isFactorized(i))
+                        ImGui::Text("Layer %d -> %d: rank %d", i, i + 1, network.getLayerRank(i));
+                }
+            }
+
+            // Model file section
+            if (ImGui::CollapsingHeader("Model File"))
+            {
+                ImGui::InputText("Model Path", modelPath, sizeof(modelPath));
+                if (networkCreated && !isTraining && ImGui::Button("Save Model"))
+                    SaveModel(network, modelPath);
+                if (networkCreated && !isTraining)
+                    ImGui::SameLine();
+                if (!isTraining && ImGui::Button("Load Model"))
+                {
+                    MappedModel model;
+                    if (model.Open(modelPath, true))
+                    {
+                        network = model.ToNetwork();
+                        network.setPrecision(selectedPrecision == 1 ? Precision::BF16 : Precision::FP32);
+                        network.setSparseInference(sparseInference);
+                        networkCreated = true;
+
+                        // Show the loaded architecture
+                        numberOfLayers = network.getLayerCount();
+                        layerSizes.resize(numberOfLayers);
+                        for (int i = 0; i < numberOfLayers; i++)
+                            layerSizes[i] = network.getLayerSize(i);
+                        std::cout << "Loaded model from " << modelPath << std::endl;
+                    }
+                }
+            }
+
+            // Export section
+            if (ImGui::CollapsingHeader("Export") && networkCreated)
+            {
+                // Standalone header with constexpr weights, see src/bench/CompiledModelBench.cpp
+                ImGui::InputText("Header Path", compiledHeaderPath, sizeof(compiledHeaderPath));
+                if (!isTraining && ImGui::Button("Compile C++ Header"))
+                    CompileModelHeader(network, compiledHeaderPath);
+            }
+
             ImGui::End();
 
             #pragma endregion
@@ -569,7 +861,7 @@ int main(void)
                         ImGui::Text("Network Prediction:");
 
                         // Predicted class
-                        auto prediction = network.Forward(sample.input);
+                        auto prediction = predictionCache.Predict(network, sample.input);
                         int predictedClass = 0;
                         float maxProb = prediction[0];
                         for (int i = 1; i < prediction.size(); i++)
@@ -612,6 +904,17 @@ int main(void)
                             ImGui::SameLine();
                             ImGui::Text("%.3f", prob);
                         }
+
+                        PredictionCacheStats cacheStats = predictionCache.getStats();
+                        ImGui::Separator();
+                        ImGui::Text("Prediction cache: %lld hits, %lld misses (%.1f%% hit rate)",
+                            cacheStats.hits, cacheStats.misses, cacheStats.getHitRate() * 100.0f);
+                        ImGui::Text("%zu / %zu entries, %lld invalidations", cacheStats.size, cacheStats.capacity, cacheStats.invalidations);
+                        if (ImGui::Button("Reset Cache"))
+                        {
+                            predictionCache.Clear();
+                            predictionCache.ResetStats();
+                        }
                     }
                 }
                 ImGui::EndChild();
@@ -918,7 +1221,7 @@ int main(void)
                         for (int i = 0; i < 784; i++)
                             canvasInput[i] = canvasData[i];
 
-                        canvasPrediction = network.Forward(canvasInput);
+                        canvasPrediction = predictionCache.Predict(network, canvasInput);
                         canvasMaxProb = canvasPrediction[0];
                         canvasPredictedClass = 0;
 
@@ -950,13 +1253,12 @@ int main(void)
                     if (ImGui::Button("Predict Digit"))
                     {
                         displayCanvasMetrics = true;
-                        network.Forward(canvasInput);
                         if (!isTraining && networkCreated && displayCanvasMetrics)
                         {
                             for (int i = 0; i < 784; i++)
                                 canvasInput[i] = canvasData[i];
 
-                            canvasPrediction = network.Forward(canvasInput);
+                            canvasPrediction = predictionCache.Predict(network, canvasInput);
                             canvasMaxProb = canvasPrediction[0];
                             canvasPredictedClass = 0;
 
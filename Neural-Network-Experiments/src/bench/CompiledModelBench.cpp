@@ -0,0 +1,97 @@
+// Compiled header (ModelCompiler) versus Network::Forward on the same weights
+//
+// 1. Export a trained network from the GUI (Export -> Compile C++ Header) or with CompileModelHeader()
+// 2. Build this file against it, e.g.
+//		g++ -O2 -march=native -Isrc -Isrc/vendor -DNN_MODEL_HEADER="\"model_compiled.h\"" src/bench/CompiledModelBench.cpp src/ml/*.cpp
+//	  (MSVC : /O2 /arch:AVX2 with the same include paths and define)
+// 3. Run it, optionally passing the number of samples : ./a.out 20000
+#include <chrono>
+#include <cstdlib>
+
+#include "ml/Network.h"
+
+#ifndef NN_MODEL_HEADER
+#define NN_MODEL_HEADER "model_compiled.h"
+#endif
+#include NN_MODEL_HEADER
+
+template<typename Func>
+static double TimeUs(Func&& func)
+{
+	auto start = std::chrono::steady_clock::now();
+	func();
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+int main(int argc, char** argv)
+{
+	int sampleCount = argc > 1 ? std::atoi(argv[1]) : 10000;
+	if (sampleCount <= 0)
+		sampleCount = 10000;
+
+	// Rebuild the same model as a Network from the arrays in the header
+	std::vector<int> sizes(nn_model::kLayerSizes, nn_model::kLayerSizes + nn_model::kLayerCount);
+	Network network(sizes);
+	for (int layer = 0; layer < nn_model::kLayerCount - 1; layer++)
+	{
+		network.setWeights(layer, Eigen::Map<const Eigen::MatrixXf>(nn_model::kLayerWeights[layer], sizes[layer + 1], sizes[layer]));
+		network.setBiases(layer, Eigen::Map<const Eigen::VectorXf>(nn_model::kLayerBiases[layer], sizes[layer + 1]));
+	}
+
+	// MNIST-like inputs : about 80% of the pixels are exactly 0, the rest in (0, 1]
+	std::mt19937 gen(42);
+	std::uniform_real_distribution<float> pixel(0.0f, 1.0f);
+	std::vector<Eigen::VectorXf> inputs(sampleCount, Eigen::VectorXf(nn_model::kInputSize));
+	for (auto& input : inputs)
+	{
+		for (int i = 0; i < input.size(); i++)
+			input[i] = pixel(gen) < 0.8f ? 0.0f : pixel(gen);
+	}
+
+	// Both paths must agree before timing them
+	float maxDifference = 0.0f;
+	int labelMismatches = 0;
+	float output[nn_model::kOutputSize];
+	for (const auto& input : inputs)
+	{
+		Eigen::VectorXf reference = network.Forward(input);
+		nn_model::predict(input.data(), output);
+		for (int i = 0; i < nn_model::kOutputSize; i++)
+			maxDifference = std::max(maxDifference, std::abs(reference[i] - output[i]));
+
+		int expected;
+		reference.maxCoeff(&expected);
+		if (nn_model::predictLabel(input.data()) != expected)
+			labelMismatches++;
+	}
+
+	// Keeps the optimizer from dropping the loops
+	volatile float sink = 0.0f;
+
+	double networkUs = TimeUs([&]()
+		{
+			for (const auto& input : inputs)
+				sink = sink + network.Forward(input)[0];
+		});
+
+	double compiledUs = TimeUs([&]()
+		{
+			for (const auto& input : inputs)
+			{
+				nn_model::predict(input.data(), output);
+				sink = sink + output[0];
+			}
+		});
+
+	std::cout << "Topology:          ";
+	for (int i = 0; i < nn_model::kLayerCount; i++)
+		std::cout << (i > 0 ? "-" : "") << nn_model::kLayerSizes[i];
+	std::cout << "\nSamples:           " << sampleCount << std::endl;
+	std::cout << "Max difference:    " << maxDifference << " (" << labelMismatches << " label mismatches)" << std::endl;
+	std::cout << "Network::Forward:  " << networkUs / sampleCount << " us/sample" << std::endl;
+	std::cout << "Compiled predict:  " << compiledUs / sampleCount << " us/sample" << std::endl;
+	std::cout << "Speedup:           " << networkUs / compiledUs << "x" << std::endl;
+
+	return maxDifference < 1e-4f ? 0 : 1;
+}
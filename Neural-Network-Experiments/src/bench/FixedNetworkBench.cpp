@@ -0,0 +1,94 @@
+// FixedNetwork<784, 128, 64, 10> versus Network on the same weights : one sample inference and TrainBatch
+//
+// Built by CMake as fixed-network-bench. Run it, optionally passing the number of samples : ./fixed-network-bench 20000
+#include <chrono>
+#include <cstdlib>
+
+#include "ml/FixedNetwork.h"
+
+using Fixed = FixedNetwork<784, 128, 64, 10>;
+
+template<typename Func>
+static double TimeUs(Func&& func)
+{
+	auto start = std::chrono::steady_clock::now();
+	func();
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+int main(int argc, char** argv)
+{
+	int sampleCount = argc > 1 ? std::atoi(argv[1]) : 10000;
+	if (sampleCount <= 0)
+		sampleCount = 10000;
+	const int batchSize = 32;
+
+	Network network({ 784, 128, 64, 10 });
+	Fixed fixed(network);
+
+	// MNIST-like samples : about 80% of the pixels are exactly 0, the rest in (0, 1]
+	std::mt19937 gen(42);
+	std::uniform_real_distribution<float> pixel(0.0f, 1.0f);
+	std::vector<DataSample> samples(sampleCount);
+	for (auto& sample : samples)
+	{
+		sample.input.resize(Fixed::InputSize);
+		for (int i = 0; i < sample.input.size(); i++)
+			sample.input[i] = pixel(gen) < 0.8f ? 0.0f : pixel(gen);
+		sample.label = static_cast<int>(gen() % Fixed::OutputSize);
+		sample.target = Dataset::oneHotEncode(sample.label, Fixed::OutputSize);
+	}
+	std::vector<std::vector<DataSample>> batches;
+	for (size_t first = 0; first < samples.size(); first += batchSize)
+		batches.emplace_back(samples.begin() + first, samples.begin() + std::min(samples.size(), first + batchSize));
+
+	// Fixed size inputs for the fixed network, converting them would be timed too
+	std::vector<Fixed::InputVector, Eigen::aligned_allocator<Fixed::InputVector>> inputs(sampleCount);
+	for (int i = 0; i < sampleCount; i++)
+		inputs[i] = samples[i].input;
+
+	// Keeps the optimizer from dropping the loops
+	volatile float sink = 0.0f;
+
+	double networkForwardUs = TimeUs([&]()
+		{
+			for (const auto& sample : samples)
+				sink = sink + network.Forward(sample.input)[0];
+		});
+
+	double fixedForwardUs = TimeUs([&]()
+		{
+			for (const auto& input : inputs)
+				sink = sink + fixed.Forward(input)[0];
+		});
+
+	double networkTrainUs = TimeUs([&]()
+		{
+			for (const auto& batch : batches)
+				network.TrainBatch(batch, 0.1f);
+		});
+
+	double fixedTrainUs = TimeUs([&]()
+		{
+			for (const auto& batch : batches)
+				fixed.TrainBatch(batch, 0.1f);
+		});
+
+	// Both trained on the same batches from the same weights
+	float maxDifference = 0.0f;
+	for (const auto& sample : samples)
+		maxDifference = std::max(maxDifference, (network.Forward(sample.input) - fixed.Forward(sample.input)).cwiseAbs().maxCoeff());
+
+	std::cout << "Topology:            784-128-64-10" << std::endl;
+	std::cout << "Samples:             " << sampleCount << " (batches of " << batchSize << ")" << std::endl;
+	std::cout << "Max difference:      " << maxDifference << std::endl;
+	std::cout << "Network::Forward:    " << networkForwardUs / sampleCount << " us/sample" << std::endl;
+	std::cout << "Fixed Forward:       " << fixedForwardUs / sampleCount << " us/sample" << std::endl;
+	std::cout << "Forward speedup:     " << networkForwardUs / fixedForwardUs << "x" << std::endl;
+	std::cout << "Network::TrainBatch: " << networkTrainUs / sampleCount << " us/sample" << std::endl;
+	std::cout << "Fixed TrainBatch:    " << fixedTrainUs / sampleCount << " us/sample" << std::endl;
+	std::cout << "Train speedup:       " << networkTrainUs / fixedTrainUs << "x" << std::endl;
+
+	return maxDifference < 1e-3f ? 0 : 1;
+}
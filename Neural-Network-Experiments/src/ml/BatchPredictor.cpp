@@ -0,0 +1,207 @@
+#include "BatchPredictor.h"
+#include <cmath>
+#include <stdexcept>
+
+void LatencyHistogram::Record(float us)
+{
+	int bucket = 0;
+	if (us > 1.0f)
+		bucket = std::min(static_cast<int>(std::log2(us) * BucketsPerOctave), BucketCount - 1);
+	m_Counts[bucket]++;
+	m_Total++;
+	m_SumUs += us;
+	m_MaxUs = std::max(m_MaxUs, us);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other)
+{
+	for (int i = 0; i < BucketCount; i++)
+		m_Counts[i] += other.m_Counts[i];
+	m_Total += other.m_Total;
+	m_SumUs += other.m_SumUs;
+	m_MaxUs = std::max(m_MaxUs, other.m_MaxUs);
+}
+
+void LatencyHistogram::Clear()
+{
+	std::fill(m_Counts.begin(), m_Counts.end(), 0);
+	m_Total = 0;
+	m_SumUs = 0.0;
+	m_MaxUs = 0.0f;
+}
+
+float LatencyHistogram::Percentile(float p) const
+{
+	if (m_Total == 0)
+		return 0.0f;
+
+	long long rank = static_cast<long long>(std::ceil(p * m_Total));
+	long long seen = 0;
+	for (int i = 0; i < BucketCount; i++)
+	{
+		seen += m_Counts[i];
+		if (seen >= std::max(rank, 1LL))
+		{
+			// Upper bound of the bucket, never above the largest sample
+			float bound = std::exp2(static_cast<float>(i + 1) / BucketsPerOctave);
+			return std::min(bound, m_MaxUs);
+		}
+	}
+	return m_MaxUs;
+}
+
+BatchPredictor::BatchPredictor(std::shared_ptr<const Network> network, int maxBatch, int maxWaitUs, int workers)
+	: m_InputSize(network->getLayerSize(0)), m_OutputSize(network->getLayerSize(network->getLayerCount() - 1)),
+	m_MaxBatch(std::max(maxBatch, 1)), m_MaxWait(std::max(maxWaitUs, 0))
+{
+	m_Model = std::make_shared<const ServedModel>(ServedModel{ std::move(network), 1 });
+	m_Stats.batchSizes.assign(m_MaxBatch + 1, 0);
+	for (int i = 0; i < std::max(workers, 1); i++)
+		m_Workers.emplace_back(&BatchPredictor::WorkerLoop, this);
+}
+
+BatchPredictor::~BatchPredictor()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Stop = true;
+	}
+	m_Condition.notify_all();
+	for (auto& worker : m_Workers)
+		worker.join();
+}
+
+unsigned long long BatchPredictor::SwapNetwork(std::shared_ptr<const Network> network)
+{
+	if (!network || network->getLayerSize(0) != m_InputSize || network->getLayerSize(network->getLayerCount() - 1) != m_OutputSize)
+		return 0;
+
+	// Only one swap at a time, so versions stay in order
+	std::lock_guard<std::mutex> lock(m_SwapMutex);
+	unsigned long long version = std::atomic_load(&m_Model)->version + 1;
+	std::atomic_store(&m_Model, std::make_shared<const ServedModel>(ServedModel{ std::move(network), version }));
+
+	std::lock_guard<std::mutex> statsLock(m_StatsMutex);
+	m_Stats.swaps++;
+	return version;
+}
+
+std::future<Prediction> BatchPredictor::Submit(Eigen::VectorXf input)
+{
+	Request request;
+	request.input = std::move(input);
+	request.submitted = std::chrono::steady_clock::now();
+	std::future<Prediction> future = request.promise.get_future();
+
+	if (request.input.size() != getInputSize())
+	{
+		request.promise.set_exception(std::make_exception_ptr(std::invalid_argument("Input size doesn't match the network")));
+		return future;
+	}
+
+	bool wake;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Pending.push_back(std::move(request));
+		// A worker sleeping on an empty queue needs to start the wait clock, one waiting for the timeout only cares
+		// about a full batch
+		wake = m_Pending.size() == 1 || m_Pending.size() >= static_cast<size_t>(m_MaxBatch);
+	}
+	if (wake)
+		m_Condition.notify_one();
+	return future;
+}
+
+void BatchPredictor::WorkerLoop()
+{
+	std::vector<Request> batch;
+	batch.reserve(m_MaxBatch);
+	Eigen::MatrixXf inputs;
+
+	while (true)
+	{
+		bool full;
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_Condition.wait(lock, [this] { return m_Stop || !m_Pending.empty(); });
+			if (m_Pending.empty())
+				return;	// Stopping
+
+			// Hold the batch open until it's full or the oldest request runs out of waiting time
+			auto deadline = m_Pending.front().submitted + m_MaxWait;
+			m_Condition.wait_until(lock, deadline, [this]
+			{
+				return m_Stop || m_Pending.empty() || m_Pending.size() >= static_cast<size_t>(m_MaxBatch);
+			});
+			if (m_Pending.empty())
+				continue;	// Another worker took them
+
+			full = m_Pending.size() >= static_cast<size_t>(m_MaxBatch);
+			size_t count = std::min(m_Pending.size(), static_cast<size_t>(m_MaxBatch));
+			for (size_t i = 0; i < count; i++)
+			{
+				batch.push_back(std::move(m_Pending.front()));
+				m_Pending.pop_front();
+			}
+
+			// Leftovers belong to the next worker
+			if (!m_Pending.empty())
+				m_Condition.notify_one();
+		}
+
+		int count = static_cast<int>(batch.size());
+		inputs.resize(getInputSize(), count);
+		for (int i = 0; i < count; i++)
+			inputs.col(i) = batch[i].input;
+
+		// Keeps this model alive until the batch is answered, even if it gets swapped out meanwhile
+		std::shared_ptr<const ServedModel> model = std::atomic_load(&m_Model);
+
+		auto forwardStart = std::chrono::steady_clock::now();
+		Eigen::MatrixXf outputs = model->network->ForwardBatch(inputs);
+		auto done = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < count; i++)
+		{
+			Prediction prediction;
+			prediction.outputs = outputs.col(i);
+			Eigen::Index label;
+			prediction.outputs.maxCoeff(&label);
+			prediction.label = static_cast<int>(label);
+			prediction.modelVersion = model->version;
+			batch[i].promise.set_value(std::move(prediction));
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_StatsMutex);
+			m_Stats.requests += count;
+			m_Stats.batches++;
+			for (int i = 0; i < count; i++)
+				m_Stats.latency.Record(std::chrono::duration<float, std::micro>(done - batch[i].submitted).count());
+			m_Stats.forward.Record(std::chrono::duration<float, std::micro>(done - forwardStart).count());
+			m_Stats.batchSizes[count]++;
+			if (full)
+				m_Stats.fullBatches++;
+			else
+				m_Stats.timeoutBatches++;
+		}
+		batch.clear();
+	}
+}
+
+BatchPredictorStats BatchPredictor::getStats()
+{
+	std::lock_guard<std::mutex> lock(m_StatsMutex);
+	BatchPredictorStats stats = m_Stats;
+	stats.modelVersion = getModelVersion();
+	return stats;
+}
+
+void BatchPredictor::ResetStats()
+{
+	std::lock_guard<std::mutex> lock(m_StatsMutex);
+	int swaps = m_Stats.swaps;
+	m_Stats = BatchPredictorStats();
+	m_Stats.swaps = swaps;
+	m_Stats.batchSizes.assign(m_MaxBatch + 1, 0);
+}
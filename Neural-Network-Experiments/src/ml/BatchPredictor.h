@@ -0,0 +1,126 @@
+#pragma once
+#include "Network.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+struct Prediction
+{
+	int label = -1;
+	Eigen::VectorXf outputs;
+	unsigned long long modelVersion = 0;	// Model that answered
+};
+
+// Latency histogram with log spaced buckets (8 per power of two, ~9% wide) from 1 us to ~1 hour.
+// Percentiles come from the bucket bounds, so they're exact to about one bucket
+class LatencyHistogram
+{
+public:
+	static constexpr int BucketsPerOctave = 8;
+	static constexpr int BucketCount = 32 * BucketsPerOctave;
+
+private:
+	std::vector<long long> m_Counts;
+	long long m_Total = 0;
+	double m_SumUs = 0.0;
+	float m_MaxUs = 0.0f;
+
+public:
+	LatencyHistogram() : m_Counts(BucketCount, 0) {}
+
+	void Record(float us);
+	void Merge(const LatencyHistogram& other);
+	void Clear();
+
+	float Percentile(float p) const;	// p in 0..1, 0 without samples
+	long long getCount() const { return m_Total; }
+	float getMeanUs() const { return m_Total > 0 ? static_cast<float>(m_SumUs / m_Total) : 0.0f; }
+	float getMaxUs() const { return m_MaxUs; }
+};
+
+struct BatchPredictorStats
+{
+	long long requests = 0;
+	long long batches = 0;
+	LatencyHistogram latency;			// Submit() to result ready (queueing + batching + forward)
+	LatencyHistogram forward;			// ForwardBatch time per batch
+	std::vector<long long> batchSizes;	// batchSizes[n] = batches of n requests
+	long long fullBatches = 0;			// Sent because maxBatch requests were waiting
+	long long timeoutBatches = 0;		// Sent because the oldest request waited maxWait
+	unsigned long long modelVersion = 0;
+	int swaps = 0;
+};
+
+// Dynamic batching : concurrent Submit() calls are collected into one batch until maxBatch requests are waiting
+// or the oldest one has waited maxWait, then a single ForwardBatch serves all of them.
+// Several workers let one batch fill up while the previous one is computing.
+// The model can be replaced while serving : every batch takes a reference to the current one, so batches already
+// computing finish on the old model (freed with the last of them) and the next batch picks up the new one
+class BatchPredictor
+{
+private:
+	struct ServedModel
+	{
+		std::shared_ptr<const Network> network;
+		unsigned long long version;
+	};
+
+	struct Request
+	{
+		Eigen::VectorXf input;
+		std::promise<Prediction> promise;
+		std::chrono::steady_clock::time_point submitted;
+	};
+
+	std::shared_ptr<const ServedModel> m_Model;	// Only through std::atomic_load / atomic_store
+	int m_InputSize;
+	int m_OutputSize;
+	int m_MaxBatch;
+	std::chrono::microseconds m_MaxWait;
+
+	std::deque<Request> m_Pending;
+	bool m_Stop = false;
+	std::mutex m_Mutex;
+	std::condition_variable m_Condition;
+	std::vector<std::thread> m_Workers;
+
+	std::mutex m_SwapMutex;
+	std::mutex m_StatsMutex;
+	BatchPredictorStats m_Stats;
+
+	void WorkerLoop();
+
+public:
+	BatchPredictor(std::shared_ptr<const Network> network, int maxBatch, int maxWaitUs, int workers = 1);
+	~BatchPredictor();	// Serves what's pending, then stops
+
+	BatchPredictor(const BatchPredictor&) = delete;
+	BatchPredictor& operator=(const BatchPredictor&) = delete;
+
+	// Thread safe. The input size has to match the network's input layer
+	std::future<Prediction> Submit(Eigen::VectorXf input);
+
+	// Lock free for the callers of Submit(). The new network needs the same input and output sizes,
+	// returns its version number (0 = rejected)
+	unsigned long long SwapNetwork(std::shared_ptr<const Network> network);
+
+	std::shared_ptr<const Network> getNetwork() const { return std::atomic_load(&m_Model)->network; }
+	// Network and its version read together (a swap can happen between getNetwork() and getModelVersion())
+	std::shared_ptr<const Network> getNetwork(unsigned long long& version) const
+	{
+		std::shared_ptr<const ServedModel> model = std::atomic_load(&m_Model);
+		version = model->version;
+		return model->network;
+	}
+	unsigned long long getModelVersion() const { return std::atomic_load(&m_Model)->version; }
+	int getInputSize() const { return m_InputSize; }
+	int getMaxBatch() const { return m_MaxBatch; }
+
+	BatchPredictorStats getStats();
+	void ResetStats();
+};
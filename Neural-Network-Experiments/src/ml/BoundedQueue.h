@@ -0,0 +1,69 @@
+#pragma once
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// Blocking FIFO with a fixed capacity, for producer / consumer pipelines. Push waits while the queue is full
+// (backpressure on the producer), Pop waits while it's empty.
+// After Close() every Push fails and Pop hands out what's left, then fails
+template<typename T>
+class BoundedQueue
+{
+private:
+	std::deque<T> m_Items;
+	size_t m_Capacity;
+	bool m_Closed = false;
+	std::mutex m_Mutex;
+	std::condition_variable m_NotFull;
+	std::condition_variable m_NotEmpty;
+
+public:
+	explicit BoundedQueue(size_t capacity) : m_Capacity(std::max<size_t>(capacity, 1)) {}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	bool Push(T item)
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_NotFull.wait(lock, [this] { return m_Closed || m_Items.size() < m_Capacity; });
+		if (m_Closed)
+			return false;
+		m_Items.push_back(std::move(item));
+		lock.unlock();
+		m_NotEmpty.notify_one();
+		return true;
+	}
+
+	bool Pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_NotEmpty.wait(lock, [this] { return m_Closed || !m_Items.empty(); });
+		if (m_Items.empty())
+			return false;
+		item = std::move(m_Items.front());
+		m_Items.pop_front();
+		lock.unlock();
+		m_NotFull.notify_one();
+		return true;
+	}
+
+	void Close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Closed = true;
+		}
+		m_NotFull.notify_all();
+		m_NotEmpty.notify_all();
+	}
+
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		return m_Items.size();
+	}
+
+	size_t getCapacity() const { return m_Capacity; }
+};
@@ -0,0 +1,659 @@
+#include "Checkpoint.h"
+#include "DeltaCodec.h"
+#include "ModelFile.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const uint32_t CheckpointMagic = 0x4B434E4E;	// "NNCK"
+static const uint32_t DeltaMagic = 0x44434E4E;		// "NNCD"
+static const uint32_t CheckpointVersion = 2;
+
+// Little helpers to append / read plain values, the reader fails instead of reading past the end
+class BufferWriter
+{
+private:
+	std::vector<char>& m_Data;
+
+public:
+	BufferWriter(std::vector<char>& data) : m_Data(data) {}
+
+	void PutBytes(const void* bytes, size_t size)
+	{
+		// resize + memcpy rather than insert : GCC 12 reports a bogus -Wstringop-overflow for insert once it is
+		// inlined into a writer that starts from an empty vector (SerializeDeltaCheckpoint)
+		size_t offset = m_Data.size();
+		m_Data.resize(offset + size);
+		if (size > 0)
+			std::memcpy(m_Data.data() + offset, bytes, size);
+	}
+
+	template<typename T>
+	void Put(const T& value) { PutBytes(&value, sizeof(T)); }
+
+	template<typename Derived>
+	void PutMatrix(const Eigen::PlainObjectBase<Derived>& matrix)
+	{
+		Put<int64_t>(matrix.rows());
+		Put<int64_t>(matrix.cols());
+		PutBytes(matrix.data(), matrix.size() * sizeof(typename Derived::Scalar));
+	}
+
+	template<typename Matrix>
+	void PutMatrices(const std::vector<Matrix>& matrices)
+	{
+		Put<uint32_t>(static_cast<uint32_t>(matrices.size()));
+		for (const auto& matrix : matrices)
+			PutMatrix(matrix);
+	}
+
+	// The text form of the state is the only portable one, stored as binary words so every checkpoint of
+	// a run has the same size (incremental checkpoints need that)
+	void PutGenerator(const std::mt19937& gen)
+	{
+		std::stringstream stream;
+		stream << gen;
+		std::vector<uint32_t> words;
+		unsigned long long word;
+		while (stream >> word)
+			words.push_back(static_cast<uint32_t>(word));
+
+		Put<uint32_t>(static_cast<uint32_t>(words.size()));
+		PutBytes(words.data(), words.size() * sizeof(uint32_t));
+	}
+};
+
+class BufferReader
+{
+private:
+	const std::vector<char>& m_Data;
+	size_t m_Offset = 0;
+	bool m_Failed = false;
+
+public:
+	BufferReader(const std::vector<char>& data) : m_Data(data) {}
+
+	bool failed() const { return m_Failed; }
+	bool atEnd() const { return m_Offset == m_Data.size(); }
+	size_t remaining() const { return m_Data.size() - m_Offset; }
+
+	bool GetBytes(void* bytes, size_t size)
+	{
+		if (m_Failed || size > m_Data.size() - m_Offset)
+		{
+			m_Failed = true;
+			return false;
+		}
+		std::memcpy(bytes, m_Data.data() + m_Offset, size);
+		m_Offset += size;
+		return true;
+	}
+
+	template<typename T>
+	T Get()
+	{
+		T value = T();
+		GetBytes(&value, sizeof(T));
+		return value;
+	}
+
+	template<typename Derived>
+	void GetMatrix(Eigen::PlainObjectBase<Derived>& matrix)
+	{
+		int64_t rows = Get<int64_t>();
+		int64_t cols = Get<int64_t>();
+		size_t remaining = m_Data.size() - m_Offset;
+		if (m_Failed || rows < 0 || cols < 0 || (cols != 0 && static_cast<uint64_t>(rows) > remaining / cols / sizeof(typename Derived::Scalar)))
+		{
+			m_Failed = true;
+			return;
+		}
+		matrix.resize(rows, cols);
+		GetBytes(matrix.data(), matrix.size() * sizeof(typename Derived::Scalar));
+	}
+
+	template<typename Matrix>
+	void GetMatrices(std::vector<Matrix>& matrices)
+	{
+		uint32_t count = Get<uint32_t>();
+		if (m_Failed || count > m_Data.size() - m_Offset)
+		{
+			m_Failed = true;
+			return;
+		}
+		matrices.resize(count);
+		for (auto& matrix : matrices)
+			GetMatrix(matrix);
+	}
+
+	void GetGenerator(std::mt19937& gen)
+	{
+		uint32_t count = Get<uint32_t>();
+		if (m_Failed || count > (m_Data.size() - m_Offset) / sizeof(uint32_t))
+		{
+			m_Failed = true;
+			return;
+		}
+
+		std::stringstream stream;
+		for (uint32_t i = 0; i < count; i++)
+			stream << Get<uint32_t>() << ' ';
+		stream >> gen;
+		if (stream.fail())
+			m_Failed = true;
+	}
+};
+
+std::vector<char> SerializeCheckpoint(const TrainingCheckpoint& checkpoint)
+{
+	const NetworkState& network = checkpoint.network;
+	const DatasetCursor& dataset = checkpoint.dataset;
+
+	std::vector<char> data;
+	BufferWriter writer(data);
+
+	writer.Put<uint32_t>(CheckpointMagic);
+	writer.Put<uint32_t>(CheckpointVersion);
+	writer.Put<int32_t>(checkpoint.epoch);
+	writer.Put<float>(checkpoint.learningRate);
+	writer.Put<int32_t>(checkpoint.batchSize);
+
+	writer.Put<uint32_t>(static_cast<uint32_t>(network.layerSizes.size()));
+	for (int size : network.layerSizes)
+		writer.Put<int32_t>(size);
+	writer.PutMatrices(network.weights);
+	writer.PutMatrices(network.biases);
+	writer.PutMatrices(network.factorU);
+	writer.PutMatrices(network.factorV);
+	writer.PutMatrices(network.weightMasks);
+	writer.Put<uint32_t>(static_cast<uint32_t>(network.precision));
+	writer.Put<uint8_t>(network.sparseInference);
+	writer.Put<uint8_t>(network.sparseTraining);
+	writer.Put<int32_t>(network.regrowInterval);
+	writer.Put<float>(network.regrowFraction);
+	writer.Put<int32_t>(network.sparseStep);
+	writer.PutGenerator(network.roundingGen);
+	writer.PutGenerator(network.sparseGen);
+
+	writer.Put<uint64_t>(dataset.indices.size());
+	for (size_t index : dataset.indices)
+		writer.Put<uint64_t>(index);
+	writer.Put<uint64_t>(dataset.currentIndex);
+	writer.PutGenerator(dataset.gen);
+
+	return data;
+}
+
+// Every matrix has to agree with the topology before anyone restores the state into a Network : RestoreState
+// takes them as they are and the training loops index them by layer size
+static bool CheckNetworkShapes(const NetworkState& network)
+{
+	size_t connections = network.layerSizes.size() - 1;
+	if (network.weights.size() != connections || network.biases.size() != connections
+		|| network.factorU.size() != connections || network.factorV.size() != connections
+		|| (!network.weightMasks.empty() && network.weightMasks.size() != connections))
+		return false;
+	if (network.precision != Precision::FP32 && network.precision != Precision::BF16)
+		return false;
+	for (int size : network.layerSizes)
+	{
+		if (size <= 0)
+			return false;
+	}
+
+	for (size_t i = 0; i < connections; i++)
+	{
+		Eigen::Index rows = network.layerSizes[i + 1];
+		Eigen::Index cols = network.layerSizes[i];
+		if (network.weights[i].rows() != rows || network.weights[i].cols() != cols || network.biases[i].size() != rows)
+			return false;
+
+		// Low rank layer : U = rows x rank, V = rank x cols. Dense layer : both empty
+		const Eigen::MatrixXf& u = network.factorU[i];
+		const Eigen::MatrixXf& v = network.factorV[i];
+		if (u.size() == 0 ? v.size() != 0 : (u.rows() != rows || v.rows() != u.cols() || v.cols() != cols))
+			return false;
+
+		if (!network.weightMasks.empty() && (network.weightMasks[i].rows() != rows || network.weightMasks[i].cols() != cols))
+			return false;
+	}
+	return true;
+}
+
+bool DeserializeCheckpoint(const std::vector<char>& data, TrainingCheckpoint& checkpoint)
+{
+	NetworkState& network = checkpoint.network;
+	DatasetCursor& dataset = checkpoint.dataset;
+	BufferReader reader(data);
+
+	if (reader.Get<uint32_t>() != CheckpointMagic || reader.Get<uint32_t>() != CheckpointVersion)
+		return false;
+	checkpoint.epoch = reader.Get<int32_t>();
+	checkpoint.learningRate = reader.Get<float>();
+	checkpoint.batchSize = reader.Get<int32_t>();
+
+	uint32_t layerCount = reader.Get<uint32_t>();
+	if (reader.failed() || layerCount < 2 || layerCount > data.size())
+		return false;
+	network.layerSizes.resize(layerCount);
+	for (int& size : network.layerSizes)
+		size = reader.Get<int32_t>();
+	reader.GetMatrices(network.weights);
+	reader.GetMatrices(network.biases);
+	reader.GetMatrices(network.factorU);
+	reader.GetMatrices(network.factorV);
+	reader.GetMatrices(network.weightMasks);
+	network.precision = static_cast<Precision>(reader.Get<uint32_t>());
+	network.sparseInference = reader.Get<uint8_t>() != 0;
+	network.sparseTraining = reader.Get<uint8_t>() != 0;
+	network.regrowInterval = reader.Get<int32_t>();
+	network.regrowFraction = reader.Get<float>();
+	network.sparseStep = reader.Get<int32_t>();
+	reader.GetGenerator(network.roundingGen);
+	reader.GetGenerator(network.sparseGen);
+
+	uint64_t indexCount = reader.Get<uint64_t>();
+	if (reader.failed() || indexCount > data.size())
+		return false;
+	dataset.indices.resize(static_cast<size_t>(indexCount));
+	for (size_t& index : dataset.indices)
+		index = static_cast<size_t>(reader.Get<uint64_t>());
+	dataset.currentIndex = static_cast<size_t>(reader.Get<uint64_t>());
+	reader.GetGenerator(dataset.gen);
+
+	if (reader.failed() || !reader.atEnd())
+		return false;
+	return CheckNetworkShapes(network);
+}
+
+std::string FindLatestCheckpoint(const std::string& filepath)
+{
+	size_t slash = filepath.find_last_of("/\\");
+	std::string prefix = (slash == std::string::npos ? filepath : filepath.substr(slash + 1)) + ".";
+
+	std::vector<std::string> names;
+#ifdef _WIN32
+	WIN32_FIND_DATAA found;
+	HANDLE search = FindFirstFileA((filepath + ".*").c_str(), &found);
+	if (search != INVALID_HANDLE_VALUE)
+	{
+		do
+			names.push_back(found.cFileName);
+		while (FindNextFileA(search, &found));
+		FindClose(search);
+	}
+#else
+	DIR* directory = opendir(slash == std::string::npos ? "." : filepath.substr(0, slash + 1).c_str());
+	if (directory)
+	{
+		while (dirent* entry = readdir(directory))
+			names.push_back(entry->d_name);
+		closedir(directory);
+	}
+#endif
+
+	// Only <name>.<digits>, so the .tmp files of a write in progress don't count
+	unsigned long long latest = 0;
+	for (const std::string& name : names)
+	{
+		if (name.size() <= prefix.size() || name.size() > prefix.size() + 18 || name.compare(0, prefix.size(), prefix) != 0
+			|| name.find_first_not_of("0123456789", prefix.size()) != std::string::npos)
+			continue;
+		latest = std::max(latest, std::stoull(name.substr(prefix.size())));
+	}
+	return latest == 0 ? filepath : filepath + "." + std::to_string(latest);
+}
+
+bool WriteFileDurable(const std::string& filepath, const std::vector<char>& data)
+{
+	std::string tempPath = filepath + ".tmp";
+
+#ifdef _WIN32
+	int fd = _open(tempPath.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+	if (fd < 0)
+		return false;
+
+	size_t written = 0;
+	while (written < data.size())
+	{
+		unsigned int chunk = static_cast<unsigned int>(std::min<size_t>(data.size() - written, 1 << 30));
+		int result = _write(fd, data.data() + written, chunk);
+		if (result <= 0)
+		{
+			_close(fd);
+			return false;
+		}
+		written += static_cast<size_t>(result);
+	}
+	bool synced = _commit(fd) == 0;
+	_close(fd);
+
+	return synced && MoveFileExA(tempPath.c_str(), filepath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+	int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	size_t written = 0;
+	while (written < data.size())
+	{
+		ssize_t result = write(fd, data.data() + written, data.size() - written);
+		if (result <= 0)
+		{
+			close(fd);
+			return false;
+		}
+		written += static_cast<size_t>(result);
+	}
+	bool synced = fsync(fd) == 0;
+	close(fd);
+
+	if (!synced || rename(tempPath.c_str(), filepath.c_str()) != 0)
+		return false;
+
+	// The rename itself lives in the directory
+	size_t slash = filepath.find_last_of('/');
+	std::string directory = slash == std::string::npos ? "." : filepath.substr(0, slash + 1);
+	int dirFd = open(directory.c_str(), O_RDONLY);
+	if (dirFd >= 0)
+	{
+		fsync(dirFd);
+		close(dirFd);
+	}
+	return true;
+#endif
+}
+
+bool WriteCheckpoint(const TrainingCheckpoint& checkpoint, const std::string& filepath)
+{
+	if (!WriteFileDurable(filepath, SerializeCheckpoint(checkpoint)))
+	{
+		std::cerr << "Error: Could not write checkpoint " << filepath << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static bool ReadFile(const std::string& filepath, std::vector<char>& data)
+{
+	std::ifstream file(filepath, std::ios::binary);
+	if (!file.is_open())
+	{
+		std::cerr << "Error: Could not open file " << filepath << std::endl;
+		return false;
+	}
+
+	data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	return true;
+}
+
+// "dir/name" -> "dir/" and "name"
+static std::string DirectoryOf(const std::string& filepath)
+{
+	size_t slash = filepath.find_last_of("/\\");
+	return slash == std::string::npos ? "" : filepath.substr(0, slash + 1);
+}
+
+static std::string FilenameOf(const std::string& filepath)
+{
+	return filepath.substr(DirectoryOf(filepath).size());
+}
+
+std::vector<char> SerializeDeltaCheckpoint(const std::vector<char>& base, const std::string& baseFilename,
+	const std::vector<char>& serialized)
+{
+	std::vector<char> data;
+	BufferWriter writer(data);
+	writer.Put<uint32_t>(DeltaMagic);
+	writer.Put<uint32_t>(CheckpointVersion);
+	writer.Put<uint64_t>(model_format::Checksum(reinterpret_cast<const unsigned char*>(base.data()), base.size()));
+	writer.Put<uint32_t>(static_cast<uint32_t>(baseFilename.size()));
+	writer.PutBytes(baseFilename.data(), baseFilename.size());
+
+	std::vector<char> encoded = CompressDelta(base, serialized);
+	writer.PutBytes(encoded.data(), encoded.size());
+	return data;
+}
+
+bool RebuildCheckpoint(const std::string& filepath, std::vector<char>& serialized)
+{
+	std::vector<char> data;
+	if (!ReadFile(filepath, data))
+		return false;
+
+	BufferReader reader(data);
+	uint32_t magic = reader.Get<uint32_t>();
+	if (magic == CheckpointMagic)
+	{
+		serialized = std::move(data);
+		return true;
+	}
+	if (magic != DeltaMagic || reader.Get<uint32_t>() != CheckpointVersion)
+		return false;
+
+	uint64_t baseChecksum = reader.Get<uint64_t>();
+	uint32_t nameLength = reader.Get<uint32_t>();
+	if (reader.failed() || nameLength > data.size())
+		return false;
+	std::string baseFilename(nameLength, '\0');
+	if (nameLength > 0 && !reader.GetBytes(&baseFilename[0], nameLength))
+		return false;
+
+	// Deltas always point to a full checkpoint, so the chain is never more than one step deep
+	std::string basePath = DirectoryOf(filepath) + baseFilename;
+	std::vector<char> base;
+	if (!ReadFile(basePath, base))
+		return false;
+	if (BufferReader(base).Get<uint32_t>() != CheckpointMagic
+		|| model_format::Checksum(reinterpret_cast<const unsigned char*>(base.data()), base.size()) != baseChecksum)
+	{
+		std::cerr << "Error: " << basePath << " is not the base of " << filepath << std::endl;
+		return false;
+	}
+
+	std::vector<char> encoded(data.begin() + (data.size() - reader.remaining()), data.end());
+	return DecompressDelta(base, encoded, serialized);
+}
+
+bool LoadCheckpoint(const std::string& filepath, TrainingCheckpoint& checkpoint)
+{
+	std::vector<char> data;
+	if (!RebuildCheckpoint(filepath, data) || !DeserializeCheckpoint(data, checkpoint))
+	{
+		std::cerr << "Error: Corrupted checkpoint " << filepath << std::endl;
+		return false;
+	}
+	return true;
+}
+
+CheckpointWriter::CheckpointWriter()
+{
+	m_Thread = std::thread(&CheckpointWriter::WriterLoop, this);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+	Flush();
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Stop = true;
+	}
+	m_Condition.notify_all();
+	m_Thread.join();
+}
+
+void CheckpointWriter::Save(const Network& network, const Dataset& dataset, int epoch, float learningRate, int batchSize,
+	const std::string& filepath)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	// Take a free slot, otherwise replace the oldest snapshot that the writer hasn't picked up yet
+	int slot = -1;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		for (int i = 0; i < 2 && slot < 0; i++)
+		{
+			if (i != m_Writing && !m_Slots[i].pending)
+				slot = i;
+		}
+		if (slot < 0)
+		{
+			if (m_Writing >= 0)
+				slot = 1 - m_Writing;
+			else
+				slot = m_Slots[0].sequence < m_Slots[1].sequence ? 0 : 1;
+			m_Dropped++;
+		}
+		m_Slots[slot].pending = false;
+	}
+
+	// The writer never touches a slot that isn't pending, so the copy runs without the lock
+	TrainingCheckpoint& checkpoint = m_Slots[slot].checkpoint;
+	network.CaptureState(checkpoint.network);
+	dataset.getCursor(checkpoint.dataset);
+	checkpoint.epoch = epoch;
+	checkpoint.learningRate = learningRate;
+	checkpoint.batchSize = batchSize;
+	m_Slots[slot].filepath = filepath;
+
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Slots[slot].pending = true;
+		m_Slots[slot].sequence = ++m_Sequence;
+	}
+	m_Condition.notify_all();
+
+	m_LastCaptureUs = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+void CheckpointWriter::Flush()
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_Condition.wait(lock, [this]() { return m_Writing < 0 && !m_Slots[0].pending && !m_Slots[1].pending; });
+}
+
+void CheckpointWriter::WriterLoop()
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	while (true)
+	{
+		m_Condition.wait(lock, [this]() { return m_Stop || m_Slots[0].pending || m_Slots[1].pending; });
+		if (!m_Slots[0].pending && !m_Slots[1].pending)
+			return; // Stopping with nothing left to write
+
+		// Older snapshot first when both are waiting
+		int slot = m_Slots[0].pending ? 0 : 1;
+		if (m_Slots[0].pending && m_Slots[1].pending && m_Slots[1].sequence < m_Slots[0].sequence)
+			slot = 1;
+		m_Slots[slot].pending = false;
+		m_Writing = slot;
+		bool incremental = m_Incremental;
+		int fullInterval = m_FullInterval;
+		lock.unlock();
+
+		CheckpointRecord record = WriteSlot(m_Slots[slot], incremental, fullInterval);
+		m_LastWriteMs = record.writeMs;
+		m_LastFailed = record.bytesWritten == 0;
+		if (record.bytesWritten > 0)
+			m_Written++;
+
+		lock.lock();
+		if (record.bytesWritten > 0)
+			m_Records.push_back(record);
+		m_Writing = -1;
+		m_Condition.notify_all();
+	}
+}
+
+CheckpointRecord CheckpointWriter::WriteSlot(const Slot& slot, bool incremental, int fullInterval)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	CheckpointRecord record;
+	record.filepath = slot.filepath;
+	record.epoch = slot.checkpoint.epoch;
+	record.delta = false;
+	record.bytesWritten = 0;
+
+	std::vector<char> serialized = SerializeCheckpoint(slot.checkpoint);
+	record.rawBytes = serialized.size();
+
+	bool ok;
+	if (incremental)
+	{
+		record.filepath += "." + std::to_string(slot.sequence);
+
+		// A delta needs a base of the same size in the same directory
+		record.delta = !m_Base.empty() && m_Base.size() == serialized.size() && m_DeltasSinceFull + 1 < fullInterval
+			&& DirectoryOf(m_BasePath) == DirectoryOf(record.filepath);
+		if (record.delta)
+		{
+			std::vector<char> data = SerializeDeltaCheckpoint(m_Base, FilenameOf(m_BasePath), serialized);
+			ok = WriteFileDurable(record.filepath, data);
+			record.bytesWritten = ok ? data.size() : 0;
+			if (ok)
+				m_DeltasSinceFull++;
+		}
+		else
+		{
+			ok = WriteFileDurable(record.filepath, serialized);
+			record.bytesWritten = ok ? serialized.size() : 0;
+			if (ok)
+			{
+				m_Base = std::move(serialized);
+				m_BasePath = record.filepath;
+				m_DeltasSinceFull = 0;
+			}
+		}
+	}
+	else
+	{
+		ok = WriteFileDurable(record.filepath, serialized);
+		record.bytesWritten = ok ? serialized.size() : 0;
+	}
+
+	record.writeMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	if (ok)
+	{
+		std::cout << "Checkpoint " << record.filepath << " (epoch " << record.epoch << "): " << record.bytesWritten << " bytes"
+			<< (record.delta ? " delta of " + std::to_string(record.rawBytes) : std::string()) << std::endl;
+	}
+	else
+	{
+		std::cerr << "Error: Could not write checkpoint " << record.filepath << std::endl;
+	}
+	return record;
+}
+
+void CheckpointWriter::setIncremental(bool enabled, int fullInterval)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Incremental = enabled;
+	m_FullInterval = std::max(fullInterval, 1);
+}
+
+bool CheckpointWriter::isIncremental()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return m_Incremental;
+}
+
+std::vector<CheckpointRecord> CheckpointWriter::getRecords()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return m_Records;
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include "Network.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Everything needed to continue a training run exactly where it stopped
+struct TrainingCheckpoint
+{
+	NetworkState network;
+	DatasetCursor dataset;
+	int epoch = 0;				// Completed epochs
+	float learningRate = 0.0f;
+	int batchSize = 0;
+};
+
+// Writes to filepath.tmp, flushes it to disk and renames it over filepath, so a crash never leaves a half written file
+bool WriteFileDurable(const std::string& filepath, const std::vector<char>& data);
+
+std::vector<char> SerializeCheckpoint(const TrainingCheckpoint& checkpoint);
+bool DeserializeCheckpoint(const std::vector<char>& data, TrainingCheckpoint& checkpoint);
+
+// Synchronous versions (resume, tools)
+bool WriteCheckpoint(const TrainingCheckpoint& checkpoint, const std::string& filepath);
+bool LoadCheckpoint(const std::string& filepath, TrainingCheckpoint& checkpoint);	// Full or delta file
+
+// Incremental checkpoints : a delta file only holds the XOR against a full checkpoint (DeltaCodec) and the file
+// name of that full checkpoint, which has to sit in the same directory
+std::vector<char> SerializeDeltaCheckpoint(const std::vector<char>& base, const std::string& baseFilename,
+	const std::vector<char>& serialized);
+
+// Serialized checkpoint stored in a full or delta file, any checkpoint of a chain can be rebuilt on its own
+bool RebuildCheckpoint(const std::string& filepath, std::vector<char>& serialized);
+
+// Newest record written in incremental mode (<filepath>.<n> with the largest n), filepath itself if there is none
+std::string FindLatestCheckpoint(const std::string& filepath);
+
+struct CheckpointRecord
+{
+	std::string filepath;
+	int epoch;
+	bool delta;
+	size_t rawBytes;		// Serialized size of the full state
+	size_t bytesWritten;	// Size of the file on disk
+	float writeMs;
+};
+
+// Non blocking checkpoints : Save() only copies the state into a spare buffer, a background thread serializes it
+// and fsyncs the file. Two buffers : one can be on its way to disk while the other takes the next snapshot.
+// If the writer falls behind, a snapshot that is still waiting gets replaced by the newer one.
+// In incremental mode every checkpoint gets its own file (<filepath>.<n>) : a full one every fullInterval
+// checkpoints (or when the model size changes), deltas against the last full one in between
+class CheckpointWriter
+{
+private:
+	struct Slot
+	{
+		TrainingCheckpoint checkpoint;
+		std::string filepath;
+		bool pending = false;
+		unsigned long long sequence = 0;	// Order of the Save() calls
+	};
+
+	Slot m_Slots[2];
+	int m_Writing = -1;		// Slot owned by the writer thread
+	unsigned long long m_Sequence = 0;
+	bool m_Stop = false;
+	std::mutex m_Mutex;
+	std::condition_variable m_Condition;
+	std::thread m_Thread;
+
+	std::atomic<int> m_Written{ 0 };
+	std::atomic<int> m_Dropped{ 0 };
+	std::atomic<float> m_LastCaptureUs{ 0.0f };
+	std::atomic<float> m_LastWriteMs{ 0.0f };
+	std::atomic<bool> m_LastFailed{ false };
+
+	bool m_Incremental = false;
+	int m_FullInterval = 10;
+	std::vector<CheckpointRecord> m_Records;
+
+	// Writer thread only
+	std::vector<char> m_Base;	// Serialized last full checkpoint
+	std::string m_BasePath;
+	int m_DeltasSinceFull = 0;
+
+	void WriterLoop();
+	CheckpointRecord WriteSlot(const Slot& slot, bool incremental, int fullInterval);
+
+public:
+	CheckpointWriter();
+	~CheckpointWriter();	// Finishes the pending writes
+
+	CheckpointWriter(const CheckpointWriter&) = delete;
+	CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+	void Save(const Network& network, const Dataset& dataset, int epoch, float learningRate, int batchSize,
+		const std::string& filepath);
+
+	// Blocks until nothing is pending or being written
+	void Flush();
+
+	// Applies to the next snapshot the writer picks up
+	void setIncremental(bool enabled, int fullInterval = 10);
+	bool isIncremental();
+
+	std::vector<CheckpointRecord> getRecords();	// One per written checkpoint
+
+	int getWrittenCount() const { return m_Written; }
+	int getDroppedCount() const { return m_Dropped; }		// Snapshots replaced before reaching the disk
+	float getLastCaptureUs() const { return m_LastCaptureUs; }	// Time Save() blocked the caller
+	float getLastWriteMs() const { return m_LastWriteMs; }		// Serialize + write + fsync on the writer thread
+	bool lastWriteFailed() const { return m_LastFailed; }
+};
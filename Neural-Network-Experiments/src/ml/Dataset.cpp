@@ -1,6 +1,46 @@
 #include "Dataset.h"
+#include "ThreadPool.h"
 
 
+// One CSV line into a sample, input left empty when the line is invalid. Messages go to errors so the
+// lines can be parsed on several threads and still report in order
+static void ParseSampleLine(const std::string& line, DataSample& sample, std::string& errors)
+{
+    std::stringstream ss(line);
+    std::string cell;
+    std::vector<float> values;
+
+    // Parse CSV line
+    while (std::getline(ss, cell, ',')) 
+    {
+        try 
+        {
+            values.push_back(std::stof(cell));
+        }
+        catch (const std::exception& e) 
+        {
+            errors += "Error parsing value: " + cell + "\n";
+            continue;
+        }
+    }
+
+    if (values.size() != 785) 
+    { // 1 label + 784 pixels
+        errors += "Invalid data format. Expected 785 values, got " + std::to_string(values.size()) + "\n";
+        return;
+    }
+
+    sample.label = static_cast<int>(values[0]);
+
+    // Create input vector (784 pixels)
+    sample.input = Eigen::VectorXf(784);
+    for (int i = 0; i < 784; i++) 
+        sample.input[i] = values[i + 1] / 255.0f; // Normalize to [0,1]
+
+    // Create one-hot encoded target
+    sample.target = Dataset::oneHotEncode(sample.label, 10);
+}
+
 bool Dataset::loadMNIST_CSV(const std::string& filepath, int maxSamples) 
 {
     std::ifstream file(filepath);
@@ -28,48 +68,40 @@ bool Dataset::loadMNIST_CSV(const std::string& filepath, int maxSamples)
         file.seekg(0); // Go back to beginning
     }
 
-    while (std::getline(file, line) && (maxSamples == -1 || samplesLoaded < maxSamples)) 
+    // Lines are read in chunks and parsed on the thread pool, the samples keep the file order
+    const size_t chunkSize = 4096;
+    std::vector<std::string> lines;
+    std::vector<DataSample> parsed;
+    std::vector<std::string> errors;
+    bool endOfFile = false;
+    while (!endOfFile && (maxSamples == -1 || samplesLoaded < maxSamples))
     {
-        std::stringstream ss(line);
-        std::string cell;
-        std::vector<float> values;
+        size_t wanted = maxSamples == -1 ? chunkSize : std::min<size_t>(chunkSize, maxSamples - samplesLoaded);
+        lines.clear();
+        while (lines.size() < wanted && std::getline(file, line))
+            lines.push_back(std::move(line));
+        endOfFile = lines.size() < wanted;
+
+        parsed.assign(lines.size(), DataSample());
+        errors.assign(lines.size(), std::string());
+        ThreadPool::Global().ParallelFor(0, lines.size(), 64, [&](size_t first, size_t last)
+            {
+                for (size_t i = first; i < last; i++)
+                    ParseSampleLine(lines[i], parsed[i], errors[i]);
+            });
 
-        // Parse CSV line
-        while (std::getline(ss, cell, ',')) 
+        for (size_t i = 0; i < lines.size(); i++)
         {
-            try 
-            {
-                values.push_back(std::stof(cell));
-            }
-            catch (const std::exception& e) 
-            {
-                std::cerr << "Error parsing value: " << cell << std::endl;
+            std::cerr << errors[i];
+            if (parsed[i].input.size() == 0)
                 continue;
-            }
-        }
-
-        if (values.size() != 785) 
-        { // 1 label + 784 pixels
-            std::cerr << "Invalid data format. Expected 785 values, got " << values.size() << std::endl;
-            continue;
-        }
-
-        DataSample sample;
-        sample.label = static_cast<int>(values[0]);
-
-        // Create input vector (784 pixels)
-        sample.input = Eigen::VectorXf(784);
-        for (int i = 0; i < 784; i++) 
-            sample.input[i] = values[i + 1] / 255.0f; // Normalize to [0,1]
 
-        // Create one-hot encoded target
-        sample.target = oneHotEncode(sample.label, 10);
+            m_Samples.push_back(std::move(parsed[i]));
+            samplesLoaded++;
 
-        m_Samples.push_back(sample);
-        samplesLoaded++;
-
-        if (samplesLoaded % 1000 == 0) 
-            std::cout << "Loaded " << samplesLoaded << " samples..." << std::endl;
+            if (samplesLoaded % 1000 == 0) 
+                std::cout << "Loaded " << samplesLoaded << " samples..." << std::endl;
+        }
     }
 
     file.close();
@@ -114,6 +146,55 @@ void Dataset::shuffle()
     m_CurrentIndex = 0;
 }
 
+void Dataset::shuffleShards(int shards)
+{
+    // Position range i only ever holds samples stored in range i, so a thread that trains on a position range
+    // keeps reading the memory it relocated
+    shards = std::max(shards, 1);
+    std::iota(m_Indices.begin(), m_Indices.end(), 0);
+    for (int shard = 0; shard < shards; shard++)
+    {
+        size_t first = m_Samples.size() * shard / shards;
+        size_t last = m_Samples.size() * (shard + 1) / shards;
+        std::shuffle(m_Indices.begin() + first, m_Indices.begin() + last, m_Gen);
+    }
+    m_CurrentIndex = 0;
+}
+
+void Dataset::relocateSamples(size_t first, size_t last)
+{
+    for (size_t i = first; i < std::min(last, m_Samples.size()); i++)
+    {
+        Eigen::VectorXf input = m_Samples[i].input;
+        Eigen::VectorXf target = m_Samples[i].target;
+        m_Samples[i].input.swap(input);
+        m_Samples[i].target.swap(target);
+    }
+}
+
+void Dataset::getCursor(DatasetCursor& cursor) const
+{
+    cursor.indices = m_Indices;
+    cursor.currentIndex = m_CurrentIndex;
+    cursor.gen = m_Gen;
+}
+
+bool Dataset::setCursor(const DatasetCursor& cursor)
+{
+    if (cursor.indices.size() != m_Samples.size() || cursor.currentIndex > m_Samples.size())
+        return false;
+    for (size_t index : cursor.indices)
+    {
+        if (index >= m_Samples.size())
+            return false;
+    }
+
+    m_Indices = cursor.indices;
+    m_CurrentIndex = cursor.currentIndex;
+    m_Gen = cursor.gen;
+    return true;
+}
+
 std::vector<int> Dataset::getLabelCounts() const 
 {
     std::vector<int> counts(10, 0); 
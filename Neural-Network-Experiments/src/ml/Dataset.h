@@ -16,6 +16,14 @@ struct DataSample
     int label;              // Display
 };
 
+// Where the dataset is in an epoch : sample order, position and the shuffle generator (for checkpoints)
+struct DatasetCursor
+{
+    std::vector<size_t> indices;
+    size_t currentIndex = 0;
+    std::mt19937 gen;
+};
+
 class Dataset 
 {
 private:
@@ -40,6 +48,16 @@ public:
     std::vector<DataSample> getBatch(size_t batchSize);
     void shuffle();
     void reset() { m_CurrentIndex = 0; } // Reset sequential access
+    void setSeed(unsigned int seed) { m_Gen.seed(seed); } // Reproducible shuffles
+
+    // NUMA placement : shuffle within each of shards equal ranges only (position range i <-> stored range i), and
+    // copy the stored samples [first, last) into memory allocated by the calling thread (first touch = its node)
+    void shuffleShards(int shards);
+    void relocateSamples(size_t first, size_t last);
+
+    // Save/restore the order and position, restoring fails if the sample count is different
+    void getCursor(DatasetCursor& cursor) const;
+    bool setCursor(const DatasetCursor& cursor);
 
     // Info
     size_t size() const { return m_Samples.size(); }
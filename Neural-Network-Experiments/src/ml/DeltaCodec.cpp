@@ -0,0 +1,131 @@
+#include "DeltaCodec.h"
+#include <cstdint>
+#include <cstring>
+
+static const size_t Stride = 4;		// sizeof(float)
+static const size_t MinZeroRun = 4;	// Shorter zero runs stay inside literals
+
+static void PutVarint(std::vector<char>& out, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<char>(value));
+}
+
+static bool GetVarint(const std::vector<char>& in, size_t& pos, uint64_t& value)
+{
+	value = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		if (pos >= in.size())
+			return false;
+		uint8_t byte = static_cast<uint8_t>(in[pos++]);
+		value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+std::vector<char> CompressDelta(const std::vector<char>& base, const std::vector<char>& target)
+{
+	size_t size = target.size();
+	size_t planeSize = size / Stride;
+
+	// XOR + shuffle in one pass, the tail that doesn't fill a whole float is copied as is
+	std::vector<char> shuffled(size);
+	for (size_t i = 0; i < size; i++)
+	{
+		char delta = static_cast<char>(target[i] ^ (i < base.size() ? base[i] : 0));
+		if (i < planeSize * Stride)
+			shuffled[(i % Stride) * planeSize + i / Stride] = delta;
+		else
+			shuffled[i] = delta;
+	}
+
+	std::vector<char> out;
+	out.reserve(size / 2 + 16);
+	PutVarint(out, size);
+
+	// Tokens : varint(length << 1 | 1) for a zero run, varint(length << 1) + bytes for literals
+	size_t pos = 0;
+	while (pos < size)
+	{
+		size_t zeros = 0;
+		while (pos + zeros < size && shuffled[pos + zeros] == 0)
+			zeros++;
+		if (zeros >= MinZeroRun || pos + zeros == size)
+		{
+			PutVarint(out, (static_cast<uint64_t>(zeros) << 1) | 1);
+			pos += zeros;
+			continue;
+		}
+
+		// Literal until the next zero run worth encoding
+		size_t end = pos + zeros;
+		while (end < size)
+		{
+			if (shuffled[end] != 0)
+			{
+				end++;
+				continue;
+			}
+			size_t run = 0;
+			while (end + run < size && run < MinZeroRun && shuffled[end + run] == 0)
+				run++;
+			if (run >= MinZeroRun)
+				break;
+			end += run;
+		}
+
+		PutVarint(out, static_cast<uint64_t>(end - pos) << 1);
+		out.insert(out.end(), shuffled.begin() + pos, shuffled.begin() + end);
+		pos = end;
+	}
+
+	return out;
+}
+
+bool DecompressDelta(const std::vector<char>& base, const std::vector<char>& encoded, std::vector<char>& target)
+{
+	size_t in = 0;
+	uint64_t size;
+	if (!GetVarint(encoded, in, size) || size > encoded.size() * 64 + base.size())
+		return false;
+
+	std::vector<char> shuffled(static_cast<size_t>(size), 0);
+	size_t pos = 0;
+	while (pos < size)
+	{
+		uint64_t token;
+		if (!GetVarint(encoded, in, token))
+			return false;
+
+		uint64_t length = token >> 1;
+		if (length == 0 || length > size - pos)
+			return false;
+		if (!(token & 1))
+		{
+			if (length > encoded.size() - in)
+				return false;
+			std::memcpy(shuffled.data() + pos, encoded.data() + in, static_cast<size_t>(length));
+			in += static_cast<size_t>(length);
+		}
+		pos += static_cast<size_t>(length);
+	}
+	if (in != encoded.size())
+		return false;
+
+	size_t planeSize = static_cast<size_t>(size) / Stride;
+	target.resize(static_cast<size_t>(size));
+	for (size_t i = 0; i < target.size(); i++)
+	{
+		char delta = i < planeSize * Stride ? shuffled[(i % Stride) * planeSize + i / Stride] : shuffled[i];
+		target[i] = static_cast<char>(delta ^ (i < base.size() ? base[i] : 0));
+	}
+
+	return true;
+}
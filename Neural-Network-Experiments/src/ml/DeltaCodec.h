@@ -0,0 +1,13 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+
+// Delta codec for checkpoints : target XOR base, then a byte shuffle with a stride of 4 (byte 0 of every float
+// together, then byte 1...) and a zero run-length encoding. Floats are little endian, so the planes go from the
+// low mantissa bytes (plane 0, mostly noise) to the sign/exponent bytes (plane 3). Weights that moved a little
+// keep their sign and exponent, so the last planes of the XOR are long runs of zeros.
+// A base shorter than the target counts as zero padded. No dependencies, a few hundred MB/s
+std::vector<char> CompressDelta(const std::vector<char>& base, const std::vector<char>& target);
+
+// Fails on truncated or corrupted input
+bool DecompressDelta(const std::vector<char>& base, const std::vector<char>& encoded, std::vector<char>& target);
@@ -0,0 +1,264 @@
+#pragma once
+#include "Network.h"
+
+// Same model as Network (sigmoid everywhere, cross entropy targets) with the topology fixed at compile time,
+// e.g. FixedNetwork<784, 128, 64, 10>. All the shapes are compile time constants, so Eigen picks fixed size
+// kernels, nothing is allocated after construction and the layer loop is unrolled by the recursive templates below.
+// Meant for low latency inference and as a speed baseline for Network
+namespace fixed_detail
+{
+	// Sizes<784, 128, 64, 10>::At<1>::value == 128
+	template<int... Sizes>
+	struct LayerSizes;
+
+	template<int First, int... Rest>
+	struct LayerSizes<First, Rest...>
+	{
+		static constexpr int Count = 1 + sizeof...(Rest);
+
+		template<int Index, int Dummy = 0>
+		struct At { static constexpr int value = LayerSizes<Rest...>::template At<Index - 1>::value; };
+		template<int Dummy>
+		struct At<0, Dummy> { static constexpr int value = First; };
+	};
+
+	template<>
+	struct LayerSizes<>
+	{
+		static constexpr int Count = 0;
+	};
+
+	// Connection layer between In and Out neurons. Vectors are fixed size members, the matrices are too big for
+	// fixed size Eigen objects (stack allocation limit) so they live in aligned heap blocks seen through fixed size Maps
+	template<int In, int Out>
+	struct Layer
+	{
+		static constexpr int Options = (Out == 1 && In != 1) ? Eigen::RowMajor : Eigen::ColMajor;
+		using WeightsMap = Eigen::Map<Eigen::Matrix<float, Out, In, Options>, Eigen::AlignedMax>;
+		using ConstWeightsMap = Eigen::Map<const Eigen::Matrix<float, Out, In, Options>, Eigen::AlignedMax>;
+		using Vector = Eigen::Matrix<float, Out, 1>;
+		using Storage = std::vector<float, Eigen::aligned_allocator<float>>;
+
+		Storage weightData = Storage(static_cast<size_t>(In) * Out, 0.0f);
+		Storage weightGradientData = Storage(static_cast<size_t>(In) * Out, 0.0f);
+		Vector biases = Vector::Zero();
+		Vector biasGradient = Vector::Zero();
+		Vector z = Vector::Zero();	// Pre-activation
+		Vector a = Vector::Zero();	// Activation
+		Vector delta = Vector::Zero();
+
+		WeightsMap Weights() { return WeightsMap(weightData.data()); }
+		ConstWeightsMap Weights() const { return ConstWeightsMap(weightData.data()); }
+		WeightsMap WeightGradient() { return WeightsMap(weightGradientData.data()); }
+
+		EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+	};
+
+	// Recursive chain of layers : Chain<784, 128, 64, 10> = Layer<784, 128> + Chain<128, 64, 10>
+	template<int... Sizes>
+	struct Chain;
+
+	template<int Last>
+	struct Chain<Last>
+	{
+		using Output = Eigen::Matrix<float, Last, 1>;
+
+		template<typename Input>
+		const Input& Forward(const Input& input) { return input; }
+
+		template<typename Target>
+		void OutputDelta(const Eigen::Matrix<float, Last, 1>& output, const Target& target, Eigen::Matrix<float, Last, 1>& delta)
+		{
+			// C'(a) ⊙ σ'(z) with σ'(z) = a * (1 - a)
+			delta = (output - target).cwiseProduct(output.cwiseProduct(Output::Ones() - output));
+		}
+	};
+
+	template<int In, int Out, int... Rest>
+	struct Chain<In, Out, Rest...>
+	{
+		using Output = typename Chain<Out, Rest...>::Output;
+		using InputVector = Eigen::Matrix<float, In, 1>;
+
+		Layer<In, Out> layer;
+		Chain<Out, Rest...> next;
+
+		static constexpr bool IsLast = sizeof...(Rest) == 0;
+
+		const Output& Forward(const InputVector& input)
+		{
+			layer.z.noalias() = layer.Weights() * input;
+			layer.z += layer.biases;
+			layer.a = 1.0f / (1.0f + (-layer.z).array().exp());
+			return next.Forward(layer.a);
+		}
+
+		// Backward pass for one sample, the gradients are accumulated
+		template<typename Target>
+		void Backward(const InputVector& input, const Target& target)
+		{
+			BackwardImpl(input, target, std::integral_constant<bool, IsLast>());
+		}
+
+		void ZeroGradients()
+		{
+			layer.WeightGradient().setZero();
+			layer.biasGradient.setZero();
+			ZeroNext(std::integral_constant<bool, IsLast>());
+		}
+
+		void Update(float step)
+		{
+			layer.Weights() -= step * layer.WeightGradient();
+			layer.biases -= step * layer.biasGradient;
+			UpdateNext(step, std::integral_constant<bool, IsLast>());
+		}
+
+		void Import(const Network& network, int index)
+		{
+			layer.Weights() = network.getWeights(index);
+			layer.biases = network.getBiases(index);
+			ImportNext(network, index, std::integral_constant<bool, IsLast>());
+		}
+
+		void Export(Network& network, int index) const
+		{
+			network.setWeights(index, layer.Weights());
+			network.setBiases(index, layer.biases);
+			ExportNext(network, index, std::integral_constant<bool, IsLast>());
+		}
+
+	private:
+		// Output layer : delta from the loss
+		template<typename Target>
+		void BackwardImpl(const InputVector& input, const Target& target, std::true_type)
+		{
+			next.OutputDelta(layer.a, target, layer.delta);
+			Accumulate(input);
+		}
+
+		// Hidden layer : delta = (W_next^T * delta_next) ⊙ σ'(z)
+		template<typename Target>
+		void BackwardImpl(const InputVector& input, const Target& target, std::false_type)
+		{
+			next.Backward(layer.a, target);
+			layer.delta.noalias() = next.layer.Weights().transpose() * next.layer.delta;
+			layer.delta.array() *= layer.a.array() * (1.0f - layer.a.array());
+			Accumulate(input);
+		}
+
+		void Accumulate(const InputVector& input)
+		{
+			layer.WeightGradient().noalias() += layer.delta * input.transpose();
+			layer.biasGradient += layer.delta;
+		}
+
+		void ZeroNext(std::true_type) {}
+		void ZeroNext(std::false_type) { next.ZeroGradients(); }
+		void UpdateNext(float, std::true_type) {}
+		void UpdateNext(float step, std::false_type) { next.Update(step); }
+		void ImportNext(const Network&, int, std::true_type) {}
+		void ImportNext(const Network& network, int index, std::false_type) { next.Import(network, index + 1); }
+		void ExportNext(Network&, int, std::true_type) const {}
+		void ExportNext(Network& network, int index, std::false_type) const { next.Export(network, index + 1); }
+	};
+}
+
+template<int... Sizes>
+class FixedNetwork
+{
+	static_assert(sizeof...(Sizes) >= 2, "FixedNetwork needs at least an input and an output layer");
+
+public:
+	using Topology = fixed_detail::LayerSizes<Sizes...>;
+	static constexpr int LayerCount = Topology::Count;
+	static constexpr int InputSize = Topology::template At<0>::value;
+	static constexpr int OutputSize = Topology::template At<LayerCount - 1>::value;
+
+	using InputVector = Eigen::Matrix<float, InputSize, 1>;
+	using OutputVector = Eigen::Matrix<float, OutputSize, 1>;
+
+private:
+	fixed_detail::Chain<Sizes...> m_Layers;
+
+public:
+	FixedNetwork() = default;
+
+	// Takes the weights of a trained Network with the same topology
+	explicit FixedNetwork(const Network& network) { Import(network); }
+
+	static bool Matches(const Network& network)
+	{
+		const int sizes[] = { Sizes... };
+		if (network.getLayerCount() != LayerCount)
+			return false;
+		for (int i = 0; i < LayerCount; i++)
+		{
+			if (network.getLayerSize(i) != sizes[i])
+				return false;
+		}
+		return true;
+	}
+
+	bool Import(const Network& network)
+	{
+		if (!Matches(network))
+			return false;
+		m_Layers.Import(network, 0);
+		return true;
+	}
+
+	// Writes the weights back into a Network with the same topology
+	bool Export(Network& network) const
+	{
+		if (!Matches(network))
+			return false;
+		m_Layers.Export(network, 0);
+		return true;
+	}
+
+	Network ToNetwork() const
+	{
+		Network network({ Sizes... });
+		m_Layers.Export(network, 0);
+		return network;
+	}
+
+	const OutputVector& Forward(const InputVector& input) { return m_Layers.Forward(input); }
+
+	// Dynamic size inputs (DataSample) are checked by Eigen in debug builds
+	OutputVector Forward(const Eigen::VectorXf& input) { return m_Layers.Forward(InputVector(input)); }
+
+	// Same update as Network::TrainBatch
+	void TrainBatch(const std::vector<DataSample>& batch, float learningRate)
+	{
+		if (batch.empty()) return;
+
+		m_Layers.ZeroGradients();
+		for (const auto& sample : batch)
+		{
+			InputVector input = sample.input;
+			OutputVector target = sample.target;
+			m_Layers.Forward(input);
+			m_Layers.Backward(input, target);
+		}
+		m_Layers.Update(learningRate / static_cast<float>(batch.size()));
+	}
+
+	float CalculateAccuracy(const std::vector<DataSample>& testBatch)
+	{
+		if (testBatch.empty()) return 0.0f;
+
+		int correct = 0;
+		for (const auto& sample : testBatch)
+		{
+			int predicted;
+			Forward(sample.input).maxCoeff(&predicted);
+			if (predicted == sample.label)
+				correct++;
+		}
+		return static_cast<float>(correct) / static_cast<float>(testBatch.size());
+	}
+
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
@@ -0,0 +1,200 @@
+#include "GradientCompressor.h"
+#include "Eigen/Dense"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+
+namespace
+{
+	// Encoded layout : header, then
+	//   TopK : entries uint32 indices (increasing), entries float values
+	//   Int8 : one float scale per block, count int8 values
+	//   None : count floats
+	struct Header
+	{
+		uint32_t method;
+		uint32_t count;
+		uint32_t entries;	// TopK : kept entries, Int8 : blocks
+	};
+
+	using ArrayMap = Eigen::Map<Eigen::ArrayXf>;
+	using ConstArrayMap = Eigen::Map<const Eigen::ArrayXf>;
+	using Int8Map = Eigen::Map<Eigen::Array<int8_t, Eigen::Dynamic, 1>>;
+	using ConstInt8Map = Eigen::Map<const Eigen::Array<int8_t, Eigen::Dynamic, 1>>;
+
+	char* Resize(std::vector<char>& encoded, GradientCompression method, size_t count, size_t entries, size_t payload)
+	{
+		Header header = { static_cast<uint32_t>(method), static_cast<uint32_t>(count), static_cast<uint32_t>(entries) };
+		encoded.resize(sizeof(Header) + payload);
+		std::memcpy(encoded.data(), &header, sizeof(header));
+		return encoded.data() + sizeof(Header);
+	}
+}
+
+const size_t GradientCompressor::Int8BlockSize;
+
+const char* GradientCompressionName(GradientCompression method)
+{
+	switch (method)
+	{
+	case GradientCompression::TopK: return "topk";
+	case GradientCompression::Int8: return "int8";
+	default: return "none";
+	}
+}
+
+bool ParseGradientCompression(const std::string& name, GradientCompression& method)
+{
+	if (name == "none") method = GradientCompression::None;
+	else if (name == "topk") method = GradientCompression::TopK;
+	else if (name == "int8") method = GradientCompression::Int8;
+	else return false;
+	return true;
+}
+
+GradientCompressor::GradientCompressor(GradientCompression method, float topKRatio, bool errorFeedback)
+	: m_Method(method), m_Ratio(std::min(std::max(topKRatio, 0.0f), 1.0f)), m_ErrorFeedback(errorFeedback)
+{
+}
+
+void GradientCompressor::Encode(const float* gradient, size_t count, std::vector<char>& encoded)
+{
+	m_Stats.calls++;
+	m_Stats.rawBytes += count * sizeof(float);
+	if (m_Method == GradientCompression::None)
+	{
+		std::memcpy(Resize(encoded, m_Method, count, 0, count * sizeof(float)), gradient, count * sizeof(float));
+		m_Stats.encodedBytes += encoded.size();
+		return;
+	}
+
+	m_Work.resize(count);
+	ArrayMap work(m_Work.data(), count);
+	if (m_ErrorFeedback && m_Residual.size() == count)
+		work = ConstArrayMap(gradient, count) + ArrayMap(m_Residual.data(), count);
+	else
+		work = ConstArrayMap(gradient, count);
+
+	if (m_Method == GradientCompression::TopK)
+		EncodeTopK(count, encoded);
+	else
+		EncodeInt8(count, encoded);
+	m_Stats.encodedBytes += encoded.size();
+}
+
+void GradientCompressor::EncodeTopK(size_t count, std::vector<char>& encoded)
+{
+	size_t k = std::min(count, std::max<size_t>(static_cast<size_t>(std::ceil(m_Ratio * count)), 1));
+	ArrayMap work(m_Work.data(), count);
+
+	// k-th largest magnitude in linear time, then one pass keeps everything above it (ties up to k)
+	m_Magnitudes.resize(count);
+	ArrayMap(m_Magnitudes.data(), count) = work.abs();
+	std::nth_element(m_Magnitudes.begin(), m_Magnitudes.begin() + (k - 1), m_Magnitudes.end(), std::greater<float>());
+	float threshold = m_Magnitudes[k - 1];
+
+	char* payload = Resize(encoded, m_Method, count, k, k * (sizeof(uint32_t) + sizeof(float)));
+	uint32_t* indices = reinterpret_cast<uint32_t*>(payload);
+	float* values = reinterpret_cast<float*>(payload + k * sizeof(uint32_t));
+	size_t kept = 0;
+	for (size_t i = 0; i < count && kept < k; i++)
+	{
+		if (std::abs(m_Work[i]) >= threshold)
+		{
+			indices[kept] = static_cast<uint32_t>(i);
+			values[kept] = m_Work[i];
+			kept++;
+		}
+	}
+
+	// What was sent leaves the residual, the rest waits for the next steps
+	if (m_ErrorFeedback)
+	{
+		m_Residual.swap(m_Work);
+		for (size_t i = 0; i < kept; i++)
+			m_Residual[indices[i]] = 0.0f;
+	}
+}
+
+void GradientCompressor::EncodeInt8(size_t count, std::vector<char>& encoded)
+{
+	size_t blocks = (count + Int8BlockSize - 1) / Int8BlockSize;
+	char* payload = Resize(encoded, m_Method, count, blocks, blocks * sizeof(float) + count);
+	float* scales = reinterpret_cast<float*>(payload);
+	int8_t* values = reinterpret_cast<int8_t*>(payload + blocks * sizeof(float));
+	if (m_ErrorFeedback)
+		m_Residual.resize(count);
+
+	// Symmetric, round to nearest : the rounding error is at most scale / 2 and error feedback makes it unbiased
+	for (size_t block = 0; block < blocks; block++)
+	{
+		size_t begin = block * Int8BlockSize;
+		size_t size = std::min(Int8BlockSize, count - begin);
+		ArrayMap work(m_Work.data() + begin, size);
+		Int8Map quantized(values + begin, size);
+
+		float maxAbs = work.abs().maxCoeff();
+		float scale = maxAbs > 0.0f ? maxAbs / 127.0f : 1.0f;
+		scales[block] = scale;
+		quantized = (work * (1.0f / scale)).round().max(-127.0f).min(127.0f).cast<int8_t>();
+		if (m_ErrorFeedback)
+			ArrayMap(m_Residual.data() + begin, size) = work - quantized.cast<float>() * scale;
+	}
+}
+
+bool GradientCompressor::DecodeAdd(const char* data, size_t size, float* sum, size_t count)
+{
+	Header header;
+	if (size < sizeof(header))
+		return false;
+	std::memcpy(&header, data, sizeof(header));
+	if (header.count != count)
+		return false;
+	const char* payload = data + sizeof(header);
+	size -= sizeof(header);
+
+	switch (static_cast<GradientCompression>(header.method))
+	{
+	case GradientCompression::None:
+		if (size != count * sizeof(float))
+			return false;
+		ArrayMap(sum, count) += ConstArrayMap(reinterpret_cast<const float*>(payload), count);
+		return true;
+
+	case GradientCompression::TopK:
+	{
+		size_t k = header.entries;
+		if (k > count || size != k * (sizeof(uint32_t) + sizeof(float)))
+			return false;
+		const uint32_t* indices = reinterpret_cast<const uint32_t*>(payload);
+		const float* values = reinterpret_cast<const float*>(payload + k * sizeof(uint32_t));
+		for (size_t i = 0; i < k; i++)
+		{
+			if (indices[i] >= count)
+				return false;
+			sum[indices[i]] += values[i];
+		}
+		return true;
+	}
+
+	case GradientCompression::Int8:
+	{
+		size_t blocks = header.entries;
+		if (blocks != (count + Int8BlockSize - 1) / Int8BlockSize || size != blocks * sizeof(float) + count)
+			return false;
+		const float* scales = reinterpret_cast<const float*>(payload);
+		const int8_t* values = reinterpret_cast<const int8_t*>(payload + blocks * sizeof(float));
+		for (size_t block = 0; block < blocks; block++)
+		{
+			size_t begin = block * Int8BlockSize;
+			size_t length = std::min(Int8BlockSize, count - begin);
+			ArrayMap(sum + begin, length) += ConstInt8Map(values + begin, length).cast<float>() * scales[block];
+		}
+		return true;
+	}
+
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,63 @@
+#include "LowRankCompressor.h"
+
+std::vector<LowRankLayerReport> CompressLowRank(Network& network, const Dataset& dataset, float maxAccuracyLoss, int maxSamples)
+{
+	std::vector<DataSample> samples;
+	size_t count = std::min(dataset.size(), static_cast<size_t>(maxSamples));
+	samples.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		samples.push_back(dataset.getSample(i));
+
+	// The budget is measured against the original network so the losses of all layers add up to at most maxAccuracyLoss.
+	// Both accuracies are measured once per pass, current follows the layers factorized so far
+	float baseline = network.CalculateAccuracy(samples);
+	float current = baseline;
+
+	std::vector<LowRankLayerReport> reports;
+	for (int layer = 0; layer < network.getLayerCount() - 1; layer++)
+	{
+		int rows = network.getLayerSize(layer + 1);
+		int cols = network.getLayerSize(layer);
+
+		LowRankLayerReport report;
+		report.layer = layer;
+		report.rank = 0;
+		report.denseFlops = rows * cols;
+		report.factorizedFlops = rows * cols;
+		report.accuracy = current;
+
+		// Only ranks below the break-even point rank * (rows + cols) < rows * cols are worth trying. The accuracy grows
+		// with the rank, so binary search the smallest one within the budget : if the widest one misses it none fits
+		int low = 1;
+		int high = (rows * cols - 1) / (rows + cols);
+		float found = 0.0f;
+		while (low <= high)
+		{
+			int rank = low + (high - low) / 2;
+			Network candidate = network;
+			candidate.FactorizeLayer(layer, rank);
+			float accuracy = candidate.CalculateAccuracy(samples);
+
+			if (baseline - accuracy <= maxAccuracyLoss)
+			{
+				report.rank = rank;
+				found = accuracy;
+				high = rank - 1;
+			}
+			else
+				low = rank + 1;
+		}
+
+		if (report.rank > 0)
+		{
+			network.FactorizeLayer(layer, report.rank);
+			report.factorizedFlops = report.rank * (rows + cols);
+			report.accuracy = found;
+			current = found;
+		}
+
+		reports.push_back(report);
+	}
+
+	return reports;
+}
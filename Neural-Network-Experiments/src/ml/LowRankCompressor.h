@@ -0,0 +1,16 @@
+#pragma once
+#include "Network.h"
+
+struct LowRankLayerReport
+{
+	int layer;
+	int rank;				// 0 = left dense
+	int denseFlops;			// Multiply-adds per sample, rows * cols
+	int factorizedFlops;	// rank * (rows + cols)
+	float accuracy;			// Network accuracy after this layer was processed
+};
+
+// Replaces each layer with the smallest rank factorization that still cuts its FLOPs and keeps the accuracy on the
+// first maxSamples samples within maxAccuracyLoss (absolute, e.g. 0.01 = 1%) of the original network. The rank is
+// binary searched, about log2(rows * cols / (rows + cols)) candidate evaluations per layer
+std::vector<LowRankLayerReport> CompressLowRank(Network& network, const Dataset& dataset, float maxAccuracyLoss, int maxSamples = 1000);
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include "Eigen/Dense"
+
+// bf16 storage helpers for mixed precision training
+// Master weights and accumulation stay in fp32, only what the backward pass reads back is stored in bf16.
+// That halves the memory held per saved vector, not the bandwidth of a step : the GEMVs read fp32 weights
+using VectorBF16 = Eigen::Matrix<Eigen::bfloat16, Eigen::Dynamic, 1>;
+
+// Stochastic rounding : add 16 random bits below the bf16 mantissa and truncate,
+// so the expected value of the rounded number is the fp32 input (plain truncation is biased towards 0)
+inline Eigen::bfloat16 StochasticRoundBF16(float value, uint32_t noise)
+{
+	uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+
+	// Leave inf and NaN untouched
+	if ((bits & 0x7F800000u) != 0x7F800000u)
+		bits += noise & 0xFFFFu;
+
+	return Eigen::numext::bit_cast<Eigen::bfloat16>(static_cast<uint16_t>(bits >> 16));
+}
+
+inline void StochasticRoundBF16(const Eigen::VectorXf& src, VectorBF16& dst, std::mt19937& gen)
+{
+	dst.resize(src.size());
+	Eigen::Index i = 0;
+
+	// One 32 bit draw gives the noise for two values
+	for (; i + 1 < src.size(); i += 2)
+	{
+		uint32_t noise = gen();
+		dst[i] = StochasticRoundBF16(src[i], noise);
+		dst[i + 1] = StochasticRoundBF16(src[i + 1], noise >> 16);
+	}
+	if (i < src.size())
+		dst[i] = StochasticRoundBF16(src[i], gen());
+}
@@ -0,0 +1,144 @@
+#include "ModelCompiler.h"
+#include <cstdio>
+#include <cstring>
+
+// %.9g round trips every float exactly
+static void WriteFloatArray(std::ofstream& file, const std::string& name, const float* data, size_t count)
+{
+	file << "alignas(64) constexpr float " << name << "[" << count << "] = {\n";
+
+	char buffer[32];
+	for (size_t i = 0; i < count; i++)
+	{
+		int length = std::snprintf(buffer, sizeof(buffer), "%.9g", data[i]);
+		if (!std::strpbrk(buffer, ".e"))
+			length += std::snprintf(buffer + length, sizeof(buffer) - length, ".0"); // "0f" isn't a float literal
+		std::snprintf(buffer + length, sizeof(buffer) - length, "f");
+		file << (i % 8 == 0 ? "\t" : " ") << buffer << (i + 1 < count ? "," : "");
+		if (i % 8 == 7 || i + 1 == count)
+			file << "\n";
+	}
+	file << "};\n\n";
+}
+
+bool CompileModelHeader(const Network& network, const std::string& filepath, const std::string& nameSpace)
+{
+	std::ofstream file(filepath);
+	if (!file.is_open())
+	{
+		std::cerr << "Error: Could not open file " << filepath << std::endl;
+		return false;
+	}
+
+	int layerCount = network.getLayerCount();
+	std::string topology;
+	for (int i = 0; i < layerCount; i++)
+		topology += (i > 0 ? "-" : "") + std::to_string(network.getLayerSize(i));
+
+	file << "// Generated by ModelCompiler from a " << topology << " Network, do not edit\n";
+	file << "#pragma once\n#include <cmath>\n\n";
+	file << "namespace " << nameSpace << "\n{\n\n";
+	file << "constexpr int kLayerCount = " << layerCount << ";\n";
+	file << "constexpr int kLayerSizes[" << layerCount << "] = { ";
+	for (int i = 0; i < layerCount; i++)
+		file << network.getLayerSize(i) << (i + 1 < layerCount ? ", " : " };\n");
+	file << "constexpr int kInputSize = " << network.getLayerSize(0) << ";\n";
+	file << "constexpr int kOutputSize = " << network.getLayerSize(layerCount - 1) << ";\n\n";
+
+	// Weights are written in Eigen's column major order : the Out weights leaving input i are contiguous,
+	// so the kernel below is a chain of axpys the compiler vectorizes without -ffast-math
+	for (int layer = 0; layer < layerCount - 1; layer++)
+	{
+		const Eigen::MatrixXf& weights = network.getWeights(layer);
+		const Eigen::VectorXf& biases = network.getBiases(layer);
+		WriteFloatArray(file, "kWeights" + std::to_string(layer), weights.data(), static_cast<size_t>(weights.size()));
+		WriteFloatArray(file, "kBiases" + std::to_string(layer), biases.data(), static_cast<size_t>(biases.size()));
+	}
+
+	// Per layer tables, so code that doesn't know the topology can still read the weights back
+	file << "constexpr const float* kLayerWeights[" << layerCount - 1 << "] = { ";
+	for (int layer = 0; layer < layerCount - 1; layer++)
+		file << "kWeights" << layer << (layer + 1 < layerCount - 1 ? ", " : " };\n");
+	file << "constexpr const float* kLayerBiases[" << layerCount - 1 << "] = { ";
+	for (int layer = 0; layer < layerCount - 1; layer++)
+		file << "kBiases" << layer << (layer + 1 < layerCount - 1 ? ", " : " };\n\n");
+
+	file <<
+		"// y = sigmoid(W * x + b) with compile time sizes. Inputs that are exactly 0 (most MNIST pixels) are dropped first,\n"
+		"// then the remaining columns are added four at a time so acc is loaded and stored once per four columns\n"
+		"template<int In, int Out>\n"
+		"inline void DenseSigmoid(const float* weights, const float* biases, const float* x, float* y)\n"
+		"{\n"
+		"\tint active[In];\n"
+		"\tint count = 0;\n"
+		"\tfor (int i = 0; i < In; i++)\n"
+		"\t{\n"
+		"\t\tactive[count] = i;\n"
+		"\t\tcount += x[i] != 0.0f;\n"
+		"\t}\n"
+		"\n"
+		"\talignas(64) float acc[Out];\n"
+		"\tfor (int o = 0; o < Out; o++)\n"
+		"\t\tacc[o] = biases[o];\n"
+		"\n"
+		"\tint k = 0;\n"
+		"\tfor (; k + 3 < count; k += 4)\n"
+		"\t{\n"
+		"\t\tconst float x0 = x[active[k]], x1 = x[active[k + 1]], x2 = x[active[k + 2]], x3 = x[active[k + 3]];\n"
+		"\t\tconst float* c0 = weights + active[k] * Out;\n"
+		"\t\tconst float* c1 = weights + active[k + 1] * Out;\n"
+		"\t\tconst float* c2 = weights + active[k + 2] * Out;\n"
+		"\t\tconst float* c3 = weights + active[k + 3] * Out;\n"
+		"\t\tfor (int o = 0; o < Out; o++)\n"
+		"\t\t\tacc[o] += (c0[o] * x0 + c1[o] * x1) + (c2[o] * x2 + c3[o] * x3);\n"
+		"\t}\n"
+		"\tfor (; k < count; k++)\n"
+		"\t{\n"
+		"\t\tconst float x0 = x[active[k]];\n"
+		"\t\tconst float* c0 = weights + active[k] * Out;\n"
+		"\t\tfor (int o = 0; o < Out; o++)\n"
+		"\t\t\tacc[o] += c0[o] * x0;\n"
+		"\t}\n"
+		"\n"
+		"\tfor (int o = 0; o < Out; o++)\n"
+		"\t\ty[o] = 1.0f / (1.0f + std::exp(-acc[o]));\n"
+		"}\n"
+		"\n";
+
+	// Straight line predict(), one call per layer with its own stack buffer
+	file << "inline void predict(const float* input, float* output)\n{\n";
+	for (int layer = 0; layer < layerCount - 1; layer++)
+	{
+		int in = network.getLayerSize(layer);
+		int out = network.getLayerSize(layer + 1);
+		std::string x = layer == 0 ? "input" : "a" + std::to_string(layer);
+		std::string y = layer == layerCount - 2 ? "output" : "a" + std::to_string(layer + 1);
+
+		if (layer < layerCount - 2)
+			file << "\talignas(64) float " << y << "[" << out << "];\n";
+		file << "\tDenseSigmoid<" << in << ", " << out << ">(kWeights" << layer << ", kBiases" << layer
+			<< ", " << x << ", " << y << ");\n";
+	}
+	file << "}\n\n";
+
+	file <<
+		"inline int predictLabel(const float* input)\n"
+		"{\n"
+		"\tfloat output[kOutputSize];\n"
+		"\tpredict(input, output);\n"
+		"\n"
+		"\tint best = 0;\n"
+		"\tfor (int i = 1; i < kOutputSize; i++)\n"
+		"\t{\n"
+		"\t\tif (output[i] > output[best])\n"
+		"\t\t\tbest = i;\n"
+		"\t}\n"
+		"\treturn best;\n"
+		"}\n\n";
+
+	file << "} // namespace " << nameSpace << "\n";
+
+	file.close();
+	std::cout << "Compiled " << topology << " network to " << filepath << std::endl;
+	return true;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "Network.h"
+
+// Ahead of time model compiler : writes a self contained C++ header with the trained weights as constexpr arrays
+// and a predict() specialized for the network topology. The header only needs <cmath>, no Network and no Eigen
+//
+//		namespace <nameSpace> {
+//			constexpr int kInputSize, kOutputSize;
+//			void predict(const float* input, float* output);	// output = sigmoid activations of the last layer
+//			int predictLabel(const float* input);				// argmax of predict()
+//		}
+//
+// Low rank and pruned layers are written as their dense equivalent
+bool CompileModelHeader(const Network& network, const std::string& filepath, const std::string& nameSpace = "nn_model");
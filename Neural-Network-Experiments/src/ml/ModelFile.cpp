@@ -0,0 +1,288 @@
+#include "ModelFile.h"
+#include "Checkpoint.h"
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace model_format;
+
+static uint64_t AlignUp(uint64_t value)
+{
+	return (value + Alignment - 1) / Alignment * Alignment;
+}
+
+// The header (with a zero checksum field), the layer table, the padding and the payload
+static uint64_t FileChecksum(const unsigned char* data, const FileHeader& header)
+{
+	FileHeader zeroed = header;
+	zeroed.checksum = 0;
+	uint64_t hash = Checksum(reinterpret_cast<const unsigned char*>(&zeroed), sizeof(zeroed));
+	return Checksum(data + sizeof(FileHeader), header.payloadOffset + header.payloadSize - sizeof(FileHeader), hash);
+}
+
+// offset + size <= limit, without overflowing
+static bool FitsIn(uint64_t offset, uint64_t size, uint64_t limit)
+{
+	return offset <= limit && size <= limit - offset;
+}
+
+uint64_t model_format::Checksum(const unsigned char* data, size_t size, uint64_t hash)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+bool SaveModel(const Network& network, const std::string& filepath)
+{
+	int layerCount = network.getLayerCount();
+
+	FileHeader header = {};
+	header.magic = Magic;
+	header.version = Version;
+	header.layerCount = static_cast<uint32_t>(layerCount);
+	header.dtype = static_cast<uint32_t>(DType::FP32);
+	header.payloadOffset = AlignUp(sizeof(FileHeader) + layerCount * sizeof(LayerEntry));
+
+	// Lay out the blobs first, then fill one buffer and write it in one go
+	std::vector<LayerEntry> entries(layerCount);
+	uint64_t offset = header.payloadOffset;
+	for (int i = 0; i < layerCount; i++)
+	{
+		entries[i] = {};
+		entries[i].size = static_cast<uint32_t>(network.getLayerSize(i));
+		entries[i].activation = static_cast<uint32_t>(i == 0 ? Activation::None : Activation::Sigmoid);
+		if (i == 0)
+			continue;
+
+		entries[i].weightsOffset = offset;
+		offset = AlignUp(offset + network.getWeights(i - 1).size() * sizeof(float));
+		entries[i].biasesOffset = offset;
+		offset = AlignUp(offset + network.getBiases(i - 1).size() * sizeof(float));
+	}
+	header.payloadSize = offset - header.payloadOffset;
+
+	std::vector<char> buffer(offset, 0);
+	for (int i = 1; i < layerCount; i++)
+	{
+		const Eigen::MatrixXf& weights = network.getWeights(i - 1);
+		const Eigen::VectorXf& biases = network.getBiases(i - 1);
+		std::memcpy(buffer.data() + entries[i].weightsOffset, weights.data(), weights.size() * sizeof(float));
+		std::memcpy(buffer.data() + entries[i].biasesOffset, biases.data(), biases.size() * sizeof(float));
+	}
+	std::memcpy(buffer.data() + sizeof(header), entries.data(), entries.size() * sizeof(LayerEntry));
+	header.checksum = FileChecksum(reinterpret_cast<const unsigned char*>(buffer.data()), header);
+	std::memcpy(buffer.data(), &header, sizeof(header));
+
+	// Replaced in one rename : processes mapping or watching the old file never see a half written one
+	if (!WriteFileDurable(filepath, buffer))
+	{
+		std::cerr << "Error: Could not write " << filepath << std::endl;
+		return false;
+	}
+
+	std::cout << "Saved model to " << filepath << " (" << buffer.size() << " bytes)" << std::endl;
+	return true;
+}
+
+bool MappedModel::Map(const std::string& filepath)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	m_File = file;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+		return false;
+	m_Size = static_cast<size_t>(size.QuadPart);
+
+	m_Mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!m_Mapping)
+		return false;
+
+	m_Data = static_cast<const unsigned char*>(MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+	return m_Data != nullptr;
+#else
+	m_Fd = open(filepath.c_str(), O_RDONLY);
+	if (m_Fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(m_Fd, &info) != 0 || info.st_size == 0)
+		return false;
+	m_Size = static_cast<size_t>(info.st_size);
+
+	void* data = mmap(nullptr, m_Size, PROT_READ, MAP_SHARED, m_Fd, 0);
+	if (data == MAP_FAILED)
+		return false;
+	m_Data = static_cast<const unsigned char*>(data);
+	return true;
+#endif
+}
+
+bool MappedModel::ParseHeader()
+{
+	if (m_Size < sizeof(FileHeader))
+		return false;
+
+	FileHeader header;
+	std::memcpy(&header, m_Data, sizeof(header));
+	if (header.magic != Magic)
+	{
+		std::cerr << "Error: Not a model file" << std::endl;
+		return false;
+	}
+	if (header.version != Version || header.dtype != static_cast<uint32_t>(DType::FP32))
+	{
+		std::cerr << "Error: Unsupported model file version " << header.version << " / dtype " << header.dtype << std::endl;
+		return false;
+	}
+	uint64_t tableEnd = sizeof(FileHeader) + static_cast<uint64_t>(header.layerCount) * sizeof(LayerEntry);
+	if (header.layerCount < 2 || tableEnd > m_Size || header.payloadOffset < tableEnd
+		|| !FitsIn(header.payloadOffset, header.payloadSize, m_Size))
+		return false;
+
+	const LayerEntry* entries = reinterpret_cast<const LayerEntry*>(m_Data + sizeof(FileHeader));
+	for (uint32_t i = 0; i < header.layerCount; i++)
+	{
+		if (entries[i].size == 0)
+			return false;
+		m_LayerSizes.push_back(static_cast<int>(entries[i].size));
+		if (i == 0)
+			continue;
+
+		if (entries[i].activation != static_cast<uint32_t>(Activation::Sigmoid))
+		{
+			std::cerr << "Error: Unsupported activation " << entries[i].activation << std::endl;
+			return false;
+		}
+
+		// Every blob has to be aligned and inside the file before we hand out Maps on it. The sizes come from the
+		// file, so the weights size is checked against the file size before it's computed
+		uint64_t maxFloats = m_Size / sizeof(float);
+		if (entries[i].size > maxFloats / entries[i - 1].size)
+			return false;
+		uint64_t weightsBytes = static_cast<uint64_t>(entries[i].size) * entries[i - 1].size * sizeof(float);
+		uint64_t biasesBytes = static_cast<uint64_t>(entries[i].size) * sizeof(float);
+		if (entries[i].weightsOffset % Alignment != 0 || entries[i].biasesOffset % Alignment != 0
+			|| !FitsIn(entries[i].weightsOffset, weightsBytes, m_Size) || !FitsIn(entries[i].biasesOffset, biasesBytes, m_Size))
+			return false;
+
+		m_Weights.push_back(reinterpret_cast<const float*>(m_Data + entries[i].weightsOffset));
+		m_Biases.push_back(reinterpret_cast<const float*>(m_Data + entries[i].biasesOffset));
+	}
+
+	return true;
+}
+
+bool MappedModel::Open(const std::string& filepath, bool verifyChecksum)
+{
+	Close();
+
+	if (!Map(filepath))
+	{
+		std::cerr << "Error: Could not map file " << filepath << std::endl;
+		Close();
+		return false;
+	}
+
+	if (!ParseHeader())
+	{
+		std::cerr << "Error: Corrupted model file " << filepath << std::endl;
+		Close();
+		return false;
+	}
+
+	if (verifyChecksum && !VerifyChecksum())
+	{
+		std::cerr << "Error: Checksum mismatch in " << filepath << std::endl;
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void MappedModel::Close()
+{
+#ifdef _WIN32
+	if (m_Data)
+		UnmapViewOfFile(m_Data);
+	if (m_Mapping)
+		CloseHandle(m_Mapping);
+	if (m_File)
+		CloseHandle(m_File);
+	m_Mapping = nullptr;
+	m_File = nullptr;
+#else
+	if (m_Data)
+		munmap(const_cast<unsigned char*>(m_Data), m_Size);
+	if (m_Fd >= 0)
+		close(m_Fd);
+	m_Fd = -1;
+#endif
+	m_Data = nullptr;
+	m_Size = 0;
+	m_LayerSizes.clear();
+	m_Weights.clear();
+	m_Biases.clear();
+}
+
+bool MappedModel::VerifyChecksum() const
+{
+	if (!m_Data)
+		return false;
+
+	FileHeader header;
+	std::memcpy(&header, m_Data, sizeof(header));
+	return FileChecksum(m_Data, header) == header.checksum;
+}
+
+Eigen::VectorXf MappedModel::Forward(const Eigen::VectorXf& input) const
+{
+	Eigen::VectorXf activation = input;
+	for (int i = 0; i < getLayerCount() - 1; i++)
+	{
+		Eigen::VectorXf z = getWeights(i) * activation + getBiases(i);
+		activation = 1.0f / (1.0f + (-z).array().exp());
+	}
+	return activation;
+}
+
+Eigen::MatrixXf MappedModel::ForwardBatch(const Eigen::MatrixXf& inputs) const
+{
+	Eigen::MatrixXf activations = inputs;
+	Eigen::MatrixXf z;
+	for (int i = 0; i < getLayerCount() - 1; i++)
+	{
+		z.noalias() = getWeights(i) * activations;
+		z.colwise() += getBiases(i);
+		activations = 1.0f / (1.0f + (-z).array().exp());
+	}
+	return activations;
+}
+
+Network MappedModel::ToNetwork() const
+{
+	Network network(m_LayerSizes);
+	for (int i = 0; i < getLayerCount() - 1; i++)
+	{
+		network.setWeights(i, getWeights(i));
+		network.setBiases(i, getBiases(i));
+	}
+	return network;
+}
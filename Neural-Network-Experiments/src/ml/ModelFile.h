@@ -0,0 +1,112 @@
+#pragma once
+#include "Network.h"
+#include <cstdint>
+
+// Binary model format (little endian), version 1 :
+//
+//		FileHeader
+//		LayerEntry[layerCount]			layer 0 is the input layer and has no weights
+//		padding to 64 bytes
+//		payload							for every layer > 0 : weights (size x previous size, column major) then biases,
+//										every blob starting on a 64 byte boundary
+//
+// The checksum is FNV-1a over the whole file up to the end of the payload, with the checksum field taken as 0.
+// Low rank and pruned layers are saved as their dense equivalent
+namespace model_format
+{
+	constexpr uint32_t Magic = 0x464D4E4E;	// "NNMF"
+	constexpr uint32_t Version = 1;
+	constexpr uint64_t Alignment = 64;
+
+	enum class DType : uint32_t
+	{
+		FP32 = 0
+	};
+
+	enum class Activation : uint32_t
+	{
+		None = 0,		// Input layer
+		Sigmoid = 1
+	};
+
+	struct FileHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t layerCount;
+		uint32_t dtype;
+		uint64_t payloadOffset;
+		uint64_t payloadSize;
+		uint64_t checksum;
+	};
+
+	struct LayerEntry
+	{
+		uint32_t size;
+		uint32_t activation;
+		uint64_t weightsOffset;	// From the start of the file
+		uint64_t biasesOffset;
+	};
+
+	static_assert(sizeof(FileHeader) == 40, "FileHeader must not contain padding");
+	static_assert(sizeof(LayerEntry) == 24, "LayerEntry must not contain padding");
+
+	// FNV-1a, hash carries on from a previous call
+	uint64_t Checksum(const unsigned char* data, size_t size, uint64_t hash = 14695981039346656037ull);
+}
+
+bool SaveModel(const Network& network, const std::string& filepath);
+
+// Read only view of a model file. The file is memory mapped and the weights are used in place through Eigen::Map,
+// so opening costs the same for any model size and every process opening the file shares the same pages.
+// Checksum verification reads the whole file, so it's optional
+class MappedModel
+{
+public:
+	using WeightsMap = Eigen::Map<const Eigen::MatrixXf, Eigen::Aligned64>;
+	using BiasesMap = Eigen::Map<const Eigen::VectorXf, Eigen::Aligned64>;
+
+private:
+	const unsigned char* m_Data = nullptr;
+	size_t m_Size = 0;
+#ifdef _WIN32
+	void* m_File = nullptr;
+	void* m_Mapping = nullptr;
+#else
+	int m_Fd = -1;
+#endif
+
+	std::vector<int> m_LayerSizes;
+	std::vector<const float*> m_Weights;	// Index i = connections between layer i and i+1, like Network
+	std::vector<const float*> m_Biases;
+
+	bool Map(const std::string& filepath);
+	bool ParseHeader();
+
+public:
+	MappedModel() = default;
+	~MappedModel() { Close(); }
+
+	MappedModel(const MappedModel&) = delete;
+	MappedModel& operator=(const MappedModel&) = delete;
+
+	bool Open(const std::string& filepath, bool verifyChecksum = false);
+	void Close();
+	bool VerifyChecksum() const;
+
+	bool isOpen() const { return m_Data != nullptr; }
+	size_t getFileSize() const { return m_Size; }
+	int getLayerCount() const { return static_cast<int>(m_LayerSizes.size()); }
+	int getLayerSize(int layerIndex) const { return m_LayerSizes[layerIndex]; }
+	WeightsMap getWeights(int layerIndex) const { return WeightsMap(m_Weights[layerIndex], m_LayerSizes[layerIndex + 1], m_LayerSizes[layerIndex]); }
+	BiasesMap getBiases(int layerIndex) const { return BiasesMap(m_Biases[layerIndex], m_LayerSizes[layerIndex + 1]); }
+
+	// Same result as Network::Forward, straight from the mapped weights
+	Eigen::VectorXf Forward(const Eigen::VectorXf& input) const;
+
+	// One sample per column, every layer is a single matrix-matrix product. Safe to call from several threads
+	Eigen::MatrixXf ForwardBatch(const Eigen::MatrixXf& inputs) const;
+
+	// Copies the weights into a regular Network (for training or the GUI)
+	Network ToNetwork() const;
+};
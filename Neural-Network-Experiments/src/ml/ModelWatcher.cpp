@@ -0,0 +1,197 @@
+#include "ModelWatcher.h"
+#include "ModelFile.h"
+#include <chrono>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+ModelWatcher::ModelWatcher(const std::string& directory, Callback onLoaded, int intervalMs, const std::string& extension)
+	: m_Directory(directory), m_Extension(extension), m_OnLoaded(std::move(onLoaded)), m_IntervalMs(std::max(intervalMs, 1))
+{
+}
+
+bool ModelWatcher::ListFiles(std::map<std::string, FileState>& files) const
+{
+	files.clear();
+	auto matches = [this](const std::string& name)
+	{
+		return name.size() > m_Extension.size() && name.compare(name.size() - m_Extension.size(), m_Extension.size(), m_Extension) == 0;
+	};
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA data;
+	HANDLE find = FindFirstFileA((m_Directory + "\\*").c_str(), &data);
+	if (find == INVALID_HANDLE_VALUE)
+		return false;
+	do
+	{
+		std::string name = data.cFileName;
+		if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || !matches(name))
+			continue;
+		FileState state;
+		state.modified = (static_cast<long long>(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+		state.size = (static_cast<unsigned long long>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+		files[m_Directory + "\\" + name] = state;
+	} while (FindNextFileA(find, &data));
+	FindClose(find);
+#else
+	DIR* dir = opendir(m_Directory.c_str());
+	if (!dir)
+		return false;
+	while (dirent* entry = readdir(dir))
+	{
+		std::string name = entry->d_name;
+		if (!matches(name))
+			continue;
+		std::string filepath = m_Directory + "/" + name;
+		struct stat info;
+		if (stat(filepath.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+			continue;
+		FileState state;
+		state.modified = static_cast<long long>(info.st_mtim.tv_sec) * 1000000000LL + info.st_mtim.tv_nsec;
+		state.size = static_cast<unsigned long long>(info.st_size);
+		files[filepath] = state;
+	}
+	closedir(dir);
+#endif
+	return true;
+}
+
+bool ModelWatcher::Load(const std::string& filepath, ModelReload& reload)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	std::shared_ptr<Network> network;
+	{
+		MappedModel model;
+		if (!model.Open(filepath, true))
+			return false;
+		network = std::make_shared<Network>(model.ToNetwork());
+	}
+	auto loaded = std::chrono::steady_clock::now();
+
+	Eigen::MatrixXf batch = Eigen::MatrixXf::Constant(network->getLayerSize(0), std::max(m_WarmupBatchSize, 1), 0.5f);
+	for (int i = 0; i < m_WarmupBatches; i++)
+		network->ForwardBatch(batch);
+	auto warmed = std::chrono::steady_clock::now();
+
+	reload.filepath = filepath;
+	reload.network = network;
+	reload.loadMs = std::chrono::duration<float, std::milli>(loaded - start).count();
+	reload.warmupMs = std::chrono::duration<float, std::milli>(warmed - loaded).count();
+	return true;
+}
+
+bool ModelWatcher::LoadNewest(ModelReload& reload)
+{
+	std::map<std::string, FileState> files;
+	if (!ListFiles(files))
+	{
+		std::cerr << "Error: Could not read the directory " << m_Directory << std::endl;
+		return false;
+	}
+
+	// Newest first, fall back to older files if it doesn't load
+	std::vector<std::pair<std::string, FileState>> sorted(files.begin(), files.end());
+	std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, FileState>& a, const std::pair<std::string, FileState>& b)
+	{
+		return a.second.modified > b.second.modified;
+	});
+	for (const auto& file : sorted)
+	{
+		if (Load(file.first, reload))
+		{
+			m_CurrentPath = file.first;
+			m_CurrentState = file.second;
+			return true;
+		}
+		m_Rejected[file.first] = file.second;
+	}
+
+	std::cerr << "Error: No loadable " << m_Extension << " file in " << m_Directory << std::endl;
+	return false;
+}
+
+void ModelWatcher::Poll()
+{
+	std::map<std::string, FileState> files;
+	if (!ListFiles(files))
+		return;
+
+	// Newest file that isn't the current model or a known bad one
+	const std::pair<const std::string, FileState>* newest = nullptr;
+	for (const auto& file : files)
+	{
+		if (file.first == m_CurrentPath && file.second == m_CurrentState)
+			continue;
+		auto rejected = m_Rejected.find(file.first);
+		if (rejected != m_Rejected.end() && rejected->second == file.second)
+			continue;
+		if (file.second.modified <= m_CurrentState.modified && !m_CurrentPath.empty())
+			continue;	// Older than what's being served
+		if (!newest || file.second.modified > newest->second.modified)
+			newest = &file;
+	}
+	if (!newest)
+		return;
+
+	// Wait until it stops changing
+	if (newest->first != m_CandidatePath || newest->second != m_CandidateState)
+	{
+		m_CandidatePath = newest->first;
+		m_CandidateState = newest->second;
+		return;
+	}
+
+	ModelReload reload;
+	if (!Load(newest->first, reload))
+	{
+		std::cerr << "Error: Could not load " << newest->first << ", keeping the current model" << std::endl;
+		m_Rejected[newest->first] = newest->second;
+		m_Failures++;
+		return;
+	}
+
+	m_CurrentPath = newest->first;
+	m_CurrentState = newest->second;
+	m_CandidatePath.clear();
+	m_Reloads++;
+	m_OnLoaded(reload);
+}
+
+void ModelWatcher::WatchLoop()
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	while (!m_Stop)
+	{
+		lock.unlock();
+		Poll();
+		lock.lock();
+		m_Condition.wait_for(lock, std::chrono::milliseconds(m_IntervalMs), [this] { return m_Stop; });
+	}
+}
+
+void ModelWatcher::Start()
+{
+	if (m_Thread.joinable())
+		return;
+	m_Stop = false;
+	m_Thread = std::thread(&ModelWatcher::WatchLoop, this);
+}
+
+void ModelWatcher::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Stop = true;
+	}
+	m_Condition.notify_all();
+	if (m_Thread.joinable())
+		m_Thread.join();
+}
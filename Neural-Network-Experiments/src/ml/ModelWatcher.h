@@ -0,0 +1,83 @@
+#pragma once
+#include "Network.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+struct ModelReload
+{
+	std::string filepath;
+	std::shared_ptr<const Network> network;
+	float loadMs = 0.0f;		// Map + checksum + copy into a Network
+	float warmupMs = 0.0f;
+};
+
+// Watches a directory for model files (SaveModel format) and hands every new one, loaded and warmed up, to a
+// callback. Everything runs on the watcher's own thread, the callback only has to swap a pointer.
+// The directory is polled : it works the same everywhere, and a model written by SaveModel shows up in one rename.
+// A file has to look the same on two scans in a row before it's loaded (files copied in are still growing),
+// and a file that fails to load is skipped until it changes
+class ModelWatcher
+{
+public:
+	using Callback = std::function<void(const ModelReload&)>;
+
+private:
+	struct FileState
+	{
+		long long modified = 0;		// ns (100 ns ticks on Windows)
+		unsigned long long size = 0;
+		bool operator==(const FileState& other) const { return modified == other.modified && size == other.size; }
+		bool operator!=(const FileState& other) const { return !(*this == other); }
+	};
+
+	std::string m_Directory;
+	std::string m_Extension;
+	Callback m_OnLoaded;
+	int m_IntervalMs;
+	int m_WarmupBatches = 4;
+	int m_WarmupBatchSize = 32;
+
+	// Watcher thread only (before Start(), LoadNewest)
+	std::string m_CurrentPath;
+	FileState m_CurrentState;
+	std::string m_CandidatePath;
+	FileState m_CandidateState;
+	std::map<std::string, FileState> m_Rejected;
+
+	std::thread m_Thread;
+	std::mutex m_Mutex;
+	std::condition_variable m_Condition;
+	bool m_Stop = false;
+
+	std::atomic<int> m_Reloads{ 0 };
+	std::atomic<int> m_Failures{ 0 };
+
+	bool ListFiles(std::map<std::string, FileState>& files) const;
+	bool Load(const std::string& filepath, ModelReload& reload);
+	void Poll();
+	void WatchLoop();
+
+public:
+	ModelWatcher(const std::string& directory, Callback onLoaded, int intervalMs = 1000, const std::string& extension = ".nnm");
+	~ModelWatcher() { Stop(); }
+
+	ModelWatcher(const ModelWatcher&) = delete;
+	ModelWatcher& operator=(const ModelWatcher&) = delete;
+
+	// Dummy batches run through every new model before it's handed over (first touch of the weights, allocations)
+	void setWarmup(int batches, int batchSize) { m_WarmupBatches = batches; m_WarmupBatchSize = batchSize; }
+
+	// Synchronous, for startup : loads the newest model file in the directory, the watcher then waits for a newer one
+	bool LoadNewest(ModelReload& reload);
+
+	void Start();
+	void Stop();
+
+	int getReloadCount() const { return m_Reloads; }
+	int getFailureCount() const { return m_Failures; }
+};
@@ -1,4 +1,16 @@
 ﻿#include "Network.h"
+#include "Eigen/SVD"
+#include "SpscQueue.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <chrono>
+
+static std::atomic<unsigned long long> s_NextVersion{ 1 };
+
+void Network::Touch()
+{
+	m_Version = s_NextVersion++;
+}
 
 Network::Network(const std::vector<int>& sizes)
 	:m_LayerSizes(sizes)
@@ -8,8 +20,15 @@ Network::Network(const std::vector<int>& sizes)
 	m_Activations.resize(sizes.size());          // N activation vectors
 	m_PreActivations.resize(sizes.size());       // N pre-activation vectors
 	m_WeightGradients.resize(sizes.size() - 1);  // N-1 weight gradient matrices
+	m_FactorGradients.resize(sizes.size() - 1);  // Only used by low rank layers
 	m_BiasGradients.resize(sizes.size() - 1);    // N-1 bias gradient vectors
 	m_Deltas.resize(sizes.size());               // N delta vectors
+	m_ActivationsBF16.resize(sizes.size());      // Only used with Precision::BF16
+	m_DeltasBF16.resize(sizes.size());
+	m_FactorU.resize(sizes.size() - 1);          // Empty = dense layer
+	m_FactorV.resize(sizes.size() - 1);
+	m_Bottlenecks.resize(sizes.size() - 1);
+	m_FactorProductsDirty.assign(sizes.size() - 1, 0);
 
 	// RANDOM INTIALISATION SHOULD BE RE-MADE (there are nuances that I don't know yet)
 
@@ -27,6 +46,7 @@ Network::Network(const std::vector<int>& sizes)
 		m_PreActivations[i] = Eigen::VectorXf::Zero(sizes[i]);
 		m_Deltas[i] = Eigen::VectorXf::Zero(sizes[i]);
 	}
+	Touch();
 }
 
 Network::~Network()
@@ -34,35 +54,94 @@ Network::~Network()
 }
 
 Eigen::VectorXf Network::Forward(const Eigen::VectorXf& input)
+{
+	ForwardPass(input, m_SparseInference || m_SparseTraining);
+
+	// Return the output layer activation (FOR NOW this hasn't a different activation function) WILL USE cross entropy
+	return m_Activations.back();
+}
+
+void Network::ForwardPass(const Eigen::VectorXf& input, bool sparse)
 {
 	m_Activations[0] = input;
 	m_PreActivations[0] = input;
 
+	if (sparse && m_SparseWeightsDirty)
+		BuildSparseWeights();
+
 	// Propagate through the layers
 	for (size_t i = 0; i < m_Weights.size(); i++) {
-		m_PreActivations[i + 1] = m_Weights[i] * m_Activations[i] + m_Biases[i];
+		if (isFactorized(i))
+		{
+			m_Bottlenecks[i].noalias() = m_FactorV[i] * m_Activations[i];
+			m_PreActivations[i + 1] = m_FactorU[i] * m_Bottlenecks[i] + m_Biases[i];
+		}
+		else if (sparse && (m_SparseTraining || m_SparseLayers[i]))
+			m_PreActivations[i + 1] = m_SparseWeights[i] * m_Activations[i] + m_Biases[i];
+		else
+			m_PreActivations[i + 1] = m_Weights[i] * m_Activations[i] + m_Biases[i];
 		m_Activations[i + 1] = ActivationFunction(m_PreActivations[i + 1]);
 	}
+}
 
-	// Return the output layer activation (FOR NOW this hasn't a different activation function) WILL USE cross entropy
-	return m_Activations.back();
+Eigen::MatrixXf Network::ForwardBatch(const Eigen::MatrixXf& inputs) const
+{
+	// Big batches are cut into blocks of columns for the thread pool, each block goes through all the layers
+	const size_t blockSize = 64;
+	size_t columns = static_cast<size_t>(inputs.cols());
+	if (columns <= 2 * blockSize)
+		return ForwardColumns(inputs);
+
+	Eigen::MatrixXf outputs(m_LayerSizes.back(), inputs.cols());
+	ThreadPool::Global().ParallelFor(0, columns, blockSize, [&](size_t first, size_t last)
+		{
+			outputs.middleCols(first, last - first) = ForwardColumns(inputs.middleCols(first, last - first));
+		});
+	return outputs;
+}
+
+Eigen::MatrixXf Network::ForwardColumns(const Eigen::Ref<const Eigen::MatrixXf>& inputs) const
+{
+	// Pruned weights are zero in the dense matrices too, so the dense product gives the same result as the sparse one
+	Eigen::MatrixXf activations = inputs;
+	Eigen::MatrixXf z;
+	for (size_t i = 0; i < m_Weights.size(); i++)
+	{
+		if (isFactorized(i))
+			z.noalias() = m_FactorU[i] * (m_FactorV[i] * activations);
+		else
+			z.noalias() = m_Weights[i] * activations;
+		z.colwise() += m_Biases[i];
+		activations = 1.0f / (1.0f + (-z).array().exp());
+	}
+	return activations;
 }
 
 void Network::BackPropagation(const Eigen::VectorXf& input, const Eigen::VectorXf& target, float learningRate)
 {
 	// TRANSCRIBE WRITTEN NOTES ONTO OBSIDIAN
-
-	Forward(input);
-	int numLayers = m_LayerSizes.size();
-	int outputLayerIndex = numLayers - 1;
+	Touch();
 
 	// Initialize gradients to 0
 	for (size_t i = 0; i < m_WeightGradients.size(); i++) 
 	{
-		m_WeightGradients[i] = Eigen::MatrixXf::Zero(m_Weights[i].rows(), m_Weights[i].cols());
+		ZeroLayerGradients(i, m_WeightGradients[i], m_FactorGradients[i]);
 		m_BiasGradients[i] = Eigen::VectorXf::Zero(m_Biases[i].size());
 	}
 
+	if (m_Precision == Precision::BF16)
+	{
+		AccumulateGradientsBF16(input, target, m_WeightGradients, m_FactorGradients, m_BiasGradients);
+		for (size_t layer = 0; layer < m_Weights.size(); layer++) 
+			UpdateLayer(layer, m_WeightGradients[layer], m_FactorGradients[layer], m_BiasGradients[layer], learningRate);
+		ApplyWeightMasks();
+		return;
+	}
+
+	ForwardPass(input, m_SparseTraining);
+	int numLayers = m_LayerSizes.size();
+	int outputLayerIndex = numLayers - 1;
+
 	// Error = ∂C(network) / ∂z
 
 	// Calculate output layer error : C'(a) ⊙ σ'(z)
@@ -74,7 +153,7 @@ void Network::BackPropagation(const Eigen::VectorXf& input, const Eigen::VectorX
 	// Propagate the error backwords 
 	for (int layer = outputLayerIndex - 1; layer >= 1; layer--) {
 		// error for any layer : (W^T * delta_next) ⊙ σ'(z)
-		m_Deltas[layer] = (m_Weights[layer].transpose() * m_Deltas[layer + 1]).cwiseProduct(
+		m_Deltas[layer] = BackpropDelta(layer, m_Deltas[layer + 1]).cwiseProduct(
 			ActivationFunctionDerivative(m_PreActivations[layer])
 		);
 	}
@@ -82,7 +161,7 @@ void Network::BackPropagation(const Eigen::VectorXf& input, const Eigen::VectorX
 	// Calculate gradients for weigths and biases (you needed ∂C(network) / ∂z)
 	for (int layer = 0; layer < numLayers - 1; layer++) {
 		// W gradient = error * activation^(L-1) -> you also need to transpose for dimension reasons 
-		m_WeightGradients[layer] = m_Deltas[layer + 1] * m_Activations[layer].transpose();
+		AccumulateLayerGradient(layer, m_Deltas[layer + 1], m_Activations[layer], m_WeightGradients[layer], m_FactorGradients[layer]);
 
 		// B gradient = error
 		m_BiasGradients[layer] = m_Deltas[layer + 1];
@@ -90,30 +169,53 @@ void Network::BackPropagation(const Eigen::VectorXf& input, const Eigen::VectorX
 
 	// Update network with the components of the gradient of the Cost() 
 	for (size_t layer = 0; layer < m_Weights.size(); layer++) 
-	{
-		m_Weights[layer] -= learningRate * m_WeightGradients[layer];
-		m_Biases[layer] -= learningRate * m_BiasGradients[layer];
-	}
-
+		UpdateLayer(layer, m_WeightGradients[layer], m_FactorGradients[layer], m_BiasGradients[layer], learningRate);
+	ApplyWeightMasks();
 }
 
 void Network::TrainBatch(const std::vector<DataSample>& batch, float learningRate)
 {
 	if (batch.empty()) return;
+	Touch();
+
+	if (m_SparseTraining)
+	{
+		TrainBatchSparse(batch, learningRate);
+		return;
+	}
+
+	NetworkGradients gradients;
+	ComputeGradients(batch, gradients);
+
+	// Update parameters after batch is completed
+	ApplyGradients(gradients, learningRate / static_cast<float>(batch.size()));
+}
 
+void Network::ComputeGradients(const std::vector<DataSample>& batch, NetworkGradients& gradients, size_t begin, size_t end)
+{
 	// Initialize cumulative gradients	
-	std::vector<Eigen::MatrixXf> WeightGradients(m_Weights.size());
-	std::vector<Eigen::VectorXf> BiasGradients(m_Biases.size());
+	gradients.weights.resize(m_Weights.size());
+	gradients.factors.resize(m_Weights.size());
+	gradients.biases.resize(m_Biases.size());
 	for (size_t i = 0; i < m_Weights.size(); i++) 
 	{
-		WeightGradients[i] = Eigen::MatrixXf::Zero(m_Weights[i].rows(), m_Weights[i].cols());
-		BiasGradients[i] = Eigen::VectorXf::Zero(m_Biases[i].size());
+		ZeroLayerGradients(i, gradients.weights[i], gradients.factors[i]);
+		gradients.biases[i] = Eigen::VectorXf::Zero(m_Biases[i].size());
 	}
 
-	for (const auto& sample : batch) {
+	end = std::min(end, batch.size());
+	gradients.samples = static_cast<int>(end > begin ? end - begin : 0);
+	for (size_t s = begin; s < end; s++) {
+		const DataSample& sample = batch[s];
+		if (m_Precision == Precision::BF16)
+		{
+			AccumulateGradientsBF16(sample.input, sample.target, gradients.weights, gradients.factors, gradients.biases);
+			continue;
+		}
+
 		// Calculate deltas (same as in BackPropagation)
 
-		Forward(sample.input); // I really forgot this line
+		ForwardPass(sample.input, m_SparseTraining); // I really forgot this line
 
 		int numLayers = m_LayerSizes.size();
 		int outputLayerIndex = numLayers - 1;
@@ -125,7 +227,7 @@ void Network::TrainBatch(const std::vector<DataSample>& batch, float learningRat
 
 		for (int layer = outputLayerIndex - 1; layer >= 1; layer--) 
 		{
-			m_Deltas[layer] = (m_Weights[layer].transpose() * m_Deltas[layer + 1]).cwiseProduct(
+			m_Deltas[layer] = BackpropDelta(layer, m_Deltas[layer + 1]).cwiseProduct(
 				ActivationFunctionDerivative(m_PreActivations[layer])
 			);
 		}
@@ -133,18 +235,1140 @@ void Network::TrainBatch(const std::vector<DataSample>& batch, float learningRat
 		// Accumulate gradients instead of updating the weigths and biases immediately
 		for (int layer = 0; layer < numLayers - 1; layer++) 
 		{
-			WeightGradients[layer] += m_Deltas[layer + 1] * m_Activations[layer].transpose();
-			BiasGradients[layer] += m_Deltas[layer + 1];
+			AccumulateLayerGradient(layer, m_Deltas[layer + 1], m_Activations[layer], gradients.weights[layer], gradients.factors[layer]);
+			gradients.biases[layer] += m_Deltas[layer + 1];
 		}
 	}
+}
 
-	// Update parameters after batch is completed
-	float batchSize = static_cast<float>(batch.size());
+void Network::ApplyGradients(const NetworkGradients& gradients, float step)
+{
 	for (size_t layer = 0; layer < m_Weights.size(); layer++) 
+		UpdateLayer(layer, gradients.weights[layer], gradients.factors[layer], gradients.biases[layer], step);
+	ApplyWeightMasks();
+	Touch();
+}
+
+// One sample per column : the inputs (or targets) of batch[first, last)
+static Eigen::MatrixXf SampleColumns(const std::vector<DataSample>& batch, size_t first, size_t last, bool targets)
+{
+	const Eigen::VectorXf& model = targets ? batch[first].target : batch[first].input;
+	Eigen::MatrixXf columns(model.size(), last - first);
+	for (size_t s = first; s < last; s++)
+		columns.col(s - first) = targets ? batch[s].target : batch[s].input;
+	return columns;
+}
+
+Eigen::MatrixXf Network::ForwardLayerColumns(int layer, const Eigen::MatrixXf& input, Eigen::MatrixXf& bottleneck) const
+{
+	Eigen::MatrixXf z;
+	if (isFactorized(layer))
+	{
+		bottleneck.noalias() = m_FactorV[layer] * input;
+		z.noalias() = m_FactorU[layer] * bottleneck;
+	}
+	else
+		z.noalias() = m_Weights[layer] * input;
+	z.colwise() += m_Biases[layer];
+	return 1.0f / (1.0f + (-z).array().exp());
+}
+
+// (W^T * delta) * a * (1 - a), a being the layer's input
+Eigen::MatrixXf Network::BackpropDeltaColumns(int layer, const Eigen::MatrixXf& delta, const Eigen::MatrixXf& activation) const
+{
+	Eigen::MatrixXf backprop;
+	if (isFactorized(layer))
+		backprop.noalias() = m_FactorV[layer].transpose() * (m_FactorU[layer].transpose() * delta);
+	else
+		backprop.noalias() = m_Weights[layer].transpose() * delta;
+	return (backprop.array() * activation.array() * (1.0f - activation.array())).matrix();
+}
+
+void Network::AccumulateLayerGradientColumns(int layer, const Eigen::MatrixXf& delta, const Eigen::MatrixXf& activation,
+	const Eigen::MatrixXf& bottleneck, Eigen::MatrixXf& weightGradient, Eigen::MatrixXf& factorGradient, Eigen::VectorXf& biasGradient) const
+{
+	if (isFactorized(layer))
+	{
+		weightGradient.noalias() += delta * bottleneck.transpose();
+		factorGradient.noalias() += (m_FactorU[layer].transpose() * delta) * activation.transpose();
+	}
+	else
+		weightGradient.noalias() += delta * activation.transpose();
+	biasGradient += delta.rowwise().sum();
+}
+
+TaskGraphStats Network::TrainBatchesOverlapped(const std::vector<std::vector<DataSample>>& batches, float learningRate)
+{
+	if (m_Precision != Precision::FP32 || m_SparseTraining)
+	{
+		for (const std::vector<DataSample>& batch : batches)
+			TrainBatch(batch, learningRate);
+		return TaskGraphStats();
+	}
+
+	// Everything a batch needs between its tasks, one sample per column
+	struct BatchBuffers
+	{
+		std::vector<Eigen::MatrixXf> activations;	// a, layer 0 = inputs
+		std::vector<Eigen::MatrixXf> deltas;
+		std::vector<Eigen::MatrixXf> bottlenecks;	// V * a of low rank layers
+	};
+	const int layers = static_cast<int>(m_Weights.size());
+	std::vector<BatchBuffers> buffers(batches.size());
+
+	TaskGraph graph;
+	std::vector<int> previousUpdates(layers, -1);
+	for (size_t k = 0; k < batches.size(); k++)
+	{
+		const std::vector<DataSample>& batch = batches[k];
+		BatchBuffers& buffer = buffers[k];
+		if (batch.empty())
+			continue;
+		buffer.activations.resize(layers + 1);
+		buffer.deltas.resize(layers + 1);
+		buffer.bottlenecks.resize(layers);
+		float step = learningRate / static_cast<float>(batch.size());
+
+		// Forward : layer l waits for layer l - 1 and for the previous batch's update of its weights
+		std::vector<int> forward(layers);
+		for (int layer = 0; layer < layers; layer++)
+		{
+			forward[layer] = graph.Add([this, &batch, &buffer, layer]()
+				{
+					if (layer == 0)
+						buffer.activations[0] = SampleColumns(batch, 0, batch.size(), false);
+					buffer.activations[layer + 1] = ForwardLayerColumns(layer, buffer.activations[layer], buffer.bottlenecks[layer]);
+				}, { layer > 0 ? forward[layer - 1] : -1, previousUpdates[layer] });
+		}
+
+		// Deltas, output first : (a - target) * a * (1 - a), then (W^T * delta) * a * (1 - a)
+		std::vector<int> delta(layers + 1, -1);
+		delta[layers] = graph.Add([this, &batch, &buffer, layers]()
+			{
+				const Eigen::MatrixXf& output = buffer.activations[layers];
+				Eigen::MatrixXf targets = SampleColumns(batch, 0, batch.size(), true);
+				buffer.deltas[layers] = ((output - targets).array() * output.array() * (1.0f - output.array())).matrix();
+			}, { forward[layers - 1] });
+		for (int layer = layers - 1; layer >= 1; layer--)
+		{
+			delta[layer] = graph.Add([this, &buffer, layer]()
+				{
+					buffer.deltas[layer] = BackpropDeltaColumns(layer, buffer.deltas[layer + 1], buffer.activations[layer]);
+				}, { delta[layer + 1] });
+		}
+
+		// Gradient + update of a layer : needs the delta above it, and the delta below it has to have read
+		// the old weights first
+		for (int layer = layers - 1; layer >= 0; layer--)
+		{
+			previousUpdates[layer] = graph.Add([this, &buffer, layer, step]()
+				{
+					Eigen::MatrixXf weightGradient, factorGradient;
+					ZeroLayerGradients(layer, weightGradient, factorGradient);
+					Eigen::VectorXf biasGradient = Eigen::VectorXf::Zero(m_Biases[layer].size());
+					AccumulateLayerGradientColumns(layer, buffer.deltas[layer + 1], buffer.activations[layer], buffer.bottlenecks[layer],
+						weightGradient, factorGradient, biasGradient);
+					UpdateLayer(layer, weightGradient, factorGradient, biasGradient, step);
+					if (!m_WeightMasks.empty())
+						m_Weights[layer].array() *= m_WeightMasks[layer].array();
+				}, { delta[layer + 1], layer > 0 ? delta[layer] : -1 });
+		}
+	}
+
+	graph.Run();
+	m_SparseWeightsDirty = true;
+	Touch();
+	return graph.getStats();
+}
+
+// Eigen's thread count is process wide : set for the lifetime of the object, then put back
+class ScopedEigenThreads
+{
+private:
+	int m_Saved;
+
+public:
+	explicit ScopedEigenThreads(int threads) : m_Saved(Eigen::nbThreads()) { Eigen::setNbThreads(threads); }
+	~ScopedEigenThreads() { Eigen::setNbThreads(m_Saved); }
+
+	ScopedEigenThreads(const ScopedEigenThreads&) = delete;
+	ScopedEigenThreads& operator=(const ScopedEigenThreads&) = delete;
+};
+
+PipelineStats Network::TrainBatchesPipelined(const std::vector<std::vector<DataSample>>& batches, float learningRate,
+	const PipelineOptions& options)
+{
+	PipelineStats stats;
+	stats.schedule = options.schedule;
+	if (m_Precision != Precision::FP32 || m_SparseTraining)
+	{
+		for (const std::vector<DataSample>& batch : batches)
+			TrainBatch(batch, learningRate);
+		return stats;
+	}
+	auto start = std::chrono::steady_clock::now();
+
+	// Every stage is a pinned thread running its own products, Eigen spawning more on top would oversubscribe the cores
+	ScopedEigenThreads singleThreadedEigen(1);
+
+	// Balance the stages by parameter count : that's both the work per sample and what has to stay in cache
+	const int layers = static_cast<int>(m_Weights.size());
+	std::vector<size_t> costs(layers);
+	for (int layer = 0; layer < layers; layer++)
+		costs[layer] = (isFactorized(layer) ? m_FactorU[layer].size() + m_FactorV[layer].size() : m_Weights[layer].size()) + m_Biases[layer].size();
+	std::vector<int> bounds = PartitionLayers(costs, options.stages);
+	const int stages = static_cast<int>(bounds.size()) - 1;
+	const int microBatches = std::max(options.microBatches, 1);
+	stats.microBatches = microBatches;
+	stats.stages.resize(stages);
+
+	// forward[s] carries activations from stage s to s + 1, backward[s] the deltas from s + 1 back to s.
+	// A stage can't get a batch ahead of its neighbours, so no queue ever holds more than a batch's micro-batches
+	struct Message
+	{
+		int microBatch = 0;
+		Eigen::MatrixXf data;
+	};
+	std::vector<std::unique_ptr<SpscQueue<Message>>> forwardQueues, backwardQueues;
+	for (int stage = 0; stage + 1 < stages; stage++)
 	{
-		m_Weights[layer] -= learningRate * WeightGradients[layer] / batchSize;
-		m_Biases[layer] -= learningRate * BiasGradients[layer] / batchSize;
+		forwardQueues.emplace_back(new SpscQueue<Message>(microBatches));
+		backwardQueues.emplace_back(new SpscQueue<Message>(microBatches));
 	}
+
+	auto runStage = [&](int stage)
+	{
+		auto stageStart = std::chrono::steady_clock::now();
+		PipelineStageStats& stageStats = stats.stages[stage];
+		const int first = bounds[stage];
+		const int last = bounds[stage + 1];
+		stageStats.firstLayer = first;
+		stageStats.lastLayer = last;
+		for (int layer = first; layer < last; layer++)
+			stageStats.parameterBytes += costs[layer] * sizeof(float);
+		if (options.pinThreads)
+		{
+			int core = NumaTopology::Get().getCoreForThread(stage);
+			if (PinThreadToCore(core))
+				stageStats.core = core;
+		}
+
+		// Per micro-batch : the inputs of the stage's layers (+ the output on the last stage), low rank bottlenecks
+		std::vector<std::vector<Eigen::MatrixXf>> activations(microBatches, std::vector<Eigen::MatrixXf>(last - first + 1));
+		std::vector<std::vector<Eigen::MatrixXf>> bottlenecks(microBatches, std::vector<Eigen::MatrixXf>(last - first));
+		std::vector<Eigen::MatrixXf> weightGradients(last - first), factorGradients(last - first);
+		std::vector<Eigen::VectorXf> biasGradients(last - first);
+		double waitSeconds = 0.0;
+		auto receive = [&waitSeconds](SpscQueue<Message>& queue, Message& message)
+		{
+			auto waitStart = std::chrono::steady_clock::now();
+			queue.Pop(message);
+			waitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+		};
+
+		for (const std::vector<DataSample>& batch : batches)
+		{
+			if (batch.empty())
+				continue;
+			const int micro = static_cast<int>(std::min<size_t>(microBatches, batch.size()));
+			for (int layer = first; layer < last; layer++)
+			{
+				ZeroLayerGradients(layer, weightGradients[layer - first], factorGradients[layer - first]);
+				biasGradients[layer - first] = Eigen::VectorXf::Zero(m_Biases[layer].size());
+			}
+
+			int inFlight = 0;
+			for (const PipelineStep& step : BuildPipelineSchedule(options.schedule, stage, stages, micro))
+			{
+				size_t begin = batch.size() * step.microBatch / micro;
+				size_t end = batch.size() * (step.microBatch + 1) / micro;
+				std::vector<Eigen::MatrixXf>& a = activations[step.microBatch];
+				std::vector<Eigen::MatrixXf>& bottleneck = bottlenecks[step.microBatch];
+				Message message;
+				if (!step.backward)
+				{
+					if (stage == 0)
+						a[0] = SampleColumns(batch, begin, end, false);
+					else
+					{
+						receive(*forwardQueues[stage - 1], message);
+						a[0] = std::move(message.data);
+					}
+					for (int layer = first; layer < last; layer++)
+						a[layer - first + 1] = ForwardLayerColumns(layer, a[layer - first], bottleneck[layer - first]);
+					stageStats.peakMicroBatches = std::max(stageStats.peakMicroBatches, ++inFlight);
+
+					// The stage's output is the next stage's input, the backward pass here doesn't need it
+					if (stage + 1 < stages)
+					{
+						message.microBatch = step.microBatch;
+						message.data = std::move(a.back());
+						forwardQueues[stage]->Push(std::move(message));
+					}
+					continue;
+				}
+
+				Eigen::MatrixXf delta;
+				if (stage + 1 == stages)
+				{
+					const Eigen::MatrixXf& output = a.back();
+					Eigen::MatrixXf targets = SampleColumns(batch, begin, end, true);
+					delta = ((output - targets).array() * output.array() * (1.0f - output.array())).matrix();
+				}
+				else
+				{
+					receive(*backwardQueues[stage], message);
+					delta = std::move(message.data);
+				}
+
+				// The weights only change at the end of the batch, so the deltas read the same ones as the forward
+				for (int layer = last - 1; layer >= first; layer--)
+				{
+					AccumulateLayerGradientColumns(layer, delta, a[layer - first], bottleneck[layer - first],
+						weightGradients[layer - first], factorGradients[layer - first], biasGradients[layer - first]);
+					if (layer > 0)
+						delta = BackpropDeltaColumns(layer, delta, a[layer - first]);
+				}
+				inFlight--;
+				if (stage > 0)
+				{
+					message.microBatch = step.microBatch;
+					message.data = std::move(delta);
+					backwardQueues[stage - 1]->Push(std::move(message));
+				}
+			}
+
+			// Pipeline flush : every micro-batch is through, the stage updates its own layers
+			float learningStep = learningRate / static_cast<float>(batch.size());
+			for (int layer = first; layer < last; layer++)
+			{
+				UpdateLayer(layer, weightGradients[layer - first], factorGradients[layer - first], biasGradients[layer - first], learningStep);
+				if (!m_WeightMasks.empty())
+					m_Weights[layer].array() *= m_WeightMasks[layer].array();
+			}
+		}
+
+		stageStats.waitSeconds = waitSeconds;
+		stageStats.busySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - stageStart).count() - waitSeconds;
+	};
+
+	std::vector<std::thread> threads;
+	for (int stage = 0; stage < stages; stage++)
+		threads.emplace_back(runStage, stage);
+	for (std::thread& thread : threads)
+		thread.join();
+
+	for (const std::vector<DataSample>& batch : batches)
+	{
+		stats.batches += batch.empty() ? 0 : 1;
+		stats.samples += batch.size();
+	}
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	m_SparseWeightsDirty = true;
+	Touch();
+	return stats;
+}
+
+TensorParallelStats Network::TrainBatchesTensorParallel(const std::vector<std::vector<DataSample>>& batches, float learningRate,
+	const TensorParallelOptions& options)
+{
+	TensorParallelStats stats;
+	if (m_Precision != Precision::FP32 || m_SparseTraining)
+	{
+		for (const std::vector<DataSample>& batch : batches)
+			TrainBatch(batch, learningRate);
+		return stats;
+	}
+	auto start = std::chrono::steady_clock::now();
+
+	// Row ranges of every split layer, and of every layer's delta for the reduction of the backward partial sums
+	const int layers = static_cast<int>(m_Weights.size());
+	const int partitions = std::max(options.partitions, 1);
+	std::vector<bool> split(layers, false);
+	std::vector<std::vector<int>> rowBounds(layers), deltaBounds(layers);
+	for (int layer = 0; layer < layers; layer++)
+	{
+		split[layer] = partitions > 1 && !isFactorized(layer) && m_Weights[layer].rows() >= options.minRows;
+		stats.splitLayers += split[layer] ? 1 : 0;
+		rowBounds[layer] = SplitRows(static_cast<int>(m_Weights[layer].rows()), partitions);
+		deltaBounds[layer] = SplitRows(m_LayerSizes[layer], partitions);
+	}
+	stats.partitions.resize(partitions);
+
+	// Shared between the threads : whole activations and deltas (each thread writes its rows), the partial
+	// W_t^T * delta_t of every thread
+	std::vector<Eigen::MatrixXf> activations(layers + 1), deltas(layers + 1), bottlenecks(layers);
+	std::vector<Eigen::MatrixXf> partials(partitions);
+	SpinBarrier barrier(partitions);
+
+	auto runPartition = [&](int t)
+	{
+		auto threadStart = std::chrono::steady_clock::now();
+		TensorParallelPartitionStats& partitionStats = stats.partitions[t];
+		if (options.pinThreads)
+		{
+			int core = NumaTopology::Get().getCoreForThread(t);
+			if (PinThreadToCore(core))
+				partitionStats.core = core;
+		}
+		double waitSeconds = 0.0;
+		auto sync = [&]()
+		{
+			auto waitStart = std::chrono::steady_clock::now();
+			barrier.Wait();
+			waitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+			if (t == 0)
+				stats.barriers++;
+		};
+
+		// The thread's own rows of the split layers, copied (first touched) here
+		std::vector<Eigen::MatrixXf> weights(layers), masks(layers);
+		std::vector<Eigen::VectorXf> biases(layers);
+		for (int layer = 0; layer < layers; layer++)
+		{
+			if (!split[layer])
+				continue;
+			int first = rowBounds[layer][t];
+			int rows = rowBounds[layer][t + 1] - first;
+			weights[layer] = m_Weights[layer].middleRows(first, rows);
+			biases[layer] = m_Biases[layer].segment(first, rows);
+			if (!m_WeightMasks.empty())
+				masks[layer] = m_WeightMasks[layer].middleRows(first, rows);
+			partitionStats.parameterBytes += (weights[layer].size() + biases[layer].size()) * sizeof(float);
+		}
+		Eigen::MatrixXf weightGradient, factorGradient;
+		Eigen::VectorXf biasGradient;
+
+		for (const std::vector<DataSample>& batch : batches)
+		{
+			if (batch.empty())
+				continue;
+			const Eigen::Index columns = static_cast<Eigen::Index>(batch.size());
+			float step = learningRate / static_cast<float>(batch.size());
+			if (t == 0)
+			{
+				activations[0] = SampleColumns(batch, 0, batch.size(), false);
+				for (int layer = 1; layer <= layers; layer++)
+				{
+					activations[layer].resize(m_LayerSizes[layer], columns);
+					deltas[layer].resize(m_LayerSizes[layer], columns);
+				}
+			}
+			sync();
+
+			// Forward : every thread its rows of the pre-activation, straight into the shared activations (the gather)
+			for (int layer = 0; layer < layers; layer++)
+			{
+				if (split[layer])
+				{
+					Eigen::MatrixXf z;
+					z.noalias() = weights[layer] * activations[layer];
+					z.colwise() += biases[layer];
+					activations[layer + 1].middleRows(rowBounds[layer][t], z.rows()) = 1.0f / (1.0f + (-z).array().exp());
+				}
+				else if (t == 0)
+					activations[layer + 1] = ForwardLayerColumns(layer, activations[layer], bottlenecks[layer]);
+				sync();
+			}
+
+			if (t == 0)
+			{
+				const Eigen::MatrixXf& output = activations[layers];
+				Eigen::MatrixXf targets = SampleColumns(batch, 0, batch.size(), true);
+				deltas[layers] = ((output - targets).array() * output.array() * (1.0f - output.array())).matrix();
+			}
+			sync();
+
+			for (int layer = layers - 1; layer >= 0; layer--)
+			{
+				if (!split[layer])
+				{
+					// Narrow layer : the caller does it the usual way
+					if (t == 0)
+					{
+						ZeroLayerGradients(layer, weightGradient, factorGradient);
+						biasGradient = Eigen::VectorXf::Zero(m_Biases[layer].size());
+						AccumulateLayerGradientColumns(layer, deltas[layer + 1], activations[layer], bottlenecks[layer],
+							weightGradient, factorGradient, biasGradient);
+						if (layer > 0)
+							deltas[layer] = BackpropDeltaColumns(layer, deltas[layer + 1], activations[layer]);
+						UpdateLayer(layer, weightGradient, factorGradient, biasGradient, step);
+						if (!m_WeightMasks.empty())
+							m_Weights[layer].array() *= m_WeightMasks[layer].array();
+					}
+					if (layer > 0)
+						sync();
+					continue;
+				}
+
+				// The rows' gradient and update never leave the thread, their share of W^T * delta is summed below
+				Eigen::MatrixXf delta = deltas[layer + 1].middleRows(rowBounds[layer][t], weights[layer].rows());
+				if (layer > 0)
+					partials[t].noalias() = weights[layer].transpose() * delta;
+				weights[layer].noalias() -= step * (delta * activations[layer].transpose());
+				biases[layer] -= step * delta.rowwise().sum();
+				if (!m_WeightMasks.empty())
+					weights[layer].array() *= masks[layer].array();
+				if (layer == 0)
+					continue;
+
+				sync();
+				int first = deltaBounds[layer][t];
+				int rows = deltaBounds[layer][t + 1] - first;
+				if (rows > 0)
+				{
+					Eigen::MatrixXf sum = partials[0].middleRows(first, rows);
+					for (int u = 1; u < partitions; u++)
+						sum += partials[u].middleRows(first, rows);
+					auto a = activations[layer].middleRows(first, rows).array();
+					deltas[layer].middleRows(first, rows) = (sum.array() * a * (1.0f - a)).matrix();
+				}
+				sync();
+			}
+
+			// The first layer's gradients read the inputs, which the caller replaces for the next batch
+			sync();
+		}
+
+		// Every thread writes its own rows back
+		for (int layer = 0; layer < layers; layer++)
+		{
+			if (!split[layer])
+				continue;
+			m_Weights[layer].middleRows(rowBounds[layer][t], weights[layer].rows()) = weights[layer];
+			m_Biases[layer].segment(rowBounds[layer][t], biases[layer].size()) = biases[layer];
+		}
+		partitionStats.waitSeconds = waitSeconds;
+		partitionStats.busySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - threadStart).count() - waitSeconds;
+	};
+
+	std::vector<std::thread> threads;
+	for (int t = 1; t < partitions; t++)
+		threads.emplace_back(runPartition, t);
+	{
+		// Partition 0 pins the caller's thread, it gets its old affinity back afterwards
+		ScopedThreadAffinity callerAffinity;
+		runPartition(0);
+	}
+	for (std::thread& thread : threads)
+		thread.join();
+
+	for (const std::vector<DataSample>& batch : batches)
+	{
+		stats.batches += batch.empty() ? 0 : 1;
+		stats.samples += batch.size();
+	}
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	m_SparseWeightsDirty = true;
+	Touch();
+	return stats;
+}
+
+size_t NetworkGradients::getParameterCount() const
+{
+	size_t count = 0;
+	for (size_t layer = 0; layer < weights.size(); layer++)
+		count += weights[layer].size() + factors[layer].size() + biases[layer].size();
+	return count;
+}
+
+// Eigen matrices are column major, so each one is a single copy
+void NetworkGradients::Pack(float* data) const
+{
+	for (size_t layer = 0; layer < weights.size(); layer++)
+	{
+		data = std::copy(weights[layer].data(), weights[layer].data() + weights[layer].size(), data);
+		data = std::copy(factors[layer].data(), factors[layer].data() + factors[layer].size(), data);
+	}
+	for (size_t layer = 0; layer < biases.size(); layer++)
+		data = std::copy(biases[layer].data(), biases[layer].data() + biases[layer].size(), data);
+}
+
+void NetworkGradients::Unpack(const float* data)
+{
+	for (size_t layer = 0; layer < weights.size(); layer++)
+	{
+		std::copy(data, data + weights[layer].size(), weights[layer].data());
+		data += weights[layer].size();
+		std::copy(data, data + factors[layer].size(), factors[layer].data());
+		data += factors[layer].size();
+	}
+	for (size_t layer = 0; layer < biases.size(); layer++)
+	{
+		std::copy(data, data + biases[layer].size(), biases[layer].data());
+		data += biases[layer].size();
+	}
+}
+
+size_t Network::getParameterCount() const
+{
+	size_t count = 0;
+	for (size_t layer = 0; layer < m_Weights.size(); layer++)
+	{
+		count += isFactorized(layer) ? m_FactorU[layer].size() + m_FactorV[layer].size() : m_Weights[layer].size();
+		count += m_Biases[layer].size();
+	}
+	return count;
+}
+
+void Network::PackParameters(float* data) const
+{
+	for (size_t layer = 0; layer < m_Weights.size(); layer++)
+	{
+		if (isFactorized(layer))
+		{
+			data = std::copy(m_FactorU[layer].data(), m_FactorU[layer].data() + m_FactorU[layer].size(), data);
+			data = std::copy(m_FactorV[layer].data(), m_FactorV[layer].data() + m_FactorV[layer].size(), data);
+		}
+		else
+			data = std::copy(m_Weights[layer].data(), m_Weights[layer].data() + m_Weights[layer].size(), data);
+	}
+	for (size_t layer = 0; layer < m_Biases.size(); layer++)
+		data = std::copy(m_Biases[layer].data(), m_Biases[layer].data() + m_Biases[layer].size(), data);
+}
+
+void Network::UnpackParameters(const float* data)
+{
+	for (size_t layer = 0; layer < m_Weights.size(); layer++)
+	{
+		if (isFactorized(layer))
+		{
+			std::copy(data, data + m_FactorU[layer].size(), m_FactorU[layer].data());
+			data += m_FactorU[layer].size();
+			std::copy(data, data + m_FactorV[layer].size(), m_FactorV[layer].data());
+			data += m_FactorV[layer].size();
+			m_FactorProductsDirty[layer] = 1;
+		}
+		else
+		{
+			std::copy(data, data + m_Weights[layer].size(), m_Weights[layer].data());
+			data += m_Weights[layer].size();
+		}
+	}
+	for (size_t layer = 0; layer < m_Biases.size(); layer++)
+	{
+		std::copy(data, data + m_Biases[layer].size(), m_Biases[layer].data());
+		data += m_Biases[layer].size();
+	}
+	m_SparseWeightsDirty = true;
+	Touch();
+}
+
+// Same as the fp32 pass, but the activations and deltas the backward pass reads back are only stored as
+// stochastically rounded bf16 : the fp32 values live in the two scratch vectors just long enough to compute the next
+// layer (or the previous delta). σ'(z) = a ⊙ (1 - a) for the sigmoid, so no pre-activation is kept either.
+// The input isn't copied, the caller keeps it alive. Gradients are still accumulated in fp32
+void Network::AccumulateGradientsBF16(const Eigen::VectorXf& input, const Eigen::VectorXf& target,
+	std::vector<Eigen::MatrixXf>& weightGradients, std::vector<Eigen::MatrixXf>& factorGradients, std::vector<Eigen::VectorXf>& biasGradients)
+{
+	int numLayers = m_LayerSizes.size();
+	int outputLayerIndex = numLayers - 1;
+	Eigen::VectorXf& current = m_ScratchBF16[0];
+	Eigen::VectorXf& next = m_ScratchBF16[1];
+
+	// Forward : the output layer stays in fp32, it's used right away
+	for (int layer = 0; layer < outputLayerIndex; layer++)
+	{
+		const Eigen::VectorXf& activation = layer == 0 ? input : current;
+		if (isFactorized(layer))
+		{
+			m_Bottlenecks[layer].noalias() = m_FactorV[layer] * activation;
+			next.noalias() = m_FactorU[layer] * m_Bottlenecks[layer];
+		}
+		else
+			next.noalias() = m_Weights[layer] * activation;
+		next = ActivationFunction(next + m_Biases[layer]);
+		current.swap(next);
+		if (layer + 1 < outputLayerIndex)
+			StochasticRoundBF16(current, m_ActivationsBF16[layer + 1], m_RoundingGen);
+	}
+
+	current.array() = (current - target).array() * current.array() * (1.0f - current.array());
+	StochasticRoundBF16(current, m_DeltasBF16[outputLayerIndex], m_RoundingGen);
+
+	for (int layer = outputLayerIndex - 1; layer >= 1; layer--)
+	{
+		current = m_DeltasBF16[layer + 1].cast<float>();
+		next = BackpropDelta(layer, current);
+		current = m_ActivationsBF16[layer].cast<float>();
+		next.array() *= current.array() * (1.0f - current.array());
+		StochasticRoundBF16(next, m_DeltasBF16[layer], m_RoundingGen);
+	}
+
+	for (int layer = 0; layer < numLayers - 1; layer++)
+	{
+		next = m_DeltasBF16[layer + 1].cast<float>();
+		if (layer > 0)
+			current = m_ActivationsBF16[layer].cast<float>();
+		AccumulateLayerGradient(layer, next, layer == 0 ? input : current, weightGradients[layer], factorGradients[layer]);
+		biasGradients[layer] += next;
+	}
+}
+
+void Network::setPrecision(Precision precision)
+{
+	m_Precision = precision;
+	if (precision != Precision::BF16)
+		return;
+
+	// The bf16 pass doesn't use the fp32 copies, Forward() brings them back when the network is used for inference
+	for (size_t i = 0; i < m_Activations.size(); i++)
+	{
+		m_Activations[i].resize(0);
+		m_PreActivations[i].resize(0);
+		m_Deltas[i].resize(0);
+	}
+}
+
+Eigen::VectorXf Network::BackpropDelta(int layer, const Eigen::VectorXf& delta) const
+{
+	if (isFactorized(layer))
+		return m_FactorV[layer].transpose() * (m_FactorU[layer].transpose() * delta);
+	return m_Weights[layer].transpose() * delta;
+}
+
+void Network::ZeroLayerGradients(int layer, Eigen::MatrixXf& weightGradient, Eigen::MatrixXf& factorGradient) const
+{
+	if (isFactorized(layer))
+	{
+		weightGradient = Eigen::MatrixXf::Zero(m_FactorU[layer].rows(), m_FactorU[layer].cols());
+		factorGradient = Eigen::MatrixXf::Zero(m_FactorV[layer].rows(), m_FactorV[layer].cols());
+	}
+	else
+	{
+		weightGradient = Eigen::MatrixXf::Zero(m_Weights[layer].rows(), m_Weights[layer].cols());
+		factorGradient.resize(0, 0);
+	}
+}
+
+// Low rank layer : z = U * (V * a), so dC/dU = delta * (V * a)^T and dC/dV = (U^T * delta) * a^T
+void Network::AccumulateLayerGradient(int layer, const Eigen::VectorXf& delta, const Eigen::VectorXf& activation,
+	Eigen::MatrixXf& weightGradient, Eigen::MatrixXf& factorGradient) const
+{
+	if (isFactorized(layer))
+	{
+		weightGradient.noalias() += delta * m_Bottlenecks[layer].transpose();
+		factorGradient.noalias() += (m_FactorU[layer].transpose() * delta) * activation.transpose();
+	}
+	else
+	{
+		weightGradient.noalias() += delta * activation.transpose();
+	}
+}
+
+void Network::UpdateLayer(int layer, const Eigen::MatrixXf& weightGradient, const Eigen::MatrixXf& factorGradient,
+	const Eigen::VectorXf& biasGradient, float step)
+{
+	if (isFactorized(layer))
+	{
+		m_FactorU[layer] -= step * weightGradient;
+		m_FactorV[layer] -= step * factorGradient;
+		m_FactorProductsDirty[layer] = 1;
+	}
+	else
+	{
+		m_Weights[layer] -= step * weightGradient;
+	}
+	m_Biases[layer] -= step * biasGradient;
+}
+
+void Network::FactorizeLayer(int layerIndex, int rank)
+{
+	if (layerIndex < 0 || layerIndex >= static_cast<int>(m_Weights.size()))
+		return;
+
+	const Eigen::MatrixXf& weights = getWeights(layerIndex);
+	rank = std::min(std::max(rank, 1), static_cast<int>(std::min(weights.rows(), weights.cols())));
+
+	// Masks are per weight and have no meaning for the factors
+	m_WeightMasks.clear();
+	m_SparseTraining = false;
+
+	// Split the singular values evenly between the two factors : U = U_k * sqrt(S), V = sqrt(S) * V_k^T
+	Eigen::BDCSVD<Eigen::MatrixXf> svd(weights, Eigen::ComputeThinU | Eigen::ComputeThinV);
+	Eigen::VectorXf sqrtS = svd.singularValues().head(rank).cwiseSqrt();
+	m_FactorU[layerIndex] = svd.matrixU().leftCols(rank) * sqrtS.asDiagonal();
+	m_FactorV[layerIndex] = sqrtS.asDiagonal() * svd.matrixV().leftCols(rank).transpose();
+
+	m_Weights[layerIndex].noalias() = m_FactorU[layerIndex] * m_FactorV[layerIndex];
+	m_SparseWeightsDirty = true;
+	Touch();
+}
+
+void Network::RefreshFactorProducts() const
+{
+	// m_Weights of a low rank layer is only a cache of the product, rebuilding it doesn't change the network
+	std::vector<Eigen::MatrixXf>& weights = const_cast<std::vector<Eigen::MatrixXf>&>(m_Weights);
+	for (size_t layer = 0; layer < m_Weights.size(); layer++)
+	{
+		if (!m_FactorProductsDirty[layer])
+			continue;
+		m_FactorProductsDirty[layer] = 0;
+		if (isFactorized(layer))
+			weights[layer].noalias() = m_FactorU[layer] * m_FactorV[layer];
+	}
+}
+
+void Network::ExpandAllLayers()
+{
+	for (size_t layer = 0; layer < m_Weights.size(); layer++)
+		ExpandLayer(layer);
+}
+
+void Network::PruneByMagnitude(float sparsity)
+{
+	sparsity = std::min(std::max(sparsity, 0.0f), 1.0f);
+	ExpandAllLayers(); // m_Weights already holds U * V
+
+	if (m_WeightMasks.size() != m_Weights.size())
+	{
+		m_WeightMasks.resize(m_Weights.size());
+		for (size_t layer = 0; layer < m_Weights.size(); layer++)
+			m_WeightMasks[layer] = Eigen::MatrixXf::Ones(m_Weights[layer].rows(), m_Weights[layer].cols());
+	}
+
+	for (size_t layer = 0; layer < m_Weights.size(); layer++)
+	{
+		Eigen::MatrixXf& weights = m_Weights[layer];
+		size_t toPrune = static_cast<size_t>(sparsity * weights.size());
+		if (toPrune == 0)
+			continue;
+
+		// Threshold = k-th smallest magnitude (already pruned weights are 0 so they count towards the target)
+		std::vector<float> magnitudes(weights.size());
+		for (Eigen::Index i = 0; i < weights.size(); i++)
+			magnitudes[i] = std::abs(weights.data()[i]);
+		std::nth_element(magnitudes.begin(), magnitudes.begin() + (toPrune - 1), magnitudes.end());
+		float threshold = magnitudes[toPrune - 1];
+
+		// Ties at the threshold could prune more than asked, so stop at the target count
+		size_t pruned = 0;
+		for (Eigen::Index i = 0; i < weights.size(); i++)
+		{
+			if (pruned < toPrune && std::abs(weights.data()[i]) <= threshold)
+			{
+				m_WeightMasks[layer].data()[i] = 0.0f;
+				pruned++;
+			}
+		}
+	}
+
+	ApplyWeightMasks();
+}
+
+float Network::getSparsity(int layerIndex) const
+{
+	const Eigen::MatrixXf& weights = getWeights(layerIndex);
+	if (weights.size() == 0)
+		return 0.0f;
+
+	Eigen::Index zeros = (weights.array() == 0.0f).count();
+	return static_cast<float>(zeros) / static_cast<float>(weights.size());
+}
+
+const Eigen::SparseMatrix<float, Eigen::RowMajor>& Network::getSparseWeights(int layerIndex)
+{
+	if (m_SparseWeightsDirty)
+		BuildSparseWeights();
+	return m_SparseWeights[layerIndex];
+}
+
+// Keeps pruned weights at 0 after an update
+void Network::ApplyWeightMasks()
+{
+	m_SparseWeightsDirty = true;
+	if (m_WeightMasks.empty())
+		return;
+
+	for (size_t layer = 0; layer < m_Weights.size(); layer++)
+		m_Weights[layer].array() *= m_WeightMasks[layer].array();
+}
+
+// CSR against dense matrix-vector product of one layer, measured with -march=native on one core. CSR only wins below
+// about 5% density while the dense weights fit in L2 (784x128 : 0.5x at 10%, 1.1x at 5%), below about 12% once they
+// stream from memory (784x512 in a 784-512-512-10 network : 0.9x at 20%, 1.9x at 10%)
+static bool SparseProductIsFaster(const Eigen::SparseMatrix<float, Eigen::RowMajor>& weights)
+{
+	double size = static_cast<double>(weights.rows()) * weights.cols();
+	if (size == 0.0)
+		return false;
+	double density = weights.nonZeros() / size;
+	return density <= (size * sizeof(float) <= 1024.0 * 1024.0 ? 0.05 : 0.12);
+}
+
+void Network::BuildSparseWeights()
+{
+	RefreshFactorProducts();
+	m_SparseWeights.resize(m_Weights.size());
+	for (size_t layer = 0; layer < m_Weights.size(); layer++)
+	{
+		if (m_WeightMasks.empty())
+		{
+			m_SparseWeights[layer] = m_Weights[layer].sparseView();
+			continue;
+		}
+
+		// With a mask the pattern comes from the mask, so freshly regrown (still 0) connections are kept
+		std::vector<Eigen::Triplet<float>> entries;
+		entries.reserve(static_cast<size_t>((m_WeightMasks[layer].array() != 0.0f).count()));
+		for (Eigen::Index col = 0; col < m_Weights[layer].cols(); col++)
+			for (Eigen::Index row = 0; row < m_Weights[layer].rows(); row++)
+				if (m_WeightMasks[layer](row, col) != 0.0f)
+					entries.emplace_back(row, col, m_Weights[layer](row, col));
+
+		m_SparseWeights[layer].resize(m_Weights[layer].rows(), m_Weights[layer].cols());
+		m_SparseWeights[layer].setFromTriplets(entries.begin(), entries.end());
+	}
+
+	m_SparseLayers.resize(m_Weights.size());
+	for (size_t layer = 0; layer < m_Weights.size(); layer++)
+		m_SparseLayers[layer] = SparseProductIsFaster(m_SparseWeights[layer]) ? 1 : 0;
+	m_SparseWeightsDirty = false;
+}
+
+void Network::EnableSparseTraining(float sparsity, int regrowInterval, float regrowFraction)
+{
+	sparsity = std::min(std::max(sparsity, 0.0f), 0.99f);
+	m_RegrowInterval = std::max(regrowInterval, 1);
+	m_RegrowFraction = std::min(std::max(regrowFraction, 0.0f), 1.0f);
+	m_SparseStep = 0;
+	ExpandAllLayers();
+
+	// Random connectivity with the same density in every layer
+	m_WeightMasks.resize(m_Weights.size());
+	std::uniform_real_distribution<float> dis(0.0f, 1.0f);
+	for (size_t layer = 0; layer < m_Weights.size(); layer++)
+	{
+		m_WeightMasks[layer].resize(m_Weights[layer].rows(), m_Weights[layer].cols());
+		for (Eigen::Index i = 0; i < m_WeightMasks[layer].size(); i++)
+			m_WeightMasks[layer].data()[i] = dis(m_SparseGen) < sparsity ? 0.0f : 1.0f;
+	}
+
+	ApplyWeightMasks();
+	BuildSparseWeights();
+	m_SparseTraining = true;
+}
+
+// Same math as TrainBatch but only the weights in the sparsity pattern get a gradient
+void Network::TrainBatchSparse(const std::vector<DataSample>& batch, float learningRate)
+{
+	if (m_SparseWeightsDirty)
+		BuildSparseWeights();
+
+	int numLayers = m_LayerSizes.size();
+	int outputLayerIndex = numLayers - 1;
+	bool regrowStep = (++m_SparseStep % m_RegrowInterval) == 0;
+
+	// One gradient per stored nonzero, dense gradients only on prune-and-regrow steps
+	std::vector<Eigen::VectorXf> valueGradients(m_Weights.size());
+	std::vector<Eigen::VectorXf> biasGradients(m_Biases.size());
+	std::vector<Eigen::MatrixXf> denseGradients(regrowStep ? m_Weights.size() : 0);
+	for (size_t i = 0; i < m_Weights.size(); i++)
+	{
+		valueGradients[i] = Eigen::VectorXf::Zero(m_SparseWeights[i].nonZeros());
+		biasGradients[i] = Eigen::VectorXf::Zero(m_Biases[i].size());
+		if (regrowStep)
+			denseGradients[i] = Eigen::MatrixXf::Zero(m_Weights[i].rows(), m_Weights[i].cols());
+	}
+
+	for (const auto& sample : batch)
+	{
+		Forward(sample.input);
+
+		Eigen::VectorXf outputError = m_Activations[outputLayerIndex] - sample.target;
+		m_Deltas[outputLayerIndex] = outputError.cwiseProduct(
+			ActivationFunctionDerivative(m_PreActivations[outputLayerIndex])
+		);
+
+		for (int layer = outputLayerIndex - 1; layer >= 1; layer--)
+		{
+			m_Deltas[layer] = (m_SparseWeights[layer].transpose() * m_Deltas[layer + 1]).cwiseProduct(
+				ActivationFunctionDerivative(m_PreActivations[layer])
+			);
+		}
+
+		// Gradient of each stored weight : delta[row] * activation[col]
+		for (int layer = 0; layer < numLayers - 1; layer++)
+		{
+			const auto& weights = m_SparseWeights[layer];
+			const Eigen::VectorXf& delta = m_Deltas[layer + 1];
+			const Eigen::VectorXf& activation = m_Activations[layer];
+			const int* outer = weights.outerIndexPtr();
+			const int* inner = weights.innerIndexPtr();
+			float* grad = valueGradients[layer].data();
+
+			for (Eigen::Index row = 0; row < weights.rows(); row++)
+			{
+				float d = delta[row];
+				for (int k = outer[row]; k < outer[row + 1]; k++)
+					grad[k] += d * activation[inner[k]];
+			}
+
+			biasGradients[layer] += delta;
+			if (regrowStep)
+				denseGradients[layer] += delta * activation.transpose();
+		}
+	}
+
+	// Update the stored values and mirror them into m_Weights
+	float batchSize = static_cast<float>(batch.size());
+	for (int layer = 0; layer < numLayers - 1; layer++)
+	{
+		auto& weights = m_SparseWeights[layer];
+		const int* outer = weights.outerIndexPtr();
+		const int* inner = weights.innerIndexPtr();
+		float* values = weights.valuePtr();
+
+		for (Eigen::Index row = 0; row < weights.rows(); row++)
+		{
+			for (int k = outer[row]; k < outer[row + 1]; k++)
+			{
+				values[k] -= learningRate * valueGradients[layer][k] / batchSize;
+				m_Weights[layer](row, inner[k]) = values[k];
+			}
+		}
+		m_Biases[layer] -= learningRate * biasGradients[layer] / batchSize;
+
+		if (regrowStep)
+			PruneAndRegrow(layer, denseGradients[layer]);
+	}
+
+	if (regrowStep)
+		BuildSparseWeights();
+}
+
+// RigL style update : drop the smallest magnitude active weights, regrow where |gradient| is largest
+void Network::PruneAndRegrow(int layer, const Eigen::MatrixXf& denseGradient)
+{
+	Eigen::MatrixXf& weights = m_Weights[layer];
+	Eigen::MatrixXf& mask = m_WeightMasks[layer];
+
+	std::vector<Eigen::Index> active;
+	std::vector<Eigen::Index> inactive;
+	for (Eigen::Index i = 0; i < mask.size(); i++)
+		(mask.data()[i] != 0.0f ? active : inactive).push_back(i);
+
+	size_t count = static_cast<size_t>(m_RegrowFraction * active.size());
+	count = std::min(count, inactive.size());
+	if (count == 0)
+		return;
+
+	std::nth_element(active.begin(), active.begin() + (count - 1), active.end(),
+		[&](Eigen::Index a, Eigen::Index b) { return std::abs(weights.data()[a]) < std::abs(weights.data()[b]); });
+	std::nth_element(inactive.begin(), inactive.begin() + (count - 1), inactive.end(),
+		[&](Eigen::Index a, Eigen::Index b) { return std::abs(denseGradient.data()[a]) > std::abs(denseGradient.data()[b]); });
+
+	// Dropped connections are not candidates for regrowth in the same step, so the budget stays fixed
+	for (size_t i = 0; i < count; i++)
+	{
+		mask.data()[active[i]] = 0.0f;
+		weights.data()[active[i]] = 0.0f;
+
+		mask.data()[inactive[i]] = 1.0f;
+		weights.data()[inactive[i]] = 0.0f;	// Regrown connections start from 0
+	}
+}
+
+void Network::CaptureState(NetworkState& state) const
+{
+	RefreshFactorProducts();
+	state.layerSizes = m_LayerSizes;
+	state.weights = m_Weights;
+	state.biases = m_Biases;
+	state.factorU = m_FactorU;
+	state.factorV = m_FactorV;
+	state.weightMasks = m_WeightMasks;
+	state.precision = m_Precision;
+	state.sparseInference = m_SparseInference;
+	state.sparseTraining = m_SparseTraining;
+	state.regrowInterval = m_RegrowInterval;
+	state.regrowFraction = m_RegrowFraction;
+	state.sparseStep = m_SparseStep;
+	state.roundingGen = m_RoundingGen;
+	state.sparseGen = m_SparseGen;
+}
+
+void Network::RestoreState(const NetworkState& state)
+{
+	// The topology may differ (pruned neurons), so the scratch buffers are rebuilt too
+	size_t layerCount = state.layerSizes.size();
+	m_LayerSizes = state.layerSizes;
+	m_Activations.resize(layerCount);
+	m_PreActivations.resize(layerCount);
+	m_Deltas.resize(layerCount);
+	for (size_t i = 0; i < layerCount; i++)
+	{
+		m_Activations[i] = Eigen::VectorXf::Zero(m_LayerSizes[i]);
+		m_PreActivations[i] = Eigen::VectorXf::Zero(m_LayerSizes[i]);
+		m_Deltas[i] = Eigen::VectorXf::Zero(m_LayerSizes[i]);
+	}
+	m_WeightGradients.assign(layerCount - 1, Eigen::MatrixXf());
+	m_FactorGradients.assign(layerCount - 1, Eigen::MatrixXf());
+	m_BiasGradients.assign(layerCount - 1, Eigen::VectorXf());
+	m_Bottlenecks.assign(layerCount - 1, Eigen::VectorXf());
+	m_ActivationsBF16.assign(layerCount, VectorBF16());
+	m_DeltasBF16.assign(layerCount, VectorBF16());
+
+	m_Weights = state.weights;
+	m_Biases = state.biases;
+	m_FactorU = state.factorU;
+	m_FactorV = state.factorV;
+	m_FactorProductsDirty.assign(m_Weights.size(), 1);
+	m_WeightMasks = state.weightMasks;
+	setPrecision(state.precision);
+	m_SparseInference = state.sparseInference;
+	m_SparseTraining = state.sparseTraining;
+	m_RegrowInterval = state.regrowInterval;
+	m_RegrowFraction = state.regrowFraction;
+	m_SparseStep = state.sparseStep;
+	m_RoundingGen = state.roundingGen;
+	m_SparseGen = state.sparseGen;
+
+	// The CSR copy is rebuilt from the mask, same pattern and values as the one that was captured
+	m_SparseWeightsDirty = true;
+	Touch();
+}
+
+void Network::RemoveNeurons(int layerIndex, std::vector<int> neurons)
+{
+	if (layerIndex <= 0 || layerIndex >= static_cast<int>(m_LayerSizes.size()) - 1)
+		return;
+
+	std::sort(neurons.begin(), neurons.end());
+	neurons.erase(std::unique(neurons.begin(), neurons.end()), neurons.end());
+
+	std::vector<int> keep;
+	for (int n = 0, next = 0; n < m_LayerSizes[layerIndex]; n++)
+	{
+		if (next < static_cast<int>(neurons.size()) && neurons[next] == n)
+			next++;
+		else
+			keep.push_back(n);
+	}
+	if (keep.empty() || keep.size() == static_cast<size_t>(m_LayerSizes[layerIndex]))
+		return; // Never delete a whole layer
+
+	int in = layerIndex - 1;	// Connections into the layer
+	int out = layerIndex;		// Connections out of the layer
+	m_Weights[in] = Eigen::MatrixXf(m_Weights[in](keep, Eigen::all));
+	m_Biases[in] = Eigen::VectorXf(m_Biases[in](keep));
+	m_Weights[out] = Eigen::MatrixXf(m_Weights[out](Eigen::all, keep));
+	if (isFactorized(in))
+		m_FactorU[in] = Eigen::MatrixXf(m_FactorU[in](keep, Eigen::all));
+	if (isFactorized(out))
+		m_FactorV[out] = Eigen::MatrixXf(m_FactorV[out](Eigen::all, keep));
+	if (!m_WeightMasks.empty())
+	{
+		m_WeightMasks[in] = Eigen::MatrixXf(m_WeightMasks[in](keep, Eigen::all));
+		m_WeightMasks[out] = Eigen::MatrixXf(m_WeightMasks[out](Eigen::all, keep));
+	}
+
+	m_LayerSizes[layerIndex] = static_cast<int>(keep.size());
+	m_Activations[layerIndex] = Eigen::VectorXf::Zero(keep.size());
+	m_PreActivations[layerIndex] = Eigen::VectorXf::Zero(keep.size());
+	m_Deltas[layerIndex] = Eigen::VectorXf::Zero(keep.size());
+	m_SparseWeightsDirty = true;
+	Touch();
 }
 
 // Not the most optimal implementation but it's easy and it works
@@ -1,6 +1,56 @@
 #pragma once
 #include "Dataset.h"
+#include "MixedPrecision.h"
+#include "Numa.h"
+#include "Pipeline.h"
+#include "TaskGraph.h"
+#include "TensorParallel.h"
+#include "Eigen/SparseCore"
+#include <cassert>
 
+// Storage format of the activations and deltas kept around for the backward pass
+enum class Precision
+{
+	FP32,
+	BF16	// Mixed precision : bf16 activations/deltas, fp32 master weights and gradient accumulation. Only the
+			// vectors held between the forward and the backward pass shrink : the products still read the fp32
+			// weights and widen the saved vectors back to fp32, so the memory traffic per step barely changes
+};
+
+// Everything TrainBatch reads or updates between two batches (plain SGD keeps no other optimizer state).
+// Capturing into the same NetworkState again reuses its buffers, so it's a few memcpys
+struct NetworkState
+{
+	std::vector<int> layerSizes;
+	std::vector<Eigen::MatrixXf> weights;
+	std::vector<Eigen::VectorXf> biases;
+	std::vector<Eigen::MatrixXf> factorU;
+	std::vector<Eigen::MatrixXf> factorV;
+	std::vector<Eigen::MatrixXf> weightMasks;
+	Precision precision = Precision::FP32;
+	bool sparseInference = false;
+	bool sparseTraining = false;
+	int regrowInterval = 100;
+	float regrowFraction = 0.3f;
+	int sparseStep = 0;
+	std::mt19937 roundingGen;
+	std::mt19937 sparseGen;
+};
+
+// Summed (not averaged) gradients of a batch, one entry per layer like the network. Factorized layers keep
+// dC/dU in weights and dC/dV in factors. Data parallel trainers add these up across workers, then ApplyGradients.
+// Pack / Unpack flatten them in the same order as Network::PackParameters
+struct NetworkGradients
+{
+	std::vector<Eigen::MatrixXf> weights;
+	std::vector<Eigen::MatrixXf> factors;
+	std::vector<Eigen::VectorXf> biases;
+	int samples = 0;
+
+	size_t getParameterCount() const;
+	void Pack(float* data) const;
+	void Unpack(const float* data);
+};
 
 class Network
 {
@@ -13,17 +63,80 @@ private:
 
 	// For backpropagation
 	std::vector<Eigen::MatrixXf> m_WeightGradients;
+	std::vector<Eigen::MatrixXf> m_FactorGradients;	// Gradient of V for low rank layers
 	std::vector<Eigen::VectorXf> m_BiasGradients;
 	std::vector<Eigen::VectorXf> m_Deltas;
 
+	// Mixed precision
+	Precision m_Precision = Precision::FP32;
+	std::vector<VectorBF16> m_ActivationsBF16;	// Saved for the backward pass instead of m_Activations / m_PreActivations
+	std::vector<VectorBF16> m_DeltasBF16;		// Instead of m_Deltas
+	Eigen::VectorXf m_ScratchBF16[2];			// The only fp32 vectors of the bf16 pass (current and next layer)
+	std::mt19937 m_RoundingGen;	// Noise for stochastic rounding
+
+	// Magnitude pruning (masks are empty until the network is pruned)
+	std::vector<Eigen::MatrixXf> m_WeightMasks;
+	std::vector<Eigen::SparseMatrix<float, Eigen::RowMajor>> m_SparseWeights; // CSR copy of m_Weights for inference
+	std::vector<char> m_SparseLayers;		// Layers sparse inference runs on the CSR copy
+	bool m_SparseInference = false;
+	bool m_SparseWeightsDirty = true;
+
+	unsigned long long m_Version = 0;	// See getVersion
+	void Touch();						// The weights changed
+
+	void ApplyWeightMasks();
+	void BuildSparseWeights();
+
+	// Forward on the dense or the CSR weights. The training passes stay dense unless m_SparseTraining keeps the CSR
+	// up to date itself, otherwise every update would rebuild it
+	void ForwardPass(const Eigen::VectorXf& input, bool sparse);
+
+	// Dynamic sparse training : m_SparseWeights is the master copy, m_Weights only mirrors its nonzeros
+	bool m_SparseTraining = false;
+	int m_RegrowInterval = 100;		// Batches between prune-and-regrow steps
+	float m_RegrowFraction = 0.3f;	// Fraction of each layer's connections replaced per step
+	int m_SparseStep = 0;
+	std::mt19937 m_SparseGen;
+
+	void TrainBatchSparse(const std::vector<DataSample>& batch, float learningRate);
+	void PruneAndRegrow(int layer, const Eigen::MatrixXf& denseGradient);
+
+	// Low rank layers : W = U * V, a layer is factorized when its U is not empty
+	// m_Weights keeps the product U * V for the dense views. Training only updates the factors and marks the layer
+	// dirty, the product is rebuilt the first time someone reads the dense weights (getWeights, export, sparse copy).
+	// One flag per layer : the task graph and pipeline updates write their own layers' flags from different threads
+	std::vector<Eigen::MatrixXf> m_FactorU;		// rows x rank
+	std::vector<Eigen::MatrixXf> m_FactorV;		// rank x cols
+	std::vector<Eigen::VectorXf> m_Bottlenecks;	// V * a of the last Forward
+	mutable std::vector<char> m_FactorProductsDirty;
+
+	void RefreshFactorProducts() const;
+
+	void ExpandAllLayers();
+
+	Eigen::MatrixXf ForwardColumns(const Eigen::Ref<const Eigen::MatrixXf>& inputs) const;	// ForwardBatch on one thread
+
+	// Layer steps of the batched training paths (task graph, pipeline), one sample per column
+	Eigen::MatrixXf ForwardLayerColumns(int layer, const Eigen::MatrixXf& input, Eigen::MatrixXf& bottleneck) const;
+	Eigen::MatrixXf BackpropDeltaColumns(int layer, const Eigen::MatrixXf& delta, const Eigen::MatrixXf& activation) const;
+	void AccumulateLayerGradientColumns(int layer, const Eigen::MatrixXf& delta, const Eigen::MatrixXf& activation, const Eigen::MatrixXf& bottleneck,
+		Eigen::MatrixXf& weightGradient, Eigen::MatrixXf& factorGradient, Eigen::VectorXf& biasGradient) const;
+
+	// Shared by every training path so dense and low rank layers are handled in one place
+	Eigen::VectorXf BackpropDelta(int layer, const Eigen::VectorXf& delta) const; // W^T * delta
+	void ZeroLayerGradients(int layer, Eigen::MatrixXf& weightGradient, Eigen::MatrixXf& factorGradient) const;
+	void AccumulateLayerGradient(int layer, const Eigen::VectorXf& delta, const Eigen::VectorXf& activation,
+		Eigen::MatrixXf& weightGradient, Eigen::MatrixXf& factorGradient) const;
+	void UpdateLayer(int layer, const Eigen::MatrixXf& weightGradient, const Eigen::MatrixXf& factorGradient,
+		const Eigen::VectorXf& biasGradient, float step);
+
 	Eigen::VectorXf ActivationFunction(const Eigen::VectorXf&);
 	Eigen::VectorXf ActivationFunctionDerivative(const Eigen::VectorXf& x);
 
-	// Returns the loss for a single target and single input
-	// Theoretical loss/cost function : 
-	//		INPUT = output del network su N samples (one batch), BIASES and WEIGHTS of the network
-	//		OUTPUT = (somma di tutti (output - expected)^2) * 1/N  
-	float LossFunction(const Eigen::VectorXf& output, const Eigen::VectorXf& target);
+
+	// TrainBatch / BackPropagation inner loop for Precision::BF16
+	void AccumulateGradientsBF16(const Eigen::VectorXf& input, const Eigen::VectorXf& target,
+		std::vector<Eigen::MatrixXf>& weightGradients, std::vector<Eigen::MatrixXf>& factorGradients, std::vector<Eigen::VectorXf>& biasGradients);
 
 public:
 	Network(const std::vector<int>& sizes);
@@ -32,32 +145,99 @@ public:
 	// Advance the input in the simulation
 	Eigen::VectorXf Forward(const Eigen::VectorXf& input);
 
+	// Returns the loss for a single target and single input
+	// Theoretical loss/cost function : 
+	//		INPUT = output del network su N samples (one batch), BIASES and WEIGHTS of the network
+	//		OUTPUT = (somma di tutti (output - expected)^2) * 1/N  
+	static float LossFunction(const Eigen::VectorXf& output, const Eigen::VectorXf& target);
+
+	// Inference only, one sample per column. Doesn't touch the training buffers, so several threads can share a network.
+	// Batches over 128 columns are split across ThreadPool::Global()
+	Eigen::MatrixXf ForwardBatch(const Eigen::MatrixXf& inputs) const;
+
 	void BackPropagation(const Eigen::VectorXf& input, const Eigen::VectorXf& target, float learningRate);
 
 	// Setters
+	// Same shape as the layer (and its pruning mask)
 	void setWeights(int layerIndex, const Eigen::MatrixXf& newWeights)
 	{
-		if (layerIndex >= 0 && layerIndex <= m_Weights.size())
-			m_Weights[layerIndex] = newWeights;
+		if (layerIndex < 0 || layerIndex >= static_cast<int>(m_Weights.size()))
+			return;
+		assert(newWeights.rows() == m_LayerSizes[layerIndex + 1] && newWeights.cols() == m_LayerSizes[layerIndex]);
 
+		ExpandLayer(layerIndex);
+		m_Weights[layerIndex] = newWeights;
+		m_SparseWeightsDirty = true;
+		Touch();
 	}
 	void setBiases(int layerIndex, const Eigen::VectorXf& newBiases)
 	{
-		if (layerIndex >= 0 && layerIndex <= m_Biases.size())
-			m_Biases[layerIndex] = newBiases;
+		if (layerIndex < 0 || layerIndex >= static_cast<int>(m_Biases.size()))
+			return;
+		assert(newBiases.size() == m_LayerSizes[layerIndex + 1]);
 
+		m_Biases[layerIndex] = newBiases;
+		Touch();
 	}
 
+	void setPrecision(Precision precision);	// BF16 releases the fp32 activations and deltas
+
+	// Zero the smallest magnitude weights of every layer until each layer reaches the target sparsity (0..1)
+	// The zeros are kept as a mask, so further training fine-tunes only the surviving weights
+	void PruneByMagnitude(float sparsity);
+	void ClearPruning() { m_WeightMasks.clear(); m_SparseTraining = false; }
+
+	// Sparse-from-the-start training : every layer keeps a fixed budget of (1 - sparsity) * size connections.
+	// Every regrowInterval batches the weakest connections are dropped and the same number is regrown
+	// where the dense gradient is largest. Forward and backward run as sparse kernels (fp32 only)
+	void EnableSparseTraining(float sparsity, int regrowInterval, float regrowFraction = 0.3f);
+	void DisableSparseTraining() { m_SparseTraining = false; }
+
+	// Structured pruning : physically delete hidden neurons of a layer (rows of the incoming weights,
+	// bias entries and columns of the outgoing weights). Input and output layers can't be shrunk
+	void RemoveNeurons(int layerIndex, std::vector<int> neurons);
+
+	// Replace a layer with its truncated SVD W ~= U * V (U = rows x rank, V = rank x cols).
+	// Forward and training then work on the two thin matrices : rank * (rows + cols) instead of rows * cols
+	// Low rank layers are dense only, factorizing drops pruning masks and sparse training
+	void FactorizeLayer(int layerIndex, int rank);
+	void ExpandLayer(int layerIndex) { RefreshFactorProducts(); m_FactorU[layerIndex].resize(0, 0); m_FactorV[layerIndex].resize(0, 0); Touch(); }
+
+	// Snapshot of the trainable state, restoring it reproduces the following TrainBatch calls bit for bit
+	void CaptureState(NetworkState& state) const;
+	void RestoreState(const NetworkState& state);
+
+	// Run Forward with sparse matrix-vector products on the layers sparse enough for them to win (see
+	// BuildSparseWeights), the others keep the dense product
+	void setSparseInference(bool enabled) { m_SparseInference = enabled; m_SparseWeightsDirty = true; }
+
 	// Getters
+	Precision getPrecision() const { return m_Precision; }
+	// Identifies the current weights : any change gets a new number (unique in the process), copies keep it.
+	// Caches of predictions key on it to notice retraining
+	unsigned long long getVersion() const { return m_Version; }
 	int getLayerCount() const { return m_LayerSizes.size(); }
 	int getLayerSize(int layerIndex) const { return m_LayerSizes[layerIndex]; }
-	const Eigen::MatrixXf& getWeights(int layerIndex) const { return m_Weights[layerIndex]; }
+	// Rebuilds U * V of low rank layers trained since the last call : don't call it from several threads on such a network
+	const Eigen::MatrixXf& getWeights(int layerIndex) const { RefreshFactorProducts(); return m_Weights[layerIndex]; }
 	const Eigen::VectorXf& getBiases(int layerIndex) const { return m_Biases[layerIndex]; }
+	bool isPruned() const { return !m_WeightMasks.empty(); }
+	bool getSparseInference() const { return m_SparseInference; }
+	bool isSparseTraining() const { return m_SparseTraining; }
+	float getSparsity(int layerIndex) const;
+	bool isFactorized(int layerIndex) const { return m_FactorU[layerIndex].size() > 0; }
+	int getLayerRank(int layerIndex) const { return isFactorized(layerIndex) ? static_cast<int>(m_FactorU[layerIndex].cols()) : 0; }
+	const Eigen::MatrixXf& getFactorU(int layerIndex) const { return m_FactorU[layerIndex]; }
+	const Eigen::MatrixXf& getFactorV(int layerIndex) const { return m_FactorV[layerIndex]; }
+
+	// Export of a layer as an Eigen sparse matrix
+	const Eigen::SparseMatrix<float, Eigen::RowMajor>& getSparseWeights(int layerIndex);
 
-	// Get activation levels output
+	// Get activation levels output (of the last Forward). In BF16 mode the training passes don't keep fp32
+	// activations, so it's empty until the next Forward
 	Eigen::VectorXf getLayerOutput(int layerIndex) const
 	{
-		if (layerIndex >= 0 && layerIndex < m_Activations.size()) {
+		if (layerIndex >= 0 && layerIndex < static_cast<int>(m_Activations.size())) {
 			return m_Activations[layerIndex];
 		}
 		return Eigen::VectorXf();
@@ -66,6 +246,39 @@ public:
 	// Same as backProp but with a batch of input data to approximate Cost()
 	void TrainBatch(const std::vector<DataSample>& batch, float learningRate);
 
+	// TrainBatch in two halves, for training across processes : the summed gradients of [begin, end) of the batch
+	// (weights untouched), then weights -= step * gradients. Not for sparse training (the mask changes every step)
+	void ComputeGradients(const std::vector<DataSample>& batch, NetworkGradients& gradients, size_t begin = 0, size_t end = SIZE_MAX);
+	void ApplyGradients(const NetworkGradients& gradients, float step);
+
+	// TrainBatch on each batch in turn, as one task graph on ThreadPool::Global(). Per batch : the forward of every
+	// layer (whole batch as a matrix), the delta chain down the layers, and for every layer a gradient GEMM + update
+	// task that only waits for the deltas it needs, so the upper layers update while the lower deltas are computed.
+	// The next batch's forward of a layer starts once that layer's update has landed. Needs fp32 and no sparse
+	// training, otherwise it falls back to TrainBatch (and returns empty stats)
+	TaskGraphStats TrainBatchesOverlapped(const std::vector<std::vector<DataSample>>& batches, float learningRate);
+
+	// TrainBatch on each batch in turn, pipeline parallel : the layers are split into options.stages contiguous
+	// stages balanced by parameter count, one thread per stage (pinned to its own core), and every batch into
+	// options.microBatches micro-batches. Activations go up and deltas come down through lock-free queues between
+	// neighbouring stages, in the order of options.schedule. Gradients add up over the micro-batches and each stage
+	// updates its layers once the batch is through, so it's TrainBatch up to the summation order. Eigen runs single
+	// threaded meanwhile, the caller's Eigen::nbThreads() is restored on return. Same fallback as above
+	PipelineStats TrainBatchesPipelined(const std::vector<std::vector<DataSample>>& batches, float learningRate,
+		const PipelineOptions& options);
+
+	// TrainBatch on each batch in turn, tensor parallel : the layers with at least options.minRows neurons are split
+	// by rows across options.partitions threads (the caller included), see TensorParallel.h. Per layer every thread
+	// computes its rows of the batch's activations, then after the backward each one sums its rows of the other
+	// threads' partial deltas. Same result as TrainBatch up to the summation order, same fallback as above
+	TensorParallelStats TrainBatchesTensorParallel(const std::vector<std::vector<DataSample>>& batches, float learningRate,
+		const TensorParallelOptions& options);
+
+	// Trainable parameters as one flat array, layer by layer : weights (U then V when factorized), then biases
+	size_t getParameterCount() const;
+	void PackParameters(float* data) const;
+	void UnpackParameters(const float* data);
+
 	float CalculateAccuracy(const std::vector<DataSample>& testBatch);
 	float CalculateAverageLoss(const std::vector<DataSample>& testBatch);
 };
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include "NeuronPruner.h"
+#include <chrono>
+
+// Mean and variance of every hidden activation over the first maxSamples samples
+static void HiddenActivationStats(Network& network, const Dataset& dataset, int maxSamples,
+	std::vector<Eigen::VectorXf>& mean, std::vector<Eigen::VectorXf>& variance)
+{
+	int hiddenLayers = network.getLayerCount() - 2;
+	mean.assign(hiddenLayers, Eigen::VectorXf());
+	variance.assign(hiddenLayers, Eigen::VectorXf());
+	for (int h = 0; h < hiddenLayers; h++)
+	{
+		mean[h] = Eigen::VectorXf::Zero(network.getLayerSize(h + 1));
+		variance[h] = Eigen::VectorXf::Zero(network.getLayerSize(h + 1));
+	}
+
+	size_t count = std::min(dataset.size(), static_cast<size_t>(maxSamples));
+	if (count == 0)
+		return;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		network.Forward(dataset.getSample(i).input);
+		for (int h = 0; h < hiddenLayers; h++)
+		{
+			Eigen::VectorXf a = network.getLayerOutput(h + 1);
+			mean[h] += a;
+			variance[h] += a.cwiseProduct(a);
+		}
+	}
+
+	for (int h = 0; h < hiddenLayers; h++)
+	{
+		mean[h] /= static_cast<float>(count);
+		variance[h] = (variance[h] / static_cast<float>(count) - mean[h].cwiseProduct(mean[h])).cwiseMax(0.0f);
+	}
+}
+
+static float EvaluateLatencyUs(Network& network, const std::vector<DataSample>& samples)
+{
+	if (samples.empty())
+		return 0.0f;
+
+	auto start = std::chrono::steady_clock::now();
+	for (const auto& sample : samples)
+		network.Forward(sample.input);
+	auto end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<float, std::micro>(end - start).count() / static_cast<float>(samples.size());
+}
+
+static std::vector<Eigen::VectorXf> ScoreFromStats(const Network& network, NeuronRanking ranking,
+	const std::vector<Eigen::VectorXf>& variance)
+{
+	int hiddenLayers = network.getLayerCount() - 2;
+	std::vector<Eigen::VectorXf> scores(hiddenLayers);
+
+	for (int h = 0; h < hiddenLayers; h++)
+	{
+		// Outgoing weights of hidden layer h+1 are the columns of m_Weights[h+1]
+		Eigen::VectorXf outgoing = network.getWeights(h + 1).colwise().norm().transpose();
+
+		if (ranking == NeuronRanking::WeightNorm)
+			scores[h] = network.getWeights(h).rowwise().norm().cwiseProduct(outgoing);
+		else
+			scores[h] = variance[h].cwiseSqrt().cwiseProduct(outgoing);
+	}
+
+	return scores;
+}
+
+std::vector<Eigen::VectorXf> ScoreHiddenNeurons(Network& network, const Dataset& dataset, NeuronRanking ranking, int maxSamples)
+{
+	std::vector<Eigen::VectorXf> mean, variance;
+	if (ranking == NeuronRanking::ActivationVariance)
+		HiddenActivationStats(network, dataset, maxSamples, mean, variance);
+
+	return ScoreFromStats(network, ranking, variance);
+}
+
+void PruneNeurons(Network& network, const Dataset& dataset, float fraction, NeuronRanking ranking, int maxSamples)
+{
+	fraction = std::min(std::max(fraction, 0.0f), 1.0f);
+
+	// Front to back, with fresh stats after every pruned layer : the removed neurons (and the means folded into the
+	// biases) change what the following layers output and the incoming weights they're scored on
+	std::vector<Eigen::VectorXf> mean, variance, scores;
+	bool stale = true;
+	int hiddenLayers = network.getLayerCount() - 2;
+	for (int h = 0; h < hiddenLayers; h++)
+	{
+		if (stale)
+		{
+			HiddenActivationStats(network, dataset, maxSamples, mean, variance);
+			scores = ScoreFromStats(network, ranking, variance);
+			stale = false;
+		}
+
+		int layer = h + 1;
+		int size = network.getLayerSize(layer);
+		int toRemove = std::min(static_cast<int>(fraction * size), size - 1); // Keep at least one neuron
+		if (toRemove <= 0)
+			continue;
+
+		std::vector<int> order(size);
+		std::iota(order.begin(), order.end(), 0);
+		std::partial_sort(order.begin(), order.begin() + toRemove, order.end(),
+			[&](int a, int b) { return scores[h][a] < scores[h][b]; });
+		std::vector<int> removed(order.begin(), order.begin() + toRemove);
+
+		// Next layer sees the removed neurons as constants equal to their mean output
+		Eigen::VectorXf compensation = Eigen::VectorXf::Zero(network.getLayerSize(layer + 1));
+		for (int n : removed)
+			compensation += network.getWeights(layer).col(n) * mean[h][n];
+		network.setBiases(layer, network.getBiases(layer) + compensation);
+
+		network.RemoveNeurons(layer, removed);
+		stale = true;
+	}
+}
+
+std::vector<NeuronPruningReport> NeuronPruningSweep(const Network& network, const Dataset& dataset,
+	const std::vector<float>& fractions, NeuronRanking ranking, int maxSamples)
+{
+	std::vector<DataSample> samples;
+	size_t count = std::min(dataset.size(), static_cast<size_t>(maxSamples));
+	samples.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		samples.push_back(dataset.getSample(i));
+
+	std::vector<NeuronPruningReport> reports;
+	for (float fraction : fractions)
+	{
+		Network pruned = network;
+		if (fraction > 0.0f)
+			PruneNeurons(pruned, dataset, fraction, ranking, maxSamples);
+
+		NeuronPruningReport report;
+		report.fraction = fraction;
+		report.parameters = 0;
+		for (int i = 0; i < pruned.getLayerCount(); i++)
+		{
+			report.layerSizes.push_back(pruned.getLayerSize(i));
+			if (i > 0)
+				report.parameters += pruned.getLayerSize(i - 1) * pruned.getLayerSize(i) + pruned.getLayerSize(i);
+		}
+
+		EvaluateLatencyUs(pruned, samples); // Warm up
+		report.latencyUs = EvaluateLatencyUs(pruned, samples);
+		report.accuracy = pruned.CalculateAccuracy(samples);
+		reports.push_back(report);
+	}
+
+	return reports;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "Network.h"
+
+// Structured pruning : removes whole hidden neurons so the result is a smaller dense Network
+enum class NeuronRanking
+{
+	WeightNorm,			// ||incoming weights|| * ||outgoing weights||
+	ActivationVariance	// Spread of the neuron output over the dataset * ||outgoing weights||
+};
+
+struct NeuronPruningReport
+{
+	float fraction;				// Fraction of every hidden layer removed
+	std::vector<int> layerSizes;
+	int parameters;
+	float accuracy;
+	float latencyUs;			// Average Forward time per sample
+};
+
+// One score per hidden neuron (index 0 = first hidden layer), lower = less useful
+std::vector<Eigen::VectorXf> ScoreHiddenNeurons(Network& network, const Dataset& dataset, NeuronRanking ranking, int maxSamples = 1000);
+
+// Removes the lowest scoring fraction of every hidden layer. The mean output of a removed neuron is
+// folded into the next layer's biases, so near-constant neurons disappear almost for free
+void PruneNeurons(Network& network, const Dataset& dataset, float fraction, NeuronRanking ranking, int maxSamples = 1000);
+
+// Accuracy versus latency for several pruning fractions (fraction 0 = the unpruned network)
+std::vector<NeuronPruningReport> NeuronPruningSweep(const Network& network, const Dataset& dataset,
+	const std::vector<float>& fractions, NeuronRanking ranking, int maxSamples = 1000);
@@ -0,0 +1,249 @@
+#include "Numa.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	// "0-3,8-11" -> 0 1 2 3 8 9 10 11
+	std::vector<int> ParseCpuList(const std::string& text)
+	{
+		std::vector<int> cores;
+		std::stringstream stream(text);
+		std::string range;
+		while (std::getline(stream, range, ','))
+		{
+			if (range.empty() || range[0] < '0' || range[0] > '9')
+				continue;
+			size_t dash = range.find('-');
+			int first = std::atoi(range.c_str());
+			int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+			for (int core = first; core <= last; core++)
+				cores.push_back(core);
+		}
+		return cores;
+	}
+}
+
+NumaTopology::NumaTopology()
+{
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+	std::ifstream online("/sys/devices/system/node/online");
+	std::string nodes;
+	if (online && std::getline(online, nodes))
+	{
+		for (int nodeId : ParseCpuList(nodes))
+		{
+			std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(nodeId) + "/cpulist");
+			std::string list;
+			if (!cpulist || !std::getline(cpulist, list))
+				continue;
+			std::vector<int> cores;
+			for (int core : ParseCpuList(list))
+				if (!haveMask || (core < CPU_SETSIZE && CPU_ISSET(core, &allowed)))
+					cores.push_back(core);
+			if (cores.empty())
+				continue;
+			m_NodeCores.push_back(cores);
+			m_NodeIds.push_back(nodeId);
+		}
+	}
+#endif
+
+	// No sysfs : one node with every core
+	if (m_NodeCores.empty())
+	{
+		std::vector<int> cores(std::max(1u, std::thread::hardware_concurrency()));
+		for (size_t core = 0; core < cores.size(); core++)
+			cores[core] = static_cast<int>(core);
+		m_NodeCores.push_back(cores);
+		m_NodeIds.push_back(0);
+	}
+	for (const std::vector<int>& cores : m_NodeCores)
+		m_CoreOrder.insert(m_CoreOrder.end(), cores.begin(), cores.end());
+}
+
+const NumaTopology& NumaTopology::Get()
+{
+	static NumaTopology topology;
+	return topology;
+}
+
+int NumaTopology::getNodeOfCore(int core) const
+{
+	for (size_t node = 0; node < m_NodeCores.size(); node++)
+		if (std::find(m_NodeCores[node].begin(), m_NodeCores[node].end(), core) != m_NodeCores[node].end())
+			return static_cast<int>(node);
+	return -1;
+}
+
+int NumaTopology::getNodeOfId(int nodeId) const
+{
+	auto found = std::find(m_NodeIds.begin(), m_NodeIds.end(), nodeId);
+	return found == m_NodeIds.end() ? -1 : static_cast<int>(found - m_NodeIds.begin());
+}
+
+bool PinThreadToCore(int core)
+{
+#ifdef __linux__
+	if (core < 0 || core >= CPU_SETSIZE)
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)core;
+	return false;
+#endif
+}
+
+bool PinThreadToNode(int node)
+{
+#ifdef __linux__
+	const NumaTopology& topology = NumaTopology::Get();
+	if (node < 0 || node >= topology.getNodeCount())
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int core : topology.getNodeCores(node))
+		if (core < CPU_SETSIZE)
+			CPU_SET(core, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)node;
+	return false;
+#endif
+}
+
+ScopedThreadAffinity::ScopedThreadAffinity()
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+	{
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&set);
+		m_Mask.assign(bytes, bytes + sizeof(set));
+	}
+#endif
+}
+
+ScopedThreadAffinity::~ScopedThreadAffinity()
+{
+#ifdef __linux__
+	if (m_Mask.size() != sizeof(cpu_set_t))
+		return;
+	cpu_set_t set;
+	std::memcpy(&set, m_Mask.data(), sizeof(set));
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+int GetCurrentNode()
+{
+#ifdef __linux__
+	int core = sched_getcpu();
+	return core < 0 ? -1 : NumaTopology::Get().getNodeOfCore(core);
+#else
+	return -1;
+#endif
+}
+
+void PageQuery::Add(const void* data, size_t bytes)
+{
+	if (data == nullptr || bytes == 0)
+		return;
+#ifdef __linux__
+	static const uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+#else
+	static const uintptr_t pageSize = 4096;
+#endif
+	uintptr_t first = reinterpret_cast<uintptr_t>(data) & ~(pageSize - 1);
+	uintptr_t end = reinterpret_cast<uintptr_t>(data) + bytes;
+	for (uintptr_t page = first; page < end; page += pageSize)
+	{
+		// Small buffers next to each other often share a page
+		if (!m_Pages.empty() && m_Pages.back() == reinterpret_cast<void*>(page))
+			continue;
+		m_Pages.push_back(reinterpret_cast<void*>(page));
+	}
+}
+
+PagePlacement PageQuery::Count(int node) const
+{
+	PagePlacement placement;
+#if defined(__linux__) && defined(SYS_move_pages)
+	const NumaTopology& topology = NumaTopology::Get();
+	std::vector<int> status(m_Pages.size(), -1);
+	if (m_Pages.empty() || syscall(SYS_move_pages, 0, static_cast<unsigned long>(m_Pages.size()),
+		const_cast<void**>(m_Pages.data()), nullptr, status.data(), 0) != 0)
+		return placement;
+	for (int pageNode : status)
+	{
+		if (pageNode < 0)
+			continue;	// Not faulted in, or not a normal page
+		placement.pages++;
+		if (topology.getNodeOfId(pageNode) != node)
+			placement.remotePages++;
+	}
+#else
+	(void)node;
+#endif
+	return placement;
+}
+
+RemoteLoadCounter::~RemoteLoadCounter()
+{
+	Close();
+}
+
+bool RemoteLoadCounter::Open()
+{
+	Close();
+#if defined(__linux__) && defined(SYS_perf_event_open)
+	perf_event_attr attr = {};
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_NODE | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	m_Fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+	return m_Fd >= 0;
+}
+
+long long RemoteLoadCounter::Read() const
+{
+#ifdef __linux__
+	long long value = 0;
+	if (m_Fd >= 0 && read(m_Fd, &value, sizeof(value)) == static_cast<ssize_t>(sizeof(value)))
+		return value;
+#endif
+	return -1;
+}
+
+void RemoteLoadCounter::Close()
+{
+#ifdef __linux__
+	if (m_Fd >= 0)
+		close(m_Fd);
+#endif
+	m_Fd = -1;
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+// Where the cores and the memory are. On Linux the nodes come from /sys/devices/system/node (no libnuma), limited
+// to the cores the process may run on; elsewhere, or without sysfs, everything is one node.
+// Memory is placed by first touch : a page lands on the node of the thread that writes it first, so buffers a
+// pinned thread allocates and fills itself are local to it
+class NumaTopology
+{
+private:
+	std::vector<std::vector<int>> m_NodeCores;	// Usable cores of every node (nodes without any are dropped)
+	std::vector<int> m_NodeIds;					// Kernel id of every node, for the page queries
+	std::vector<int> m_CoreOrder;				// Node 0's cores, then node 1's...
+
+	NumaTopology();
+
+public:
+	static const NumaTopology& Get();
+
+	int getNodeCount() const { return static_cast<int>(m_NodeCores.size()); }
+	int getCoreCount() const { return static_cast<int>(m_CoreOrder.size()); }
+	const std::vector<int>& getNodeCores(int node) const { return m_NodeCores[node]; }
+	int getNodeId(int node) const { return m_NodeIds[node]; }
+	int getNodeOfCore(int core) const;			// -1 = unknown core
+	int getNodeOfId(int nodeId) const;			// Kernel id -> index, -1 = unknown
+
+	// Core for the index-th thread of a group : fills a node before using the next one, so threads that share
+	// data share a socket, and wraps around when there are more threads than cores
+	int getCoreForThread(int index) const { return m_CoreOrder[index % m_CoreOrder.size()]; }
+};
+
+// Best effort : false where the platform doesn't support it (or the core doesn't exist)
+bool PinThreadToCore(int core);
+bool PinThreadToNode(int node);		// Any core of the node
+
+// Saves the calling thread's CPU affinity and puts it back when it goes out of scope, for code that pins the
+// caller's thread (it belongs to someone else) for a while
+class ScopedThreadAffinity
+{
+private:
+	std::vector<unsigned char> m_Mask;	// cpu_set_t, empty = nothing saved
+
+public:
+	ScopedThreadAffinity();
+	~ScopedThreadAffinity();
+
+	ScopedThreadAffinity(const ScopedThreadAffinity&) = delete;
+	ScopedThreadAffinity& operator=(const ScopedThreadAffinity&) = delete;
+};
+
+// Node of the core the calling thread runs on right now, -1 = unknown
+int GetCurrentNode();
+
+// Pages under a set of buffers and how many of them sit on another node than node (Linux move_pages in query
+// mode, it doesn't move anything). Pages not faulted in yet or unknown are left out, both stay 0 elsewhere
+struct PagePlacement
+{
+	long long pages = 0;
+	long long remotePages = 0;
+
+	void Add(const PagePlacement& other) { pages += other.pages; remotePages += other.remotePages; }
+	double getRemoteFraction() const { return pages > 0 ? static_cast<double>(remotePages) / pages : 0.0; }
+};
+
+class PageQuery
+{
+private:
+	std::vector<void*> m_Pages;
+
+public:
+	void Add(const void* data, size_t bytes);
+	PagePlacement Count(int node) const;
+	void Clear() { m_Pages.clear(); }
+};
+
+// Loads served by another node's memory, for the thread that opens it (the node-load-misses hardware cache event
+// through perf_event_open). Unavailable without the event (most VMs) or with perf_event_paranoid > 2 : Read = -1
+class RemoteLoadCounter
+{
+private:
+	int m_Fd = -1;
+
+public:
+	RemoteLoadCounter() = default;
+	~RemoteLoadCounter();
+
+	RemoteLoadCounter(const RemoteLoadCounter&) = delete;
+	RemoteLoadCounter& operator=(const RemoteLoadCounter&) = delete;
+
+	bool Open();				// Counts the calling thread from now on
+	long long Read() const;		// Can be called from any thread
+	void Close();
+};
@@ -0,0 +1,374 @@
+#include "ParallelTraining.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+
+namespace
+{
+	// Every thread's share as one pool task. With one share per pool thread, share t always runs on slot t, so
+	// what a share allocates stays on its thread's node from one call to the next
+	bool SharesOnOwnThreads(int threads)
+	{
+		return threads == ThreadPool::Global().getThreadCount();
+	}
+
+	template<typename Work>
+	void RunThreads(int threads, Work&& work)
+	{
+		if (SharesOnOwnThreads(threads))
+		{
+			ThreadPool::Global().RunOnEach([&](int slot) { work(slot); });
+			return;
+		}
+		ThreadPool::Global().ParallelFor(0, threads, 1, [&](size_t first, size_t last)
+			{
+				for (size_t t = first; t < last; t++)
+					work(static_cast<int>(t));
+			});
+	}
+
+	// Samples read by a share, for the remote page count
+	void AddSamples(PageQuery& query, const Dataset& dataset, size_t first, size_t last)
+	{
+		for (size_t i = first; i < last; i++)
+		{
+			const DataSample& sample = dataset.getSample(i);
+			query.Add(sample.input.data(), sample.input.size() * sizeof(float));
+			query.Add(sample.target.data(), sample.target.size() * sizeof(float));
+		}
+	}
+
+	inline void AtomicAdd(std::atomic<float>& value, float delta)
+	{
+		// Not a compare-exchange loop on purpose : a racing update can be lost, that's the Hogwild deal
+		value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+	}
+
+	bool SupportsHogwild(const Network& network)
+	{
+		if (network.getPrecision() != Precision::FP32 || network.isPruned() || network.isSparseTraining())
+			return false;
+		for (int layer = 0; layer < network.getLayerCount() - 1; layer++)
+			if (network.isFactorized(layer))
+				return false;
+		return true;
+	}
+}
+
+bool TrainEpochHogwild(Network& network, const Dataset& dataset, int threads, float learningRate, int batchSize,
+	ParallelTrainingStats& stats, int replicaSyncInterval)
+{
+	if (!SupportsHogwild(network))
+	{
+		std::cerr << "Error: Hogwild needs a dense fp32 network (no low rank layers, pruning or sparse training)" << std::endl;
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	threads = std::max(threads, 1);
+	batchSize = std::max(batchSize, 1);
+	const int layers = network.getLayerCount() - 1;
+
+	// Same layout as PackParameters for dense layers : every layer's weights (column major), then the biases
+	size_t count = network.getParameterCount();
+	std::vector<float> packed(count);
+	network.PackParameters(packed.data());
+
+	// One copy of the weights per NUMA node the threads run on (only when the shares stay on their threads),
+	// allocated by the first thread of the node
+	std::vector<int> replicaOf(threads, 0);
+	std::vector<int> owner(1, 0);
+	if (replicaSyncInterval > 0 && SharesOnOwnThreads(threads))
+	{
+		std::vector<int> nodes(threads, 0);
+		ThreadPool::Global().RunOnEach([&](int t) { nodes[t] = std::max(GetCurrentNode(), 0); });
+		std::vector<int> seen;
+		owner.clear();
+		for (int t = 0; t < threads; t++)
+		{
+			auto found = std::find(seen.begin(), seen.end(), nodes[t]);
+			replicaOf[t] = static_cast<int>(found - seen.begin());
+			if (found == seen.end())
+			{
+				seen.push_back(nodes[t]);
+				owner.push_back(t);
+			}
+		}
+	}
+	const int replicas = static_cast<int>(owner.size());
+	std::vector<std::unique_ptr<std::atomic<float>[]>> shared(replicas);
+	auto allocate = [&](int replica)
+	{
+		shared[replica].reset(new std::atomic<float>[count]);
+		for (size_t i = 0; i < count; i++)
+			shared[replica][i].store(packed[i], std::memory_order_relaxed);
+	};
+	if (replicas == 1)
+		allocate(0);
+	else
+		RunThreads(threads, [&](int t)
+			{
+				if (owner[replicaOf[t]] == t)
+					allocate(replicaOf[t]);
+			});
+
+	std::vector<size_t> weightOffsets(layers), biasOffsets(layers);
+	size_t offset = 0;
+	for (int layer = 0; layer < layers; layer++)
+	{
+		weightOffsets[layer] = offset;
+		offset += static_cast<size_t>(network.getLayerSize(layer + 1)) * network.getLayerSize(layer);
+	}
+	for (int layer = 0; layer < layers; layer++)
+	{
+		biasOffsets[layer] = offset;
+		offset += network.getLayerSize(layer + 1);
+	}
+
+	// Buffers of a thread, allocated on its first call so they're on its node
+	struct ThreadState
+	{
+		std::vector<Eigen::VectorXf> activations, deltas;
+		std::vector<Eigen::MatrixXf> weightGradients;
+		std::vector<Eigen::VectorXf> biasGradients;
+		std::vector<std::vector<int>> columns;		// Columns with a gradient in this batch
+		std::vector<std::vector<char>> touched;
+		std::vector<float> weights;					// Relaxed copy of the shared weights, taken before every batch
+		size_t next = 0;							// Next sample of the share
+	};
+	std::vector<std::unique_ptr<ThreadState>> states(threads);
+	std::vector<long long> updates(threads, 0);
+	std::vector<PagePlacement> placements(threads);
+	const size_t batchesPerRound = replicas > 1 ? static_cast<size_t>(replicaSyncInterval) : SIZE_MAX;
+
+	auto work = [&](int t)
+	{
+		size_t begin = dataset.size() * t / threads;
+		size_t end = dataset.size() * (t + 1) / threads;
+		if (!states[t])
+		{
+			states[t].reset(new ThreadState());
+			ThreadState& created = *states[t];
+			created.activations.resize(layers + 1);
+			created.deltas.resize(layers + 1);
+			created.weightGradients.resize(layers);
+			created.biasGradients.resize(layers);
+			created.columns.resize(layers);
+			created.touched.resize(layers);
+			for (int layer = 0; layer < layers; layer++)
+			{
+				created.weightGradients[layer] = Eigen::MatrixXf::Zero(network.getLayerSize(layer + 1), network.getLayerSize(layer));
+				created.biasGradients[layer] = Eigen::VectorXf::Zero(network.getLayerSize(layer + 1));
+				created.touched[layer].assign(network.getLayerSize(layer), 0);
+			}
+			created.weights.resize(count);
+			created.next = begin;
+		}
+		ThreadState& state = *states[t];
+		std::vector<Eigen::VectorXf>& activations = state.activations;
+		std::vector<Eigen::VectorXf>& deltas = state.deltas;
+		std::vector<Eigen::MatrixXf>& weightGradients = state.weightGradients;
+		std::vector<Eigen::VectorXf>& biasGradients = state.biasGradients;
+		std::atomic<float>* replica = shared[replicaOf[t]].get();
+		const float* weights = state.weights.data();
+
+		for (size_t batch = 0; batch < batchesPerRound && state.next < end; batch++)
+		{
+			size_t first = state.next;
+			size_t last = std::min(end, first + batchSize);
+			state.next = last;
+
+			// Eigen only reads plain floats : the batch runs on a snapshot, at most one batch behind the other threads
+			for (size_t i = 0; i < count; i++)
+				state.weights[i] = replica[i].load(std::memory_order_relaxed);
+
+			for (size_t s = first; s < last; s++)
+			{
+				const DataSample& sample = dataset.getSample(s);
+
+				// Same forward and backward as Network::ComputeGradients
+				activations[0] = sample.input;
+				for (int layer = 0; layer < layers; layer++)
+				{
+					Eigen::Map<const Eigen::MatrixXf> W(weights + weightOffsets[layer], network.getLayerSize(layer + 1), network.getLayerSize(layer));
+					Eigen::Map<const Eigen::VectorXf> b(weights + biasOffsets[layer], network.getLayerSize(layer + 1));
+					activations[layer + 1] = 1.0f / (1.0f + (-(W * activations[layer] + b)).array().exp());
+				}
+				deltas[layers] = (activations[layers] - sample.target).array()
+					* activations[layers].array() * (1.0f - activations[layers].array());
+				for (int layer = layers - 1; layer >= 1; layer--)
+				{
+					Eigen::Map<const Eigen::MatrixXf> W(weights + weightOffsets[layer], network.getLayerSize(layer + 1), network.getLayerSize(layer));
+					deltas[layer] = (W.transpose() * deltas[layer + 1]).array()
+						* activations[layer].array() * (1.0f - activations[layer].array());
+				}
+
+				// Only the columns of nonzero inputs get a gradient
+				for (int layer = 0; layer < layers; layer++)
+				{
+					const Eigen::VectorXf& input = activations[layer];
+					for (int j = 0; j < input.size(); j++)
+					{
+						if (input[j] == 0.0f)
+							continue;
+						if (!state.touched[layer][j])
+						{
+							state.touched[layer][j] = 1;
+							state.columns[layer].push_back(j);
+						}
+						weightGradients[layer].col(j) += deltas[layer + 1] * input[j];
+					}
+					biasGradients[layer] += deltas[layer + 1];
+				}
+			}
+
+			// Write the update into the shared weights, column by column, and clear what was used
+			float step = -learningRate / static_cast<float>(last - first);
+			for (int layer = 0; layer < layers; layer++)
+			{
+				int rows = network.getLayerSize(layer + 1);
+				for (int j : state.columns[layer])
+				{
+					std::atomic<float>* column = replica + weightOffsets[layer] + static_cast<size_t>(j) * rows;
+					float* gradient = weightGradients[layer].col(j).data();
+					for (int i = 0; i < rows; i++)
+						AtomicAdd(column[i], step * gradient[i]);
+					weightGradients[layer].col(j).setZero();
+					state.touched[layer][j] = 0;
+				}
+				state.columns[layer].clear();
+
+				std::atomic<float>* bias = replica + biasOffsets[layer];
+				for (int i = 0; i < rows; i++)
+					AtomicAdd(bias[i], step * biasGradients[layer][i]);
+				biasGradients[layer].setZero();
+			}
+			updates[t]++;
+		}
+
+		// Share done : how much of what it read lives on another node
+		if (state.next >= end && placements[t].pages == 0)
+		{
+			PageQuery query;
+			AddSamples(query, dataset, begin, end);
+			query.Add(replica, count * sizeof(std::atomic<float>));
+			query.Add(weights, count * sizeof(float));
+			for (int layer = 0; layer < layers; layer++)
+				query.Add(weightGradients[layer].data(), weightGradients[layer].size() * sizeof(float));
+			placements[t] = query.Count(GetCurrentNode());
+		}
+	};
+
+	// Replicas : the threads train on their node's copy for a round, then the copies are averaged
+	while (true)
+	{
+		RunThreads(threads, work);
+		bool done = true;
+		for (int t = 0; t < threads; t++)
+			done = done && states[t]->next >= dataset.size() * (t + 1) / threads;
+		if (replicas > 1)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				float sum = 0.0f;
+				for (int r = 0; r < replicas; r++)
+					sum += shared[r][i].load(std::memory_order_relaxed);
+				for (int r = 0; r < replicas; r++)
+					shared[r][i].store(sum / replicas, std::memory_order_relaxed);
+			}
+		}
+		if (done)
+			break;
+	}
+
+	for (size_t i = 0; i < count; i++)
+		packed[i] = shared[0][i].load(std::memory_order_relaxed);
+	network.UnpackParameters(packed.data());
+
+	stats.threads = threads;
+	stats.replicas = replicas;
+	stats.samples += static_cast<long long>(dataset.size());
+	for (long long threadUpdates : updates)
+		stats.updates += threadUpdates;
+	for (const PagePlacement& placement : placements)
+		stats.pages.Add(placement);
+	stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return true;
+}
+
+bool TrainEpochSynchronous(Network& network, const Dataset& dataset, int threads, float learningRate, int batchSize,
+	ParallelTrainingStats& stats)
+{
+	if (network.isSparseTraining())
+	{
+		std::cerr << "Error: Synchronous data parallel training doesn't support sparse training" << std::endl;
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	threads = std::max(threads, 1);
+	batchSize = std::max(batchSize, 1);
+	size_t globalBatch = static_cast<size_t>(threads) * batchSize;
+	size_t steps = (dataset.size() + globalBatch - 1) / globalBatch;
+
+	// One replica per thread share, copied by its thread (first touch) and refreshed from the network after every update
+	std::vector<std::unique_ptr<Network>> replicas(threads);
+	std::vector<NetworkGradients> gradients(threads);
+	std::vector<std::vector<DataSample>> batches(threads);
+	std::vector<float> parameters(network.getParameterCount());
+	std::vector<PagePlacement> placements(threads);
+
+	for (size_t step = 0; step < steps; step++)
+	{
+		RunThreads(threads, [&](int t)
+			{
+				if (!replicas[t])
+					replicas[t].reset(new Network(network));
+				else
+					replicas[t]->UnpackParameters(parameters.data());
+				size_t first = std::min(dataset.size(), step * globalBatch + t * batchSize);
+				size_t last = std::min(dataset.size(), first + batchSize);
+				batches[t].clear();
+				for (size_t i = first; i < last; i++)
+					batches[t].push_back(dataset.getSample(i));
+				replicas[t]->ComputeGradients(batches[t], gradients[t]);
+
+				// The replica and its gradients are what the thread reads over and over
+				if (step + 1 == steps)
+				{
+					PageQuery query;
+					for (int layer = 0; layer + 1 < replicas[t]->getLayerCount(); layer++)
+					{
+						const Eigen::MatrixXf& weights = replicas[t]->getWeights(layer);
+						query.Add(weights.data(), weights.size() * sizeof(float));
+						query.Add(gradients[t].weights[layer].data(), gradients[t].weights[layer].size() * sizeof(float));
+					}
+					placements[t] = query.Count(GetCurrentNode());
+				}
+			});
+
+		for (int other = 1; other < threads; other++)
+		{
+			for (size_t layer = 0; layer < gradients[0].weights.size(); layer++)
+			{
+				gradients[0].weights[layer] += gradients[other].weights[layer];
+				gradients[0].factors[layer] += gradients[other].factors[layer];
+				gradients[0].biases[layer] += gradients[other].biases[layer];
+			}
+			gradients[0].samples += gradients[other].samples;
+		}
+		if (gradients[0].samples > 0)
+			network.ApplyGradients(gradients[0], learningRate / static_cast<float>(gradients[0].samples));
+		network.PackParameters(parameters.data());
+	}
+
+	stats.threads = threads;
+	stats.samples += static_cast<long long>(dataset.size());
+	stats.updates += static_cast<long long>(steps);
+	for (const PagePlacement& placement : placements)
+		stats.pages.Add(placement);
+	stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return true;
+}
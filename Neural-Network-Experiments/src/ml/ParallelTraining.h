@@ -0,0 +1,37 @@
+#pragma once
+#include "Network.h"
+
+// Multi-threaded training of one Network, one epoch per call over the dataset in its current (shuffled) order.
+// The network's weights are updated in place. threads is the number of shares the work is cut into, they run
+// on ThreadPool::Global() (size it with setThreadCount, Eigen::setNbThreads(1) so the two don't fight over the cores).
+// With as many shares as pool threads, share t always runs on pool thread t and allocates its buffers there, so
+// with a pinned pool they stay on its node. Dataset::shuffleShards(threads) keeps its samples there too
+struct ParallelTrainingStats
+{
+	int threads = 0;
+	long long samples = 0;
+	long long updates = 0;		// Weight updates written (Hogwild : one per thread batch, synchronous : one per step)
+	double seconds = 0.0;
+	int replicas = 1;			// Hogwild copies of the weights (one per NUMA node with replicaSyncInterval)
+	PagePlacement pages;		// Pages of the samples, weights and gradients the threads read, on their own node or not
+
+	double getSamplesPerSecond() const { return seconds > 0.0 ? samples / seconds : 0.0; }
+};
+
+// Hogwild : the weights live in one shared array, every thread trains on its own slice of the dataset with
+// batches of batchSize samples and writes its update straight into the shared weights with relaxed atomics,
+// no locks. Before every batch a thread copies the shared weights with relaxed loads, so it computes on weights up
+// to one batch old, and an update can overwrite a concurrent one :
+// with sparse inputs (most MNIST pixels are 0, so most first layer columns get no gradient) collisions are
+// rare enough that SGD doesn't notice, and nobody waits.
+// replicaSyncInterval > 0 : one copy of the weights per NUMA node, so the threads never write across sockets; the
+// copies are averaged every replicaSyncInterval batches per thread (needs one share per pool thread).
+// Dense fp32 networks only (no low rank layers, pruning masks or sparse training), returns false otherwise
+bool TrainEpochHogwild(Network& network, const Dataset& dataset, int threads, float learningRate, int batchSize,
+	ParallelTrainingStats& stats, int replicaSyncInterval = 0);
+
+// Synchronous data parallel baseline : every step each thread computes the gradients of batchSize samples on
+// its own replica, the gradients are summed and one update (learningRate / samples) is applied to all replicas.
+// Same result as TrainBatch on batches of threads * batchSize samples
+bool TrainEpochSynchronous(Network& network, const Dataset& dataset, int threads, float learningRate, int batchSize,
+	ParallelTrainingStats& stats);
@@ -0,0 +1,76 @@
+#include "Pipeline.h"
+#include <algorithm>
+
+const char* PipelineScheduleName(PipelineSchedule schedule)
+{
+	return schedule == PipelineSchedule::GPipe ? "gpipe" : "1f1b";
+}
+
+bool ParsePipelineSchedule(const std::string& name, PipelineSchedule& schedule)
+{
+	if (name == "gpipe") schedule = PipelineSchedule::GPipe;
+	else if (name == "1f1b") schedule = PipelineSchedule::OneFOneB;
+	else return false;
+	return true;
+}
+
+std::vector<PipelineStep> BuildPipelineSchedule(PipelineSchedule schedule, int stage, int stages, int microBatches)
+{
+	// Backwards run in micro-batch order on every stage, so each stage pops the deltas in the order they were pushed
+	int warmup = schedule == PipelineSchedule::GPipe ? microBatches : std::min(stages - stage - 1, microBatches);
+	std::vector<PipelineStep> steps;
+	int forward = 0;
+	int backward = 0;
+	for (; forward < warmup; forward++)
+		steps.push_back({ false, forward });
+	for (; forward < microBatches; forward++, backward++)
+	{
+		steps.push_back({ false, forward });
+		steps.push_back({ true, backward });
+	}
+	for (; backward < microBatches; backward++)
+		steps.push_back({ true, backward });
+	return steps;
+}
+
+std::vector<int> PartitionLayers(const std::vector<size_t>& layerCosts, int stages)
+{
+	// cost[s][l] : cheapest largest group when the first l layers go to s stages. A handful of layers, so O(s * l^2) is fine
+	const int layers = static_cast<int>(layerCosts.size());
+	stages = std::max(1, std::min(stages, layers));
+	std::vector<size_t> prefix(layers + 1, 0);
+	for (int l = 0; l < layers; l++)
+		prefix[l + 1] = prefix[l] + layerCosts[l];
+
+	const size_t infinite = static_cast<size_t>(-1);
+	std::vector<std::vector<size_t>> cost(stages + 1, std::vector<size_t>(layers + 1, infinite));
+	std::vector<std::vector<int>> cut(stages + 1, std::vector<int>(layers + 1, 0));
+	cost[0][0] = 0;
+	for (int s = 1; s <= stages; s++)
+		for (int l = s; l <= layers; l++)
+			for (int first = s - 1; first < l; first++)
+			{
+				if (cost[s - 1][first] == infinite)
+					continue;
+				size_t largest = std::max(cost[s - 1][first], prefix[l] - prefix[first]);
+				if (largest < cost[s][l])
+				{
+					cost[s][l] = largest;
+					cut[s][l] = first;
+				}
+			}
+
+	std::vector<int> bounds(stages + 1, layers);
+	for (int s = stages; s > 0; s--)
+		bounds[s - 1] = cut[s][bounds[s]];
+	return bounds;
+}
+
+double PipelineStats::getBubbleFraction() const
+{
+	double busy = 0.0;
+	for (const PipelineStageStats& stage : stages)
+		busy += stage.busySeconds;
+	double available = seconds * stages.size();
+	return available > 0.0 ? std::max(0.0, 1.0 - busy / available) : 0.0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Pipeline parallel training (Network::TrainBatchesPipelined) : the layers are cut into contiguous stages, one
+// thread per stage, and every batch is split into micro-batches that flow through the stages. A stage only ever
+// touches its own layers, so their weights stay in the cache of its core
+enum class PipelineSchedule
+{
+	GPipe,		// Every micro-batch forward, then every micro-batch backward : activations of all of them are kept
+	OneFOneB	// After a warm-up of (stages - stage - 1) forwards, one forward then one backward : at most
+				// (stages - stage) micro-batches in flight per stage, same bubble as GPipe
+};
+
+const char* PipelineScheduleName(PipelineSchedule schedule);
+bool ParsePipelineSchedule(const std::string& name, PipelineSchedule& schedule);
+
+struct PipelineStep
+{
+	bool backward = false;
+	int microBatch = 0;
+};
+
+// Order in which a stage runs the forward and backward passes of the micro-batches of one batch
+std::vector<PipelineStep> BuildPipelineSchedule(PipelineSchedule schedule, int stage, int stages, int microBatches);
+
+// Contiguous split of layers with the given costs into at most stages groups, the most expensive group as cheap
+// as possible. Returns the first layer of every stage followed by the layer count
+std::vector<int> PartitionLayers(const std::vector<size_t>& layerCosts, int stages);
+
+struct PipelineOptions
+{
+	int stages = 2;				// Capped at the number of layers
+	int microBatches = 4;		// Per batch, capped at the batch size
+	PipelineSchedule schedule = PipelineSchedule::OneFOneB;
+	bool pinThreads = true;		// Stage i on NumaTopology::getCoreForThread(i)
+};
+
+struct PipelineStageStats
+{
+	int firstLayer = 0;
+	int lastLayer = 0;			// Exclusive
+	size_t parameterBytes = 0;	// Weights + biases the stage keeps hot
+	int core = -1;				// -1 = not pinned
+	double busySeconds = 0.0;
+	double waitSeconds = 0.0;	// Blocked on the queue from the neighbouring stage
+	int peakMicroBatches = 0;	// Most micro-batches whose activations were held at once
+};
+
+struct PipelineStats
+{
+	PipelineSchedule schedule = PipelineSchedule::OneFOneB;
+	int microBatches = 0;
+	long long batches = 0;
+	long long samples = 0;
+	double seconds = 0.0;
+	std::vector<PipelineStageStats> stages;
+
+	// Share of the stage threads' time not spent computing. The schedule alone idles (stages - 1) /
+	// (microBatches + stages - 1) of it, unbalanced stages add to that
+	double getBubbleFraction() const;
+	double getSamplesPerSecond() const { return seconds > 0.0 ? samples / seconds : 0.0; }
+};
@@ -0,0 +1,150 @@
+#include "PredictionCache.h"
+#include <cstring>
+
+namespace
+{
+	const uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+	const uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+	const uint64_t Prime3 = 0x165667B19E3779F9ULL;
+
+	inline uint64_t RotateLeft(uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+
+	inline uint64_t Load64(const unsigned char* bytes)
+	{
+		uint64_t value;
+		std::memcpy(&value, bytes, sizeof(value));
+		return value;
+	}
+
+	inline uint64_t Round(uint64_t lane, uint64_t value) { return RotateLeft(lane + value * Prime2, 31) * Prime1; }
+}
+
+uint64_t HashBytes(const void* data, size_t size)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	const unsigned char* end = bytes + size;
+
+	// 32 bytes per step, the lanes don't depend on each other
+	uint64_t lanes[4] = { Prime1 + Prime2, Prime2, 0, 0 - Prime1 };
+	while (end - bytes >= 32)
+	{
+		lanes[0] = Round(lanes[0], Load64(bytes));
+		lanes[1] = Round(lanes[1], Load64(bytes + 8));
+		lanes[2] = Round(lanes[2], Load64(bytes + 16));
+		lanes[3] = Round(lanes[3], Load64(bytes + 24));
+		bytes += 32;
+	}
+
+	uint64_t hash = RotateLeft(lanes[0], 1) + RotateLeft(lanes[1], 7) + RotateLeft(lanes[2], 12) + RotateLeft(lanes[3], 18);
+	hash ^= static_cast<uint64_t>(size) * Prime3;
+	for (; end - bytes >= 8; bytes += 8)
+		hash = RotateLeft(hash ^ Round(0, Load64(bytes)), 27) * Prime1 + Prime3;
+	for (; bytes < end; bytes++)
+		hash = RotateLeft(hash ^ (*bytes * Prime3), 11) * Prime1;
+
+	// Mix the last bits into all of them
+	hash ^= hash >> 33;
+	hash *= Prime2;
+	hash ^= hash >> 29;
+	hash *= Prime3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+void PredictionCache::DropAll()
+{
+	m_Entries.clear();
+	m_Index.clear();
+}
+
+bool PredictionCache::Lookup(uint64_t hash, unsigned long long version, Eigen::VectorXf& outputs)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = version == m_Version ? m_Index.find(hash) : m_Index.end();
+	if (it == m_Index.end())
+	{
+		m_Stats.misses++;
+		return false;
+	}
+
+	m_Entries.splice(m_Entries.begin(), m_Entries, it->second);
+	outputs = it->second->outputs;
+	m_Stats.hits++;
+	return true;
+}
+
+void PredictionCache::Insert(uint64_t hash, unsigned long long version, const Eigen::VectorXf& outputs)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	if (m_Capacity == 0 || version < m_Version)
+		return;
+	if (version > m_Version)
+	{
+		if (!m_Entries.empty())
+			m_Stats.invalidations++;
+		DropAll();
+		m_Version = version;
+	}
+
+	auto it = m_Index.find(hash);
+	if (it != m_Index.end())
+	{
+		// Another thread got there first
+		m_Entries.splice(m_Entries.begin(), m_Entries, it->second);
+		return;
+	}
+
+	if (m_Entries.size() >= m_Capacity)
+	{
+		m_Index.erase(m_Entries.back().hash);
+		m_Entries.pop_back();
+		m_Stats.evictions++;
+	}
+	m_Entries.push_front(Entry{ hash, outputs });
+	m_Index[hash] = m_Entries.begin();
+}
+
+Eigen::VectorXf PredictionCache::Predict(Network& network, const Eigen::VectorXf& input)
+{
+	uint64_t hash = HashInput(input);
+	Eigen::VectorXf outputs;
+	if (Lookup(hash, network.getVersion(), outputs))
+		return outputs;
+
+	outputs = network.Forward(input);
+	Insert(hash, network.getVersion(), outputs);
+	return outputs;
+}
+
+void PredictionCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	DropAll();
+}
+
+void PredictionCache::setCapacity(size_t capacity)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Capacity = capacity;
+	while (m_Entries.size() > m_Capacity)
+	{
+		m_Index.erase(m_Entries.back().hash);
+		m_Entries.pop_back();
+		m_Stats.evictions++;
+	}
+}
+
+PredictionCacheStats PredictionCache::getStats() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	PredictionCacheStats stats = m_Stats;
+	stats.size = m_Entries.size();
+	stats.capacity = m_Capacity;
+	return stats;
+}
+
+void PredictionCache::ResetStats()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Stats = PredictionCacheStats();
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "Network.h"
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+// 64 bit hash of a block of memory, 4 independent lanes of 8 bytes so it runs at memory speed.
+// Not cryptographic : good enough to tell inputs apart, 784 floats hash in well under a microsecond
+uint64_t HashBytes(const void* data, size_t size);
+
+struct PredictionCacheStats
+{
+	long long hits = 0;
+	long long misses = 0;
+	long long evictions = 0;		// Least recently used entries dropped for room
+	long long invalidations = 0;	// Times the whole cache was dropped for a newer model
+	size_t size = 0;
+	size_t capacity = 0;
+
+	float getHitRate() const { return hits + misses > 0 ? static_cast<float>(hits) / (hits + misses) : 0.0f; }
+};
+
+// LRU cache of network outputs, keyed by the hash of the input bytes. Every entry belongs to one model version
+// (Network::getVersion, or the server's model version) : a newer version drops everything, so a cached answer
+// never outlives the weights it came from. Two inputs with the same hash would share an answer, with 64 bits
+// that doesn't happen in practice. Thread safe
+class PredictionCache
+{
+private:
+	struct Entry
+	{
+		uint64_t hash;
+		Eigen::VectorXf outputs;
+	};
+
+	size_t m_Capacity;
+	unsigned long long m_Version = 0;		// Model the entries belong to
+	std::list<Entry> m_Entries;				// Most recently used first
+	std::unordered_map<uint64_t, std::list<Entry>::iterator> m_Index;
+	mutable std::mutex m_Mutex;
+	PredictionCacheStats m_Stats;
+
+	void DropAll();
+
+public:
+	explicit PredictionCache(size_t capacity = 1024) : m_Capacity(capacity) {}
+
+	PredictionCache(const PredictionCache&) = delete;
+	PredictionCache& operator=(const PredictionCache&) = delete;
+
+	static uint64_t HashInput(const Eigen::VectorXf& input) { return HashBytes(input.data(), input.size() * sizeof(float)); }
+
+	// Counts a hit or a miss. Entries of an other model version never match
+	bool Lookup(uint64_t hash, unsigned long long version, Eigen::VectorXf& outputs);
+
+	// A newer version than the cached one drops the cache first. Results from an older model
+	// (computed while a newer one was swapped in) aren't kept
+	void Insert(uint64_t hash, unsigned long long version, const Eigen::VectorXf& outputs);
+
+	// Lookup, or Forward + Insert, with the network's own version
+	Eigen::VectorXf Predict(Network& network, const Eigen::VectorXf& input);
+
+	void Clear();
+	void setCapacity(size_t capacity);	// 0 = disabled
+	size_t getCapacity() const { return m_Capacity; }
+
+	PredictionCacheStats getStats() const;
+	void ResetStats();
+};
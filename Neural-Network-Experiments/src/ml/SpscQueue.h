@@ -0,0 +1,72 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Lock-free FIFO between exactly one producer thread and one consumer thread (ring buffer, the two ends only
+// share the head and tail indices). Push spins while the queue is full, Pop while it's empty : for threads that
+// own a core and hand each other work every few microseconds, where a mutex + condition variable costs more
+// than the wait. Items are moved in and out, so an Eigen matrix crosses without a copy
+template<typename T>
+class SpscQueue
+{
+private:
+	std::vector<T> m_Items;						// One slot stays free to tell full from empty
+	std::atomic<size_t> m_Head{ 0 };			// Next slot to pop, written by the consumer
+	char m_HeadPadding[64 - sizeof(size_t)];	// Head and tail on their own cache lines
+	std::atomic<size_t> m_Tail{ 0 };			// Next slot to push, written by the producer
+	char m_TailPadding[64 - sizeof(size_t)];
+
+	size_t Next(size_t index) const { return index + 1 < m_Items.size() ? index + 1 : 0; }
+
+	// Spin a little, then let other threads have the core (they may be the ones we wait for)
+	static void Backoff(int& spins)
+	{
+		if (++spins > 64)
+			std::this_thread::yield();
+	}
+
+public:
+	explicit SpscQueue(size_t capacity) : m_Items(std::max<size_t>(capacity, 1) + 1) {}
+
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	bool TryPush(T& item)
+	{
+		size_t tail = m_Tail.load(std::memory_order_relaxed);
+		size_t next = Next(tail);
+		if (next == m_Head.load(std::memory_order_acquire))
+			return false;
+		m_Items[tail] = std::move(item);
+		m_Tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool TryPop(T& item)
+	{
+		size_t head = m_Head.load(std::memory_order_relaxed);
+		if (head == m_Tail.load(std::memory_order_acquire))
+			return false;
+		item = std::move(m_Items[head]);
+		m_Head.store(Next(head), std::memory_order_release);
+		return true;
+	}
+
+	void Push(T item)
+	{
+		int spins = 0;
+		while (!TryPush(item))
+			Backoff(spins);
+	}
+
+	void Pop(T& item)
+	{
+		int spins = 0;
+		while (!TryPop(item))
+			Backoff(spins);
+	}
+
+	size_t getCapacity() const { return m_Items.size() - 1; }
+};
@@ -0,0 +1,71 @@
+#include "TaskGraph.h"
+#include <algorithm>
+#include <chrono>
+
+int TaskGraph::Add(std::function<void()> work, std::initializer_list<int> after)
+{
+	int id = static_cast<int>(m_Nodes.size());
+	m_Nodes.push_back(std::unique_ptr<Node>(new Node()));
+	m_Nodes.back()->work = std::move(work);
+	for (int dependency : after)
+		Depend(id, dependency);
+	return id;
+}
+
+void TaskGraph::Depend(int node, int after)
+{
+	if (after < 0 || after >= node)
+		return;
+	Node& target = *m_Nodes[node];
+	if (std::find(target.predecessors.begin(), target.predecessors.end(), after) != target.predecessors.end())
+		return;
+	target.predecessors.push_back(after);
+	target.dependencies++;
+	m_Nodes[after]->successors.push_back(node);
+}
+
+void TaskGraph::Launch(int id)
+{
+	m_Pool->Submit([this, id]()
+		{
+			Node& node = *m_Nodes[id];
+			auto start = std::chrono::steady_clock::now();
+			node.work();
+			node.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			// The last dependency to finish submits the successor
+			for (int successor : node.successors)
+				if (--m_Nodes[successor]->remaining == 0)
+					Launch(successor);
+			m_Pending--;
+		});
+}
+
+void TaskGraph::Run(ThreadPool& pool)
+{
+	auto start = std::chrono::steady_clock::now();
+	m_Pool = &pool;
+	m_Pending = static_cast<long long>(m_Nodes.size());
+	for (const std::unique_ptr<Node>& node : m_Nodes)
+		node->remaining = node->dependencies;
+	for (size_t id = 0; id < m_Nodes.size(); id++)
+		if (m_Nodes[id]->dependencies == 0)
+			Launch(static_cast<int>(id));
+	pool.Wait(m_Pending);
+
+	// Nodes are in dependency order, so one pass finds the longest chain
+	m_Stats = TaskGraphStats();
+	m_Stats.tasks = static_cast<long long>(m_Nodes.size());
+	m_Stats.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::vector<double> finish(m_Nodes.size(), 0.0);
+	for (size_t id = 0; id < m_Nodes.size(); id++)
+	{
+		const Node& node = *m_Nodes[id];
+		double ready = 0.0;
+		for (int predecessor : node.predecessors)
+			ready = std::max(ready, finish[predecessor]);
+		finish[id] = ready + node.seconds;
+		m_Stats.workSeconds += node.seconds;
+		m_Stats.criticalPathSeconds = std::max(m_Stats.criticalPathSeconds, finish[id]);
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include "ThreadPool.h"
+
+struct TaskGraphStats
+{
+	long long tasks = 0;
+	double wallSeconds = 0.0;
+	double workSeconds = 0.0;			// Sum of the task times : what one thread running them in order would take
+	double criticalPathSeconds = 0.0;	// Longest chain of dependent tasks : the best any number of threads can do
+
+	double getParallelism() const { return wallSeconds > 0.0 ? workSeconds / wallSeconds : 0.0; }
+};
+
+// Tasks with dependencies, run on a ThreadPool : a task is submitted as soon as everything it depends on is done,
+// from the thread that finished the last of them (so it usually runs where its inputs are still in cache).
+// Build once with Add, then Run (several times if needed). Tasks must be added after their dependencies
+class TaskGraph
+{
+private:
+	struct Node
+	{
+		std::function<void()> work;
+		std::vector<int> successors;
+		int dependencies = 0;
+		std::vector<int> predecessors;
+		std::atomic<int> remaining{ 0 };
+		double seconds = 0.0;
+	};
+
+	std::vector<std::unique_ptr<Node>> m_Nodes;
+	std::atomic<long long> m_Pending{ 0 };
+	ThreadPool* m_Pool = nullptr;
+	TaskGraphStats m_Stats;
+
+	void Launch(int node);
+
+public:
+	TaskGraph() = default;
+	TaskGraph(const TaskGraph&) = delete;
+	TaskGraph& operator=(const TaskGraph&) = delete;
+
+	// Returns the task's id. Negative ids in after are ignored, so optional dependencies can be passed as -1
+	int Add(std::function<void()> work, std::initializer_list<int> after = {});
+	void Depend(int node, int after);
+
+	// Returns when every task is done, the calling thread runs tasks meanwhile
+	void Run(ThreadPool& pool = ThreadPool::Global());
+
+	void Clear() { m_Nodes.clear(); }
+	size_t size() const { return m_Nodes.size(); }
+
+	// Of the last Run
+	const TaskGraphStats& getStats() const { return m_Stats; }
+};
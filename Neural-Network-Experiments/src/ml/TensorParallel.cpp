@@ -0,0 +1,49 @@
+#include "TensorParallel.h"
+#include <algorithm>
+#include <thread>
+
+double TensorParallelStats::getWaitFraction() const
+{
+	double wait = 0.0;
+	double total = 0.0;
+	for (const TensorParallelPartitionStats& partition : partitions)
+	{
+		wait += partition.waitSeconds;
+		total += partition.busySeconds + partition.waitSeconds;
+	}
+	return total > 0.0 ? wait / total : 0.0;
+}
+
+std::vector<int> SplitRows(int rows, int parts, int align)
+{
+	parts = std::max(parts, 1);
+	align = std::max(align, 1);
+	std::vector<int> bounds(parts + 1, rows);
+	bounds[0] = 0;
+	for (int part = 1; part < parts; part++)
+	{
+		int cut = static_cast<int>(static_cast<long long>(rows) * part / parts);
+		if (rows / parts >= align)
+			cut = (cut + align / 2) / align * align;
+		bounds[part] = std::min(std::max(cut, bounds[part - 1]), rows);
+	}
+	return bounds;
+}
+
+void SpinBarrier::Wait()
+{
+	int generation = m_Generation.load(std::memory_order_acquire);
+	if (m_Arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == m_Threads)
+	{
+		m_Arrived.store(0, std::memory_order_relaxed);
+		m_Generation.fetch_add(1, std::memory_order_release);
+		return;
+	}
+
+	int spins = 0;
+	while (m_Generation.load(std::memory_order_acquire) == generation)
+	{
+		if (++spins > 64)
+			std::this_thread::yield();
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Tensor parallel training (Network::TrainBatchesTensorParallel) : the weights of every wide layer are split by
+// rows across a fixed group of threads. Thread t always owns the same block of rows of each wide layer, keeps it
+// in a matrix it allocated itself (so it lands on its NUMA node) and is the only one to read or update it :
+// the forward computes its rows of the pre-activation, the gradient of its rows and the update stay local,
+// only the activations (gathered into one matrix) and the backward partial sums are shared
+struct TensorParallelOptions
+{
+	int partitions = 2;			// Threads, the caller is one of them
+	int minRows = 1024;			// Narrower layers run on the caller alone, the others wait
+	bool pinThreads = true;		// Thread t on NumaTopology::getCoreForThread(t), the caller's affinity is restored at the end
+};
+
+struct TensorParallelPartitionStats
+{
+	int core = -1;				// -1 = not pinned
+	size_t parameterBytes = 0;	// Rows of the wide layers this thread owns
+	double busySeconds = 0.0;
+	double waitSeconds = 0.0;	// At the barriers between layers
+};
+
+struct TensorParallelStats
+{
+	int splitLayers = 0;
+	long long batches = 0;
+	long long samples = 0;
+	long long barriers = 0;
+	double seconds = 0.0;
+	std::vector<TensorParallelPartitionStats> partitions;
+
+	double getWaitFraction() const;
+	double getSamplesPerSecond() const { return seconds > 0.0 ? samples / seconds : 0.0; }
+};
+
+// Bounds of parts contiguous row ranges of about the same size (parts + 1 entries). Cuts fall on multiples of
+// align rows where possible, so two threads writing neighbouring rows of a column major matrix don't share a cache line
+std::vector<int> SplitRows(int rows, int parts, int align = 16);
+
+// All threads of a group wait until the last one arrives. Spins (then yields) : the threads own their cores and
+// the waits between two layers are short
+class SpinBarrier
+{
+private:
+	const int m_Threads;
+	std::atomic<int> m_Arrived{ 0 };
+	std::atomic<int> m_Generation{ 0 };
+
+public:
+	explicit SpinBarrier(int threads) : m_Threads(threads) {}
+
+	SpinBarrier(const SpinBarrier&) = delete;
+	SpinBarrier& operator=(const SpinBarrier&) = delete;
+
+	void Wait();
+};
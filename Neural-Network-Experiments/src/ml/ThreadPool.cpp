@@ -0,0 +1,283 @@
+#include "ThreadPool.h"
+#include "Eigen/Core"
+#include <algorithm>
+#include <chrono>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace
+{
+	// Which pool and slot the current thread works for (null outside any pool)
+	thread_local const ThreadPool* t_Pool = nullptr;
+	thread_local int t_Slot = 0;
+}
+
+ThreadPool::ThreadPool(int threads)
+{
+	Start(threads > 0 ? threads : getDefaultThreadCount());
+}
+
+ThreadPool::~ThreadPool()
+{
+	Stop();
+}
+
+ThreadPool& ThreadPool::Global()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+int ThreadPool::getDefaultThreadCount()
+{
+	int cores = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+	return std::max(1, cores / std::max(1, Eigen::nbThreads()));
+}
+
+void ThreadPool::Start(int threads)
+{
+	m_Stop = false;
+	m_Slots.clear();
+	for (int slot = 0; slot < threads; slot++)
+		m_Slots.push_back(std::unique_ptr<Slot>(new Slot()));
+	m_Slots[0]->remoteLoads.Open();		// The thread that sizes the pool is the one that helps
+	for (int slot = 1; slot < threads; slot++)
+		m_Workers.emplace_back(&ThreadPool::WorkerLoop, this, slot);
+}
+
+void ThreadPool::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_WakeMutex);
+		m_Stop = true;
+	}
+	m_Wake.notify_all();
+	for (std::thread& worker : m_Workers)
+		worker.join();
+	m_Workers.clear();
+
+	// Whatever is left runs on the caller
+	while (RunOne(0)) {}
+}
+
+void ThreadPool::WorkerLoop(int slot)
+{
+	t_Pool = this;
+	t_Slot = slot;
+	Slot& own = *m_Slots[slot];
+	if (m_Pinning)
+	{
+		int core = NumaTopology::Get().getCoreForThread(slot);
+		if (PinThreadToCore(core))
+			own.core = core;
+	}
+	own.remoteLoads.Open();
+#ifdef _OPENMP
+	omp_set_num_threads(1);		// Eigen kernels inside tasks stay on this thread (unless Eigen::setNbThreads forces more)
+#endif
+
+	while (true)
+	{
+		if (RunOne(slot))
+			continue;
+		std::unique_lock<std::mutex> lock(m_WakeMutex);
+		m_Wake.wait(lock, [&]() { return m_Stop || m_Queued > 0 || own.pinnedCount > 0; });
+		if (m_Stop && m_Queued == 0 && own.pinnedCount == 0)
+			return;
+	}
+}
+
+int ThreadPool::getCurrentSlot() const
+{
+	return t_Pool == this ? t_Slot : 0;
+}
+
+void ThreadPool::Push(int slot, Task task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Slots[slot]->mutex);
+		m_Slots[slot]->tasks.push_back(std::move(task));
+	}
+	m_Queued++;
+	if (!m_Workers.empty())
+	{
+		// Taking the lock orders this with a worker that just checked m_Queued and is about to sleep
+		std::lock_guard<std::mutex> lock(m_WakeMutex);
+		m_Wake.notify_one();
+	}
+}
+
+bool ThreadPool::RunOne(int slot)
+{
+	Task task;
+	bool stolen = false;
+	{
+		Slot& own = *m_Slots[slot];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.pinned.empty())
+		{
+			task = std::move(own.pinned.front());
+			own.pinned.pop_front();
+			own.pinnedCount--;
+			m_Queued++;		// Balances the decrement below, pinned tasks aren't in m_Queued
+		}
+		else if (!own.tasks.empty())
+		{
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+		}
+	}
+
+	// Start at a different victim every time so the thieves don't all line up on the same deque
+	int count = static_cast<int>(m_Slots.size());
+	int first = static_cast<int>(m_NextVictim++ % count);
+	for (int i = 0; i < count && !task; i++)
+	{
+		int victim = (first + i) % count;
+		if (victim == slot)
+			continue;
+		Slot& other = *m_Slots[victim];
+		std::lock_guard<std::mutex> lock(other.mutex);
+		if (!other.tasks.empty())
+		{
+			task = std::move(other.tasks.front());
+			other.tasks.pop_front();
+			stolen = true;
+		}
+	}
+	if (!task)
+		return false;
+
+	m_Queued--;
+	Slot& own = *m_Slots[slot];
+	auto start = std::chrono::steady_clock::now();
+	task();
+	own.busyNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	own.executed++;
+	if (stolen)
+		own.steals++;
+	return true;
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+	if (m_Workers.empty())
+	{
+		task();
+		return;
+	}
+	Push(getCurrentSlot(), std::move(task));
+}
+
+void ThreadPool::ParallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body)
+{
+	if (end <= begin)
+		return;
+	grain = std::max<size_t>(grain, 1);
+	if (m_Workers.empty() || end - begin <= grain)
+	{
+		body(begin, end);
+		return;
+	}
+
+	// Every split pushes its upper half and keeps going with the lower one. pending counts the pushed halves that
+	// haven't finished, a half counts its own splits before it finishes so it never drops to 0 early
+	std::atomic<long long> pending{ 0 };
+	std::function<void(size_t, size_t)> split = [&](size_t first, size_t last)
+	{
+		int slot = getCurrentSlot();
+		while (last - first > grain)
+		{
+			size_t middle = first + (last - first) / 2;
+			pending++;
+			Push(slot, [&split, &pending, middle, last]()
+				{
+					split(middle, last);
+					pending--;
+				});
+			last = middle;
+		}
+		body(first, last);
+	};
+	split(begin, end);
+	Wait(pending);
+}
+
+void ThreadPool::Wait(const std::atomic<long long>& pending)
+{
+	// Help instead of blocking, the tasks waited for may be sitting on this thread's deque
+	int slot = getCurrentSlot();
+	while (pending > 0)
+	{
+		if (!RunOne(slot))
+			std::this_thread::yield();
+	}
+}
+
+void ThreadPool::RunOnEach(const std::function<void(int)>& body)
+{
+	std::atomic<long long> pending{ static_cast<long long>(m_Workers.size()) };
+	for (size_t slot = 1; slot < m_Slots.size(); slot++)
+	{
+		int index = static_cast<int>(slot);
+		std::lock_guard<std::mutex> lock(m_Slots[slot]->mutex);
+		m_Slots[slot]->pinned.push_back([&body, &pending, index]()
+			{
+				body(index);
+				pending--;
+			});
+		m_Slots[slot]->pinnedCount++;
+	}
+	if (!m_Workers.empty())
+	{
+		std::lock_guard<std::mutex> lock(m_WakeMutex);
+		m_Wake.notify_all();
+	}
+	body(0);
+	Wait(pending);
+}
+
+void ThreadPool::setPinning(bool pinning)
+{
+	if (pinning == m_Pinning)
+		return;
+	int threads = getThreadCount();
+	Stop();
+	m_Pinning = pinning;
+	Start(threads);
+}
+
+void ThreadPool::setThreadCount(int threads)
+{
+	threads = threads > 0 ? threads : getDefaultThreadCount();
+	if (threads == getThreadCount())
+		return;
+	Stop();
+	Start(threads);
+}
+
+std::vector<ThreadPoolWorkerStats> ThreadPool::getStats() const
+{
+	std::vector<ThreadPoolWorkerStats> stats(m_Slots.size());
+	for (size_t slot = 0; slot < m_Slots.size(); slot++)
+	{
+		stats[slot].tasks = m_Slots[slot]->executed;
+		stats[slot].steals = m_Slots[slot]->steals;
+		stats[slot].busySeconds = m_Slots[slot]->busyNanoseconds * 1e-9;
+		stats[slot].core = m_Slots[slot]->core;
+		stats[slot].node = NumaTopology::Get().getNodeOfCore(m_Slots[slot]->core);
+		stats[slot].remoteLoads = m_Slots[slot]->remoteLoads.Read();
+	}
+	return stats;
+}
+
+void ThreadPool::ResetStats()
+{
+	for (const std::unique_ptr<Slot>& slot : m_Slots)
+	{
+		slot->executed = 0;
+		slot->steals = 0;
+		slot->busyNanoseconds = 0;
+	}
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include "Numa.h"
+#include <thread>
+#include <vector>
+
+struct ThreadPoolWorkerStats
+{
+	long long tasks = 0;
+	long long steals = 0;		// Tasks taken from an other worker's deque
+	double busySeconds = 0.0;	// Running tasks
+	int core = -1;				// Pinned core, -1 = not pinned
+	int node = -1;				// Its NUMA node
+	long long remoteLoads = -1;	// Loads served by another node's memory, -1 = no counter (see RemoteLoadCounter)
+};
+
+// Work stealing pool. Every worker owns a deque : it pushes and pops at the back (the newest, still hot in cache),
+// idle workers steal from the front of the others (the oldest, which ParallelFor makes the biggest ranges).
+// Threads outside the pool share slot 0 : their tasks go to its deque and they help while they wait, so a
+// ParallelFor inside a task (or with no workers at all) can't deadlock.
+// With setPinning(true) worker i stays on NumaTopology::getCoreForThread(i), and RunOnEach runs a task on every
+// thread in turn so per-thread buffers can be allocated (first touched) on the node that will use them.
+//
+// Global() is the one pool of the process. The pool and Eigen share the cores : by default the pool has
+// cores / Eigen::nbThreads() threads (the caller counts as one), so with Eigen::setNbThreads(1) it uses every core
+// and with Eigen on all cores ParallelFor runs inline. Tools that parallelize through the pool set Eigen to 1 thread
+class ThreadPool
+{
+private:
+	using Task = std::function<void()>;
+
+	struct Slot
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+		std::deque<Task> pinned;		// RunOnEach : only this slot's thread runs these
+		std::atomic<int> pinnedCount{ 0 };
+		int core = -1;
+		RemoteLoadCounter remoteLoads;
+		std::atomic<long long> executed{ 0 };
+		std::atomic<long long> steals{ 0 };
+		std::atomic<long long> busyNanoseconds{ 0 };
+	};
+
+	std::vector<std::unique_ptr<Slot>> m_Slots;		// 0 = threads outside the pool, then one per worker
+	std::vector<std::thread> m_Workers;
+	std::atomic<long long> m_Queued{ 0 };
+	std::atomic<bool> m_Stop{ false };
+	std::mutex m_WakeMutex;
+	std::condition_variable m_Wake;
+	std::atomic<unsigned int> m_NextVictim{ 0 };
+	bool m_Pinning = false;
+
+	void Start(int threads);
+	void Stop();
+	void WorkerLoop(int slot);
+	void Push(int slot, Task task);
+	bool RunOne(int slot);		// Own deque first, then steal. False when every deque was empty
+
+public:
+	// threads <= 0 : getDefaultThreadCount()
+	explicit ThreadPool(int threads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	static ThreadPool& Global();
+	static int getDefaultThreadCount();
+
+	// Fire and forget
+	void Submit(std::function<void()> task);
+
+	// body(first, last) over [begin, end) in ranges of at most grain items, returns when all are done.
+	// Ranges are split in halves on demand, so an idle worker steals big pieces and busy ones keep the small ones
+	void ParallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body);
+
+	// Runs queued tasks on the calling thread until pending drops to 0 (pending is decremented by the tasks)
+	void Wait(const std::atomic<long long>& pending);
+
+	// body(slot) once on every thread of the pool, slot 0 on the caller, and returns when all are done.
+	// Not from inside a pool task
+	void RunOnEach(const std::function<void(int)>& body);
+
+	// Slot of the calling thread : 0 outside the pool, 1.. for the workers
+	int getCurrentSlot() const;
+
+	// Pin the workers to their cores (restarts them). The caller's thread is left alone
+	void setPinning(bool pinning);
+	bool getPinning() const { return m_Pinning; }
+
+	// Joins the workers and starts threads - 1 new ones. Only while the pool is idle
+	void setThreadCount(int threads);
+	int getThreadCount() const { return static_cast<int>(m_Workers.size()) + 1; }
+
+	// Index 0 is the work done by threads outside the pool while they waited
+	std::vector<ThreadPoolWorkerStats> getStats() const;
+	void ResetStats();
+};
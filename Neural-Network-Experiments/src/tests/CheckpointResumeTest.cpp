@@ -0,0 +1,126 @@
+// Training resumed from a checkpoint (full file or delta record) has to end bit for bit where the uninterrupted
+// run ends : weights, dataset order and shuffle generator all come back. Files whose matrices don't match the
+// layer sizes are refused
+#include <cstdio>
+#include <cstring>
+
+#include "TestData.h"
+#include "ml/Checkpoint.h"
+
+static const int Epochs = 3;
+static const int BatchSize = 16;
+static const float LearningRate = 0.5f;
+
+static void TrainEpoch(Network& network, Dataset& dataset)
+{
+	dataset.shuffle();
+	size_t batches = (dataset.size() + BatchSize - 1) / BatchSize;
+	for (size_t batch = 0; batch < batches; batch++)
+		network.TrainBatch(dataset.getBatch(BatchSize), LearningRate);
+}
+
+static bool SameBits(const std::vector<float>& a, const std::vector<float>& b)
+{
+	return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(float)) == 0;
+}
+
+// Continues from filepath up to Epochs in a fresh network and dataset
+static std::vector<float> Resume(const std::string& filepath, const std::string& dataPath, int expectedEpoch)
+{
+	TrainingCheckpoint checkpoint;
+	Dataset dataset;
+	CHECK(test::LoadDigits(dataset, dataPath));
+	CHECK(LoadCheckpoint(filepath, checkpoint));
+	CHECK(dataset.setCursor(checkpoint.dataset));
+	CHECK(checkpoint.epoch == expectedEpoch);
+
+	Network network({ 784, 24, 10 });
+	network.RestoreState(checkpoint.network);
+	for (int epoch = checkpoint.epoch; epoch < Epochs; epoch++)
+		TrainEpoch(network, dataset);
+	return test::Parameters(network);
+}
+
+// Serializes the network's state after breaking it with tamper, and reads it back
+template<typename Tamper>
+static bool Reload(const Network& network, Tamper tamper)
+{
+	TrainingCheckpoint checkpoint;
+	network.CaptureState(checkpoint.network);
+	tamper(checkpoint.network);
+	TrainingCheckpoint loaded;
+	return DeserializeCheckpoint(SerializeCheckpoint(checkpoint), loaded);
+}
+
+static void CheckShapeValidation()
+{
+	Network network({ 784, 24, 16, 10 });
+	network.FactorizeLayer(0, 8);
+
+	Network pruned({ 784, 24, 10 });
+	pruned.PruneByMagnitude(0.5f);
+
+	CHECK(Reload(network, [](NetworkState&) {}));
+	CHECK(Reload(pruned, [](NetworkState&) {}));
+	CHECK(!Reload(network, [](NetworkState& state) { state.layerSizes[1] = 25; }));
+	CHECK(!Reload(network, [](NetworkState& state) { state.weights[2].resize(10, 17); }));
+	CHECK(!Reload(network, [](NetworkState& state) { state.biases[0].resize(23); }));
+	CHECK(!Reload(network, [](NetworkState& state) { state.factorU[0].resize(23, 8); }));
+	CHECK(!Reload(network, [](NetworkState& state) { state.factorV[0].resize(7, 784); }));
+	CHECK(!Reload(network, [](NetworkState& state) { state.factorV[0].resize(8, 783); }));
+	CHECK(!Reload(network, [](NetworkState& state) { state.factorU[0].resize(0, 0); }));	// V without U
+	CHECK(!Reload(network, [](NetworkState& state) { state.factorV.pop_back(); }));
+	CHECK(!Reload(pruned, [](NetworkState& state) { state.weightMasks[1].resize(10, 23); }));
+	CHECK(!Reload(pruned, [](NetworkState& state) { state.weightMasks.pop_back(); }));
+	CHECK(!Reload(network, [](NetworkState& state) { state.precision = static_cast<Precision>(7); }));
+}
+
+int main()
+{
+	CheckShapeValidation();
+
+	const std::string dataPath = "checkpoint_resume_digits.csv";
+	const std::string fullPath = "checkpoint_resume.ckpt";
+	const std::string chainPath = "checkpoint_resume_chain.ckpt";
+	CHECK(test::WriteDigits(dataPath, 300, 7));
+
+	Dataset dataset;
+	CHECK(test::LoadDigits(dataset, dataPath));
+	dataset.setSeed(11);
+	Network network({ 784, 24, 10 });
+
+	// Chain : full record after epoch 1, deltas against it after epochs 2 and 3
+	CheckpointWriter fullWriter;
+	CheckpointWriter chainWriter;
+	chainWriter.setIncremental(true, 3);
+	for (int epoch = 0; epoch < Epochs; epoch++)
+	{
+		TrainEpoch(network, dataset);
+		if (epoch == 0)
+		{
+			fullWriter.Save(network, dataset, epoch + 1, LearningRate, BatchSize, fullPath);
+			fullWriter.Flush();
+		}
+		chainWriter.Save(network, dataset, epoch + 1, LearningRate, BatchSize, chainPath);
+		chainWriter.Flush();
+	}
+	std::vector<float> uninterrupted = test::Parameters(network);
+
+	CHECK(SameBits(Resume(fullPath, dataPath, 1), uninterrupted));
+
+	std::vector<CheckpointRecord> records = chainWriter.getRecords();
+	CHECK(records.size() == Epochs);
+	if (records.size() == Epochs)
+	{
+		CHECK(!records[0].delta && records[1].delta);
+		CHECK(SameBits(Resume(records[1].filepath, dataPath, 2), uninterrupted));
+		CHECK(FindLatestCheckpoint(chainPath) == records.back().filepath);
+	}
+	CHECK(FindLatestCheckpoint(fullPath) == fullPath);
+
+	std::remove(dataPath.c_str());
+	std::remove(fullPath.c_str());
+	for (const CheckpointRecord& record : records)
+		std::remove(record.filepath.c_str());
+	return test::Result();
+}
@@ -0,0 +1,38 @@
+// Build step of CompiledModelTest : trains a small network, then writes it as a model file and as the header
+// CompileModelHeader generates. Usage : CompiledModelExport <header> <model file>
+#include <cstdio>
+#include <cstdlib>
+
+#include "TestData.h"
+#include "ml/ModelCompiler.h"
+#include "ml/ModelFile.h"
+
+int main(int argc, char** argv)
+{
+	if (argc != 3)
+	{
+		std::cerr << "Usage: CompiledModelExport <header> <model file>" << std::endl;
+		return 1;
+	}
+
+	const std::string dataPath = std::string(argv[2]) + ".csv";
+	CHECK(test::WriteDigits(dataPath, 200, 31));
+	Dataset dataset;
+	CHECK(test::LoadDigits(dataset, dataPath));
+	std::remove(dataPath.c_str());
+	if (test::Failures() > 0)
+		return test::Result();
+
+	// A low rank layer too, the header gets its dense equivalent
+	std::srand(31);
+	Network network({ 784, 32, 16, 10 });
+	for (int batch = 0; batch < 50; batch++)
+		network.TrainBatch(dataset.getBatch(20), 0.5f);
+	network.FactorizeLayer(0, 8);
+	for (int batch = 0; batch < 10; batch++)
+		network.TrainBatch(dataset.getBatch(20), 0.5f);
+
+	CHECK(SaveModel(network, argv[2]));
+	CHECK(CompileModelHeader(network, argv[1], "compiled_test"));
+	return test::Result();
+}
@@ -0,0 +1,59 @@
+// The header CompileModelHeader wrote at build time (CompiledModelExport) against Network::Forward on the weights of
+// the same network, read back from its model file : same outputs up to float rounding, same labels
+#include "TestData.h"
+#include "ml/ModelFile.h"
+#include "compiled_model_test.h"
+
+int main()
+{
+	MappedModel model;
+	CHECK(model.Open("compiled_model_test.nnm", true));
+	if (test::Failures() > 0)
+		return test::Result();
+	Network network = model.ToNetwork();
+
+	CHECK(compiled_test::kLayerCount == network.getLayerCount());
+	CHECK(compiled_test::kInputSize == network.getLayerSize(0));
+	CHECK(compiled_test::kOutputSize == network.getLayerSize(network.getLayerCount() - 1));
+	if (test::Failures() > 0)
+		return test::Result();
+
+	// Digits like the training set, and random inputs with about 80% exact zeros (predict() skips those)
+	const std::string dataPath = "compiled_model_digits.csv";
+	CHECK(test::WriteDigits(dataPath, 100, 37));
+	Dataset dataset;
+	CHECK(test::LoadDigits(dataset, dataPath));
+	std::remove(dataPath.c_str());
+	std::vector<Eigen::VectorXf> inputs;
+	for (size_t i = 0; i < dataset.size(); i++)
+		inputs.push_back(dataset.getSample(i).input);
+	std::mt19937 gen(37);
+	std::uniform_real_distribution<float> pixel(0.0f, 1.0f);
+	for (int i = 0; i < 100; i++)
+	{
+		Eigen::VectorXf input(compiled_test::kInputSize);
+		for (int j = 0; j < input.size(); j++)
+			input[j] = pixel(gen) < 0.8f ? 0.0f : pixel(gen);
+		inputs.push_back(input);
+	}
+
+	float maxDifference = 0.0f;
+	int labelMismatches = 0;
+	float output[compiled_test::kOutputSize];
+	for (const Eigen::VectorXf& input : inputs)
+	{
+		Eigen::VectorXf reference = network.Forward(input);
+		compiled_test::predict(input.data(), output);
+		for (int i = 0; i < compiled_test::kOutputSize; i++)
+			maxDifference = std::max(maxDifference, std::abs(reference[i] - output[i]));
+
+		int expected;
+		reference.maxCoeff(&expected);
+		if (compiled_test::predictLabel(input.data()) != expected)
+			labelMismatches++;
+	}
+	CHECK(maxDifference < 1e-5f);
+	CHECK(labelMismatches == 0);
+
+	return test::Result();
+}
@@ -0,0 +1,52 @@
+// CompressDelta / DecompressDelta give back the target exactly, whatever the sizes, and refuse broken input
+#include <cstring>
+
+#include "TestData.h"
+#include "ml/DeltaCodec.h"
+
+static std::vector<char> FloatBytes(const std::vector<float>& values)
+{
+	std::vector<char> bytes(values.size() * sizeof(float));
+	if (!values.empty())
+		std::memcpy(bytes.data(), values.data(), bytes.size());
+	return bytes;
+}
+
+static void CheckRoundTrip(const std::vector<char>& base, const std::vector<char>& target)
+{
+	std::vector<char> decoded;
+	CHECK(DecompressDelta(base, CompressDelta(base, target), decoded));
+	CHECK(decoded == target);
+}
+
+int main()
+{
+	std::mt19937 gen(3);
+	std::normal_distribution<float> weight(0.0f, 0.1f);
+	std::normal_distribution<float> step(0.0f, 1e-4f);
+
+	// Weights before and after a few updates : most high bytes unchanged
+	std::vector<float> before(100003);
+	for (float& value : before)
+		value = weight(gen);
+	std::vector<float> after = before;
+	for (float& value : after)
+		value += step(gen);
+
+	std::vector<char> base = FloatBytes(before);
+	std::vector<char> target = FloatBytes(after);
+	CheckRoundTrip(base, target);
+	CHECK(CompressDelta(base, target).size() < target.size());
+
+	CheckRoundTrip(base, base);
+	CheckRoundTrip(std::vector<char>(), target);										// Everything new
+	CheckRoundTrip(base, std::vector<char>());
+	CheckRoundTrip(std::vector<char>(base.begin(), base.begin() + 1001), target);	// Shorter base, odd length
+	CheckRoundTrip(base, std::vector<char>(target.begin(), target.begin() + 7));	// Shorter target
+
+	std::vector<char> encoded = CompressDelta(base, target);
+	std::vector<char> decoded;
+	CHECK(!DecompressDelta(base, std::vector<char>(encoded.begin(), encoded.begin() + encoded.size() / 2), decoded));
+
+	return test::Result();
+}
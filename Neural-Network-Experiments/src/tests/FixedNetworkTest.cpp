@@ -0,0 +1,93 @@
+// FixedNetwork against Network on the same weights : Import / Export / ToNetwork copy them exactly, Forward and
+// TrainBatch give the same outputs and updates up to float rounding
+#include <cstdio>
+
+#include "TestData.h"
+#include "ml/FixedNetwork.h"
+
+using Fixed = FixedNetwork<784, 128, 64, 10>;
+
+static bool SameWeights(const Network& a, const Network& b)
+{
+	for (int layer = 0; layer < a.getLayerCount() - 1; layer++)
+	{
+		if (a.getWeights(layer) != b.getWeights(layer) || a.getBiases(layer) != b.getBiases(layer))
+			return false;
+	}
+	return true;
+}
+
+static float MaxWeightDifference(const Network& a, const Network& b)
+{
+	float difference = 0.0f;
+	for (int layer = 0; layer < a.getLayerCount() - 1; layer++)
+	{
+		difference = std::max(difference, (a.getWeights(layer) - b.getWeights(layer)).cwiseAbs().maxCoeff());
+		difference = std::max(difference, (a.getBiases(layer) - b.getBiases(layer)).cwiseAbs().maxCoeff());
+	}
+	return difference;
+}
+
+static float MaxOutputDifference(Network& network, Fixed& fixed, const std::vector<DataSample>& samples)
+{
+	float difference = 0.0f;
+	for (const DataSample& sample : samples)
+		difference = std::max(difference, (network.Forward(sample.input) - fixed.Forward(sample.input)).cwiseAbs().maxCoeff());
+	return difference;
+}
+
+int main()
+{
+	const std::string dataPath = "fixed_network_digits.csv";
+	CHECK(test::WriteDigits(dataPath, 320, 23));
+	Dataset dataset;
+	CHECK(test::LoadDigits(dataset, dataPath));
+	std::remove(dataPath.c_str());
+	if (test::Failures() > 0)
+		return test::Result();
+
+	std::vector<DataSample> samples;
+	for (size_t i = 0; i < dataset.size(); i++)
+		samples.push_back(dataset.getSample(i));
+
+	Network network({ 784, 128, 64, 10 });
+	Fixed fixed(network);
+
+	// Round trips are exact copies
+	CHECK(SameWeights(fixed.ToNetwork(), network));
+	Network exported({ 784, 128, 64, 10 });
+	CHECK(fixed.Export(exported));
+	CHECK(SameWeights(exported, network));
+	Fixed imported;
+	CHECK(imported.Import(exported));
+	CHECK(SameWeights(imported.ToNetwork(), network));
+
+	// Other topologies are refused and left alone
+	Network other({ 784, 64, 10 });
+	Eigen::MatrixXf otherWeights = other.getWeights(0);
+	CHECK(!Fixed::Matches(other));
+	CHECK(!imported.Import(other));
+	CHECK(!fixed.Export(other));
+	CHECK(other.getWeights(0) == otherWeights);
+
+	// Same forward pass
+	CHECK(MaxOutputDifference(network, fixed, samples) < 1e-5f);
+
+	// Same updates : both train on the same batches
+	for (int epoch = 0; epoch < 3; epoch++)
+	{
+		for (size_t first = 0; first < samples.size(); first += 32)
+		{
+			std::vector<DataSample> batch(samples.begin() + first, samples.begin() + std::min(samples.size(), first + 32));
+			network.TrainBatch(batch, 0.5f);
+			fixed.TrainBatch(batch, 0.5f);
+		}
+	}
+	CHECK(MaxWeightDifference(fixed.ToNetwork(), network) < 1e-4f);
+	CHECK(MaxOutputDifference(network, fixed, samples) < 1e-4f);
+	float accuracy = network.CalculateAccuracy(samples);
+	CHECK(accuracy > 0.5f);
+	CHECK(fixed.CalculateAccuracy(samples) == accuracy);
+
+	return test::Result();
+}
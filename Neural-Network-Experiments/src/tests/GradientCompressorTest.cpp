@@ -0,0 +1,112 @@
+// GradientCompressor::DecodeAdd has to add back what Encode kept : exact for raw floats and for the top-k
+// entries, within half a quantization step for int8. With error feedback nothing is lost over several steps
+#include <algorithm>
+#include <cmath>
+
+#include "TestData.h"
+#include "ml/GradientCompressor.h"
+
+static std::vector<float> RandomGradient(size_t count, unsigned int seed)
+{
+	std::mt19937 gen(seed);
+	std::normal_distribution<float> value(0.0f, 1.0f);
+	std::vector<float> gradient(count);
+	for (float& entry : gradient)
+		entry = value(gen);
+	return gradient;
+}
+
+static std::vector<float> Decode(const std::vector<char>& encoded, size_t count, float start = 0.0f)
+{
+	std::vector<float> sum(count, start);
+	CHECK(GradientCompressor::DecodeAdd(encoded.data(), encoded.size(), sum.data(), count));
+	return sum;
+}
+
+int main()
+{
+	const size_t count = 5000;	// Not a multiple of the int8 block
+	std::vector<float> gradient = RandomGradient(count, 5);
+	std::vector<char> encoded;
+
+	{
+		GradientCompressor none(GradientCompression::None);
+		none.Encode(gradient.data(), count, encoded);
+		CHECK(Decode(encoded, count) == gradient);
+
+		// Adds to what is already there
+		std::vector<float> shifted = Decode(encoded, count, 1.0f);
+		bool added = true;
+		for (size_t i = 0; i < count; i++)
+			added &= shifted[i] == gradient[i] + 1.0f;
+		CHECK(added);
+	}
+
+	{
+		GradientCompressor topK(GradientCompression::TopK, 0.01f, false);
+		topK.Encode(gradient.data(), count, encoded);
+		std::vector<float> decoded = Decode(encoded, count);
+		size_t kept = 0;
+		float smallestKept = INFINITY, largestDropped = 0.0f;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (decoded[i] != 0.0f)
+			{
+				CHECK(decoded[i] == gradient[i]);
+				kept++;
+				smallestKept = std::min(smallestKept, std::fabs(gradient[i]));
+			}
+			else
+				largestDropped = std::max(largestDropped, std::fabs(gradient[i]));
+		}
+		CHECK(kept == 50);
+		CHECK(smallestKept >= largestDropped);
+	}
+
+	{
+		GradientCompressor int8(GradientCompression::Int8, 0.01f, false);
+		int8.Encode(gradient.data(), count, encoded);
+		std::vector<float> decoded = Decode(encoded, count);
+		bool close = true;
+		for (size_t block = 0; block < count; block += GradientCompressor::Int8BlockSize)
+		{
+			size_t end = std::min(count, block + GradientCompressor::Int8BlockSize);
+			float largest = 0.0f;
+			for (size_t i = block; i < end; i++)
+				largest = std::max(largest, std::fabs(gradient[i]));
+			for (size_t i = block; i < end; i++)
+				close &= std::fabs(decoded[i] - gradient[i]) <= largest / 127.0f * 0.5f + 1e-6f;
+		}
+		CHECK(close);
+	}
+
+	// Error feedback : over the steps the decoded sum follows the true sum, the gap is only the last residual
+	{
+		GradientCompressor topK(GradientCompression::TopK, 0.05f, true);
+		std::vector<float> truth(count, 0.0f), received(count, 0.0f);
+		for (int step = 0; step < 40; step++)
+		{
+			std::vector<float> g = RandomGradient(count, 100 + step);
+			for (size_t i = 0; i < count; i++)
+				truth[i] += g[i];
+			topK.Encode(g.data(), count, encoded);
+			CHECK(GradientCompressor::DecodeAdd(encoded.data(), encoded.size(), received.data(), count));
+		}
+		double gap = 0.0, total = 0.0;
+		for (size_t i = 0; i < count; i++)
+		{
+			gap += std::fabs(truth[i] - received[i]);
+			total += std::fabs(truth[i]);
+		}
+		CHECK(gap < total);
+	}
+
+	// Wrong count and truncated buffers are refused
+	GradientCompressor none(GradientCompression::None);
+	none.Encode(gradient.data(), count, encoded);
+	std::vector<float> sum(count + 1, 0.0f);
+	CHECK(!GradientCompressor::DecodeAdd(encoded.data(), encoded.size(), sum.data(), count + 1));
+	CHECK(!GradientCompressor::DecodeAdd(encoded.data(), encoded.size() - 1, sum.data(), count));
+
+	return test::Result();
+}
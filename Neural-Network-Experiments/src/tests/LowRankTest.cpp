@@ -0,0 +1,98 @@
+// Low rank layers : training only moves the factors, the dense view (getWeights, SaveModel) still has to be
+// U * V afterwards, and the setters accept every layer index and nothing past the last one. CompressLowRank keeps
+// the budget and picks the smallest rank that does
+#include <cstdio>
+
+#include "TestData.h"
+#include "ml/LowRankCompressor.h"
+#include "ml/ModelFile.h"
+
+int main()
+{
+	const std::string dataPath = "low_rank_digits.csv";
+	const std::string modelPath = "low_rank_test.nnm";
+	CHECK(test::WriteDigits(dataPath, 200, 13));
+	Dataset dataset;
+	CHECK(test::LoadDigits(dataset, dataPath));
+	std::remove(dataPath.c_str());
+	if (test::Failures() > 0)
+		return test::Result();
+
+	Network network({ 784, 64, 32, 10 });
+	network.FactorizeLayer(0, 8);
+	network.FactorizeLayer(1, 4);
+	CHECK(network.isFactorized(0) && network.isFactorized(1) && !network.isFactorized(2));
+
+	Eigen::MatrixXf before = network.getWeights(0);
+	for (int batch = 0; batch < 10; batch++)
+		network.TrainBatch(dataset.getBatch(20), 0.5f);
+
+	for (int layer = 0; layer < 2; layer++)
+		CHECK(network.getWeights(layer).isApprox(network.getFactorU(layer) * network.getFactorV(layer)));
+	CHECK(!network.getWeights(0).isApprox(before));
+
+	// Export goes through the dense view
+	CHECK(SaveModel(network, modelPath));
+	{
+		MappedModel model;
+		CHECK(model.Open(modelPath, true));
+		if (model.isOpen())
+			CHECK(model.getWeights(0) == network.getWeights(0));
+	}
+	std::remove(modelPath.c_str());
+
+	// Expanding keeps the trained product
+	network.TrainBatch(dataset.getBatch(20), 0.5f);
+	Eigen::MatrixXf trained = network.getFactorU(1) * network.getFactorV(1);
+	network.ExpandLayer(1);
+	CHECK(!network.isFactorized(1));
+	CHECK(network.getWeights(1).isApprox(trained));
+
+	// setWeights / setBiases : the last layer index works, one past it is ignored and changes nothing
+	int last = network.getLayerCount() - 2;
+	Eigen::MatrixXf weights = Eigen::MatrixXf::Constant(10, 32, 0.5f);
+	network.setWeights(last, weights);
+	network.setBiases(last, Eigen::VectorXf::Ones(10));
+	CHECK(network.getWeights(last) == weights);
+	CHECK(network.getBiases(last) == Eigen::VectorXf::Ones(10));
+	unsigned long long version = network.getVersion();
+	network.setWeights(last + 1, weights);
+	network.setBiases(last + 1, Eigen::VectorXf::Ones(10));
+	CHECK(network.getVersion() == version);
+
+	// setWeights on a low rank layer replaces it with the dense matrix
+	Eigen::MatrixXf first = Eigen::MatrixXf::Constant(64, 784, 0.01f);
+	network.setWeights(0, first);
+	CHECK(!network.isFactorized(0));
+	CHECK(network.getWeights(0) == first);
+
+	// CompressLowRank on a trained network : within the budget, and one rank less on the first layer would miss it
+	Network compressed({ 784, 64, 32, 10 });
+	for (int epoch = 0; epoch < 20; epoch++)
+		for (int batch = 0; batch < 10; batch++)
+			compressed.TrainBatch(dataset.getBatch(20), 0.5f);
+	std::vector<DataSample> samples;
+	for (size_t i = 0; i < dataset.size(); i++)
+		samples.push_back(dataset.getSample(i));
+	const float budget = 0.05f;
+	Network original = compressed;
+	float baseline = compressed.CalculateAccuracy(samples);
+	std::vector<LowRankLayerReport> reports = CompressLowRank(compressed, dataset, budget);
+	CHECK(reports.size() == 3);
+	float accuracy = compressed.CalculateAccuracy(samples);
+	CHECK(baseline - accuracy <= budget);
+	if (reports.size() == 3)
+	{
+		CHECK(reports[2].accuracy == accuracy);
+		CHECK(reports[0].rank > 0);
+		for (const LowRankLayerReport& report : reports)
+			CHECK((report.rank > 0) == compressed.isFactorized(report.layer));
+		if (reports[0].rank > 1)
+		{
+			original.FactorizeLayer(0, reports[0].rank - 1);
+			CHECK(baseline - original.CalculateAccuracy(samples) > budget);
+		}
+	}
+
+	return test::Result();
+}
@@ -0,0 +1,113 @@
+// Precision::BF16 against FP32 from the same weights on the same batches : bf16 rounds what the backward pass
+// saves, so the weights drift apart a little but the loss and the accuracy have to end up close. Covers both
+// TrainBatch and the per-sample BackPropagation, and checks the fp32 activations are released in bf16 mode.
+// With NN_MNIST_TRAIN and NN_MNIST_TEST set to the MNIST CSV files, the 784-128-64-10 model is also trained in both
+// precisions on the real data and the test accuracies have to agree within a point
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "TestData.h"
+
+static void MnistParity()
+{
+	const char* trainPath = std::getenv("NN_MNIST_TRAIN");
+	const char* testPath = std::getenv("NN_MNIST_TEST");
+	if (!trainPath || !testPath)
+	{
+		std::cout << "MNIST parity skipped (set NN_MNIST_TRAIN and NN_MNIST_TEST)" << std::endl;
+		return;
+	}
+
+	Dataset trainSet, testSet;
+	CHECK(test::LoadDigits(trainSet, trainPath));
+	CHECK(test::LoadDigits(testSet, testPath));
+	if (trainSet.empty() || testSet.empty())
+		return;
+	std::vector<DataSample> testSamples;
+	for (size_t i = 0; i < testSet.size(); i++)
+		testSamples.push_back(testSet.getSample(i));
+
+	Network fp32({ 784, 128, 64, 10 });
+	Network bf16(fp32);
+	bf16.setPrecision(Precision::BF16);
+	trainSet.setSeed(3);
+	const size_t batchSize = 16;
+	for (int epoch = 0; epoch < 3; epoch++)
+	{
+		trainSet.shuffle();
+		for (size_t batch = 0; batch < (trainSet.size() + batchSize - 1) / batchSize; batch++)
+		{
+			std::vector<DataSample> samples = trainSet.getBatch(batchSize);
+			fp32.TrainBatch(samples, 1.0f);
+			bf16.TrainBatch(samples, 1.0f);
+		}
+	}
+
+	float fp32Accuracy = fp32.CalculateAccuracy(testSamples);
+	float bf16Accuracy = bf16.CalculateAccuracy(testSamples);
+	std::cout << "MNIST test accuracy fp32 " << fp32Accuracy << " bf16 " << bf16Accuracy << std::endl;
+	CHECK(fp32Accuracy > 0.9f);
+	CHECK(std::fabs(bf16Accuracy - fp32Accuracy) <= 0.01f);
+}
+
+int main()
+{
+	const std::string dataPath = "mixed_precision_digits.csv";
+	CHECK(test::WriteDigits(dataPath, 600, 21));
+	Dataset dataset;
+	CHECK(test::LoadDigits(dataset, dataPath));
+	std::remove(dataPath.c_str());
+	if (test::Failures() > 0)
+		return test::Result();
+	dataset.setSeed(2);
+
+	std::vector<DataSample> all;
+	for (size_t i = 0; i < dataset.size(); i++)
+		all.push_back(dataset.getSample(i));
+
+	const float learningRate = 0.5f;
+	Network fp32({ 784, 48, 24, 10 });
+	Network bf16(fp32);
+	bf16.setPrecision(Precision::BF16);
+	float initialLoss = fp32.CalculateAverageLoss(all);
+
+	for (int epoch = 0; epoch < 4; epoch++)
+	{
+		dataset.shuffle();
+		for (size_t batch = 0; batch < (dataset.size() + 15) / 16; batch++)
+		{
+			std::vector<DataSample> samples = dataset.getBatch(16);
+			fp32.TrainBatch(samples, learningRate);
+			bf16.TrainBatch(samples, learningRate);
+		}
+	}
+	CHECK(bf16.getLayerOutput(1).size() == 0);
+
+	// A few plain SGD steps through BackPropagation
+	for (size_t i = 0; i < 200; i++)
+	{
+		fp32.BackPropagation(all[i].input, all[i].target, 0.1f);
+		bf16.BackPropagation(all[i].input, all[i].target, 0.1f);
+	}
+	CHECK(bf16.getLayerOutput(1).size() == 0);
+	CHECK(test::Parameters(bf16) != test::Parameters(fp32));	// The bf16 path did run
+
+	float fp32Loss = fp32.CalculateAverageLoss(all);
+	float bf16Loss = bf16.CalculateAverageLoss(all);
+	float fp32Accuracy = fp32.CalculateAccuracy(all);
+	float bf16Accuracy = bf16.CalculateAccuracy(all);
+	std::cout << "loss " << initialLoss << " -> fp32 " << fp32Loss << " bf16 " << bf16Loss
+		<< ", accuracy fp32 " << fp32Accuracy << " bf16 " << bf16Accuracy << std::endl;
+
+	CHECK(fp32Loss < 0.5f * initialLoss);
+	CHECK(std::fabs(bf16Loss - fp32Loss) <= 0.1f * fp32Loss);
+	CHECK(std::fabs(bf16Accuracy - fp32Accuracy) <= 0.02f);
+
+	// Inference still works after bf16 training
+	CHECK(bf16.Forward(all[0].input).size() == 10);
+	CHECK(bf16.getLayerOutput(1).size() == 48);
+
+	MnistParity();
+	return test::Result();
+}
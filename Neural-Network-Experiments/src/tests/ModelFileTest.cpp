@@ -0,0 +1,76 @@
+// SaveModel then MappedModel : same layers, same weights, same outputs. A flipped byte anywhere (payload,
+// layer table, padding) is caught by the checksum, layer sizes that would overflow are refused
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "TestData.h"
+#include "ml/Checkpoint.h"
+#include "ml/ModelFile.h"
+
+int main()
+{
+	const std::string filepath = "model_file_test.nnm";
+	Network network({ 784, 40, 16, 10 });
+	CHECK(SaveModel(network, filepath));
+
+	{
+		MappedModel model;
+		CHECK(model.Open(filepath, true));
+		CHECK(model.getLayerCount() == network.getLayerCount());
+		for (int layer = 0; model.isOpen() && layer < model.getLayerCount(); layer++)
+			CHECK(model.getLayerSize(layer) == network.getLayerSize(layer));
+		for (int layer = 0; model.isOpen() && layer + 1 < model.getLayerCount(); layer++)
+		{
+			CHECK(model.getWeights(layer) == network.getWeights(layer));
+			CHECK(model.getBiases(layer) == network.getBiases(layer));
+		}
+
+		if (model.isOpen())
+		{
+			Eigen::VectorXf input = Eigen::VectorXf::Random(784).cwiseAbs();
+			CHECK(model.Forward(input) == network.Forward(input));
+
+			Eigen::MatrixXf inputs = Eigen::MatrixXf::Random(784, 5).cwiseAbs();
+			CHECK(model.ForwardBatch(inputs).isApprox(network.ForwardBatch(inputs), 1e-5f));
+
+			Network copy = model.ToNetwork();
+			CHECK(test::Parameters(copy) == test::Parameters(network));
+		}
+	}
+
+	std::vector<char> original;
+	{
+		std::ifstream file(filepath, std::ios::binary);
+		original.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+	model_format::FileHeader header;
+	std::memcpy(&header, original.data(), sizeof(header));
+	const size_t tableEnd = sizeof(header) + 4 * sizeof(model_format::LayerEntry);
+	CHECK(tableEnd < header.payloadOffset);
+
+	// Last byte of the payload, a byte of the padding after the layer table, the activation of a layer
+	for (size_t offset : { original.size() - 1, tableEnd + 1, sizeof(header) + sizeof(model_format::LayerEntry) + 4 })
+	{
+		std::vector<char> bytes = original;
+		bytes[offset] ^= 0x40;
+		CHECK(WriteFileDurable(filepath, bytes));
+		MappedModel corrupted;
+		CHECK(!corrupted.Open(filepath, true));
+	}
+
+	// Layer sizes whose product overflows 64 bits
+	{
+		std::vector<char> bytes = original;
+		uint32_t huge = 0xFFFFFFFFu;
+		for (int layer = 0; layer < 2; layer++)
+			std::memcpy(bytes.data() + sizeof(header) + layer * sizeof(model_format::LayerEntry), &huge, sizeof(huge));
+		CHECK(WriteFileDurable(filepath, bytes));
+		MappedModel overflowing;
+		CHECK(!overflowing.Open(filepath, false));
+	}
+
+	std::remove(filepath.c_str());
+	return test::Result();
+}
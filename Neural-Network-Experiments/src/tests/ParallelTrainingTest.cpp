@@ -0,0 +1,75 @@
+// TrainEpochSynchronous with T threads of batchSize samples does the same updates as TrainBatch on batches of
+// T * batchSize samples in the dataset order. Only the order of the gradient sums differs, so the weights agree
+// to rounding. TrainEpochHogwild has no serial equivalent, so it only has to learn : with 2 pool threads racing on the
+// shared weights, accuracy has to go well above chance
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "TestData.h"
+#include "ml/ParallelTraining.h"
+#include "ml/ThreadPool.h"
+
+int main()
+{
+	const std::string dataPath = "parallel_training_digits.csv";
+	CHECK(test::WriteDigits(dataPath, 250, 9));	// Last step is a partial batch
+	Dataset dataset;
+	CHECK(test::LoadDigits(dataset, dataPath));
+	std::remove(dataPath.c_str());
+	if (test::Failures() > 0)
+		return test::Result();
+
+	const int threads = 3;
+	const int batchSize = 8;
+	const float learningRate = 0.5f;
+	dataset.setSeed(4);
+	dataset.shuffle();
+
+	Network parallel({ 784, 32, 10 });
+	Network serial(parallel);
+	std::vector<float> initial = test::Parameters(parallel);
+
+	for (int epoch = 0; epoch < 2; epoch++)
+	{
+		ParallelTrainingStats stats;
+		CHECK(TrainEpochSynchronous(parallel, dataset, threads, learningRate, batchSize, stats));
+		CHECK(stats.samples == static_cast<long long>(dataset.size()));
+
+		size_t globalBatch = threads * batchSize;
+		for (size_t first = 0; first < dataset.size(); first += globalBatch)
+		{
+			std::vector<DataSample> batch;
+			for (size_t i = first; i < std::min(dataset.size(), first + globalBatch); i++)
+				batch.push_back(dataset.getSample(i));
+			serial.TrainBatch(batch, learningRate);
+		}
+	}
+
+	std::vector<float> a = test::Parameters(parallel);
+	std::vector<float> b = test::Parameters(serial);
+	CHECK(a.size() == b.size());
+	float largestDifference = 0.0f;
+	for (size_t i = 0; i < std::min(a.size(), b.size()); i++)
+		largestDifference = std::max(largestDifference, std::fabs(a[i] - b[i]));
+	CHECK(largestDifference < 1e-4f);
+	CHECK(a != initial);
+
+	ThreadPool::Global().setThreadCount(2);
+	std::vector<DataSample> samples;
+	for (size_t i = 0; i < dataset.size(); i++)
+		samples.push_back(dataset.getSample(i));
+	Network hogwild({ 784, 32, 10 });
+	float before = hogwild.CalculateAccuracy(samples);
+	for (int epoch = 0; epoch < 3; epoch++)
+	{
+		ParallelTrainingStats stats;
+		CHECK(TrainEpochHogwild(hogwild, dataset, 2, learningRate, 1, stats));
+		CHECK(stats.updates == static_cast<long long>(dataset.size()));
+	}
+	float after = hogwild.CalculateAccuracy(samples);
+	std::printf("hogwild accuracy %.3f -> %.3f\n", before, after);
+	CHECK(after > 0.8f && after > before + 0.3f);
+
+	return test::Result();
+}
@@ -0,0 +1,66 @@
+// RingAllReduce::Sum over Unix domain sockets with 3 ranks (one thread each) : every rank ends up with the
+// element wise sum, bit identical across ranks, for buffers that don't split evenly into chunks
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+
+#include "TestData.h"
+#include "tools/RingAllReduce.h"
+
+int main()
+{
+	const int world = 3;
+	const size_t sizes[] = { 1, 2, 3, 1000, 100001 };
+
+	std::vector<ring::Peer> peers(world);
+	for (int rank = 0; rank < world; rank++)
+		peers[rank].socketPath = "ring_test_" + std::to_string(::getpid()) + "_" + std::to_string(rank) + ".sock";
+
+	std::vector<std::vector<std::vector<float>>> results(world);
+	std::vector<int> connected(world, 0);
+	std::vector<std::thread> threads;
+	for (int rank = 0; rank < world; rank++)
+		threads.emplace_back([&, rank]()
+			{
+				ring::RingAllReduce ring;
+				if (!ring.Connect(peers, rank, 10.0f))
+					return;
+				connected[rank] = 1;
+				for (size_t count : sizes)
+				{
+					std::vector<float> data(count);
+					for (size_t i = 0; i < count; i++)
+						data[i] = 0.001f * static_cast<float>(i % 997) + (rank + 1) * 0.25f;
+					if (!ring.Sum(data.data(), count))
+						return;
+					results[rank].push_back(data);
+				}
+			});
+	for (std::thread& thread : threads)
+		thread.join();
+
+	for (int rank = 0; rank < world; rank++)
+	{
+		CHECK(connected[rank]);
+		CHECK(results[rank].size() == sizeof(sizes) / sizeof(sizes[0]));
+	}
+	if (test::Failures() > 0)
+		return test::Result();
+
+	for (size_t s = 0; s < results[0].size(); s++)
+	{
+		const std::vector<float>& sum = results[0][s];
+		bool correct = sum.size() == sizes[s];
+		for (size_t i = 0; correct && i < sum.size(); i++)
+		{
+			float expected = 0.0f;
+			for (int rank = 0; rank < world; rank++)
+				expected += 0.001f * static_cast<float>(i % 997) + (rank + 1) * 0.25f;
+			correct = std::fabs(sum[i] - expected) <= 1e-5f * std::fabs(expected);
+		}
+		CHECK(correct);
+		for (int rank = 1; rank < world; rank++)
+			CHECK(std::memcmp(results[rank][s].data(), sum.data(), sum.size() * sizeof(float)) == 0);
+	}
+	return test::Result();
+}
@@ -0,0 +1,73 @@
+// shm_transport::Client after a timeout : the slot stays queued once and untouched until the late answer comes
+// back, then the client works again. The server side is driven by hand from this process
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+
+#include "TestData.h"
+#include "tools/ShmTransport.h"
+
+int main()
+{
+	const std::string name = "/nn-shm-test-" + std::to_string(::getpid());
+	const int inputSize = 4;
+	const int outputSize = 2;
+	shm_transport::Segment server;
+	CHECK(server.Create(name, inputSize, outputSize, 2));
+	shm_transport::Client client(0);
+	CHECK(client.Attach(name));
+	if (test::Failures() > 0)
+		return test::Result();
+
+	const float first[inputSize] = { 1.0f, 2.0f, 3.0f, 4.0f };
+	const float second[inputSize] = { 5.0f, 6.0f, 7.0f, 8.0f };
+	float output[outputSize] = {};
+	int label = -1;
+	float computeUs = 0.0f;
+
+	// Nobody serves : the first request times out, the second one must not overwrite the input or queue the slot again
+	CHECK(!client.Predict(first, output, label, computeUs, 10));
+	CHECK(client.isPending());
+	CHECK(!client.Predict(second, output, label, computeUs, 10));
+	CHECK(client.isPending());
+
+	uint32_t slot = 0;
+	CHECK(server.Pop(slot));
+	uint32_t queuedAgain = 0;
+	CHECK(!server.Pop(queuedAgain));
+	for (int i = 0; i < inputSize; i++)
+		CHECK(server.getInput(slot)[i] == first[i]);
+
+	// Late answer to the first request, then a server that doubles the first two inputs
+	server.getOutput(slot)[0] = -1.0f;
+	server.Answer(slot);
+	std::atomic<bool> stop{ false };
+	std::thread serving([&]()
+		{
+			while (!stop.load())
+			{
+				uint32_t next = 0;
+				if (!server.Pop(next))
+				{
+					server.WaitForRequests(10);
+					continue;
+				}
+				for (int i = 0; i < outputSize; i++)
+					server.getOutput(next)[i] = 2.0f * server.getInput(next)[i];
+				server.getSlot(next).label = 7;
+				server.Answer(next);
+			}
+		});
+
+	CHECK(client.Predict(second, output, label, computeUs, 2000));
+	CHECK(!client.isPending());
+	CHECK(output[0] == 10.0f && output[1] == 12.0f && label == 7);
+	CHECK(client.Predict(first, output, label, computeUs, 2000));
+	CHECK(output[0] == 2.0f && output[1] == 4.0f);
+
+	stop.store(true);
+	serving.join();
+	client.Detach();
+	server.Close();
+	return test::Result();
+}
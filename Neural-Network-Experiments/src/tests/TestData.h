@@ -0,0 +1,63 @@
+#pragma once
+// Shared by the checks in src/tests : a failure counter, and small MNIST shaped datasets written on the fly
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "ml/Dataset.h"
+#include "ml/Network.h"
+
+namespace test
+{
+	inline int& Failures()
+	{
+		static int failures = 0;
+		return failures;
+	}
+
+	// Exit code of the check
+	inline int Result()
+	{
+		if (Failures() > 0)
+			std::cerr << Failures() << " check(s) failed" << std::endl;
+		return Failures() > 0 ? 1 : 0;
+	}
+
+	// Every class lights up its own band of rows on top of some noise, so a small network learns it in an epoch
+	inline bool WriteDigits(const std::string& filepath, int samples, unsigned int seed)
+	{
+		std::ofstream file(filepath);
+		std::mt19937 gen(seed);
+		std::uniform_int_distribution<int> noise(0, 40);
+		for (int i = 0; i < samples; i++)
+		{
+			int label = static_cast<int>(gen() % 10);
+			file << label;
+			for (int pixel = 0; pixel < 784; pixel++)
+			{
+				int row = pixel / 28;
+				bool lit = row >= 2 + label * 2 && row < 4 + label * 2;
+				file << ',' << (lit ? 200 + noise(gen) : noise(gen));
+			}
+			file << '\n';
+		}
+		return static_cast<bool>(file);
+	}
+
+	inline bool LoadDigits(Dataset& dataset, const std::string& filepath)
+	{
+		return dataset.loadMNIST_CSV(filepath) && !dataset.empty();
+	}
+
+	inline std::vector<float> Parameters(const Network& network)
+	{
+		std::vector<float> parameters(network.getParameterCount());
+		network.PackParameters(parameters.data());
+		return parameters;
+	}
+}
+
+#define CHECK(condition) \
+	do { if (!(condition)) { test::Failures()++; std::cerr << "FAILED: " #condition " (" << __FILE__ << ":" << __LINE__ << ")" << std::endl; } } while (0)
@@ -0,0 +1,858 @@
+// nn-dist-train : data parallel training across processes. Every rank trains on its own shard of the dataset
+// (a contiguous index range), computes the gradients of its part of the batch and all ranks sum them every step
+// with a ring all-reduce (RingAllReduce.h), so all replicas apply the same update. --batch is per rank : the global
+// batch is ranks * batch. Rank 0 prints the metrics as JSON lines.
+// With --mode ps there is no lockstep : a parameter server process (ParameterServer.h) holds the weights and the
+// workers pull weights and push gradients at their own pace, with bounded staleness
+//
+//		nn-dist-train --data mnist_train.csv --workers 4 --epochs 5				(4 local processes, Unix sockets)
+//		nn-dist-train --data mnist_train.csv --scaling 1,2,4 --epochs 2			(scaling efficiency report)
+//		nn-dist-train --data mnist_train.csv --rank 0 --peers hostA:7000,hostB:7000	(one process per host)
+//		nn-dist-train --data mnist_train.csv --mode ps --workers 4 --server-threads 2 --staleness 4
+//		nn-dist-train --data mnist_train.csv --test mnist_test.csv --workers 4 --compress none,topk,int8	(bytes vs accuracy)
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/wait.h>
+
+#include "ml/Network.h"
+#include "ml/Dataset.h"
+#include "ml/ModelFile.h"
+#include "ml/PredictionCache.h"
+#include "ml/GradientCompressor.h"
+#include "ml/ThreadPool.h"
+#include "RingAllReduce.h"
+#include "ParameterServer.h"
+
+struct DistOptions
+{
+	std::string dataPath;
+	std::string testPath;
+	int maxSamples = -1;
+	std::vector<int> layers = { 784, 128, 64, 10 };
+	std::string precision = "fp32";
+	float learningRate = 0.1f;
+	int batchSize = 32;
+	int epochs = 10;
+	int seed = 1;
+	std::string savePath;
+	std::string metricsPath;
+
+	// Local launch : fork this many ranks on this host
+	int workers = 1;
+	std::vector<int> scaling;		// Worker counts to compare, empty = a single run
+	std::string transport = "unix";
+	std::string socketDir = "/tmp";
+	int basePort = 7400;			// TCP transport : rank r listens on basePort + r
+
+	// One rank of a ring spread over several hosts
+	int rank = -1;
+	std::vector<ring::Peer> peers;
+
+	// Parameter server
+	std::string mode = "allreduce";
+	int serverThreads = 1;
+	std::vector<int> shardMap;		// Layer -> server thread, empty = balanced by size
+	int staleness = 4;
+	std::string role;				// "server" : only the parameter server, workers elsewhere
+	int world = 0;					// Workers, for --role server and --server
+	ring::Peer server;				// Shard s listens on port + s
+
+	// Gradient compression (all-reduce mode) : one run per entry of compressions
+	std::vector<GradientCompression> compressions = { GradientCompression::None };
+	GradientCompression compression = GradientCompression::None;	// The current run's
+	float topKRatio = 0.01f;
+	bool errorFeedback = true;
+};
+
+static void PrintUsage()
+{
+	std::cerr <<
+		"Usage: nn-dist-train --data <mnist.csv> [options]\n"
+		"  --data <path>             Training set (MNIST CSV)\n"
+		"  --test <path>             Test set, evaluated by rank 0 after every epoch\n"
+		"  --samples <n>             Load at most n training samples\n"
+		"  --layers <a,b,...>        Layer sizes (default 784,128,64,10)\n"
+		"  --precision <name>        fp32 | bf16\n"
+		"  --lr <f>                  Learning rate (default 0.1)\n"
+		"  --batch <n>               Batch size per rank (default 32)\n"
+		"  --epochs <n>              Epochs (default 10)\n"
+		"  --seed <n>                Seed for the initialization and the shuffles (default 1)\n"
+		"  --save <path>             Save the trained model (rank 0)\n"
+		"  --metrics <path>          Write the JSON lines to a file instead of stdout\n"
+		"Local ranks:\n"
+		"  --workers <n>             Processes on this host (default 1)\n"
+		"  --scaling <a,b,...>       Train once per worker count and report the scaling efficiency\n"
+		"  --transport <name>        unix | tcp (default unix)\n"
+		"  --socket-dir <dir>        Unix sockets go here (default /tmp)\n"
+		"  --port <n>                TCP : rank r listens on n + r (default 7400)\n"
+		"Several hosts (start one process per host, same options everywhere):\n"
+		"  --rank <r>                This process' rank\n"
+		"  --peers <h:p,h:p,...>     Every rank's address, in rank order\n"
+		"Parameter server (--mode ps):\n"
+		"  --mode <name>             allreduce | ps (default allreduce)\n"
+		"  --server-threads <n>      Server threads, the layers are split between them by size (default 1)\n"
+		"  --shard-map <a,b,...>     Server thread of every layer instead (0 = first thread)\n"
+		"  --staleness <n>           Gradients computed on weights more than n updates old are dropped (default 4)\n"
+		"  --role server             Only run the server (with --world and --port), workers use --rank, --world, --server\n"
+		"  --world <n>               Number of workers\n"
+		"  --server <host:port>      Server address for workers on other hosts\n"
+		"Gradient compression (all-reduce mode):\n"
+		"  --compress <a,b,...>      none | topk | int8, one run each to compare bytes and accuracy (default none)\n"
+		"  --topk-ratio <f>          Fraction of the gradient entries top-k sends (default 0.01)\n"
+		"  --error-feedback <on|off> Carry what the compression dropped over to the next step (default on)\n";
+}
+
+static bool ParseList(const std::string& text, std::vector<int>& values, int minimum)
+{
+	values.clear();
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ','))
+	{
+		int value = std::atoi(item.c_str());
+		if (value < minimum)
+			return false;
+		values.push_back(value);
+	}
+	return !values.empty();
+}
+
+static bool ParseArguments(int argc, char** argv, DistOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h")
+			return false;
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << arg << std::endl;
+			return false;
+		}
+
+		std::string value = argv[++i];
+		if (arg == "--data") options.dataPath = value;
+		else if (arg == "--test") options.testPath = value;
+		else if (arg == "--samples") options.maxSamples = std::atoi(value.c_str());
+		else if (arg == "--layers")
+		{
+			if (!ParseList(value, options.layers, 1) || options.layers.size() < 2)
+			{
+				std::cerr << "Invalid --layers " << value << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--precision") options.precision = value;
+		else if (arg == "--lr") options.learningRate = std::strtof(value.c_str(), nullptr);
+		else if (arg == "--batch") options.batchSize = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--epochs") options.epochs = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--seed") options.seed = std::atoi(value.c_str());
+		else if (arg == "--save") options.savePath = value;
+		else if (arg == "--metrics") options.metricsPath = value;
+		else if (arg == "--workers") options.workers = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--scaling")
+		{
+			if (!ParseList(value, options.scaling, 1))
+			{
+				std::cerr << "Invalid --scaling " << value << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--transport") options.transport = value;
+		else if (arg == "--socket-dir") options.socketDir = value;
+		else if (arg == "--port") options.basePort = std::atoi(value.c_str());
+		else if (arg == "--rank") options.rank = std::atoi(value.c_str());
+		else if (arg == "--mode") options.mode = value;
+		else if (arg == "--server-threads") options.serverThreads = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--shard-map")
+		{
+			if (!ParseList(value, options.shardMap, 0))
+			{
+				std::cerr << "Invalid --shard-map " << value << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--staleness") options.staleness = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--role") options.role = value;
+		else if (arg == "--world") options.world = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--server")
+		{
+			std::vector<ring::Peer> server;
+			if (!ring::ParsePeers(value, server) || server.size() != 1)
+			{
+				std::cerr << "Invalid --server " << value << std::endl;
+				return false;
+			}
+			options.server = server[0];
+		}
+		else if (arg == "--compress")
+		{
+			options.compressions.clear();
+			std::stringstream stream(value);
+			std::string item;
+			GradientCompression method;
+			while (std::getline(stream, item, ','))
+			{
+				if (!ParseGradientCompression(item, method))
+				{
+					std::cerr << "Unknown compression " << item << " (none, topk, int8)" << std::endl;
+					return false;
+				}
+				options.compressions.push_back(method);
+			}
+			if (options.compressions.empty())
+				return false;
+		}
+		else if (arg == "--topk-ratio") options.topKRatio = std::strtof(value.c_str(), nullptr);
+		else if (arg == "--error-feedback") options.errorFeedback = value != "off" && value != "0";
+		else if (arg == "--peers")
+		{
+			if (!ring::ParsePeers(value, options.peers))
+			{
+				std::cerr << "Invalid --peers " << value << std::endl;
+				return false;
+			}
+		}
+		else
+		{
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+	}
+
+	if (options.dataPath.empty())
+	{
+		std::cerr << "--data is required" << std::endl;
+		return false;
+	}
+	if (options.precision != "fp32" && options.precision != "bf16")
+	{
+		std::cerr << "Unknown precision " << options.precision << " (fp32, bf16)" << std::endl;
+		return false;
+	}
+	if (options.transport != "unix" && options.transport != "tcp")
+	{
+		std::cerr << "Unknown transport " << options.transport << " (unix, tcp)" << std::endl;
+		return false;
+	}
+	if (options.mode != "allreduce" && options.mode != "ps")
+	{
+		std::cerr << "Unknown mode " << options.mode << " (allreduce, ps)" << std::endl;
+		return false;
+	}
+	if (options.mode == "allreduce" && ((options.rank >= 0) != !options.peers.empty() || options.rank >= static_cast<int>(options.peers.size())))
+	{
+		std::cerr << "--rank and --peers go together, and the rank has to be in the peer list" << std::endl;
+		return false;
+	}
+	if (options.topKRatio <= 0.0f || options.topKRatio > 1.0f)
+	{
+		std::cerr << "--topk-ratio has to be in (0, 1]" << std::endl;
+		return false;
+	}
+	if (options.mode == "ps")
+	{
+		if (options.compressions.size() != 1 || options.compressions[0] != GradientCompression::None)
+		{
+			std::cerr << "--compress only applies to --mode allreduce" << std::endl;
+			return false;
+		}
+		bool remoteWorker = options.rank >= 0;
+		if (!options.role.empty() && options.role != "server")
+		{
+			std::cerr << "Unknown role " << options.role << " (server)" << std::endl;
+			return false;
+		}
+		if ((remoteWorker || !options.role.empty()) && options.world <= 0)
+		{
+			std::cerr << "--world is required with --rank or --role server" << std::endl;
+			return false;
+		}
+		if (remoteWorker && (options.server.port == 0 || options.rank >= options.world))
+		{
+			std::cerr << "Workers need --server and a rank below --world" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// What rank 0 reports back to the launcher
+struct RunResult
+{
+	int ok = 0;
+	double trainSeconds = 0.0;		// Training steps only, evaluation excluded
+	double computeSeconds = 0.0;	// Forward + backward + update
+	double allReduceSeconds = 0.0;
+	long long samples = 0;			// All ranks
+	double bytesPerRank = 0.0;
+	float testAccuracy = -1.0f;
+	int inSync = 0;
+	double bytesPerStep = 0.0;		// Sent by rank 0
+	float compressionRatio = 1.0f;	// Raw gradient bytes / encoded bytes
+
+	// Parameter server : totals over the shards
+	long long applied = 0;
+	long long dropped = 0;
+	double meanStaleness = 0.0;
+	long long maxStaleness = 0;
+	double serverBusy = 0.0;		// Busiest shard thread, fraction of the run
+};
+
+static float Accuracy(Network& network, const Dataset& dataset)
+{
+	std::vector<DataSample> all;
+	all.reserve(dataset.size());
+	for (size_t i = 0; i < dataset.size(); i++)
+		all.push_back(dataset.getSample(i));
+	return network.CalculateAccuracy(all);
+}
+
+// Rank's part of the training set : [size * rank / world, size * (rank + 1) / world)
+static std::vector<size_t> ShardIndices(const Dataset& train, int rank, int world)
+{
+	std::vector<size_t> indices(train.size() * (rank + 1) / world - train.size() * rank / world);
+	std::iota(indices.begin(), indices.end(), train.size() * rank / world);
+	return indices;
+}
+
+// One rank : joins the ring, trains, rank 0 writes the metrics
+static RunResult RunRank(const DistOptions& options, const std::vector<ring::Peer>& peers, int rank,
+	const Dataset& train, const Dataset& test, std::ostream& metrics)
+{
+	RunResult result;
+	ring::RingAllReduce ring;
+	if (!ring.Connect(peers, rank))
+		return result;
+	const int world = ring.getWorldSize();
+
+	Network network(options.layers);
+	network.setPrecision(options.precision == "bf16" ? Precision::BF16 : Precision::FP32);
+	if (network.getLayerSize(0) != train.getInputSize() || network.getLayerSize(network.getLayerCount() - 1) != train.getOutputSize())
+	{
+		std::cerr << "Error: The network is " << network.getLayerSize(0) << " -> " << network.getLayerSize(network.getLayerCount() - 1)
+			<< " but the dataset is " << train.getInputSize() << " -> " << train.getOutputSize() << std::endl;
+		return result;
+	}
+
+	// Every rank starts from rank 0's weights
+	std::vector<float> parameters(network.getParameterCount());
+	network.PackParameters(parameters.data());
+	if (!ring.Broadcast(parameters.data(), parameters.size() * sizeof(float)))
+		return result;
+	network.UnpackParameters(parameters.data());
+
+	// Every rank runs the same number of steps per epoch (shards differ by one sample at most,
+	// the last step takes whatever is left)
+	std::vector<size_t> order = ShardIndices(train, rank, world);
+	size_t smallestShard = train.size() / world;
+	int steps = static_cast<int>(std::max<size_t>((smallestShard + options.batchSize - 1) / options.batchSize, 1));
+	std::mt19937 gen(static_cast<unsigned int>(options.seed) * 1000003u + rank);
+
+	NetworkGradients gradients;
+	std::vector<float> buffer;
+	std::vector<DataSample> batch;
+	char line[640];
+
+	// Compressed : every rank encodes its gradients, the blobs are all-gathered and every rank decodes them in
+	// rank order, so the replicas still apply the exact same sum
+	bool compressed = options.compression != GradientCompression::None;
+	GradientCompressor compressor(options.compression, options.topKRatio, options.errorFeedback);
+	std::vector<char> encoded, message;
+	std::vector<std::vector<char>> messages;
+	long long totalSteps = 0;
+
+	for (int epoch = 0; epoch < options.epochs; epoch++)
+	{
+		auto epochStart = std::chrono::steady_clock::now();
+		double epochCompute = 0.0;
+		double epochAllReduce = ring.getSeconds();
+		unsigned long long epochBytes = ring.getBytesSent();
+		long long epochSamples = 0;
+
+		std::shuffle(order.begin(), order.end(), gen);
+		for (int step = 0; step < steps; step++)
+		{
+			auto computeStart = std::chrono::steady_clock::now();
+			size_t first = std::min(order.size(), static_cast<size_t>(step) * options.batchSize);
+			size_t last = step == steps - 1 ? order.size() : std::min(order.size(), first + options.batchSize);
+			batch.clear();
+			for (size_t i = first; i < last; i++)
+				batch.push_back(train.getSample(order[i]));
+			network.ComputeGradients(batch, gradients);
+
+			// Gradients and the sample count in one buffer, one all-reduce per step
+			buffer.resize(gradients.getParameterCount() + 1);
+			gradients.Pack(buffer.data());
+			buffer.back() = static_cast<float>(gradients.samples);
+			if (compressed)
+			{
+				// The sample count goes in front of the encoding, uncompressed
+				compressor.Encode(buffer.data(), buffer.size() - 1, encoded);
+				message.resize(sizeof(float) + encoded.size());
+				std::memcpy(message.data(), &buffer.back(), sizeof(float));
+				std::memcpy(message.data() + sizeof(float), encoded.data(), encoded.size());
+			}
+			auto computed = std::chrono::steady_clock::now();
+
+			if (compressed ? !ring.AllGather(message, messages) : !ring.Sum(buffer.data(), buffer.size()))
+			{
+				std::cerr << "Error: Rank " << rank << " lost the ring" << std::endl;
+				return result;
+			}
+
+			auto reduced = std::chrono::steady_clock::now();
+			if (compressed)
+			{
+				std::fill(buffer.begin(), buffer.end(), 0.0f);
+				for (const std::vector<char>& received : messages)
+				{
+					float samples;
+					if (received.size() < sizeof(float) || !GradientCompressor::DecodeAdd(received.data() + sizeof(float),
+						received.size() - sizeof(float), buffer.data(), buffer.size() - 1))
+					{
+						std::cerr << "Error: Rank " << rank << " received a corrupted gradient" << std::endl;
+						return result;
+					}
+					std::memcpy(&samples, received.data(), sizeof(float));
+					buffer.back() += samples;
+				}
+			}
+			float total = buffer.back();
+			if (total > 0.0f)
+			{
+				gradients.Unpack(buffer.data());
+				network.ApplyGradients(gradients, options.learningRate / total);
+			}
+			epochSamples += static_cast<long long>(total);
+			epochCompute += std::chrono::duration<double>(computed - computeStart).count()
+				+ std::chrono::duration<double>(std::chrono::steady_clock::now() - reduced).count();
+		}
+
+		double trainSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - epochStart).count();
+		epochAllReduce = ring.getSeconds() - epochAllReduce;
+		epochBytes = ring.getBytesSent() - epochBytes;
+		totalSteps += steps;
+		result.trainSeconds += trainSeconds;
+		result.computeSeconds += epochCompute;
+		result.allReduceSeconds += epochAllReduce;
+		result.samples += epochSamples;
+
+		if (rank == 0)
+		{
+			std::snprintf(line, sizeof(line),
+				"{\"type\":\"epoch\",\"epoch\":%d,\"epochs\":%d,\"workers\":%d,\"steps\":%d,\"train_seconds\":%.3f,"
+				"\"samples_per_second\":%.1f,\"compute_seconds\":%.3f,\"allreduce_seconds\":%.3f,\"compression\":\"%s\",\"bytes_per_step\":%.0f",
+				epoch + 1, options.epochs, world, steps, trainSeconds, epochSamples / trainSeconds, epochCompute, epochAllReduce,
+				GradientCompressionName(options.compression), double(epochBytes) / steps);
+			std::string record = line;
+			if (!test.empty())
+			{
+				result.testAccuracy = Accuracy(network, test);
+				std::snprintf(line, sizeof(line), ",\"test_accuracy\":%.6f", result.testAccuracy);
+				record += line;
+			}
+			metrics << record << "}" << std::endl;
+		}
+	}
+
+	// All replicas should hold the exact same weights : compare everyone's hash with rank 0's
+	network.PackParameters(parameters.data());
+	uint64_t hash = HashBytes(parameters.data(), parameters.size() * sizeof(float));
+	uint64_t rootHash = hash;
+	float mismatches = 0.0f;
+	if (!ring.Broadcast(&rootHash, sizeof(rootHash)))
+		return result;
+	mismatches = rootHash == hash ? 0.0f : 1.0f;
+	if (!ring.Sum(&mismatches, 1))
+		return result;
+
+	result.ok = 1;
+	result.inSync = mismatches == 0.0f;
+	result.bytesPerRank = static_cast<double>(ring.getBytesSent());
+	result.bytesPerStep = totalSteps > 0 ? result.bytesPerRank / totalSteps : 0.0;
+	if (compressed)
+		result.compressionRatio = compressor.getStats().getRatio();
+	if (rank == 0 && !options.savePath.empty() && !SaveModel(network, options.savePath))
+		result.ok = 0;
+	return result;
+}
+
+// Layer -> server thread from --shard-map or balanced by size
+static bool BuildShardLayout(const DistOptions& options, param_server::ShardLayout& layout)
+{
+	Network network(options.layers);
+	std::vector<int> layerShards = options.shardMap.empty() ? param_server::ShardLayout::Balance(network, options.serverThreads) : options.shardMap;
+	if (static_cast<int>(layerShards.size()) != network.getLayerCount() - 1)
+	{
+		std::cerr << "Error: --shard-map needs one entry per weight layer (" << network.getLayerCount() - 1 << ")" << std::endl;
+		return false;
+	}
+	layout = param_server::ShardLayout::Build(network, layerShards);
+	for (size_t size : layout.sizes)
+	{
+		if (size == 0)
+		{
+			std::cerr << "Error: Every server thread needs at least one layer" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Parameter server worker : pulls the shards that got too old, computes a batch, pushes the gradients
+static RunResult RunPsWorker(const DistOptions& options, const param_server::ShardLayout& layout, const std::vector<ring::Peer>& endpoints,
+	int rank, int world, const Dataset& train, std::ostream& metrics)
+{
+	RunResult result;
+	Network network(options.layers);
+	network.setPrecision(options.precision == "bf16" ? Precision::BF16 : Precision::FP32);
+	param_server::Client client(layout, options.staleness);
+	if (!client.Connect(endpoints))
+		return result;
+
+	std::vector<size_t> order = ShardIndices(train, rank, world);
+	std::mt19937 gen(static_cast<unsigned int>(options.seed) * 1000003u + rank);
+	std::vector<float> parameters(layout.parameterCount);
+	std::vector<float> buffer(layout.parameterCount);
+	NetworkGradients gradients;
+	std::vector<DataSample> batch;
+	char line[512];
+
+	for (int epoch = 0; epoch < options.epochs; epoch++)
+	{
+		auto epochStart = std::chrono::steady_clock::now();
+		double epochComm = client.getSeconds();
+		long long epochSamples = 0;
+
+		std::shuffle(order.begin(), order.end(), gen);
+		for (size_t first = 0; first < order.size(); first += options.batchSize)
+		{
+			bool refreshed;
+			if (!client.Pull(parameters.data(), refreshed))
+			{
+				std::cerr << "Error: Worker " << rank << " lost the server" << std::endl;
+				return result;
+			}
+			if (refreshed)
+				network.UnpackParameters(parameters.data());
+
+			batch.clear();
+			for (size_t i = first; i < std::min(order.size(), first + options.batchSize); i++)
+				batch.push_back(train.getSample(order[i]));
+			network.ComputeGradients(batch, gradients);
+			gradients.Pack(buffer.data());
+			if (!client.Push(buffer.data(), static_cast<float>(gradients.samples)))
+			{
+				std::cerr << "Error: Worker " << rank << " lost the server" << std::endl;
+				return result;
+			}
+			epochSamples += gradients.samples;
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - epochStart).count();
+		epochComm = client.getSeconds() - epochComm;
+		result.trainSeconds += seconds;
+		result.samples += epochSamples;
+		if (rank == 0)
+		{
+			std::snprintf(line, sizeof(line),
+				"{\"type\":\"epoch\",\"mode\":\"ps\",\"epoch\":%d,\"epochs\":%d,\"workers\":%d,\"train_seconds\":%.3f,"
+				"\"worker_samples_per_second\":%.1f,\"comm_seconds\":%.3f,\"pulls\":%lld,\"dropped\":%lld}",
+				epoch + 1, options.epochs, world, seconds, epochSamples / seconds, epochComm, client.getPullCount(), client.getDroppedCount());
+			metrics << line << std::endl;
+		}
+	}
+	result.ok = 1;
+	return result;
+}
+
+// Parameter server : owns the weights until every worker is done, then evaluates and saves them
+static RunResult RunPsServer(const DistOptions& options, const param_server::ShardLayout& layout, const std::vector<ring::Peer>& endpoints,
+	int workers, const Dataset& test, std::ostream& metrics)
+{
+	RunResult result;
+	Network network(options.layers);
+	std::vector<float> parameters(network.getParameterCount());
+	network.PackParameters(parameters.data());
+
+	param_server::Server server(layout, std::move(parameters), options.learningRate, options.staleness);
+	bool listening = server.Listen(endpoints);
+	auto start = std::chrono::steady_clock::now();
+	bool ok = listening && server.Run(workers);
+	result.trainSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	for (const ring::Peer& endpoint : endpoints)
+		if (!endpoint.socketPath.empty())
+			::unlink(endpoint.socketPath.c_str());
+	if (!ok)
+		return result;
+
+	char line[512];
+	long long stalenessSum = 0;
+	for (int shard = 0; shard < layout.getShardCount(); shard++)
+	{
+		const param_server::ShardStats& stats = server.getStats()[shard];
+		std::string layers;
+		for (size_t layer = 0; layer < layout.layerShards.size(); layer++)
+			if (layout.layerShards[layer] == shard)
+				layers += (layers.empty() ? "" : ",") + std::to_string(layer);
+		std::snprintf(line, sizeof(line),
+			"{\"type\":\"shard\",\"shard\":%d,\"layers\":[%s],\"parameters\":%zu,\"pulls\":%lld,\"pushes\":%lld,\"applied\":%lld,"
+			"\"dropped\":%lld,\"mean_staleness\":%.2f,\"max_staleness\":%lld,\"busy\":%.4f}",
+			shard, layers.c_str(), layout.sizes[shard], stats.pulls, stats.pushes, stats.applied, stats.dropped,
+			stats.applied > 0 ? double(stats.stalenessSum) / stats.applied : 0.0, stats.maxStaleness, stats.busySeconds / result.trainSeconds);
+		metrics << line << std::endl;
+
+		// A batch counts once even though every shard applies a part of it
+		result.samples = std::max(result.samples, stats.samples);
+		result.applied += stats.applied;
+		result.dropped += stats.dropped;
+		stalenessSum += stats.stalenessSum;
+		result.maxStaleness = std::max(result.maxStaleness, stats.maxStaleness);
+		result.serverBusy = std::max(result.serverBusy, stats.busySeconds / result.trainSeconds);
+	}
+	result.meanStaleness = result.applied > 0 ? double(stalenessSum) / result.applied : 0.0;
+
+	network.UnpackParameters(server.getParameters().data());
+	if (!test.empty())
+		result.testAccuracy = Accuracy(network, test);
+	result.ok = 1;
+	if (!options.savePath.empty() && !SaveModel(network, options.savePath))
+		result.ok = 0;
+	return result;
+}
+
+// Forks the ranks of a local ring (or the parameter server and its workers) and waits for them. Rank 0's result
+// (the server's with --mode ps) comes back through a pipe
+static RunResult LaunchLocal(const DistOptions& options, int workers, const Dataset& train, const Dataset& test, std::ostream& metrics)
+{
+	bool ps = options.mode == "ps";
+	param_server::ShardLayout layout;
+	if (ps && !BuildShardLayout(options, layout))
+		return RunResult();
+
+	// Ring ranks, or the server's shards
+	int endpointCount = ps ? layout.getShardCount() : workers;
+	std::vector<ring::Peer> peers(endpointCount);
+	for (int i = 0; i < endpointCount; i++)
+	{
+		if (options.transport == "unix")
+			peers[i].socketPath = options.socketDir + (ps ? "/nn-ps-" : "/nn-dist-") + std::to_string(::getpid()) + "-" + std::to_string(i) + ".sock";
+		else
+			peers[i].port = options.basePort + i;
+	}
+
+	RunResult result;
+	int channel[2];
+	if (::pipe(channel) != 0)
+	{
+		std::perror("pipe");
+		return result;
+	}
+
+	metrics.flush();
+	std::cerr.flush();
+	std::vector<pid_t> children;
+	int processes = ps ? workers + 1 : workers;
+	for (int process = 0; process < processes; process++)
+	{
+		pid_t pid = ::fork();
+		if (pid < 0)
+		{
+			std::perror("fork");
+			break;
+		}
+		if (pid == 0)
+		{
+			// Child : one rank, one core. With --mode ps process 0 is the server, the workers come after
+			::close(channel[0]);
+			Eigen::setNbThreads(1);
+			RunResult rankResult;
+			if (!ps)
+				rankResult = RunRank(options, peers, process, train, test, metrics);
+			else if (process == 0)
+				rankResult = RunPsServer(options, layout, peers, workers, test, metrics);
+			else
+				rankResult = RunPsWorker(options, layout, peers, process - 1, workers, train, metrics);
+			metrics.flush();
+			if (process == 0 && ::write(channel[1], &rankResult, sizeof(rankResult)) != sizeof(rankResult))	// Atomic below PIPE_BUF
+				rankResult.ok = 0;
+			std::_Exit(rankResult.ok ? 0 : 1);
+		}
+		children.push_back(pid);
+	}
+	::close(channel[1]);
+
+	// A pipe isn't a socket, so read() instead of ReadAll
+	size_t received = 0;
+	char* bytes = reinterpret_cast<char*>(&result);
+	ssize_t count;
+	while (received < sizeof(result) && (count = ::read(channel[0], bytes + received, sizeof(result) - received)) > 0)
+		received += count;
+	::close(channel[0]);
+	if (received != sizeof(result))
+		result = RunResult();
+
+	bool failed = static_cast<int>(children.size()) != processes;
+	for (pid_t child : children)
+	{
+		int status = 0;
+		::waitpid(child, &status, 0);
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	}
+	if (failed)
+		result.ok = 0;
+	return result;
+}
+
+// Summary line of a run. speedup < 0 leaves out the speedup and the efficiency
+static std::string ResultToJson(const char* type, const DistOptions& options, int workers, const RunResult& result, double speedup)
+{
+	// Pieces formatted one at a time and appended, the record grows with the mode and the compression
+	char line[512];
+	std::snprintf(line, sizeof(line),
+		"{\"type\":\"%s\",\"mode\":\"%s\",\"workers\":%d,\"transport\":\"%s\",\"seconds\":%.3f,\"samples_per_second\":%.1f",
+		type, options.mode.c_str(), workers, options.transport.c_str(), result.trainSeconds, result.samples / result.trainSeconds);
+	std::string record = line;
+	if (options.mode == "ps")
+	{
+		std::snprintf(line, sizeof(line),
+			",\"staleness_bound\":%d,\"applied\":%lld,\"dropped\":%lld,\"mean_staleness\":%.2f,\"max_staleness\":%lld,\"server_busy\":%.4f",
+			options.staleness, result.applied, result.dropped, result.meanStaleness, result.maxStaleness, result.serverBusy);
+		record += line;
+	}
+	else
+	{
+		std::snprintf(line, sizeof(line),
+			",\"compute_seconds\":%.3f,\"allreduce_seconds\":%.3f,\"allreduce_fraction\":%.4f,\"allreduce_mb_per_rank\":%.2f,\"replicas_in_sync\":%s"
+			",\"compression\":\"%s\",\"bytes_per_step\":%.0f",
+			result.computeSeconds, result.allReduceSeconds, result.allReduceSeconds / result.trainSeconds,
+			result.bytesPerRank / 1e6, result.inSync ? "true" : "false", GradientCompressionName(options.compression), result.bytesPerStep);
+		record += line;
+		if (options.compression != GradientCompression::None)
+		{
+			std::snprintf(line, sizeof(line), ",\"compression_ratio\":%.2f,\"error_feedback\":%s",
+				result.compressionRatio, options.errorFeedback ? "true" : "false");
+			record += line;
+		}
+		if (options.compression == GradientCompression::TopK)
+		{
+			std::snprintf(line, sizeof(line), ",\"topk_ratio\":%g", options.topKRatio);
+			record += line;
+		}
+	}
+	if (speedup >= 0.0)
+	{
+		std::snprintf(line, sizeof(line), ",\"speedup\":%.3f,\"efficiency\":%.3f", speedup, speedup / workers);
+		record += line;
+	}
+	if (result.testAccuracy >= 0.0f)
+	{
+		std::snprintf(line, sizeof(line), ",\"test_accuracy\":%.6f", result.testAccuracy);
+		record += line;
+	}
+	return record + "}";
+}
+
+int main(int argc, char** argv)
+{
+	DistOptions options;
+	if (!ParseArguments(argc, argv, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	// The ml code logs with std::cout, keep stdout for the metrics only
+	std::ofstream metricsFile;
+	std::ostream metrics(std::cout.rdbuf());
+	if (!options.metricsPath.empty())
+	{
+		metricsFile.open(options.metricsPath);
+		if (!metricsFile.is_open())
+		{
+			std::cerr << "Error: Could not open file " << options.metricsPath << std::endl;
+			return 1;
+		}
+		metrics.rdbuf(metricsFile.rdbuf());
+	}
+	std::cout.rdbuf(std::cerr.rdbuf());
+
+	// Each rank is one process on one core
+	Eigen::setNbThreads(1);
+	std::srand(static_cast<unsigned int>(options.seed)); // Eigen's Random() uses rand()
+
+	// Loaded once before forking, the ranks share the pages
+	Dataset train;
+	if (!train.loadMNIST_CSV(options.dataPath, options.maxSamples) || train.empty())
+		return 1;
+	Dataset test;
+	if (!options.testPath.empty() && (!test.loadMNIST_CSV(options.testPath) || test.empty()))
+		return 1;
+
+	// The ranks are the parallelism, and pool threads don't survive fork() : from here on the pool runs inline
+	ThreadPool::Global().setThreadCount(1);
+
+	if (options.mode == "ps" && (options.rank >= 0 || !options.role.empty()))
+	{
+		// One side of a parameter server spread over several hosts, shard s on port + s
+		options.transport = "tcp";
+		param_server::ShardLayout layout;
+		if (!BuildShardLayout(options, layout))
+			return 1;
+		std::vector<ring::Peer> endpoints(layout.getShardCount(), options.server);
+		for (int shard = 0; shard < layout.getShardCount(); shard++)
+			endpoints[shard].port = (options.role == "server" ? options.basePort : options.server.port) + shard;
+
+		if (options.role == "server")
+		{
+			RunResult result = RunPsServer(options, layout, endpoints, options.world, test, metrics);
+			if (result.ok)
+				metrics << ResultToJson("done", options, options.world, result, -1.0) << std::endl;
+			return result.ok ? 0 : 1;
+		}
+		return RunPsWorker(options, layout, endpoints, options.rank, options.world, train, metrics).ok ? 0 : 1;
+	}
+	bool ok = true;
+	for (GradientCompression compression : options.compressions)
+	{
+		// Same seed for every compression, the runs only differ by the gradient exchange
+		options.compression = compression;
+		std::srand(static_cast<unsigned int>(options.seed));
+		if (options.rank >= 0)
+		{
+			options.transport = "tcp";
+			RunResult result = RunRank(options, options.peers, options.rank, train, test, metrics);
+			if (result.ok && options.rank == 0)
+				metrics << ResultToJson("done", options, static_cast<int>(options.peers.size()), result, -1.0) << std::endl;
+			ok &= result.ok != 0;
+			continue;
+		}
+
+		// Speedup and efficiency against the per rank throughput of the first count (normally 1)
+		std::vector<int> counts = options.scaling.empty() ? std::vector<int>{ options.workers } : options.scaling;
+		double baseline = 0.0;
+		int baselineWorkers = counts[0];
+		for (int workers : counts)
+		{
+			RunResult result = LaunchLocal(options, workers, train, test, metrics);
+			if (!result.ok)
+			{
+				std::cerr << "Error: The run with " << workers << " workers failed" << std::endl;
+				ok = false;
+				continue;
+			}
+
+			double throughput = result.samples / result.trainSeconds;
+			if (baseline == 0.0)
+				baseline = throughput / baselineWorkers;
+			if (options.scaling.empty())
+				metrics << ResultToJson("done", options, workers, result, -1.0) << std::endl;
+			else
+				metrics << ResultToJson("scaling", options, workers, result, throughput / baseline) << std::endl;
+		}
+	}
+	return ok ? 0 : 1;
+}
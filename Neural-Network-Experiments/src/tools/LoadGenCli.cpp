@@ -0,0 +1,281 @@
+// nn-loadgen : closed loop load generator for nn-serve. Every connection sends a request as soon as the previous
+// answer arrives, so --connections is the number of requests in flight. Prints the client side latency
+// percentiles and throughput, then the server's own metrics
+//
+//		nn-loadgen --socket /tmp/nn.sock --connections 64 --duration 10 --data mnist_test.csv
+//		nn-loadgen --shm /nn-serve --connections 4 --duration 10
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+
+#include "ml/Dataset.h"
+#include "ml/BatchPredictor.h"
+#include "ServeProtocol.h"
+#include "ShmTransport.h"
+
+struct LoadOptions
+{
+	serve_protocol::Endpoint endpoint;
+	std::string shmName;
+	int spinUs = 200;
+	int connections = 16;
+	long long requests = 0;		// Total, 0 = use the duration
+	float duration = 10.0f;
+	std::string dataPath;		// Empty = random inputs
+	int inputSize = 784;
+};
+
+static void PrintUsage()
+{
+	std::cerr <<
+		"Usage: nn-loadgen (--socket <path> | --port <n> | --shm <name>) [options]\n"
+		"  --socket <path>           Server Unix domain socket\n"
+		"  --port <n>                Server port on 127.0.0.1\n"
+		"  --shm <name>              Server shared memory segment\n"
+		"  --spin-us <n>             Shared memory clients poll this long before sleeping (default 200)\n"
+		"  --connections <n>         Concurrent connections / shared memory clients (default 16)\n"
+		"  --requests <n>            Stop after n requests in total\n"
+		"  --duration <seconds>      Stop after this long (default 10)\n"
+		"  --data <path>             Send MNIST CSV samples and check the labels\n"
+		"  --input-size <n>          Random inputs of this size without --data (default 784)\n";
+}
+
+static bool ParseArguments(int argc, char** argv, LoadOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h")
+			return false;
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << arg << std::endl;
+			return false;
+		}
+
+		std::string value = argv[++i];
+		if (arg == "--socket") options.endpoint.socketPath = value;
+		else if (arg == "--port") options.endpoint.port = std::atoi(value.c_str());
+		else if (arg == "--shm") options.shmName = value[0] == '/' ? value : "/" + value;
+		else if (arg == "--spin-us") options.spinUs = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--connections") options.connections = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--requests") options.requests = std::max(std::atoll(value.c_str()), 0LL);
+		else if (arg == "--duration") options.duration = std::strtof(value.c_str(), nullptr);
+		else if (arg == "--data") options.dataPath = value;
+		else if (arg == "--input-size") options.inputSize = std::max(std::atoi(value.c_str()), 1);
+		else
+		{
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+	}
+
+	if (options.shmName.empty() && options.endpoint.socketPath.empty() && (options.endpoint.port <= 0 || options.endpoint.port > 65535))
+	{
+		std::cerr << "--socket, --shm or a valid --port is required" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	LoadOptions options;
+	if (!ParseArguments(argc, argv, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+	std::ostream metrics(std::cout.rdbuf());
+	std::cout.rdbuf(std::cerr.rdbuf());
+
+	// Inputs to cycle through, and their labels (-1 = random input)
+	std::vector<std::vector<float>> inputs;
+	std::vector<int> labels;
+	if (!options.dataPath.empty())
+	{
+		Dataset dataset;
+		if (!dataset.loadMNIST_CSV(options.dataPath, 10000) || dataset.empty())
+			return 1;
+		for (size_t i = 0; i < dataset.size(); i++)
+		{
+			const DataSample& sample = dataset.getSample(i);
+			inputs.emplace_back(sample.input.data(), sample.input.data() + sample.input.size());
+			labels.push_back(sample.label);
+		}
+	}
+	else
+	{
+		std::mt19937 gen(42);
+		std::uniform_real_distribution<float> pixel(0.0f, 1.0f);
+		for (int i = 0; i < 256; i++)
+		{
+			inputs.emplace_back(options.inputSize);
+			for (float& value : inputs.back())
+				value = pixel(gen);
+			labels.push_back(-1);
+		}
+	}
+
+	std::atomic<long long> issued{ 0 };
+	std::atomic<long long> errors{ 0 };
+	std::atomic<long long> correct{ 0 };
+	std::atomic<long long> labeled{ 0 };
+	std::mutex latencyMutex;
+	LatencyHistogram latency;
+	LatencyHistogram transport;	// Shared memory : round trip minus the server's compute time
+
+	auto start = std::chrono::steady_clock::now();
+	auto deadline = start + std::chrono::microseconds(static_cast<long long>(options.duration * 1e6));
+
+	auto client = [&](int id)
+	{
+		int fd = serve_protocol::Connect(options.endpoint);
+		if (fd < 0)
+		{
+			errors++;
+			return;
+		}
+
+		LatencyHistogram local;
+		std::vector<char> request;
+		std::vector<float> outputs;
+		size_t next = id;
+		while (true)
+		{
+			if (options.requests > 0 ? issued++ >= options.requests : std::chrono::steady_clock::now() >= deadline)
+				break;
+
+			const std::vector<float>& input = inputs[next % inputs.size()];
+			uint32_t count = static_cast<uint32_t>(input.size());
+			request.resize(4 + count * sizeof(float));
+			std::memcpy(request.data(), &count, 4);
+			std::memcpy(request.data() + 4, input.data(), count * sizeof(float));
+
+			auto sent = std::chrono::steady_clock::now();
+			int32_t header[2];
+			if (!serve_protocol::WriteAll(fd, request.data(), request.size()) || !serve_protocol::ReadAll(fd, header, sizeof(header)))
+			{
+				errors++;
+				break;
+			}
+			outputs.resize(static_cast<uint32_t>(header[1]));
+			if (!serve_protocol::ReadAll(fd, outputs.data(), outputs.size() * sizeof(float)) || header[0] < 0)
+			{
+				errors++;
+				break;
+			}
+			local.Record(std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - sent).count());
+
+			int label = labels[next % labels.size()];
+			if (label >= 0)
+			{
+				labeled++;
+				if (label == header[0])
+					correct++;
+			}
+			next += options.connections;
+		}
+		::close(fd);
+
+		std::lock_guard<std::mutex> lock(latencyMutex);
+		latency.Merge(local);
+	};
+
+	auto shmClient = [&](int id)
+	{
+		shm_transport::Client connection(options.spinUs);
+		if (!connection.Attach(options.shmName) || connection.getInputSize() != static_cast<int>(inputs[0].size()))
+		{
+			errors++;
+			return;
+		}
+
+		LatencyHistogram local;
+		LatencyHistogram localTransport;
+		std::vector<float> outputs(connection.getOutputSize());
+		size_t next = id;
+		while (true)
+		{
+			if (options.requests > 0 ? issued++ >= options.requests : std::chrono::steady_clock::now() >= deadline)
+				break;
+
+			int label;
+			float computeUs;
+			auto sent = std::chrono::steady_clock::now();
+			if (!connection.Predict(inputs[next % inputs.size()].data(), outputs.data(), label, computeUs))
+			{
+				errors++;
+				break;
+			}
+			float roundTripUs = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - sent).count();
+			local.Record(roundTripUs);
+			localTransport.Record(std::max(roundTripUs - computeUs, 0.0f));
+
+			int expected = labels[next % labels.size()];
+			if (expected >= 0)
+			{
+				labeled++;
+				if (expected == label)
+					correct++;
+			}
+			next += options.connections;
+		}
+
+		std::lock_guard<std::mutex> lock(latencyMutex);
+		latency.Merge(local);
+		transport.Merge(localTransport);
+	};
+
+	std::vector<std::thread> clients;
+	for (int i = 0; i < options.connections; i++)
+	{
+		if (options.shmName.empty())
+			clients.emplace_back(client, i);
+		else
+			clients.emplace_back(shmClient, i);
+	}
+	for (auto& thread : clients)
+		thread.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	char line[512];
+	std::snprintf(line, sizeof(line),
+		"{\"type\":\"loadgen\",\"connections\":%d,\"requests\":%lld,\"errors\":%lld,\"seconds\":%.3f,\"requests_per_second\":%.1f,"
+		"\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+		options.connections, latency.getCount(), errors.load(), seconds, latency.getCount() / seconds,
+		latency.getMeanUs(), latency.Percentile(0.5f), latency.Percentile(0.9f), latency.Percentile(0.99f),
+		latency.Percentile(0.999f), latency.getMaxUs());
+	std::string record = line;
+	if (labeled > 0)
+	{
+		std::snprintf(line, sizeof(line), ",\"accuracy\":%.6f", double(correct) / labeled);
+		record += line;
+	}
+	if (transport.getCount() > 0)
+	{
+		std::snprintf(line, sizeof(line), ",\"transport_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f}",
+			transport.getMeanUs(), transport.Percentile(0.5f), transport.Percentile(0.99f));
+		record += line;
+	}
+	metrics << record << "}" << std::endl;
+	if (!options.shmName.empty())
+		return errors > 0 ? 1 : 0;	// The server prints its own metrics
+
+	// Server side view : batch sizes and the latency without the socket round trip
+	int fd = serve_protocol::Connect(options.endpoint);
+	uint32_t statsRequest = serve_protocol::StatsRequest;
+	uint32_t statsLength;
+	if (fd >= 0 && serve_protocol::WriteAll(fd, &statsRequest, 4) && serve_protocol::ReadAll(fd, &statsLength, 4))
+	{
+		std::string json(statsLength, '\0');
+		if (serve_protocol::ReadAll(fd, &json[0], statsLength))
+			metrics << json << std::endl;
+	}
+	if (fd >= 0)
+		::close(fd);
+
+	return errors > 0 ? 1 : 0;
+}
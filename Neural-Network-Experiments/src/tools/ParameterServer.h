@@ -0,0 +1,414 @@
+#pragma once
+// Asynchronous parameter server (POSIX sockets, Linux build only). The server process holds the authoritative
+// parameters (Network::PackParameters layout) split into shards by layer, one server thread per shard with its own
+// endpoint. Workers pull the shards, compute gradients on their copy and push them back; every shard applies
+// each gradient as soon as it arrives, nobody waits for the slowest worker.
+// Staleness is bounded : every shard counts its updates (its version), a gradient computed on version v that
+// arrives when the shard is at version c is dropped when c - v > maxStaleness, and workers pull again before their
+// copy gets that old. Messages on a shard connection (little endian) :
+//
+//		pull			uint32 PullRequest							-> uint64 version, the shard's floats
+//		push			uint32 PushRequest, uint64 version,
+//						float samples, the shard's gradient floats	-> uint64 version, uint32 accepted
+//		done			uint32 DoneRequest							(no answer, the worker hangs up)
+#include <atomic>
+#include <thread>
+
+#include "ml/Network.h"
+#include "RingAllReduce.h"
+
+namespace param_server
+{
+	constexpr uint32_t PullRequest = 1;
+	constexpr uint32_t PushRequest = 2;
+	constexpr uint32_t DoneRequest = 3;
+
+	// Which parts of the flat parameter array every shard owns : a layer's weights (U and V when factorized)
+	// and its biases, which PackParameters stores apart
+	struct ShardLayout
+	{
+		std::vector<std::vector<std::pair<size_t, size_t>>> ranges;	// [shard] = [begin, end) ranges
+		std::vector<size_t> sizes;									// [shard] = floats
+		std::vector<int> layerShards;								// [layer] = shard
+		size_t parameterCount = 0;
+
+		int getShardCount() const { return static_cast<int>(sizes.size()); }
+
+		// layerShards[layer] = server thread of the layer, threads 0..max
+		static ShardLayout Build(const Network& network, const std::vector<int>& layerShards)
+		{
+			ShardLayout layout;
+			layout.layerShards = layerShards;
+			int shards = *std::max_element(layerShards.begin(), layerShards.end()) + 1;
+			layout.ranges.resize(shards);
+			layout.sizes.assign(shards, 0);
+
+			int layers = network.getLayerCount() - 1;
+			size_t offset = 0;
+			for (int layer = 0; layer < layers; layer++)
+			{
+				size_t size = network.isFactorized(layer) ? network.getFactorU(layer).size() + network.getFactorV(layer).size()
+					: network.getWeights(layer).size();
+				layout.ranges[layerShards[layer]].emplace_back(offset, offset + size);
+				offset += size;
+			}
+			for (int layer = 0; layer < layers; layer++)
+			{
+				size_t size = network.getBiases(layer).size();
+				layout.ranges[layerShards[layer]].emplace_back(offset, offset + size);
+				offset += size;
+			}
+			for (int shard = 0; shard < shards; shard++)
+				for (const auto& range : layout.ranges[shard])
+					layout.sizes[shard] += range.second - range.first;
+			layout.parameterCount = offset;
+			return layout;
+		}
+
+		// Biggest layers first, each one to the least loaded thread
+		static std::vector<int> Balance(const Network& network, int threads)
+		{
+			int layers = network.getLayerCount() - 1;
+			std::vector<int> order(layers);
+			std::iota(order.begin(), order.end(), 0);
+			auto layerSize = [&](int layer) { return network.getWeights(layer).size() + network.getBiases(layer).size(); };
+			std::sort(order.begin(), order.end(), [&](int a, int b) { return layerSize(a) > layerSize(b); });
+
+			threads = std::max(std::min(threads, layers), 1);
+			std::vector<long long> load(threads, 0);
+			std::vector<int> layerShards(layers, 0);
+			for (int layer : order)
+			{
+				int shard = static_cast<int>(std::min_element(load.begin(), load.end()) - load.begin());
+				layerShards[layer] = shard;
+				load[shard] += layerSize(layer);
+			}
+
+			// Renumber in layer order so that shard 0 is the first layer's
+			std::vector<int> renumber(threads, -1);
+			int next = 0;
+			for (int& shard : layerShards)
+			{
+				if (renumber[shard] < 0)
+					renumber[shard] = next++;
+				shard = renumber[shard];
+			}
+			return layerShards;
+		}
+
+		void Gather(int shard, const float* flat, float* out) const
+		{
+			for (const auto& range : ranges[shard])
+				out = std::copy(flat + range.first, flat + range.second, out);
+		}
+
+		void Scatter(int shard, const float* in, float* flat) const
+		{
+			for (const auto& range : ranges[shard])
+			{
+				std::copy(in, in + (range.second - range.first), flat + range.first);
+				in += range.second - range.first;
+			}
+		}
+	};
+
+	struct ShardStats
+	{
+		long long pulls = 0;
+		long long pushes = 0;
+		long long applied = 0;
+		long long dropped = 0;				// Too stale
+		long long samples = 0;				// In applied gradients
+		long long stalenessSum = 0;			// Over the applied gradients
+		long long maxStaleness = 0;
+		double busySeconds = 0.0;			// Serving requests (copies + updates)
+	};
+
+	class Server
+	{
+	private:
+		ShardLayout m_Layout;
+		std::vector<float> m_Parameters;	// Each shard thread only touches its own ranges
+		float m_LearningRate;
+		int m_MaxStaleness;
+		std::vector<int> m_ListenFds;
+		std::vector<ShardStats> m_Stats;
+
+		bool ServeShard(int shard, int workers, float timeoutSeconds)
+		{
+			// Every worker connects to every shard once
+			std::vector<int> fds;
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<int>(timeoutSeconds * 1000));
+			while (static_cast<int>(fds.size()) < workers)
+			{
+				pollfd accepting = { m_ListenFds[shard], POLLIN, 0 };
+				int waitMs = static_cast<int>(std::max<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now()).count(), 0));
+				if (::poll(&accepting, 1, waitMs) <= 0)
+					break;
+				int fd = ::accept(m_ListenFds[shard], nullptr, nullptr);
+				if (fd < 0)
+					continue;
+				int noDelay = 1;	// Small answers, don't let them wait for an ACK (fails harmlessly on Unix sockets)
+				::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+				fds.push_back(fd);
+			}
+			::close(m_ListenFds[shard]);
+			m_ListenFds[shard] = -1;
+			if (static_cast<int>(fds.size()) < workers)
+			{
+				std::cerr << "Error: Shard " << shard << " only got " << fds.size() << " of " << workers << " workers" << std::endl;
+				for (int fd : fds)
+					::close(fd);
+				return false;
+			}
+
+			ShardStats& stats = m_Stats[shard];
+			uint64_t version = 0;
+			std::vector<float> values(m_Layout.sizes[shard]);
+			std::vector<char> pullAnswer;
+			std::vector<pollfd> polls(workers);
+			for (int i = 0; i < workers; i++)
+				polls[i] = { fds[i], POLLIN, 0 };
+			int active = workers;
+			bool ok = true;
+
+			while (active > 0)
+			{
+				if (::poll(polls.data(), polls.size(), 60000) <= 0)
+				{
+					ok = false;
+					break;
+				}
+				for (pollfd& worker : polls)
+				{
+					if (worker.fd < 0 || !(worker.revents & (POLLIN | POLLHUP | POLLERR)))
+						continue;
+
+					uint32_t type;
+					bool served = serve_protocol::ReadAll(worker.fd, &type, sizeof(type));
+					auto start = std::chrono::steady_clock::now();
+					if (served && type == PullRequest)
+					{
+						// Version and values in one send
+						pullAnswer.resize(8 + values.size() * sizeof(float));
+						std::memcpy(pullAnswer.data(), &version, 8);
+						m_Layout.Gather(shard, m_Parameters.data(), reinterpret_cast<float*>(pullAnswer.data() + 8));
+						served = serve_protocol::WriteAll(worker.fd, pullAnswer.data(), pullAnswer.size());
+						stats.pulls++;
+					}
+					else if (served && type == PushRequest)
+					{
+						uint64_t basedOn;
+						float samples;
+						served = serve_protocol::ReadAll(worker.fd, &basedOn, sizeof(basedOn))
+							&& serve_protocol::ReadAll(worker.fd, &samples, sizeof(samples))
+							&& serve_protocol::ReadAll(worker.fd, values.data(), values.size() * sizeof(float));
+						start = std::chrono::steady_clock::now();	// Don't count the wait for the gradient
+						long long staleness = static_cast<long long>(version - basedOn);
+						uint32_t accepted = served && staleness <= m_MaxStaleness && samples > 0.0f;
+						if (accepted)
+						{
+							// Same update as Network::ApplyGradients, on this shard's ranges
+							float step = m_LearningRate / samples;
+							const float* gradient = values.data();
+							for (const auto& range : m_Layout.ranges[shard])
+								for (size_t i = range.first; i < range.second; i++)
+									m_Parameters[i] -= step * *gradient++;
+							version++;
+							stats.applied++;
+							stats.samples += static_cast<long long>(samples);
+							stats.stalenessSum += staleness;
+							stats.maxStaleness = std::max(stats.maxStaleness, staleness);
+						}
+						else
+							stats.dropped++;
+						stats.pushes++;
+						char answer[12];
+						std::memcpy(answer, &version, 8);
+						std::memcpy(answer + 8, &accepted, 4);
+						served = served && serve_protocol::WriteAll(worker.fd, answer, sizeof(answer));
+					}
+					else if (served && type == DoneRequest)
+						served = false;
+					else if (served)
+						ok = false;		// Unknown request
+
+					stats.busySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+					if (!served)
+					{
+						::close(worker.fd);
+						worker.fd = -1;
+						active--;
+					}
+				}
+			}
+			for (pollfd& worker : polls)
+				if (worker.fd >= 0)
+					::close(worker.fd);
+			return ok;
+		}
+
+	public:
+		Server(const ShardLayout& layout, std::vector<float> parameters, float learningRate, int maxStaleness)
+			: m_Layout(layout), m_Parameters(std::move(parameters)), m_LearningRate(learningRate),
+			m_MaxStaleness(std::max(maxStaleness, 0)), m_Stats(layout.getShardCount())
+		{
+		}
+
+		~Server()
+		{
+			for (int fd : m_ListenFds)
+				if (fd >= 0)
+					::close(fd);
+		}
+
+		// endpoints[shard]. Listening before the workers start, so they can connect right away
+		bool Listen(const std::vector<ring::Peer>& endpoints)
+		{
+			for (const ring::Peer& endpoint : endpoints)
+			{
+				m_ListenFds.push_back(ring::ListenPeer(endpoint));
+				if (m_ListenFds.back() < 0)
+					return false;
+			}
+			return static_cast<int>(m_ListenFds.size()) == m_Layout.getShardCount();
+		}
+
+		// Serves until every worker said it's done, one thread per shard
+		bool Run(int workers, float timeoutSeconds = 30.0f)
+		{
+			std::vector<std::thread> threads;
+			std::atomic<int> failures{ 0 };
+			for (int shard = 0; shard < m_Layout.getShardCount(); shard++)
+			{
+				threads.emplace_back([this, shard, workers, timeoutSeconds, &failures]()
+				{
+					if (!ServeShard(shard, workers, timeoutSeconds))
+						failures++;
+				});
+			}
+			for (auto& thread : threads)
+				thread.join();
+			return failures == 0;
+		}
+
+		const std::vector<float>& getParameters() const { return m_Parameters; }
+		const std::vector<ShardStats>& getStats() const { return m_Stats; }
+	};
+
+	// A worker's connections to every shard. Requests go out to all shards first and the answers are read
+	// afterwards, so the shard threads work in parallel
+	class Client
+	{
+	private:
+		ShardLayout m_Layout;
+		std::vector<int> m_Fds;
+		std::vector<uint64_t> m_Versions;	// Of the copy last pulled
+		std::vector<bool> m_Stale;			// Pull before the next step
+		int m_MaxStaleness;
+		std::vector<float> m_Buffer;
+		std::vector<char> m_Message;
+
+		double m_Seconds = 0.0;
+		long long m_Pulls = 0;
+		long long m_Dropped = 0;
+
+	public:
+		Client(const ShardLayout& layout, int maxStaleness)
+			: m_Layout(layout), m_Versions(layout.getShardCount(), 0), m_Stale(layout.getShardCount(), true),
+			m_MaxStaleness(std::max(maxStaleness, 0))
+		{
+		}
+
+		~Client()
+		{
+			for (int fd : m_Fds)
+			{
+				uint32_t done = DoneRequest;
+				serve_protocol::WriteAll(fd, &done, sizeof(done));
+				::close(fd);
+			}
+		}
+
+		bool Connect(const std::vector<ring::Peer>& endpoints, float timeoutSeconds = 30.0f)
+		{
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<int>(timeoutSeconds * 1000));
+			for (const ring::Peer& endpoint : endpoints)
+			{
+				int fd = ring::ConnectPeer(endpoint, deadline);
+				if (fd < 0)
+				{
+					std::cerr << "Error: Could not reach the parameter server" << std::endl;
+					return false;
+				}
+				m_Fds.push_back(fd);
+			}
+			return true;
+		}
+
+		// Refreshes the shards of the flat parameters that got too old, returns false on a connection error.
+		// refreshed tells whether anything changed
+		bool Pull(float* parameters, bool& refreshed)
+		{
+			auto start = std::chrono::steady_clock::now();
+			refreshed = false;
+			uint32_t request = PullRequest;
+			for (int shard = 0; shard < m_Layout.getShardCount(); shard++)
+				if (m_Stale[shard] && !serve_protocol::WriteAll(m_Fds[shard], &request, sizeof(request)))
+					return false;
+			for (int shard = 0; shard < m_Layout.getShardCount(); shard++)
+			{
+				if (!m_Stale[shard])
+					continue;
+				m_Buffer.resize(m_Layout.sizes[shard]);
+				if (!serve_protocol::ReadAll(m_Fds[shard], &m_Versions[shard], sizeof(uint64_t))
+					|| !serve_protocol::ReadAll(m_Fds[shard], m_Buffer.data(), m_Buffer.size() * sizeof(float)))
+					return false;
+				m_Layout.Scatter(shard, m_Buffer.data(), parameters);
+				m_Stale[shard] = false;
+				m_Pulls++;
+				refreshed = true;
+			}
+			m_Seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			return true;
+		}
+
+		// Summed gradients of `samples` samples (flat, PackParameters layout), computed on the last pulled copy
+		bool Push(const float* gradients, float samples)
+		{
+			auto start = std::chrono::steady_clock::now();
+			for (int shard = 0; shard < m_Layout.getShardCount(); shard++)
+			{
+				// One send per shard
+				size_t size = m_Layout.sizes[shard] * sizeof(float);
+				m_Message.resize(4 + 8 + 4 + size);
+				uint32_t request = PushRequest;
+				std::memcpy(m_Message.data(), &request, 4);
+				std::memcpy(m_Message.data() + 4, &m_Versions[shard], 8);
+				std::memcpy(m_Message.data() + 12, &samples, 4);
+				m_Layout.Gather(shard, gradients, reinterpret_cast<float*>(m_Message.data() + 16));
+				if (!serve_protocol::WriteAll(m_Fds[shard], m_Message.data(), m_Message.size()))
+					return false;
+			}
+			for (int shard = 0; shard < m_Layout.getShardCount(); shard++)
+			{
+				uint64_t version;
+				uint32_t accepted;
+				if (!serve_protocol::ReadAll(m_Fds[shard], &version, sizeof(version)) || !serve_protocol::ReadAll(m_Fds[shard], &accepted, sizeof(accepted)))
+					return false;
+				if (!accepted)
+					m_Dropped++;
+				// The next gradient will be at least version + 1 - copy updates old
+				if (!accepted || static_cast<long long>(version + 1 - m_Versions[shard]) > m_MaxStaleness)
+					m_Stale[shard] = true;
+			}
+			m_Seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			return true;
+		}
+
+		double getSeconds() const { return m_Seconds; }		// Pulls and pushes
+		long long getPullCount() const { return m_Pulls; }
+		long long getDroppedCount() const { return m_Dropped; }
+	};
+}
@@ -0,0 +1,794 @@
+// nn-predict : offline scoring of large MNIST CSV / IDX files with a model saved by nn-train --save (or the GUI).
+// The input streams through read -> parse -> predict -> write, every stage on its own threads with bounded queues
+// between them, so memory stays flat for any file size. Output is one CSV row per image : index, label, probabilities
+//
+//		nn-predict --model model.nnm --input mnist_test.csv --output predictions.csv
+//		nn-predict --model model.nnm --input t10k-images-idx3-ubyte --labels t10k-labels-idx1-ubyte
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <thread>
+
+#include "ml/ModelFile.h"
+#include "ml/BoundedQueue.h"
+#include "ml/ThreadPool.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct PredictOptions
+{
+	std::string modelPath;
+	std::string inputPath;
+	std::string format;			// csv | idx, empty = from the file name
+	std::string labelsPath;		// IDX labels, enables the accuracy
+	std::string outputPath;		// Empty = stdout
+	std::string metricsPath;	// Empty = stderr
+	int batchSize = 256;
+	int parseThreads = 0;		// 0 = from the core count
+	int predictThreads = 0;
+	int queueSize = 4;			// Batches per queue
+	long long limit = -1;
+	float progressSeconds = 5.0f;
+	bool verify = false;
+	bool numa = false;			// Pinned predictors, one copy of the weights per NUMA node
+};
+
+static void PrintUsage()
+{
+	std::cerr <<
+		"Usage: nn-predict --model <model file> --input <path> [options]\n"
+		"  --model <path>            Binary model file (nn-train --save)\n"
+		"  --input <path>            MNIST CSV (label column optional) or IDX image file\n"
+		"  --format <name>           csv | idx (default: from the file name)\n"
+		"  --labels <path>           IDX label file, reports the accuracy\n"
+		"  --output <path>           Predictions CSV (default stdout)\n"
+		"  --batch <n>               Images per batch (default 256)\n"
+		"  --parse-threads <n>       Parser threads (default: cores / 4)\n"
+		"  --predict-threads <n>     Inference threads (default: the remaining cores)\n"
+		"  --queue <n>               Batches each queue can hold (default 4)\n"
+		"  --limit <n>               Stop after n images\n"
+		"  --progress <seconds>      Progress line interval, 0 = off (default 5)\n"
+		"  --verify                  Check the model checksum before starting\n"
+		"  --numa                    Pin the predictor and parser threads to cores, predictors read a copy of the\n"
+		"                            weights made on their own NUMA node\n"
+		"  --metrics <path>          Write the JSON lines to a file instead of stderr\n";
+}
+
+static bool ParseArguments(int argc, char** argv, PredictOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h")
+			return false;
+		if (arg == "--verify")
+		{
+			options.verify = true;
+			continue;
+		}
+		if (arg == "--numa")
+		{
+			options.numa = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << arg << std::endl;
+			return false;
+		}
+
+		std::string value = argv[++i];
+		if (arg == "--model") options.modelPath = value;
+		else if (arg == "--input") options.inputPath = value;
+		else if (arg == "--format") options.format = value;
+		else if (arg == "--labels") options.labelsPath = value;
+		else if (arg == "--output") options.outputPath = value;
+		else if (arg == "--batch") options.batchSize = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--parse-threads") options.parseThreads = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--predict-threads") options.predictThreads = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--queue") options.queueSize = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--limit") options.limit = std::atoll(value.c_str());
+		else if (arg == "--progress") options.progressSeconds = std::strtof(value.c_str(), nullptr);
+		else if (arg == "--metrics") options.metricsPath = value;
+		else
+		{
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+	}
+
+	if (options.modelPath.empty() || options.inputPath.empty())
+	{
+		std::cerr << "--model and --input are required" << std::endl;
+		return false;
+	}
+	if (options.format.empty())
+	{
+		const std::string& path = options.inputPath;
+		bool csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+		options.format = csv ? "csv" : "idx";
+	}
+	if (options.format != "csv" && options.format != "idx")
+	{
+		std::cerr << "Unknown format " << options.format << " (csv, idx)" << std::endl;
+		return false;
+	}
+	if (options.format == "csv" && !options.labelsPath.empty())
+	{
+		std::cerr << "--labels is for IDX input, CSV files carry their labels" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Items moving through the pipeline. The sequence number puts the batches back in file order at the writer
+struct RawChunk
+{
+	size_t sequence = 0;
+	size_t firstIndex = 0;		// Record number of the first image
+	int count = 0;
+	std::string text;			// CSV : count lines, '\n' terminated
+	std::vector<unsigned char> pixels;	// IDX : count * inputSize bytes
+	std::vector<int> labels;	// IDX with --labels
+};
+
+struct InputBatch
+{
+	size_t sequence = 0;
+	Eigen::MatrixXf inputs;		// One image per column
+	std::vector<size_t> indices;
+	std::vector<int> labels;	// -1 = unknown
+	int badRecords = 0;
+};
+
+struct OutputBatch
+{
+	size_t sequence = 0;
+	Eigen::MatrixXf outputs;
+	std::vector<size_t> indices;
+	std::vector<int> labels;
+	int badRecords = 0;
+};
+
+// Where the threads of a stage spent their time. Waiting for input means the stage upstream is too slow,
+// waiting for output means the stage downstream is
+struct StageStats
+{
+	const char* name;
+	int threads;
+	std::atomic<long long> busyNs{ 0 };
+	std::atomic<long long> waitInNs{ 0 };
+	std::atomic<long long> waitOutNs{ 0 };
+	std::atomic<long long> batches{ 0 };
+
+	StageStats(const char* name, int threads) : name(name), threads(threads) {}
+};
+
+static long long ElapsedNs(Clock::time_point& since)
+{
+	Clock::time_point now = Clock::now();
+	long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - since).count();
+	since = now;
+	return ns;
+}
+
+static uint32_t ReadBigEndian32(const unsigned char* bytes)
+{
+	return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | uint32_t(bytes[3]);
+}
+
+// Splits the CSV file into chunks of whole lines, reading it in large blocks
+class CsvSource
+{
+private:
+	FILE* m_File = nullptr;
+	std::vector<char> m_Buffer;
+	size_t m_Begin = 0;
+	size_t m_End = 0;
+	bool m_Eof = false;
+	bool m_FirstLine = true;
+
+	bool Fill()
+	{
+		if (m_Eof)
+			return false;
+		if (m_Begin > 0)
+		{
+			std::memmove(m_Buffer.data(), m_Buffer.data() + m_Begin, m_End - m_Begin);
+			m_End -= m_Begin;
+			m_Begin = 0;
+		}
+		if (m_End == m_Buffer.size())
+			m_Buffer.resize(m_Buffer.size() * 2);	// Line longer than the buffer
+		size_t read = std::fread(m_Buffer.data() + m_End, 1, m_Buffer.size() - m_End, m_File);
+		m_End += read;
+		if (read == 0)
+			m_Eof = true;
+		return read > 0;
+	}
+
+public:
+	~CsvSource() { if (m_File) std::fclose(m_File); }
+
+	bool Open(const std::string& filepath)
+	{
+		m_File = std::fopen(filepath.c_str(), "rb");
+		if (!m_File)
+		{
+			std::cerr << "Error: Could not open file " << filepath << std::endl;
+			return false;
+		}
+		m_Buffer.resize(1 << 20);
+		return true;
+	}
+
+	// Appends up to maxCount lines, returns how many
+	int Next(RawChunk& chunk, int maxCount)
+	{
+		chunk.text.clear();
+		int count = 0;
+		while (count < maxCount)
+		{
+			const char* begin = m_Buffer.data() + m_Begin;
+			const char* newline = static_cast<const char*>(std::memchr(begin, '\n', m_End - m_Begin));
+			size_t length;
+			if (newline)
+				length = newline - begin;
+			else if (!Fill())
+			{
+				if (m_Begin == m_End)
+					break;
+				length = m_End - m_Begin;	// Last line without '\n'
+			}
+			else
+				continue;
+
+			std::string line(begin, length);
+			m_Begin = std::min(m_Begin + length + 1, m_End);
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (line.empty())
+				continue;
+
+			// Header line (same rule as Dataset::loadMNIST_CSV)
+			bool header = m_FirstLine && line.find("label") != std::string::npos;
+			m_FirstLine = false;
+			if (header)
+				continue;
+
+			chunk.text += line;
+			chunk.text += '\n';
+			count++;
+		}
+		return count;
+	}
+};
+
+// MNIST IDX files : big endian header then one unsigned byte per pixel / label
+class IdxSource
+{
+private:
+	FILE* m_Images = nullptr;
+	FILE* m_Labels = nullptr;
+	size_t m_Count = 0;
+	size_t m_ImageSize = 0;
+	size_t m_Position = 0;
+
+public:
+	~IdxSource()
+	{
+		if (m_Images) std::fclose(m_Images);
+		if (m_Labels) std::fclose(m_Labels);
+	}
+
+	bool Open(const std::string& imagesPath, const std::string& labelsPath, int inputSize)
+	{
+		m_Images = std::fopen(imagesPath.c_str(), "rb");
+		if (!m_Images)
+		{
+			std::cerr << "Error: Could not open file " << imagesPath << std::endl;
+			return false;
+		}
+
+		unsigned char header[16];
+		if (std::fread(header, 1, 8, m_Images) != 8 || header[0] != 0 || header[1] != 0 || header[2] != 0x08)
+		{
+			std::cerr << "Error: " << imagesPath << " is not an unsigned byte IDX file" << std::endl;
+			return false;
+		}
+		int dimensions = header[3];
+		if (dimensions < 1 || std::fread(header + 8, 1, 4 * (dimensions - 1), m_Images) != size_t(4 * (dimensions - 1)))
+		{
+			std::cerr << "Error: Truncated IDX header in " << imagesPath << std::endl;
+			return false;
+		}
+		m_Count = ReadBigEndian32(header + 4);
+		m_ImageSize = 1;
+		for (int d = 1; d < dimensions; d++)
+			m_ImageSize *= ReadBigEndian32(header + 4 + 4 * d);
+		if (m_ImageSize != static_cast<size_t>(inputSize))
+		{
+			std::cerr << "Error: The images have " << m_ImageSize << " pixels but the model takes " << inputSize << " inputs" << std::endl;
+			return false;
+		}
+
+		if (!labelsPath.empty())
+		{
+			m_Labels = std::fopen(labelsPath.c_str(), "rb");
+			if (!m_Labels)
+			{
+				std::cerr << "Error: Could not open file " << labelsPath << std::endl;
+				return false;
+			}
+			if (std::fread(header, 1, 8, m_Labels) != 8 || ReadBigEndian32(header) != 0x00000801 || ReadBigEndian32(header + 4) != m_Count)
+			{
+				std::cerr << "Error: " << labelsPath << " is not a label file for " << imagesPath << std::endl;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// -1 on a read error
+	int Next(RawChunk& chunk, int maxCount)
+	{
+		size_t count = std::min<size_t>(maxCount, m_Count - m_Position);
+		chunk.pixels.resize(count * m_ImageSize);
+		if (count > 0 && std::fread(chunk.pixels.data(), m_ImageSize, count, m_Images) != count)
+		{
+			std::cerr << "Error: Truncated IDX file" << std::endl;
+			return -1;
+		}
+
+		chunk.labels.clear();
+		if (m_Labels && count > 0)
+		{
+			std::vector<unsigned char> labels(count);
+			if (std::fread(labels.data(), 1, count, m_Labels) != count)
+			{
+				std::cerr << "Error: Truncated IDX label file" << std::endl;
+				return -1;
+			}
+			chunk.labels.assign(labels.begin(), labels.end());
+		}
+		m_Position += count;
+		return static_cast<int>(count);
+	}
+};
+
+// A record is inputSize pixel values, or a label followed by them
+static void ParseCsvChunk(const RawChunk& chunk, int inputSize, InputBatch& batch)
+{
+	batch.inputs.resize(inputSize, chunk.count);
+	batch.indices.clear();
+	batch.labels.clear();
+	batch.badRecords = 0;
+
+	std::vector<float> values;
+	values.reserve(inputSize + 1);
+	const char* cursor = chunk.text.c_str();
+	int columns = 0;
+	for (int record = 0; record < chunk.count; record++)
+	{
+		const char* end = std::strchr(cursor, '\n');
+		values.clear();
+		while (cursor < end)
+		{
+			char* next;
+			float value = std::strtof(cursor, &next);
+			if (next == cursor)
+				break;
+			values.push_back(value);
+			cursor = next;
+			while (cursor < end && (*cursor == ',' || *cursor == ' '))
+				cursor++;
+		}
+
+		bool labeled = values.size() == static_cast<size_t>(inputSize) + 1;
+		if (cursor != end || (!labeled && values.size() != static_cast<size_t>(inputSize)))
+		{
+			std::cerr << "Invalid record " << chunk.firstIndex + record << ", expected " << inputSize << " or " << inputSize + 1
+				<< " values" << std::endl;
+			batch.badRecords++;
+		}
+		else
+		{
+			const float* pixels = values.data() + (labeled ? 1 : 0);
+			for (int i = 0; i < inputSize; i++)
+				batch.inputs(i, columns) = pixels[i] / 255.0f; // Same normalization as Dataset
+			batch.indices.push_back(chunk.firstIndex + record);
+			batch.labels.push_back(labeled ? static_cast<int>(values[0]) : -1);
+			columns++;
+		}
+		cursor = end + 1;
+	}
+	batch.inputs.conservativeResize(inputSize, columns);
+}
+
+static void ParseIdxChunk(const RawChunk& chunk, int inputSize, InputBatch& batch)
+{
+	Eigen::Map<const Eigen::Matrix<unsigned char, Eigen::Dynamic, Eigen::Dynamic>> pixels(chunk.pixels.data(), inputSize, chunk.count);
+	batch.inputs = pixels.cast<float>() / 255.0f;
+	batch.indices.resize(chunk.count);
+	std::iota(batch.indices.begin(), batch.indices.end(), chunk.firstIndex);
+	if (chunk.labels.empty())
+		batch.labels.assign(chunk.count, -1);
+	else
+		batch.labels = chunk.labels;
+	batch.badRecords = 0;
+}
+
+// Label and probabilities (the sigmoid outputs normalized to sum to 1) of every image
+static void FormatBatch(const OutputBatch& batch, std::string& text, long long& correct, long long& labeled)
+{
+	char number[32];
+	text.clear();
+	for (int column = 0; column < batch.outputs.cols(); column++)
+	{
+		auto output = batch.outputs.col(column);
+		Eigen::Index label;
+		output.maxCoeff(&label);
+		float sum = output.sum();
+		float scale = sum > 0.0f ? 1.0f / sum : 0.0f;
+
+		int length = std::snprintf(number, sizeof(number), "%zu,%d", batch.indices[column], static_cast<int>(label));
+		text.append(number, length);
+		for (Eigen::Index i = 0; i < output.size(); i++)
+		{
+			length = std::snprintf(number, sizeof(number), ",%.5f", output[i] * scale);
+			text.append(number, length);
+		}
+		text += '\n';
+
+		if (batch.labels[column] >= 0)
+		{
+			labeled++;
+			if (batch.labels[column] == label)
+				correct++;
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	PredictOptions options;
+	if (!ParseArguments(argc, argv, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	std::ofstream metricsFile;
+	std::ostream metrics(std::cerr.rdbuf());
+	if (!options.metricsPath.empty())
+	{
+		metricsFile.open(options.metricsPath);
+		if (!metricsFile.is_open())
+		{
+			std::cerr << "Error: Could not open file " << options.metricsPath << std::endl;
+			return 1;
+		}
+		metrics.rdbuf(metricsFile.rdbuf());
+	}
+
+	MappedModel model;
+	if (!model.Open(options.modelPath, options.verify))
+		return 1;
+	int inputSize = model.getLayerSize(0);
+	int outputSize = model.getLayerSize(model.getLayerCount() - 1);
+
+	CsvSource csv;
+	IdxSource idx;
+	bool isCsv = options.format == "csv";
+	if (isCsv ? !csv.Open(options.inputPath) : !idx.Open(options.inputPath, options.labelsPath, inputSize))
+		return 1;
+
+	FILE* output = stdout;
+	if (!options.outputPath.empty())
+	{
+		output = std::fopen(options.outputPath.c_str(), "wb");
+		if (!output)
+		{
+			std::cerr << "Error: Could not open file " << options.outputPath << std::endl;
+			return 1;
+		}
+	}
+
+	// The pipeline supplies the parallelism, one Eigen thread per predictor avoids oversubscribing the cores
+	int cores = std::max(1u, std::thread::hardware_concurrency());
+	if (options.parseThreads == 0)
+		options.parseThreads = std::max(1, cores / 4);
+	if (options.predictThreads == 0)
+		options.predictThreads = std::max(1, cores - options.parseThreads - 2);
+	Eigen::setNbThreads(1);
+	ThreadPool::Global().setThreadCount(1);	// Same for the pool : ForwardBatch runs on the predictor's own thread
+
+	BoundedQueue<RawChunk> chunks(options.queueSize);
+	BoundedQueue<InputBatch> inputs(options.queueSize);
+	BoundedQueue<OutputBatch> outputs(options.queueSize);
+
+	// Parsers and predictors can finish out of order, the writer holds batches until their turn comes.
+	// Every batch takes a ticket from the reader until it's written, so that backlog stays bounded too
+	size_t maxInFlight = 3 * options.queueSize + options.parseThreads + options.predictThreads + 2;
+	BoundedQueue<char> tickets(maxInFlight);
+
+	StageStats readStats("read", 1);
+	StageStats parseStats("parse", options.parseThreads);
+	StageStats predictStats("predict", options.predictThreads);
+	StageStats writeStats("write", 1);
+
+	std::atomic<int> parsersLeft{ options.parseThreads };
+	std::atomic<int> predictorsLeft{ options.predictThreads };
+	std::atomic<long long> badRecords{ 0 };
+
+	// --numa : the first predictor on a node copies the weights there (first touch), the others of the node share it
+	const NumaTopology& topology = NumaTopology::Get();
+	std::vector<std::unique_ptr<Network>> replicas(topology.getNodeCount());
+	std::mutex replicasMutex;
+	PagePlacement weightPages;
+	std::atomic<bool> failed{ false };
+
+	auto stopPipeline = [&]()
+	{
+		failed = true;
+		chunks.Close();
+		inputs.Close();
+		outputs.Close();
+		tickets.Close();
+	};
+
+	Clock::time_point start = Clock::now();
+
+	std::thread reader([&]()
+	{
+		Clock::time_point mark = Clock::now();
+		size_t sequence = 0;
+		size_t index = 0;
+		while (options.limit < 0 || static_cast<long long>(index) < options.limit)
+		{
+			int maxCount = options.batchSize;
+			if (options.limit >= 0)
+				maxCount = static_cast<int>(std::min<long long>(maxCount, options.limit - index));
+
+			RawChunk chunk;
+			chunk.sequence = sequence;
+			chunk.firstIndex = index;
+			chunk.count = isCsv ? csv.Next(chunk, maxCount) : idx.Next(chunk, maxCount);
+			readStats.busyNs += ElapsedNs(mark);
+			if (chunk.count < 0)
+				stopPipeline();
+			if (chunk.count <= 0)
+				break;
+
+			int count = chunk.count;
+			bool pushed = tickets.Push(0) && chunks.Push(std::move(chunk));
+			readStats.waitOutNs += ElapsedNs(mark);
+			if (!pushed)
+				break;
+			readStats.batches++;
+			index += count;
+			sequence++;
+		}
+		chunks.Close();
+	});
+
+	auto parse = [&]()
+	{
+		Clock::time_point mark = Clock::now();
+		RawChunk chunk;
+		while (true)
+		{
+			bool popped = chunks.Pop(chunk);
+			parseStats.waitInNs += ElapsedNs(mark);
+			if (!popped)
+				break;
+
+			InputBatch batch;
+			batch.sequence = chunk.sequence;
+			if (isCsv)
+				ParseCsvChunk(chunk, inputSize, batch);
+			else
+				ParseIdxChunk(chunk, inputSize, batch);
+			badRecords += batch.badRecords;
+			parseStats.busyNs += ElapsedNs(mark);
+
+			bool pushed = inputs.Push(std::move(batch));
+			parseStats.waitOutNs += ElapsedNs(mark);
+			if (!pushed)
+				break;
+			parseStats.batches++;
+		}
+		if (--parsersLeft == 0)
+			inputs.Close();
+	};
+
+	auto predict = [&](int index)
+	{
+		const Network* replica = nullptr;
+		if (options.numa)
+		{
+			PinThreadToCore(topology.getCoreForThread(index));
+			int node = std::max(GetCurrentNode(), 0);
+			std::lock_guard<std::mutex> lock(replicasMutex);
+			if (!replicas[node])
+				replicas[node].reset(new Network(model.ToNetwork()));
+			replica = replicas[node].get();
+		}
+
+		Clock::time_point mark = Clock::now();
+		InputBatch batch;
+		while (true)
+		{
+			bool popped = inputs.Pop(batch);
+			predictStats.waitInNs += ElapsedNs(mark);
+			if (!popped)
+				break;
+
+			OutputBatch result;
+			result.sequence = batch.sequence;
+			if (batch.inputs.cols() > 0)
+				result.outputs = replica ? replica->ForwardBatch(batch.inputs) : model.ForwardBatch(batch.inputs);
+			else
+				result.outputs.resize(outputSize, 0);
+			result.indices = std::move(batch.indices);
+			result.labels = std::move(batch.labels);
+			result.badRecords = batch.badRecords;
+			predictStats.busyNs += ElapsedNs(mark);
+
+			bool pushed = outputs.Push(std::move(result));
+			predictStats.waitOutNs += ElapsedNs(mark);
+			if (!pushed)
+				break;
+			predictStats.batches++;
+		}
+		if (replica)
+		{
+			PageQuery query;
+			for (int layer = 0; layer + 1 < replica->getLayerCount(); layer++)
+				query.Add(replica->getWeights(layer).data(), replica->getWeights(layer).size() * sizeof(float));
+			PagePlacement placement = query.Count(GetCurrentNode());
+			std::lock_guard<std::mutex> lock(replicasMutex);
+			weightPages.Add(placement);
+		}
+		if (--predictorsLeft == 0)
+			outputs.Close();
+	};
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < options.parseThreads; t++)
+		workers.emplace_back([&, t]()
+			{
+				// Predictors get the first cores, parsers the next ones
+				if (options.numa)
+					PinThreadToCore(topology.getCoreForThread(options.predictThreads + t));
+				parse();
+			});
+	for (int t = 0; t < options.predictThreads; t++)
+		workers.emplace_back(predict, t);
+
+	// Writer, on the main thread
+	long long images = 0;
+	long long correct = 0;
+	long long labeled = 0;
+	{
+		std::string header = "index,label";
+		for (int i = 0; i < outputSize; i++)
+			header += ",p" + std::to_string(i);
+		header += '\n';
+		std::fwrite(header.data(), 1, header.size(), output);
+
+		std::map<size_t, OutputBatch> waiting;
+		size_t nextSequence = 0;
+		std::string text;
+		Clock::time_point mark = Clock::now();
+		Clock::time_point lastProgress = start;
+		long long progressImages = 0;
+		OutputBatch batch;
+
+		while (!failed)
+		{
+			bool popped = outputs.Pop(batch);
+			writeStats.waitInNs += ElapsedNs(mark);
+			if (!popped)
+				break;
+
+			waiting.emplace(batch.sequence, std::move(batch));
+			while (!waiting.empty() && waiting.begin()->first == nextSequence)
+			{
+				const OutputBatch& ready = waiting.begin()->second;
+				FormatBatch(ready, text, correct, labeled);
+				if (std::fwrite(text.data(), 1, text.size(), output) != text.size())
+				{
+					std::cerr << "Error: Could not write the predictions" << std::endl;
+					stopPipeline();
+					break;
+				}
+				images += ready.outputs.cols();
+				waiting.erase(waiting.begin());
+				nextSequence++;
+				writeStats.batches++;
+
+				char ticket;
+				tickets.Pop(ticket);
+			}
+			writeStats.busyNs += ElapsedNs(mark);
+
+			if (options.progressSeconds > 0.0f)
+			{
+				double sinceProgress = std::chrono::duration<double>(mark - lastProgress).count();
+				if (sinceProgress >= options.progressSeconds)
+				{
+					char line[256];
+					std::snprintf(line, sizeof(line), "{\"type\":\"progress\",\"images\":%lld,\"images_per_second\":%.1f}",
+						images, (images - progressImages) / sinceProgress);
+					metrics << line << std::endl;
+					lastProgress = mark;
+					progressImages = images;
+				}
+			}
+		}
+		if (!failed && !waiting.empty())
+		{
+			std::cerr << "Error: " << waiting.size() << " batches never got written" << std::endl;
+			stopPipeline();
+		}
+	}
+
+	reader.join();
+	for (auto& worker : workers)
+		worker.join();
+	if (output != stdout)
+	{
+		if (std::fclose(output) != 0)
+			failed = true;
+	}
+	else
+		std::fflush(stdout);
+
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	// Pieces formatted one at a time and appended to the record
+	char line[512];
+	std::snprintf(line, sizeof(line),
+		"{\"type\":\"done\",\"images\":%lld,\"bad_records\":%lld,\"seconds\":%.3f,\"images_per_second\":%.1f",
+		images, badRecords.load(), seconds, images / std::max(seconds, 1e-9));
+	std::string record = line;
+	if (labeled > 0)
+	{
+		std::snprintf(line, sizeof(line), ",\"accuracy\":%.6f", double(correct) / labeled);
+		record += line;
+	}
+	if (options.numa)
+	{
+		int copies = 0;
+		for (const std::unique_ptr<Network>& replica : replicas)
+			copies += replica ? 1 : 0;
+		std::snprintf(line, sizeof(line),
+			",\"numa_nodes\":%d,\"weight_replicas\":%d,\"weight_pages\":%lld,\"remote_weight_pages\":%lld",
+			topology.getNodeCount(), copies, weightPages.pages, weightPages.remotePages);
+		record += line;
+	}
+	std::snprintf(line, sizeof(line), ",\"batch\":%d,\"stages\":[", options.batchSize);
+	record += line;
+
+	// Utilization = share of the wall time the stage's threads spent working
+	const StageStats* stages[] = { &readStats, &parseStats, &predictStats, &writeStats };
+	for (int s = 0; s < 4; s++)
+	{
+		const StageStats& stage = *stages[s];
+		double threadSeconds = seconds * stage.threads;
+		std::snprintf(line, sizeof(line),
+			"%s{\"name\":\"%s\",\"threads\":%d,\"batches\":%lld,\"utilization\":%.3f,\"wait_input\":%.3f,\"wait_output\":%.3f}",
+			s == 0 ? "" : ",", stage.name, stage.threads, stage.batches.load(),
+			stage.busyNs * 1e-9 / threadSeconds, stage.waitInNs * 1e-9 / threadSeconds, stage.waitOutNs * 1e-9 / threadSeconds);
+		record += line;
+	}
+	metrics << record << "]}" << std::endl;
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,333 @@
+#pragma once
+// Ring all-reduce between training processes (POSIX sockets, Linux build only). Every rank listens on its own
+// endpoint, connects to the next rank and accepts the previous one, so the processes form a ring.
+// Sum() is the bandwidth optimal version : the buffer is cut into one chunk per rank, a reduce-scatter pass
+// (N - 1 steps, each rank adds the chunk coming from its left neighbour) leaves every rank with one fully summed
+// chunk, an all-gather pass (N - 1 steps) passes them around. Every rank sends 2 (N - 1) / N of the buffer,
+// whatever the number of ranks. Each summed chunk is computed by a single rank and then copied, so every rank
+// ends up with bit identical results
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+
+#include "ServeProtocol.h"
+
+namespace ring
+{
+	// Unix domain socket when socketPath is set, otherwise TCP
+	struct Peer
+	{
+		std::string host = "127.0.0.1";
+		int port = 0;
+		std::string socketPath;
+	};
+
+	// "host:port,host:port,..." (one per rank, in rank order)
+	inline bool ParsePeers(const std::string& text, std::vector<Peer>& peers)
+	{
+		peers.clear();
+		size_t start = 0;
+		while (start <= text.size())
+		{
+			size_t comma = text.find(',', start);
+			std::string item = text.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+			size_t colon = item.rfind(':');
+			if (colon == std::string::npos || colon == 0)
+				return false;
+			Peer peer;
+			peer.host = item.substr(0, colon);
+			peer.port = std::atoi(item.c_str() + colon + 1);
+			if (peer.port <= 0 || peer.port > 65535)
+				return false;
+			peers.push_back(peer);
+			if (comma == std::string::npos)
+				break;
+			start = comma + 1;
+		}
+		return !peers.empty();
+	}
+
+	inline int ListenPeer(const Peer& peer)
+	{
+		if (!peer.socketPath.empty())
+		{
+			serve_protocol::Endpoint endpoint;
+			endpoint.socketPath = peer.socketPath;
+			return serve_protocol::Listen(endpoint);
+		}
+
+		// Any interface : the other processes can be on other hosts
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(static_cast<uint16_t>(peer.port));
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+		int reuse = 1;
+		if (fd >= 0)
+			::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, 64) != 0)
+		{
+			std::perror("listen");
+			if (fd >= 0)
+				::close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	// One attempt, -1 while the peer isn't listening yet
+	inline int TryConnectPeer(const Peer& peer)
+	{
+		if (!peer.socketPath.empty())
+		{
+			sockaddr_un address = {};
+			address.sun_family = AF_UNIX;
+			std::strncpy(address.sun_path, peer.socketPath.c_str(), sizeof(address.sun_path) - 1);
+			int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0)
+				return fd;
+			if (fd >= 0)
+				::close(fd);
+			return -1;
+		}
+
+		addrinfo hints = {};
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo* addresses = nullptr;
+		if (::getaddrinfo(peer.host.c_str(), std::to_string(peer.port).c_str(), &hints, &addresses) != 0)
+			return -1;
+		int fd = -1;
+		for (addrinfo* address = addresses; address && fd < 0; address = address->ai_next)
+		{
+			fd = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+			if (fd >= 0 && ::connect(fd, address->ai_addr, address->ai_addrlen) != 0)
+			{
+				::close(fd);
+				fd = -1;
+			}
+		}
+		::freeaddrinfo(addresses);
+		if (fd >= 0)
+		{
+			int noDelay = 1;	// The last chunk of a step shouldn't wait for more data
+			::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+		}
+		return fd;
+	}
+
+	// Retries while the peer starts up, -1 after the deadline
+	inline int ConnectPeer(const Peer& peer, std::chrono::steady_clock::time_point deadline)
+	{
+		int fd;
+		while ((fd = TryConnectPeer(peer)) < 0 && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		return fd;
+	}
+
+	class RingAllReduce
+	{
+	private:
+		int m_Rank = 0;
+		int m_World = 1;
+		int m_SendFd = -1;		// To rank + 1
+		int m_RecvFd = -1;		// From rank - 1
+		std::vector<float> m_Scratch;
+
+		double m_Seconds = 0.0;
+		unsigned long long m_BytesSent = 0;
+		long long m_Calls = 0;
+
+		// Sends one buffer to the next rank while receiving one from the previous rank. Both directions at the
+		// same time : with blocking sends every rank would wait for its neighbour to read once the socket buffers fill
+		bool Exchange(const void* sendData, size_t sendSize, void* recvData, size_t recvSize)
+		{
+			const char* sendBytes = static_cast<const char*>(sendData);
+			char* recvBytes = static_cast<char*>(recvData);
+			while (sendSize > 0 || recvSize > 0)
+			{
+				// A finished direction is left out (fd -1) : a neighbour that is already done and hung up isn't an error
+				pollfd fds[2] = { { sendSize > 0 ? m_SendFd : -1, POLLOUT, 0 }, { recvSize > 0 ? m_RecvFd : -1, POLLIN, 0 } };
+				if (::poll(fds, 2, 60000) <= 0)
+					return false;
+				if ((fds[0].revents | fds[1].revents) & (POLLERR | POLLNVAL))
+					return false;
+
+				if (fds[0].revents & (POLLOUT | POLLHUP))
+				{
+					ssize_t written = ::send(m_SendFd, sendBytes, sendSize, MSG_NOSIGNAL | MSG_DONTWAIT);
+					if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+						return false;
+					if (written > 0)
+					{
+						sendBytes += written;
+						sendSize -= written;
+						m_BytesSent += written;
+					}
+				}
+				if (fds[1].revents & (POLLIN | POLLHUP))
+				{
+					ssize_t read = ::recv(m_RecvFd, recvBytes, recvSize, MSG_DONTWAIT);
+					if (read == 0 || (read < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+						return false;
+					if (read > 0)
+					{
+						recvBytes += read;
+						recvSize -= read;
+					}
+				}
+			}
+			return true;
+		}
+
+		size_t ChunkBegin(size_t count, int chunk) const { return count * chunk / m_World; }
+
+	public:
+		RingAllReduce() = default;
+		~RingAllReduce() { Close(); }
+
+		RingAllReduce(const RingAllReduce&) = delete;
+		RingAllReduce& operator=(const RingAllReduce&) = delete;
+
+		// peers[i] is rank i's endpoint. Waits up to timeoutSeconds for the neighbours to show up
+		bool Connect(const std::vector<Peer>& peers, int rank, float timeoutSeconds = 30.0f)
+		{
+			m_Rank = rank;
+			m_World = static_cast<int>(peers.size());
+			if (m_World <= 1)
+				return true;
+
+			int listenFd = ListenPeer(peers[rank]);
+			if (listenFd < 0)
+				return false;
+
+			// connect() completes as soon as the next rank listens, before it accepts, so every rank can connect first
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<int>(timeoutSeconds * 1000));
+			const Peer& next = peers[(rank + 1) % m_World];
+			m_SendFd = ConnectPeer(next, deadline);
+			int32_t hello = rank;
+			bool ok = m_SendFd >= 0 && serve_protocol::WriteAll(m_SendFd, &hello, sizeof(hello));
+
+			pollfd accepting = { listenFd, POLLIN, 0 };
+			int waitMs = static_cast<int>(std::max<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+				deadline - std::chrono::steady_clock::now()).count(), 0));
+			if (ok && ::poll(&accepting, 1, waitMs) > 0)
+				m_RecvFd = ::accept(listenFd, nullptr, nullptr);
+			ok = ok && m_RecvFd >= 0 && serve_protocol::ReadAll(m_RecvFd, &hello, sizeof(hello)) && hello == (rank + m_World - 1) % m_World;
+			::close(listenFd);
+			if (!peers[rank].socketPath.empty())
+				::unlink(peers[rank].socketPath.c_str());
+
+			if (!ok)
+			{
+				std::cerr << "Error: Rank " << rank << " could not join the ring" << std::endl;
+				Close();
+				return false;
+			}
+
+			int bufferSize = 4 << 20;
+			for (int fd : { m_SendFd, m_RecvFd })
+			{
+				::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+				::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+			}
+			return true;
+		}
+
+		void Close()
+		{
+			if (m_SendFd >= 0)
+				::close(m_SendFd);
+			if (m_RecvFd >= 0)
+				::close(m_RecvFd);
+			m_SendFd = m_RecvFd = -1;
+		}
+
+		// Element wise sum over all ranks, in place
+		bool Sum(float* data, size_t count)
+		{
+			auto start = std::chrono::steady_clock::now();
+			m_Calls++;
+			if (m_World <= 1)
+				return true;
+
+			m_Scratch.resize(count / m_World + 1);
+
+			// Reduce-scatter : after step s, chunk (rank - s - 1) holds the sum of s + 2 ranks
+			for (int step = 0; step < m_World - 1; step++)
+			{
+				int sendChunk = (m_Rank - step + m_World) % m_World;
+				int recvChunk = (m_Rank - step - 1 + 2 * m_World) % m_World;
+				size_t sendBegin = ChunkBegin(count, sendChunk), sendEnd = ChunkBegin(count, sendChunk + 1);
+				size_t recvBegin = ChunkBegin(count, recvChunk), recvEnd = ChunkBegin(count, recvChunk + 1);
+				if (!Exchange(data + sendBegin, (sendEnd - sendBegin) * sizeof(float), m_Scratch.data(), (recvEnd - recvBegin) * sizeof(float)))
+					return false;
+				for (size_t i = recvBegin; i < recvEnd; i++)
+					data[i] += m_Scratch[i - recvBegin];
+			}
+
+			// All-gather : rank r owns chunk r + 1, pass the finished chunks around
+			for (int step = 0; step < m_World - 1; step++)
+			{
+				int sendChunk = (m_Rank + 1 - step + m_World) % m_World;
+				int recvChunk = (m_Rank - step + m_World) % m_World;
+				size_t sendBegin = ChunkBegin(count, sendChunk), sendEnd = ChunkBegin(count, sendChunk + 1);
+				size_t recvBegin = ChunkBegin(count, recvChunk), recvEnd = ChunkBegin(count, recvChunk + 1);
+				if (!Exchange(data + sendBegin, (sendEnd - sendBegin) * sizeof(float), data + recvBegin, (recvEnd - recvBegin) * sizeof(float)))
+					return false;
+			}
+
+			m_Seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			return true;
+		}
+
+		// Every rank's blob to every rank : all[r] = rank r's data. The blobs can have different sizes (compressed
+		// gradients), each step passes on the one received in the previous step, size first. Every rank sends
+		// N - 1 blobs, so this only beats Sum() when the blobs are much smaller than the buffer
+		bool AllGather(const std::vector<char>& data, std::vector<std::vector<char>>& all)
+		{
+			auto start = std::chrono::steady_clock::now();
+			m_Calls++;
+			all.resize(m_World);
+			all[m_Rank] = data;
+			for (int step = 0; step < m_World - 1; step++)
+			{
+				const std::vector<char>& send = all[(m_Rank - step + m_World) % m_World];
+				std::vector<char>& recv = all[(m_Rank - step - 1 + 2 * m_World) % m_World];
+				uint64_t sendSize = send.size(), recvSize = 0;
+				if (!Exchange(&sendSize, sizeof(sendSize), &recvSize, sizeof(recvSize)))
+					return false;
+				recv.resize(recvSize);
+				if (!Exchange(send.data(), send.size(), recv.data(), recv.size()))
+					return false;
+			}
+			m_Seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			return true;
+		}
+
+		// Rank 0's bytes to every rank, passed along the ring
+		bool Broadcast(void* data, size_t size)
+		{
+			if (m_World <= 1)
+				return true;
+			if (m_Rank > 0 && !Exchange(nullptr, 0, data, size))
+				return false;
+			if (m_Rank < m_World - 1 && !Exchange(data, size, nullptr, 0))
+				return false;
+			return true;
+		}
+
+		int getRank() const { return m_Rank; }
+		int getWorldSize() const { return m_World; }
+		double getSeconds() const { return m_Seconds; }				// Spent in Sum() and AllGather()
+		unsigned long long getBytesSent() const { return m_BytesSent; }
+		long long getCallCount() const { return m_Calls; }
+	};
+}
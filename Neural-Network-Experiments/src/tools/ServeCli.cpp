@@ -0,0 +1,499 @@
+// nn-serve : local prediction server. Requests from all connections are collected into micro-batches by a
+// BatchPredictor (up to --max-batch requests or --max-wait-us of waiting), answered with one ForwardBatch.
+// Metrics (latency percentiles, batch size histogram) go to stdout as JSON lines and to clients asking for them.
+// With --watch the newest model file of a directory is served, newer files are loaded, warmed up and swapped in
+// without stopping : requests already batched finish on the old model
+//
+//		nn-serve --model model.nnm --socket /tmp/nn.sock
+//		nn-serve --model model.nnm --port 7070 --max-batch 64 --max-wait-us 1000
+//		nn-serve --watch models/ --socket /tmp/nn.sock
+//		nn-serve --model model.nnm --shm /nn-serve				(shared memory clients, see ShmTransport.h)
+//		nn-serve --model model.nnm --socket /tmp/nn.sock --cache 10000	(repeated inputs skip the network)
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <list>
+#include <mutex>
+#include <poll.h>
+
+#include "ml/ModelFile.h"
+#include "ml/BatchPredictor.h"
+#include "ml/ModelWatcher.h"
+#include "ml/PredictionCache.h"
+#include "ml/ThreadPool.h"
+#include "ServeProtocol.h"
+#include "ShmTransport.h"
+
+struct ServeOptions
+{
+	std::string modelPath;
+	std::string watchPath;
+	int watchIntervalMs = 1000;
+	serve_protocol::Endpoint endpoint;
+	std::string shmName;
+	int shmSlots = 64;
+	int shmSpinUs = 50;
+	int maxBatch = 32;
+	int maxWaitUs = 500;
+	int workers = 2;
+	int cacheSize = 0;
+	float statsSeconds = 10.0f;
+};
+
+static void PrintUsage()
+{
+	std::cerr <<
+		"Usage: nn-serve (--model <model file> | --watch <dir>) (--socket <path> | --port <n> | --shm <name>) [options]\n"
+		"  --model <path>            Binary model file (nn-train --save)\n"
+		"  --watch <dir>             Serve the newest .nnm file of dir and hot-swap newer ones\n"
+		"  --watch-interval <ms>     Directory polling interval (default 1000)\n"
+		"  --socket <path>           Listen on a Unix domain socket\n"
+		"  --port <n>                Listen on 127.0.0.1:<n>\n"
+		"  --shm <name>              Serve shared memory clients through the segment /name\n"
+		"  --shm-slots <n>           Shared memory clients at the same time (default 64)\n"
+		"  --shm-spin-us <n>         Polling before the shared memory worker sleeps (default 50)\n"
+		"  --max-batch <n>           Largest micro-batch (default 32)\n"
+		"  --max-wait-us <n>         Longest a request waits for the batch to fill (default 500)\n"
+		"  --workers <n>             Batches computed at the same time (default 2)\n"
+		"  --cache <n>               Keep the last n answers, keyed by the input bytes and the model version (default 0 = off)\n"
+		"  --stats <seconds>         Metrics line interval, 0 = off (default 10)\n";
+}
+
+static bool ParseArguments(int argc, char** argv, ServeOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h")
+			return false;
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << arg << std::endl;
+			return false;
+		}
+
+		std::string value = argv[++i];
+		if (arg == "--model") options.modelPath = value;
+		else if (arg == "--watch") options.watchPath = value;
+		else if (arg == "--watch-interval") options.watchIntervalMs = std::max(std::atoi(value.c_str()), 10);
+		else if (arg == "--socket") options.endpoint.socketPath = value;
+		else if (arg == "--port") options.endpoint.port = std::atoi(value.c_str());
+		else if (arg == "--shm") options.shmName = value[0] == '/' ? value : "/" + value;
+		else if (arg == "--shm-slots") options.shmSlots = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--shm-spin-us") options.shmSpinUs = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--max-batch") options.maxBatch = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--max-wait-us") options.maxWaitUs = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--workers") options.workers = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--cache") options.cacheSize = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--stats") options.statsSeconds = std::strtof(value.c_str(), nullptr);
+		else
+		{
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+	}
+
+	if (options.modelPath.empty() && options.watchPath.empty())
+	{
+		std::cerr << "--model or --watch is required" << std::endl;
+		return false;
+	}
+	bool hasEndpoint = !options.endpoint.socketPath.empty() || options.endpoint.port != 0;
+	if (options.endpoint.port < 0 || options.endpoint.port > 65535)
+	{
+		std::cerr << "Invalid --port " << options.endpoint.port << std::endl;
+		return false;
+	}
+	if (!hasEndpoint && options.shmName.empty())
+	{
+		std::cerr << "--socket, --port or --shm is required" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Requests from shared memory clients skip the BatchPredictor, the shared memory worker batches them itself
+struct ShmStats
+{
+	std::mutex mutex;
+	long long requests = 0;
+	long long batches = 0;
+	LatencyHistogram compute;	// Per batch : gather + forward + answer
+};
+
+static std::string StatsToJson(const BatchPredictorStats& stats, double uptimeSeconds, ShmStats* shm, const PredictionCache* cache)
+{
+	char text[512];
+	std::snprintf(text, sizeof(text),
+		"{\"type\":\"stats\",\"uptime\":%.1f,\"model_version\":%llu,\"swaps\":%d,\"requests\":%lld,\"batches\":%lld,\"mean_batch\":%.2f,"
+		"\"full_batches\":%lld,\"timeout_batches\":%lld,"
+		"\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},"
+		"\"forward_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f},\"batch_sizes\":{",
+		uptimeSeconds, stats.modelVersion, stats.swaps, stats.requests, stats.batches, stats.batches > 0 ? double(stats.requests) / stats.batches : 0.0,
+		stats.fullBatches, stats.timeoutBatches,
+		stats.latency.getMeanUs(), stats.latency.Percentile(0.5f), stats.latency.Percentile(0.9f),
+		stats.latency.Percentile(0.99f), stats.latency.Percentile(0.999f), stats.latency.getMaxUs(),
+		stats.forward.getMeanUs(), stats.forward.Percentile(0.5f), stats.forward.Percentile(0.99f));
+
+	std::string json = text;
+	bool first = true;
+	for (size_t size = 1; size < stats.batchSizes.size(); size++)
+	{
+		if (stats.batchSizes[size] == 0)
+			continue;
+		json += (first ? "\"" : ",\"") + std::to_string(size) + "\":" + std::to_string(stats.batchSizes[size]);
+		first = false;
+	}
+	json += "}";
+
+	if (shm)
+	{
+		std::lock_guard<std::mutex> lock(shm->mutex);
+		std::snprintf(text, sizeof(text),
+			",\"shm\":{\"requests\":%lld,\"batches\":%lld,\"mean_batch\":%.2f,\"compute_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f}}",
+			shm->requests, shm->batches, shm->batches > 0 ? double(shm->requests) / shm->batches : 0.0,
+			shm->compute.getMeanUs(), shm->compute.Percentile(0.5f), shm->compute.Percentile(0.99f));
+		json += text;
+	}
+	if (cache)
+	{
+		PredictionCacheStats cacheStats = cache->getStats();
+		std::snprintf(text, sizeof(text),
+			",\"cache\":{\"hits\":%lld,\"misses\":%lld,\"hit_rate\":%.4f,\"size\":%zu,\"capacity\":%zu,\"evictions\":%lld,\"invalidations\":%lld}",
+			cacheStats.hits, cacheStats.misses, cacheStats.getHitRate(), cacheStats.size, cacheStats.capacity,
+			cacheStats.evictions, cacheStats.invalidations);
+		json += text;
+	}
+	json += "}";
+	return json;
+}
+
+static std::atomic<bool> g_Stop{ false };
+
+static void OnSignal(int)
+{
+	g_Stop = true;
+}
+
+int main(int argc, char** argv)
+{
+	ServeOptions options;
+	if (!ParseArguments(argc, argv, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	// The ml code logs with std::cout, keep stdout for the metrics only
+	std::ostream metrics(std::cout.rdbuf());
+	std::cout.rdbuf(std::cerr.rdbuf());
+
+	std::mutex metricsMutex;	// Written by the main and watcher threads
+	Eigen::setNbThreads(1);		// Parallelism comes from the workers
+	ThreadPool::Global().setThreadCount(1);
+
+	// Set once the predictor exists, the watcher only starts after that
+	BatchPredictor* served = nullptr;
+	ModelWatcher watcher(options.watchPath, [&](const ModelReload& reload)
+	{
+		unsigned long long version = served->SwapNetwork(reload.network);
+		char line[512];
+		if (version == 0)
+			std::snprintf(line, sizeof(line), "{\"type\":\"reload_rejected\",\"path\":\"%s\",\"reason\":\"layer sizes\"}", reload.filepath.c_str());
+		else
+			std::snprintf(line, sizeof(line), "{\"type\":\"reload\",\"path\":\"%s\",\"model_version\":%llu,\"load_ms\":%.2f,\"warmup_ms\":%.2f}",
+				reload.filepath.c_str(), version, reload.loadMs, reload.warmupMs);
+		std::lock_guard<std::mutex> lock(metricsMutex);
+		metrics << line << std::endl;
+	}, options.watchIntervalMs);
+	watcher.setWarmup(4, options.maxBatch);
+
+	std::shared_ptr<const Network> network;
+	if (!options.modelPath.empty())
+	{
+		MappedModel model;
+		if (!model.Open(options.modelPath, true))
+			return 1;
+		network = std::make_shared<Network>(model.ToNetwork());
+	}
+	else
+	{
+		ModelReload initial;
+		if (!watcher.LoadNewest(initial))
+			return 1;
+		network = initial.network;
+		options.modelPath = initial.filepath;
+	}
+
+	BatchPredictor predictor(network, options.maxBatch, options.maxWaitUs, options.workers);
+	const int inputSize = network->getLayerSize(0);
+	const int outputSize = network->getLayerSize(network->getLayerCount() - 1);
+	network.reset();	// The predictor owns it, so a swap can free it
+	served = &predictor;
+
+	int listenFd = -1;
+	if (!options.endpoint.socketPath.empty() || options.endpoint.port != 0)
+	{
+		listenFd = serve_protocol::Listen(options.endpoint);
+		if (listenFd < 0)
+			return 1;
+		std::cerr << "Serving " << options.modelPath << " on "
+			<< (options.endpoint.socketPath.empty() ? "127.0.0.1:" + std::to_string(options.endpoint.port) : options.endpoint.socketPath)
+			<< std::endl;
+	}
+
+	shm_transport::Segment segment;
+	ShmStats shmStats;
+	if (!options.shmName.empty())
+	{
+		if (!segment.Create(options.shmName, inputSize, outputSize, options.shmSlots))
+			return 1;
+		std::cerr << "Serving " << options.modelPath << " on shared memory " << options.shmName << std::endl;
+	}
+
+	if (!options.watchPath.empty())
+		watcher.Start();	// Stopped before the predictor goes away
+
+	std::signal(SIGINT, OnSignal);
+	std::signal(SIGTERM, OnSignal);
+
+	auto start = std::chrono::steady_clock::now();
+	auto uptime = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+	ShmStats* shm = options.shmName.empty() ? nullptr : &shmStats;
+
+	// Answers for repeated inputs : a hot swap bumps the model version, which drops the cache
+	PredictionCache predictionCache(options.cacheSize);
+	PredictionCache* cache = options.cacheSize > 0 ? &predictionCache : nullptr;
+
+	// Shared memory worker : takes every request waiting in the ring (up to --max-batch) as one batch, no extra
+	// waiting, so a lone request is answered right away and batches grow on their own under load
+	std::atomic<bool> stopShm{ false };
+	auto serveShm = [&]()
+	{
+		std::vector<uint32_t> slots;
+		std::vector<uint32_t> misses;
+		std::vector<uint64_t> hashes;
+		Eigen::MatrixXf inputs;
+		Eigen::VectorXf cached;
+		const auto spin = std::chrono::microseconds(options.shmSpinUs);
+		while (!stopShm)
+		{
+			slots.clear();
+			uint32_t slot;
+			if (!segment.Pop(slot))
+			{
+				// Poll a little before going to sleep, waking up costs more than the forward pass
+				auto spinEnd = std::chrono::steady_clock::now() + spin;
+				bool found = false;
+				while (!(found = segment.Pop(slot)) && std::chrono::steady_clock::now() < spinEnd)
+					shm_transport::CpuRelax();
+				if (!found)
+				{
+					segment.WaitForRequests(100);
+					continue;
+				}
+			}
+			slots.push_back(slot);
+			while (slots.size() < static_cast<size_t>(options.maxBatch) && segment.Pop(slot))
+				slots.push_back(slot);
+
+			auto computeStart = std::chrono::steady_clock::now();
+			int count = static_cast<int>(slots.size());
+
+			// Same model pointer as the socket clients, so hot swaps apply here too
+			unsigned long long version;
+			std::shared_ptr<const Network> model = predictor.getNetwork(version);
+
+			auto answer = [&](uint32_t slot, float computeUs)
+			{
+				Eigen::Map<Eigen::VectorXf> output(segment.getOutput(slot), outputSize);
+				Eigen::Index label;
+				output.maxCoeff(&label);
+				shm_transport::SlotHeader& header = segment.getSlot(slot);
+				header.label = static_cast<int32_t>(label);
+				header.computeUs = computeUs;
+				segment.Answer(slot);
+			};
+
+			// Cached inputs are answered right away, the rest make up the batch
+			misses.clear();
+			hashes.clear();
+			for (uint32_t slot : slots)
+			{
+				if (!cache)
+				{
+					misses.push_back(slot);
+					continue;
+				}
+				uint64_t hash = HashBytes(segment.getInput(slot), inputSize * sizeof(float));
+				if (cache->Lookup(hash, version, cached))
+				{
+					Eigen::Map<Eigen::VectorXf>(segment.getOutput(slot), outputSize) = cached;
+					answer(slot, std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - computeStart).count());
+					continue;
+				}
+				misses.push_back(slot);
+				hashes.push_back(hash);
+			}
+
+			int batchSize = static_cast<int>(misses.size());
+			if (batchSize > 0)
+			{
+				inputs.resize(inputSize, batchSize);
+				for (int i = 0; i < batchSize; i++)
+					inputs.col(i) = Eigen::Map<const Eigen::VectorXf>(segment.getInput(misses[i]), inputSize);
+
+				Eigen::MatrixXf outputs = model->ForwardBatch(inputs);
+				float computeUs = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - computeStart).count();
+				for (int i = 0; i < batchSize; i++)
+				{
+					Eigen::Map<Eigen::VectorXf>(segment.getOutput(misses[i]), outputSize) = outputs.col(i);
+					if (cache)
+						cache->Insert(hashes[i], version, outputs.col(i));
+					answer(misses[i], computeUs);
+				}
+			}
+			float computeUs = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - computeStart).count();
+
+			std::lock_guard<std::mutex> lock(shmStats.mutex);
+			shmStats.requests += count;
+			shmStats.batches++;
+			shmStats.compute.Record(computeUs);
+		}
+	};
+	std::thread shmWorker;
+	if (shm)
+		shmWorker = std::thread(serveShm);
+
+	struct Connection
+	{
+		int fd;
+		std::thread handler;
+		std::atomic<bool> finished{ false };
+	};
+	std::list<Connection> connections;	// Accept loop only
+
+	// One thread per connection, requests on a connection are answered in order
+	auto serve = [&](Connection& connection)
+	{
+		int fd = connection.fd;
+		std::vector<float> input;
+		std::vector<char> response;
+		while (true)
+		{
+			uint32_t count;
+			if (!serve_protocol::ReadAll(fd, &count, sizeof(count)))
+				break;
+
+			if (count == serve_protocol::StatsRequest)
+			{
+				std::string json = StatsToJson(predictor.getStats(), uptime(), shm, cache);
+				uint32_t length = static_cast<uint32_t>(json.size());
+				if (!serve_protocol::WriteAll(fd, &length, sizeof(length)) || !serve_protocol::WriteAll(fd, json.data(), length))
+					break;
+				continue;
+			}
+
+			if (count != static_cast<uint32_t>(inputSize))
+			{
+				// Can't resynchronize with the stream, answer and hang up
+				int32_t header[2] = { -1, 0 };
+				serve_protocol::WriteAll(fd, header, sizeof(header));
+				break;
+			}
+
+			input.resize(count);
+			if (!serve_protocol::ReadAll(fd, input.data(), count * sizeof(float)))
+				break;
+
+			Prediction prediction;
+			uint64_t hash = 0;
+			if (cache)
+				hash = HashBytes(input.data(), count * sizeof(float));
+			if (cache && cache->Lookup(hash, predictor.getModelVersion(), prediction.outputs))
+			{
+				Eigen::Index label;
+				prediction.outputs.maxCoeff(&label);
+				prediction.label = static_cast<int>(label);
+			}
+			else
+			{
+				prediction = predictor.Submit(Eigen::Map<Eigen::VectorXf>(input.data(), count)).get();
+				if (cache)
+					cache->Insert(hash, prediction.modelVersion, prediction.outputs);
+			}
+
+			uint32_t outputCount = static_cast<uint32_t>(prediction.outputs.size());
+			int32_t label = prediction.label;
+			response.resize(8 + outputCount * sizeof(float));
+			std::memcpy(response.data(), &label, 4);
+			std::memcpy(response.data() + 4, &outputCount, 4);
+			std::memcpy(response.data() + 8, prediction.outputs.data(), outputCount * sizeof(float));
+			if (!serve_protocol::WriteAll(fd, response.data(), response.size()))
+				break;
+		}
+		::shutdown(fd, SHUT_RDWR);
+		connection.finished = true;
+	};
+
+	auto lastStats = std::chrono::steady_clock::now();
+	while (!g_Stop)
+	{
+		pollfd listening = { listenFd, POLLIN, 0 };
+		if (::poll(&listening, listenFd >= 0 ? 1 : 0, 200) > 0 && (listening.revents & POLLIN))
+		{
+			int fd = ::accept(listenFd, nullptr, nullptr);
+			if (fd >= 0)
+			{
+				int noDelay = 1;
+				if (options.endpoint.socketPath.empty())
+					::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+				connections.emplace_back();
+				connections.back().fd = fd;
+				connections.back().handler = std::thread(serve, std::ref(connections.back()));
+			}
+		}
+
+		// Clean up after the clients that hung up
+		for (auto it = connections.begin(); it != connections.end();)
+		{
+			if (!it->finished)
+			{
+				++it;
+				continue;
+			}
+			it->handler.join();
+			::close(it->fd);
+			it = connections.erase(it);
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (options.statsSeconds > 0.0f && std::chrono::duration<float>(now - lastStats).count() >= options.statsSeconds)
+		{
+			std::lock_guard<std::mutex> lock(metricsMutex);
+			metrics << StatsToJson(predictor.getStats(), uptime(), shm, cache) << std::endl;
+			lastStats = now;
+		}
+	}
+
+	// Unblock the handlers still reading, then wait for them
+	watcher.Stop();
+	stopShm = true;
+	if (shmWorker.joinable())
+		shmWorker.join();
+	if (listenFd >= 0)
+		::close(listenFd);
+	if (!options.endpoint.socketPath.empty())
+		::unlink(options.endpoint.socketPath.c_str());
+	for (auto& connection : connections)
+		::shutdown(connection.fd, SHUT_RDWR);
+	for (auto& connection : connections)
+	{
+		connection.handler.join();
+		::close(connection.fd);
+	}
+
+	metrics << StatsToJson(predictor.getStats(), uptime(), shm, cache) << std::endl;
+	return 0;
+}
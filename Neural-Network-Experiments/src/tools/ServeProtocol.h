@@ -0,0 +1,148 @@
+#pragma once
+// Wire protocol shared by nn-serve and nn-loadgen (POSIX sockets, Linux build only). Little endian,
+// any number of requests per connection, one response per request in order :
+//
+//		request			uint32 count, count floats (the input layer, pixels in 0..1)
+//		response		int32 label (-1 = rejected), uint32 count, count floats (output activations)
+//
+// A request with count == StatsRequest asks for the server metrics instead : uint32 length, JSON text
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <iostream>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace serve_protocol
+{
+	constexpr uint32_t StatsRequest = 0xFFFFFFFF;
+
+	// Unix domain socket when socketPath is set, otherwise TCP on 127.0.0.1
+	struct Endpoint
+	{
+		std::string socketPath;
+		int port = 0;
+	};
+
+	inline bool ReadAll(int fd, void* data, size_t size)
+	{
+		char* bytes = static_cast<char*>(data);
+		while (size > 0)
+		{
+			ssize_t read = ::recv(fd, bytes, size, 0);
+			if (read <= 0)
+				return false;
+			bytes += read;
+			size -= read;
+		}
+		return true;
+	}
+
+	inline bool WriteAll(int fd, const void* data, size_t size)
+	{
+		const char* bytes = static_cast<const char*>(data);
+		while (size > 0)
+		{
+			ssize_t written = ::send(fd, bytes, size, MSG_NOSIGNAL);
+			if (written <= 0)
+				return false;
+			bytes += written;
+			size -= written;
+		}
+		return true;
+	}
+
+	inline int Listen(const Endpoint& endpoint)
+	{
+		int fd;
+		if (!endpoint.socketPath.empty())
+		{
+			sockaddr_un address = {};
+			address.sun_family = AF_UNIX;
+			if (endpoint.socketPath.size() >= sizeof(address.sun_path))
+			{
+				std::cerr << "Error: Socket path too long " << endpoint.socketPath << std::endl;
+				return -1;
+			}
+			std::strcpy(address.sun_path, endpoint.socketPath.c_str());
+			::unlink(address.sun_path);	// Left over by a previous run
+
+			fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+			{
+				std::perror(endpoint.socketPath.c_str());
+				if (fd >= 0)
+					::close(fd);
+				return -1;
+			}
+		}
+		else
+		{
+			sockaddr_in address = {};
+			address.sin_family = AF_INET;
+			address.sin_port = htons(static_cast<uint16_t>(endpoint.port));
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);	// Local services only
+
+			fd = ::socket(AF_INET, SOCK_STREAM, 0);
+			int reuse = 1;
+			if (fd >= 0)
+				::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+			if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+			{
+				std::perror("bind");
+				if (fd >= 0)
+					::close(fd);
+				return -1;
+			}
+		}
+
+		if (::listen(fd, 128) != 0)
+		{
+			std::perror("listen");
+			::close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	inline int Connect(const Endpoint& endpoint)
+	{
+		int fd;
+		int result;
+		if (!endpoint.socketPath.empty())
+		{
+			sockaddr_un address = {};
+			address.sun_family = AF_UNIX;
+			std::strncpy(address.sun_path, endpoint.socketPath.c_str(), sizeof(address.sun_path) - 1);
+			fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			result = fd < 0 ? -1 : ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+		}
+		else
+		{
+			sockaddr_in address = {};
+			address.sin_family = AF_INET;
+			address.sin_port = htons(static_cast<uint16_t>(endpoint.port));
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			fd = ::socket(AF_INET, SOCK_STREAM, 0);
+			result = fd < 0 ? -1 : ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+			int noDelay = 1;	// Small request / response messages
+			if (result == 0)
+				::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+		}
+
+		if (result != 0)
+		{
+			std::perror("connect");
+			if (fd >= 0)
+				::close(fd);
+			return -1;
+		}
+		return fd;
+	}
+}
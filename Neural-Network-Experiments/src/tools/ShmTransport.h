@@ -0,0 +1,398 @@
+#pragma once
+// Shared memory transport between nn-serve and clients on the same host (Linux : shm_open + futex).
+// No syscalls and no copies on the hot path when both sides are busy, the futexes only put idle sides to sleep.
+//
+// Segment layout (every part 64 byte aligned) :
+//
+//		SegmentHeader
+//		RingCell[ringCapacity]		lock free MPSC ring of slot numbers, clients push, the server pops
+//		slotCount * slotStride		one slot per client : SlotHeader, input floats, output floats
+//
+// A client owns one slot and has at most one request in flight : it writes the input into its slot, pushes the
+// slot number and waits for slot.done to reach its request number. The server answers in place, so the ring
+// (capacity >= slotCount) can never overflow. A request that timed out is still queued or being answered : the
+// client leaves its slot alone until done catches up with it
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace shm_transport
+{
+	constexpr uint32_t Magic = 0x4D48534E;	// "NSHM"
+	constexpr uint32_t Version = 1;
+
+	static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "Atomics in shared memory have to be lock free");
+
+	struct alignas(64) SegmentHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t inputSize;
+		uint32_t outputSize;
+		uint32_t slotCount;
+		uint32_t ringCapacity;		// Power of two
+		uint64_t slotStride;		// Bytes
+		uint64_t ringOffset;
+		uint64_t slotsOffset;
+
+		alignas(64) std::atomic<uint64_t> ringTail;	// Next position producers claim
+		alignas(64) std::atomic<uint32_t> serverWake;	// Futex word, bumped to wake the server
+		std::atomic<uint32_t> serverSleeping;
+	};
+
+	struct RingCell
+	{
+		std::atomic<uint64_t> sequence;
+		uint32_t slot;
+		uint32_t padding;
+	};
+
+	struct alignas(64) SlotHeader
+	{
+		std::atomic<uint32_t> owner;			// Client pid, 0 = free
+		std::atomic<uint32_t> done;				// Futex word : last answered request number
+		std::atomic<uint32_t> clientWaiting;	// Client is (about to be) asleep on done
+		uint32_t request;						// Number of the request in the slot
+		int32_t label;
+		float computeUs;						// Server time for the batch that answered it
+	};
+
+	inline size_t AlignUp(size_t value) { return (value + 63) & ~size_t(63); }
+
+	inline void CpuRelax()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+
+	// Shared (not private) futexes, the words live in memory mapped by several processes
+	inline void FutexWait(std::atomic<uint32_t>& word, uint32_t expected, int timeoutMs)
+	{
+		timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, timeoutMs >= 0 ? &timeout : nullptr, nullptr, 0);
+	}
+
+	inline void FutexWake(std::atomic<uint32_t>& word)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+	}
+
+	class Segment
+	{
+	private:
+		std::string m_Name;
+		unsigned char* m_Base = nullptr;
+		size_t m_Size = 0;
+		bool m_Owner = false;
+		uint64_t m_Head = 0;	// Server only
+
+		bool Map(int fd, size_t size)
+		{
+			void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			close(fd);
+			if (base == MAP_FAILED)
+			{
+				std::perror("mmap");
+				return false;
+			}
+			m_Base = static_cast<unsigned char*>(base);
+			m_Size = size;
+			return true;
+		}
+
+	public:
+		Segment() = default;
+		~Segment() { Close(); }
+
+		Segment(const Segment&) = delete;
+		Segment& operator=(const Segment&) = delete;
+
+		// Server side, name like "/nn-serve"
+		bool Create(const std::string& name, int inputSize, int outputSize, int slotCount)
+		{
+			uint32_t ringCapacity = 1;
+			while (ringCapacity < static_cast<uint32_t>(slotCount))
+				ringCapacity <<= 1;
+
+			size_t slotStride = AlignUp(sizeof(SlotHeader)) + AlignUp(inputSize * sizeof(float)) + AlignUp(outputSize * sizeof(float));
+			size_t ringOffset = AlignUp(sizeof(SegmentHeader));
+			size_t slotsOffset = ringOffset + AlignUp(ringCapacity * sizeof(RingCell));
+			size_t size = slotsOffset + slotCount * slotStride;
+
+			shm_unlink(name.c_str());	// Left over by a server that crashed
+			int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+			if (fd < 0 || ftruncate(fd, static_cast<off_t>(size)) != 0)
+			{
+				std::perror(name.c_str());
+				if (fd >= 0)
+					close(fd);
+				return false;
+			}
+			m_Name = name;
+			m_Owner = true;
+			if (!Map(fd, size))
+				return false;
+
+			// ftruncate zero filled it, the atomics start at 0
+			SegmentHeader* header = new (m_Base) SegmentHeader();
+			header->inputSize = inputSize;
+			header->outputSize = outputSize;
+			header->slotCount = slotCount;
+			header->ringCapacity = ringCapacity;
+			header->slotStride = slotStride;
+			header->ringOffset = ringOffset;
+			header->slotsOffset = slotsOffset;
+			for (uint32_t i = 0; i < ringCapacity; i++)
+				getCell(i).sequence.store(i, std::memory_order_relaxed);
+			for (int i = 0; i < slotCount; i++)
+				new (&getSlot(i)) SlotHeader();
+
+			header->version = Version;
+			std::atomic_thread_fence(std::memory_order_release);
+			header->magic = Magic;	// Last, clients check it
+			return true;
+		}
+
+		// Client side
+		bool Attach(const std::string& name)
+		{
+			int fd = shm_open(name.c_str(), O_RDWR, 0);
+			struct stat info;
+			if (fd < 0 || fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(SegmentHeader))
+			{
+				std::cerr << "Error: No shared memory segment " << name << " (is nn-serve --shm running?)" << std::endl;
+				if (fd >= 0)
+					close(fd);
+				return false;
+			}
+			m_Name = name;
+			if (!Map(fd, static_cast<size_t>(info.st_size)))
+				return false;
+
+			const SegmentHeader& header = getHeader();
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (header.magic != Magic || header.version != Version || header.slotsOffset + header.slotCount * header.slotStride > m_Size)
+			{
+				std::cerr << "Error: " << name << " is not an nn-serve segment" << std::endl;
+				Close();
+				return false;
+			}
+			return true;
+		}
+
+		void Close()
+		{
+			if (m_Base)
+				munmap(m_Base, m_Size);
+			if (m_Owner)
+				shm_unlink(m_Name.c_str());
+			m_Base = nullptr;
+			m_Owner = false;
+		}
+
+		SegmentHeader& getHeader() { return *reinterpret_cast<SegmentHeader*>(m_Base); }
+		RingCell& getCell(uint64_t position) { return reinterpret_cast<RingCell*>(m_Base + getHeader().ringOffset)[position & (getHeader().ringCapacity - 1)]; }
+		SlotHeader& getSlot(uint32_t slot) { return *reinterpret_cast<SlotHeader*>(m_Base + getHeader().slotsOffset + slot * getHeader().slotStride); }
+		float* getInput(uint32_t slot) { return reinterpret_cast<float*>(reinterpret_cast<unsigned char*>(&getSlot(slot)) + AlignUp(sizeof(SlotHeader))); }
+		float* getOutput(uint32_t slot) { return getInput(slot) + AlignUp(getHeader().inputSize * sizeof(float)) / sizeof(float); }
+
+		// Bounded MPSC queue (Vyukov) : a cell's sequence says whose turn it is, producers claim positions with a CAS
+		bool Push(uint32_t slot)
+		{
+			SegmentHeader& header = getHeader();
+			uint64_t position = header.ringTail.load(std::memory_order_relaxed);
+			while (true)
+			{
+				RingCell& cell = getCell(position);
+				int64_t difference = static_cast<int64_t>(cell.sequence.load(std::memory_order_acquire) - position);
+				if (difference == 0)
+				{
+					if (header.ringTail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					{
+						cell.slot = slot;
+						cell.sequence.store(position + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (difference < 0)
+					return false;	// Full
+				else
+					position = header.ringTail.load(std::memory_order_relaxed);
+			}
+		}
+
+		// Single consumer
+		bool Pop(uint32_t& slot)
+		{
+			RingCell& cell = getCell(m_Head);
+			if (cell.sequence.load(std::memory_order_acquire) != m_Head + 1)
+				return false;
+			slot = cell.slot;
+			cell.sequence.store(m_Head + getHeader().ringCapacity, std::memory_order_release);
+			m_Head++;
+			return true;
+		}
+
+		// Server : sleep until a client pushes something (or the timeout, to check for shutdown)
+		void WaitForRequests(int timeoutMs)
+		{
+			SegmentHeader& header = getHeader();
+			uint32_t wake = header.serverWake.load(std::memory_order_acquire);
+			header.serverSleeping.store(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);	// Pairs with the fence in Notify()
+			if (getCell(m_Head).sequence.load(std::memory_order_acquire) != m_Head + 1)
+				FutexWait(header.serverWake, wake, timeoutMs);
+			header.serverSleeping.store(0, std::memory_order_relaxed);
+		}
+
+		// Client, after Push
+		void NotifyServer()
+		{
+			SegmentHeader& header = getHeader();
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (header.serverSleeping.load(std::memory_order_relaxed))
+			{
+				header.serverWake.fetch_add(1, std::memory_order_release);
+				FutexWake(header.serverWake);
+			}
+		}
+
+		// Server, after writing the outputs
+		void Answer(uint32_t slot)
+		{
+			SlotHeader& header = getSlot(slot);
+			header.done.store(header.request, std::memory_order_release);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (header.clientWaiting.load(std::memory_order_relaxed))
+				FutexWake(header.done);
+		}
+	};
+
+	// One request in flight at a time, use one client per thread
+	class Client
+	{
+	private:
+		Segment m_Segment;
+		uint32_t m_Slot = 0;
+		bool m_HasSlot = false;
+		bool m_Pending = false;		// The last request timed out, the server still owns the slot
+		std::chrono::microseconds m_Spin;
+
+		// Spin, then sleep on slot.done until it reaches request
+		bool WaitForAnswer(uint32_t request, int timeoutMs)
+		{
+			SlotHeader& slot = m_Segment.getSlot(m_Slot);
+
+			// Spin first : the answer usually comes back within microseconds
+			auto spinEnd = std::chrono::steady_clock::now() + m_Spin;
+			while (slot.done.load(std::memory_order_acquire) != request && std::chrono::steady_clock::now() < spinEnd)
+				CpuRelax();
+
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+			while (true)
+			{
+				uint32_t done = slot.done.load(std::memory_order_acquire);
+				if (done == request)
+					return true;
+				if (std::chrono::steady_clock::now() >= deadline)
+					return false;
+				slot.clientWaiting.store(1, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);	// Pairs with the fence in Answer()
+				if (slot.done.load(std::memory_order_acquire) != request)
+					FutexWait(slot.done, done, 100);
+				slot.clientWaiting.store(0, std::memory_order_relaxed);
+			}
+		}
+
+	public:
+		// Spinning keeps the round trip in the microseconds but burns a core, only worth it with cores to spare
+		explicit Client(int spinUs = 200) : m_Spin(spinUs) {}
+		~Client() { Detach(); }
+
+		bool Attach(const std::string& name)
+		{
+			if (!m_Segment.Attach(name))
+				return false;
+
+			// Free slot, or one left behind by a process that died
+			uint32_t pid = static_cast<uint32_t>(getpid());
+			for (uint32_t i = 0; i < m_Segment.getHeader().slotCount; i++)
+			{
+				SlotHeader& slot = m_Segment.getSlot(i);
+				uint32_t owner = slot.owner.load();
+				bool dead = owner != 0 && kill(static_cast<pid_t>(owner), 0) != 0 && errno == ESRCH;
+				if ((owner == 0 || dead) && slot.owner.compare_exchange_strong(owner, pid))
+				{
+					m_Slot = i;
+					m_HasSlot = true;
+					slot.request = slot.done.load();
+					return true;
+				}
+			}
+			std::cerr << "Error: All " << m_Segment.getHeader().slotCount << " client slots are taken" << std::endl;
+			return false;
+		}
+
+		void Detach()
+		{
+			if (m_HasSlot)
+				m_Segment.getSlot(m_Slot).owner.store(0);
+			m_HasSlot = false;
+			m_Segment.Close();
+		}
+
+		int getInputSize() { return m_Segment.getHeader().inputSize; }
+		int getOutputSize() { return m_Segment.getHeader().outputSize; }
+
+		// The last Predict timed out and its answer hasn't come back yet
+		bool isPending() const { return m_Pending; }
+
+		// Blocks until the answer is there, false if the server doesn't answer within timeoutMs. After a timeout the
+		// next call first waits (up to its own timeoutMs) for that answer, the slot can't be reused before
+		bool Predict(const float* input, float* output, int& label, float& computeUs, int timeoutMs = 5000)
+		{
+			SlotHeader& slot = m_Segment.getSlot(m_Slot);
+			if (m_Pending)
+			{
+				if (!WaitForAnswer(slot.request, timeoutMs))
+					return false;
+				m_Pending = false;
+			}
+
+			std::memcpy(m_Segment.getInput(m_Slot), input, getInputSize() * sizeof(float));
+			uint32_t request = ++slot.request;
+			if (!m_Segment.Push(m_Slot))
+			{
+				slot.request--;
+				return false;
+			}
+			m_Segment.NotifyServer();
+
+			if (!WaitForAnswer(request, timeoutMs))
+			{
+				m_Pending = true;
+				return false;
+			}
+
+			std::memcpy(output, m_Segment.getOutput(m_Slot), getOutputSize() * sizeof(float));
+			label = slot.label;
+			computeUs = slot.computeUs;
+			return true;
+		}
+	};
+}
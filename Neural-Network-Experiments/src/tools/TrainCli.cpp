@@ -0,0 +1,520 @@
+// nn-train : headless trainer, same training loop as the GUI. Metrics go to stdout (or --metrics) as one JSON
+// object per line, everything else goes to stderr
+//
+//		nn-train --data mnist_train.csv --test mnist_test.csv --layers 784,128,64,10 --epochs 10 --threads 8
+//		nn-train --data mnist_train.csv --test mnist_test.csv --optimizer hogwild --batch 1 --threads 8
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "ml/Network.h"
+#include "ml/Dataset.h"
+#include "ml/Checkpoint.h"
+#include "ml/ModelFile.h"
+#include "ml/ParallelTraining.h"
+#include "ml/ThreadPool.h"
+
+struct TrainOptions
+{
+	std::string dataPath;
+	std::string testPath;
+	int maxSamples = -1;
+	std::vector<int> layers = { 784, 128, 64, 10 };
+	std::string optimizer = "sgd";
+	float sparsity = 0.9f;
+	int regrowInterval = 100;
+	std::string precision = "fp32";
+	float learningRate = 0.1f;
+	int batchSize = 32;
+	int epochs = 10;
+	int threads = 0;			// 0 = hardware threads
+	bool numa = false;			// Pinned pool, node-local samples and buffers
+	int replicaSyncInterval = 0;	// > 0 = hogwild with one weight copy per NUMA node
+	int taskGraphBatches = 0;	// > 0 = sgd as a task graph over this many batches at a time
+	int pipelineStages = 0;		// > 0 = sgd pipeline parallel across this many stages
+	int microBatches = 4;
+	std::string schedule = "1f1b";
+	int tensorParallel = 0;		// > 0 = sgd with the wide layers split across this many threads
+	int tensorMinRows = 1024;
+	int seed = -1;				// -1 = random
+	std::string checkpointPath;
+	int checkpointInterval = 1;
+	int fullCheckpointInterval = 0;	// > 0 = incremental checkpoints
+	std::string resumePath;
+	std::string savePath;
+	std::string metricsPath;
+};
+
+static void PrintUsage()
+{
+	std::cerr <<
+		"Usage: nn-train --data <mnist.csv> [options]\n"
+		"  --data <path>             Training set (MNIST CSV)\n"
+		"  --test <path>             Test set, evaluated after every epoch\n"
+		"  --samples <n>             Load at most n training samples\n"
+		"  --layers <a,b,...>        Layer sizes (default 784,128,64,10)\n"
+		"  --optimizer <name>        sgd | sparse-sgd (dynamic sparse training) | hogwild (lock-free threads)\n"
+		"                            | sync (synchronous data parallel threads). hogwild and sync train with\n"
+		"                            --threads threads and --batch per thread\n"
+		"  --sparsity <f>            Fraction of zero weights for sparse-sgd (default 0.9)\n"
+		"  --regrow-interval <n>     Batches between prune-and-regrow steps (default 100)\n"
+		"  --precision <name>        fp32 | bf16\n"
+		"  --lr <f>                  Learning rate (default 0.1)\n"
+		"  --batch <n>               Batch size (default 32)\n"
+		"  --epochs <n>              Epochs (default 10)\n"
+		"  --task-graph <n>          sgd : run n batches at a time as a task graph (updates overlap the backward pass)\n"
+		"  --pipeline <n>            sgd : pipeline parallel, the layers split into n stages on their own cores\n"
+		"  --micro-batches <n>       Micro-batches per batch for --pipeline (default 4)\n"
+		"  --schedule <name>         gpipe | 1f1b (default) for --pipeline\n"
+		"  --tensor-parallel <n>     sgd : split the rows of the wide layers across n threads\n"
+		"  --tp-min-rows <n>         Narrowest layer --tensor-parallel splits (default 1024)\n"
+		"  --threads <n>             Thread pool size for loading, evaluation, hogwild and sync, Eigen's threads for plain\n"
+		"                            sgd (default: all cores)\n"
+		"  --numa                    Pin the pool threads to cores and keep every thread's samples and buffers on its\n"
+		"                            node (hogwild and sync)\n"
+		"  --replicas <n>            hogwild : one copy of the weights per NUMA node, averaged every n batches\n"
+		"  --seed <n>                Seed for the initialization and the shuffles\n"
+		"  --checkpoint <path>       Write checkpoints in the background\n"
+		"  --checkpoint-every <n>    Epochs between checkpoints (default 1)\n"
+		"  --incremental <n>         Delta checkpoints, a full one every n\n"
+		"  --resume <path>           Continue from a checkpoint\n"
+		"  --save <path>             Save the trained model (binary model file)\n"
+		"  --metrics <path>          Write the JSON lines to a file instead of stdout\n";
+}
+
+static bool ParseLayers(const std::string& text, std::vector<int>& layers)
+{
+	layers.clear();
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ','))
+	{
+		int size = std::atoi(item.c_str());
+		if (size <= 0)
+			return false;
+		layers.push_back(size);
+	}
+	return layers.size() >= 2;
+}
+
+static bool ParseArguments(int argc, char** argv, TrainOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h")
+			return false;
+		if (arg == "--numa")
+		{
+			options.numa = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << arg << std::endl;
+			return false;
+		}
+
+		std::string value = argv[++i];
+		if (arg == "--data") options.dataPath = value;
+		else if (arg == "--test") options.testPath = value;
+		else if (arg == "--samples") options.maxSamples = std::atoi(value.c_str());
+		else if (arg == "--layers")
+		{
+			if (!ParseLayers(value, options.layers))
+			{
+				std::cerr << "Invalid --layers " << value << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--optimizer") options.optimizer = value;
+		else if (arg == "--sparsity") options.sparsity = std::strtof(value.c_str(), nullptr);
+		else if (arg == "--regrow-interval") options.regrowInterval = std::atoi(value.c_str());
+		else if (arg == "--precision") options.precision = value;
+		else if (arg == "--lr") options.learningRate = std::strtof(value.c_str(), nullptr);
+		else if (arg == "--batch") options.batchSize = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--epochs") options.epochs = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--task-graph") options.taskGraphBatches = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--pipeline") options.pipelineStages = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--micro-batches") options.microBatches = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--schedule") options.schedule = value;
+		else if (arg == "--tensor-parallel") options.tensorParallel = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--tp-min-rows") options.tensorMinRows = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--threads") options.threads = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--replicas") options.replicaSyncInterval = std::max(std::atoi(value.c_str()), 0);
+		else if (arg == "--seed") options.seed = std::atoi(value.c_str());
+		else if (arg == "--checkpoint") options.checkpointPath = value;
+		else if (arg == "--checkpoint-every") options.checkpointInterval = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--incremental") options.fullCheckpointInterval = std::max(std::atoi(value.c_str()), 1);
+		else if (arg == "--resume") options.resumePath = value;
+		else if (arg == "--save") options.savePath = value;
+		else if (arg == "--metrics") options.metricsPath = value;
+		else
+		{
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+	}
+
+	if (options.dataPath.empty())
+	{
+		std::cerr << "--data is required" << std::endl;
+		return false;
+	}
+	if (options.optimizer != "sgd" && options.optimizer != "sparse-sgd" && options.optimizer != "hogwild" && options.optimizer != "sync")
+	{
+		std::cerr << "Unknown optimizer " << options.optimizer << " (sgd, sparse-sgd, hogwild, sync)" << std::endl;
+		return false;
+	}
+	if (options.taskGraphBatches > 0 && (options.optimizer != "sgd" || options.precision != "fp32"))
+	{
+		std::cerr << "--task-graph needs --optimizer sgd and fp32" << std::endl;
+		return false;
+	}
+	if (options.pipelineStages > 0 && (options.optimizer != "sgd" || options.precision != "fp32" || options.taskGraphBatches > 0))
+	{
+		std::cerr << "--pipeline needs --optimizer sgd and fp32 (and no --task-graph)" << std::endl;
+		return false;
+	}
+	if (options.tensorParallel > 0 && (options.optimizer != "sgd" || options.precision != "fp32" || options.taskGraphBatches > 0 || options.pipelineStages > 0))
+	{
+		std::cerr << "--tensor-parallel needs --optimizer sgd and fp32 (and no --task-graph or --pipeline)" << std::endl;
+		return false;
+	}
+	PipelineSchedule schedule;
+	if (!ParsePipelineSchedule(options.schedule, schedule))
+	{
+		std::cerr << "Unknown schedule " << options.schedule << " (gpipe, 1f1b)" << std::endl;
+		return false;
+	}
+	if (options.replicaSyncInterval > 0 && options.optimizer != "hogwild")
+	{
+		std::cerr << "--replicas needs --optimizer hogwild" << std::endl;
+		return false;
+	}
+	if (options.optimizer == "hogwild" && options.precision != "fp32")
+	{
+		std::cerr << "hogwild trains in fp32 only" << std::endl;
+		return false;
+	}
+	if (options.precision != "fp32" && options.precision != "bf16")
+	{
+		std::cerr << "Unknown precision " << options.precision << " (fp32, bf16)" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+struct EvalResult
+{
+	float loss = 0.0f;
+	float accuracy = 0.0f;
+};
+
+// One const ForwardBatch per chunk gives both the loss and the accuracy. Chunks run on the thread pool, and are
+// no wider than 128 columns so ForwardBatch doesn't split them again
+static EvalResult Evaluate(const Network& network, const Dataset& dataset)
+{
+	const size_t chunkSize = 128;
+	size_t count = dataset.size();
+	if (count == 0)
+		return EvalResult();
+
+	size_t chunks = (count + chunkSize - 1) / chunkSize;
+	std::vector<double> losses(chunks, 0.0);
+	std::vector<double> correct(chunks, 0.0);
+	ThreadPool::Global().ParallelFor(0, chunks, 1, [&](size_t firstChunk, size_t lastChunk)
+		{
+			Eigen::MatrixXf inputs;
+			for (size_t c = firstChunk; c < lastChunk; c++)
+			{
+				size_t first = c * chunkSize;
+				size_t n = std::min(count, first + chunkSize) - first;
+				inputs.resize(network.getLayerSize(0), n);
+				for (size_t j = 0; j < n; j++)
+					inputs.col(j) = dataset.getSample(first + j).input;
+
+				Eigen::MatrixXf outputs = network.ForwardBatch(inputs);
+				for (size_t j = 0; j < n; j++)
+				{
+					const DataSample& sample = dataset.getSample(first + j);
+					Eigen::VectorXf output = outputs.col(j);
+					losses[c] += Network::LossFunction(output, sample.target);
+					Eigen::Index predicted;
+					output.maxCoeff(&predicted);
+					if (predicted == sample.label)
+						correct[c] += 1.0;
+				}
+			}
+		});
+
+	EvalResult result;
+	for (size_t c = 0; c < chunks; c++)
+	{
+		result.loss += static_cast<float>(losses[c] / count);
+		result.accuracy += static_cast<float>(correct[c] / count);
+	}
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	auto programStart = std::chrono::steady_clock::now();	// The pool also loads the data
+	TrainOptions options;
+	if (!ParseArguments(argc, argv, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	// The ml code logs with std::cout, keep stdout for the metrics only
+	std::ofstream metricsFile;
+	std::ostream metrics(std::cout.rdbuf());
+	if (!options.metricsPath.empty())
+	{
+		metricsFile.open(options.metricsPath);
+		if (!metricsFile.is_open())
+		{
+			std::cerr << "Error: Could not open file " << options.metricsPath << std::endl;
+			return 1;
+		}
+		metrics.rdbuf(metricsFile.rdbuf());
+	}
+	std::cout.rdbuf(std::cerr.rdbuf());
+
+	if (options.threads == 0)
+		options.threads = std::max(1u, std::thread::hardware_concurrency());
+
+	// The parallel work goes through the thread pool, Eigen threads on top would oversubscribe. Plain sgd gets them
+	// back around its batch loop
+	bool threadedOptimizer = options.optimizer == "hogwild" || options.optimizer == "sync";
+	Eigen::setNbThreads(1);
+	ThreadPool::Global().setThreadCount(options.threads);
+	ThreadPool::Global().setPinning(options.numa);
+	if (options.seed >= 0)
+		std::srand(static_cast<unsigned int>(options.seed)); // Eigen's Random() uses rand()
+
+	Dataset train;
+	if (!train.loadMNIST_CSV(options.dataPath, options.maxSamples) || train.empty())
+		return 1;
+	if (options.seed >= 0)
+		train.setSeed(static_cast<unsigned int>(options.seed));
+
+	// Hogwild thread t trains on stored samples [size * t / threads, size * (t + 1) / threads) every epoch : copy
+	// them from its own thread so they sit on its node
+	bool localShards = options.numa && options.optimizer == "hogwild";
+	if (localShards)
+		ThreadPool::Global().RunOnEach([&](int t)
+			{
+				train.relocateSamples(train.size() * t / options.threads, train.size() * (t + 1) / options.threads);
+			});
+
+	Dataset test;
+	if (!options.testPath.empty() && (!test.loadMNIST_CSV(options.testPath) || test.empty()))
+		return 1;
+
+	Network network(options.layers);
+	int startEpoch = 0;
+	if (!options.resumePath.empty())
+	{
+		TrainingCheckpoint checkpoint;
+		if (!LoadCheckpoint(options.resumePath, checkpoint) || !train.setCursor(checkpoint.dataset))
+		{
+			std::cerr << "Error: Could not resume from " << options.resumePath << std::endl;
+			return 1;
+		}
+		network.RestoreState(checkpoint.network);
+		startEpoch = checkpoint.epoch;
+		std::cerr << "Resuming from epoch " << startEpoch << std::endl;
+	}
+	else
+	{
+		network.setPrecision(options.precision == "bf16" ? Precision::BF16 : Precision::FP32);
+		if (options.optimizer == "sparse-sgd")
+			network.EnableSparseTraining(options.sparsity, options.regrowInterval);
+	}
+
+	if (network.getLayerSize(0) != train.getInputSize() || network.getLayerSize(network.getLayerCount() - 1) != train.getOutputSize())
+	{
+		std::cerr << "Error: The network is " << network.getLayerSize(0) << " -> " << network.getLayerSize(network.getLayerCount() - 1)
+			<< " but the dataset is " << train.getInputSize() << " -> " << train.getOutputSize() << std::endl;
+		return 1;
+	}
+
+	CheckpointWriter checkpointWriter;
+	if (options.fullCheckpointInterval > 0)
+		checkpointWriter.setIncremental(true, options.fullCheckpointInterval);
+
+	PipelineOptions pipelineOptions;
+	pipelineOptions.stages = options.pipelineStages;
+	pipelineOptions.microBatches = options.microBatches;
+	ParsePipelineSchedule(options.schedule, pipelineOptions.schedule);
+
+	TensorParallelOptions tensorOptions;
+	tensorOptions.partitions = options.tensorParallel;
+	tensorOptions.minRows = options.tensorMinRows;
+
+	auto runStart = std::chrono::steady_clock::now();
+	int numBatches = static_cast<int>((train.size() + options.batchSize - 1) / options.batchSize);
+	// getBatch wraps around : the last batch only takes what is left, so an epoch sees every sample once
+	auto nextBatch = [&](int batch)
+		{
+			return train.getBatch(std::min<size_t>(options.batchSize, train.size() - static_cast<size_t>(batch) * options.batchSize));
+		};
+	char line[1024];
+
+	for (int epoch = startEpoch; epoch < options.epochs; epoch++)
+	{
+		auto epochStart = std::chrono::steady_clock::now();
+
+		if (localShards)
+			train.shuffleShards(options.threads);
+		else
+			train.shuffle();
+		ParallelTrainingStats parallelStats;
+		TaskGraphStats graphStats;
+		PipelineStats pipelineStats;
+		TensorParallelStats tensorStats;
+		if (options.optimizer == "hogwild")
+		{
+			if (!TrainEpochHogwild(network, train, options.threads, options.learningRate, options.batchSize, parallelStats,
+				options.replicaSyncInterval))
+				return 1;
+		}
+		else if (options.optimizer == "sync")
+			TrainEpochSynchronous(network, train, options.threads, options.learningRate, options.batchSize, parallelStats);
+		else if (options.taskGraphBatches > 0)
+		{
+			std::vector<std::vector<DataSample>> group;
+			for (int batch = 0; batch < numBatches; batch += options.taskGraphBatches)
+			{
+				group.clear();
+				for (int i = batch; i < std::min(numBatches, batch + options.taskGraphBatches); i++)
+					group.push_back(nextBatch(i));
+				TaskGraphStats stats = network.TrainBatchesOverlapped(group, options.learningRate);
+				graphStats.tasks += stats.tasks;
+				graphStats.wallSeconds += stats.wallSeconds;
+				graphStats.workSeconds += stats.workSeconds;
+				graphStats.criticalPathSeconds += stats.criticalPathSeconds;
+			}
+		}
+		else if (options.pipelineStages > 0)
+		{
+			// One call per epoch, the stage threads live through all its batches
+			std::vector<std::vector<DataSample>> batches;
+			for (int batch = 0; batch < numBatches; batch++)
+				batches.push_back(nextBatch(batch));
+			pipelineStats = network.TrainBatchesPipelined(batches, options.learningRate, pipelineOptions);
+		}
+		else if (options.tensorParallel > 0)
+		{
+			std::vector<std::vector<DataSample>> batches;
+			for (int batch = 0; batch < numBatches; batch++)
+				batches.push_back(nextBatch(batch));
+			tensorStats = network.TrainBatchesTensorParallel(batches, options.learningRate, tensorOptions);
+		}
+		else
+		{
+			// Nothing else runs meanwhile, the pool is idle : Eigen's products get the cores
+			Eigen::setNbThreads(options.threads);
+			for (int batch = 0; batch < numBatches; batch++)
+			{
+				auto batchData = nextBatch(batch);
+				network.TrainBatch(batchData, options.learningRate);
+			}
+			Eigen::setNbThreads(1);
+		}
+
+		double trainSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - epochStart).count();
+
+		if (!options.checkpointPath.empty() && (epoch + 1) % options.checkpointInterval == 0)
+			checkpointWriter.Save(network, train, epoch + 1, options.learningRate, options.batchSize, options.checkpointPath);
+
+		EvalResult trainResult = Evaluate(network, train);
+		// Pieces formatted one at a time and appended, the record grows with the options
+		std::snprintf(line, sizeof(line),
+			"{\"type\":\"epoch\",\"epoch\":%d,\"epochs\":%d,\"loss\":%.6f,\"accuracy\":%.6f",
+			epoch + 1, options.epochs, trainResult.loss, trainResult.accuracy);
+		std::string record = line;
+		if (!test.empty())
+		{
+			EvalResult testResult = Evaluate(network, test);
+			std::snprintf(line, sizeof(line), ",\"test_loss\":%.6f,\"test_accuracy\":%.6f",
+				testResult.loss, testResult.accuracy);
+			record += line;
+		}
+		if (options.taskGraphBatches > 0)
+		{
+			std::snprintf(line, sizeof(line),
+				",\"graph_tasks\":%lld,\"graph_work_seconds\":%.3f,\"graph_critical_path_seconds\":%.3f,\"graph_parallelism\":%.2f",
+				graphStats.tasks, graphStats.workSeconds, graphStats.criticalPathSeconds, graphStats.getParallelism());
+			record += line;
+		}
+		if (options.pipelineStages > 0)
+		{
+			std::snprintf(line, sizeof(line),
+				",\"schedule\":\"%s\",\"stages\":%d,\"micro_batches\":%d,\"bubble\":%.4f",
+				PipelineScheduleName(pipelineStats.schedule), static_cast<int>(pipelineStats.stages.size()),
+				pipelineStats.microBatches, pipelineStats.getBubbleFraction());
+			record += line;
+		}
+		if (options.tensorParallel > 0)
+		{
+			std::snprintf(line, sizeof(line),
+				",\"partitions\":%d,\"split_layers\":%d,\"barriers\":%lld,\"barrier_wait\":%.4f",
+				static_cast<int>(tensorStats.partitions.size()), tensorStats.splitLayers, tensorStats.barriers, tensorStats.getWaitFraction());
+			record += line;
+		}
+		if (threadedOptimizer)
+		{
+			std::snprintf(line, sizeof(line),
+				",\"optimizer\":\"%s\",\"threads\":%d,\"updates\":%lld,\"replicas\":%d,\"pages\":%lld,\"remote_pages\":%lld",
+				options.optimizer.c_str(), parallelStats.threads, parallelStats.updates, parallelStats.replicas,
+				parallelStats.pages.pages, parallelStats.pages.remotePages);
+			record += line;
+		}
+		std::snprintf(line, sizeof(line), ",\"train_seconds\":%.3f,\"samples_per_second\":%.1f}",
+			trainSeconds, (threadedOptimizer ? parallelStats.samples : static_cast<double>(train.size())) / trainSeconds);
+		record += line;
+		metrics << record << std::endl;
+
+		// Where the layers went and how busy each stage was
+		if (options.pipelineStages > 0)
+		{
+			std::string stages;
+			for (const PipelineStageStats& stage : pipelineStats.stages)
+			{
+				std::snprintf(line, sizeof(line),
+					"%s{\"layers\":[%d,%d],\"parameter_kb\":%.1f,\"core\":%d,\"busy\":%.4f,\"wait_seconds\":%.3f,\"peak_micro_batches\":%d}",
+					stages.empty() ? "" : ",", stage.firstLayer, stage.lastLayer, stage.parameterBytes / 1024.0, stage.core,
+					pipelineStats.seconds > 0.0 ? stage.busySeconds / pipelineStats.seconds : 0.0, stage.waitSeconds, stage.peakMicroBatches);
+				stages += line;
+			}
+			metrics << "{\"type\":\"pipeline\",\"epoch\":" << epoch + 1 << ",\"stages\":[" << stages << "]}" << std::endl;
+		}
+	}
+
+	checkpointWriter.Flush();
+	if (!options.savePath.empty() && !SaveModel(network, options.savePath))
+		return 1;
+
+	double totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count();
+	std::snprintf(line, sizeof(line), "{\"type\":\"done\",\"epochs\":%d,\"seconds\":%.3f,\"checkpoints\":%d}",
+		options.epochs, totalSeconds, checkpointWriter.getWrittenCount());
+	metrics << line << std::endl;
+
+	// Slot 0 : tasks the main thread picked up while it waited (the range it kept for itself isn't counted)
+	double programSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - programStart).count();
+	std::string workers;
+	for (const ThreadPoolWorkerStats& worker : ThreadPool::Global().getStats())
+	{
+		std::snprintf(line, sizeof(line), "%s{\"tasks\":%lld,\"steals\":%lld,\"busy\":%.4f,\"core\":%d,\"node\":%d,\"remote_loads\":%lld}",
+			workers.empty() ? "" : ",", worker.tasks, worker.steals, worker.busySeconds / programSeconds,
+			worker.core, worker.node, worker.remoteLoads);
+		workers += line;
+	}
+	metrics << "{\"type\":\"pool\",\"threads\":" << ThreadPool::Global().getThreadCount() << ",\"numa_nodes\":"
+		<< NumaTopology::Get().getNodeCount() << ",\"workers\":[" << workers << "]}" << std::endl;
+	return 0;
+}